@@ -0,0 +1,45 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "Block.h"
+#include "BlockCache.h"
+#include "Volume.h"
+#include "benchmark/benchmark.h"
+
+using namespace RT11FS;
+
+namespace {
+const auto VOLUME_SECTORS = 4096;
+
+auto BM_GetBlockHit(benchmark::State &state)
+{
+  Volume volume {VOLUME_SECTORS, 0, 0};
+  auto cache = volume.cache.get();
+
+  cache->putBlock(cache->getBlock(1000, 1));
+
+  for (auto _ : state) {
+    auto bp = cache->getBlock(1000, 1);
+    benchmark::DoNotOptimize(bp);
+    cache->putBlock(bp);
+  }
+}
+BENCHMARK(BM_GetBlockHit);
+
+auto BM_GetBlockMiss(benchmark::State &state)
+{
+  // the cache holds far fewer sectors than are cycled through, so every 
+  // fetch misses and evicts
+  Volume volume {VOLUME_SECTORS, 0, 0, 16 * Block::SECTOR_SIZE};
+  auto cache = volume.cache.get();
+  auto sector = 0;
+
+  for (auto _ : state) {
+    auto bp = cache->getBlock(sector, 1);
+    benchmark::DoNotOptimize(bp);
+    cache->putBlock(bp);
+    sector = (sector + 1) % VOLUME_SECTORS;
+  }
+}
+BENCHMARK(BM_GetBlockMiss);
+}
@@ -0,0 +1,77 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "Block.h"
+#include "DirChangeTracker.h"
+#include "Directory.h"
+#include "Volume.h"
+#include "benchmark/benchmark.h"
+
+#include <random>
+#include <sys/statvfs.h>
+#include <vector>
+
+using namespace RT11FS;
+
+using std::vector;
+
+namespace {
+const auto VOLUME_SECTORS = 8192;
+
+// the directory sizes to measure, in files
+auto fileCounts(benchmark::internal::Benchmark *b)
+{
+  b->RangeMultiplier(4)->Range(16, Volume::FILES_PER_SEGMENT * Volume::DIR_SEGMENTS);
+}
+
+auto BM_GetDirPointer(benchmark::State &state)
+{
+  auto files = static_cast<int>(state.range(0));
+  Volume volume {VOLUME_SECTORS, files, 1};
+  auto dir = Directory {volume.cache.get()};
+
+  auto names = vector<Dir::Rad50Name> {};
+  for (auto i = 0; i < files; i++) {
+    names.push_back(Volume::rad50Name(i));
+  }
+
+  auto random = std::minstd_rand {};
+  auto pick = std::uniform_int_distribution<int> {0, files - 1};
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(dir.getDirPointer(names[pick(random)]));
+  }
+}
+BENCHMARK(BM_GetDirPointer)->Apply(fileCounts);
+
+auto BM_Statfs(benchmark::State &state)
+{
+  Volume volume {VOLUME_SECTORS, static_cast<int>(state.range(0)), 1};
+  auto dir = Directory {volume.cache.get()};
+
+  struct statvfs vfs;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(dir.statfs(&vfs));
+  }
+}
+BENCHMARK(BM_Statfs)->Apply(fileCounts);
+
+auto BM_GrowRelocate(benchmark::State &state)
+{
+  // the first file is followed by other files, so growing it means moving
+  // it into the free space at the end of the volume
+  auto files = static_cast<int>(state.range(0));
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    Volume volume {VOLUME_SECTORS, files, 1};
+    auto dir = Directory {volume.cache.get()};
+    auto dirp = dir.getDirPointer(Volume::rad50Name(0));
+    auto moves = vector<DirChangeTracker::Entry> {};
+    state.ResumeTiming();
+
+    benchmark::DoNotOptimize(dir.truncate(dirp, 16 * Block::SECTOR_SIZE, moves));
+  }
+}
+BENCHMARK(BM_GrowRelocate)->Apply(fileCounts);
+}
@@ -0,0 +1,133 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "Block.h"
+#include "Directory.h"
+#include "OpenFileTable.h"
+#include "Volume.h"
+#include "benchmark/benchmark.h"
+
+#include <random>
+#include <vector>
+
+using namespace RT11FS;
+
+using std::vector;
+
+namespace {
+const auto VOLUME_SECTORS = 16384;
+const auto FILE_SECTORS = 4096;
+const auto FILE_BYTES = FILE_SECTORS * Block::SECTOR_SIZE;
+
+// the I/O sizes to measure, in bytes
+auto ioSizes(benchmark::internal::Benchmark *b)
+{
+  b->RangeMultiplier(8)->Range(Block::SECTOR_SIZE, 256 * 1024);
+}
+
+auto BM_SequentialRead(benchmark::State &state)
+{
+  Volume volume {VOLUME_SECTORS, 1, FILE_SECTORS};
+  auto dir = Directory {volume.cache.get()};
+  OpenFileTable oft {&dir, volume.cache.get()};
+
+  auto fd = oft.openFile(Volume::fileName(0));
+  auto buffer = vector<char>(state.range(0));
+  auto offset = off_t {0};
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(oft.readFile(fd, buffer.data(), buffer.size(), offset));
+    offset = (offset + buffer.size()) % FILE_BYTES;
+  }
+
+  state.SetBytesProcessed(state.iterations() * buffer.size());
+  oft.closeFile(fd);
+}
+BENCHMARK(BM_SequentialRead)->Apply(ioSizes);
+
+auto BM_RandomRead(benchmark::State &state)
+{
+  Volume volume {VOLUME_SECTORS, 1, FILE_SECTORS};
+  auto dir = Directory {volume.cache.get()};
+  OpenFileTable oft {&dir, volume.cache.get()};
+
+  auto fd = oft.openFile(Volume::fileName(0));
+  auto buffer = vector<char>(state.range(0));
+  auto random = std::minstd_rand {};
+  auto sectors = std::uniform_int_distribution<int> {0, static_cast<int>((FILE_BYTES - buffer.size()) / Block::SECTOR_SIZE)};
+
+  for (auto _ : state) {
+    auto offset = static_cast<off_t>(sectors(random)) * Block::SECTOR_SIZE;
+    benchmark::DoNotOptimize(oft.readFile(fd, buffer.data(), buffer.size(), offset));
+  }
+
+  state.SetBytesProcessed(state.iterations() * buffer.size());
+  oft.closeFile(fd);
+}
+BENCHMARK(BM_RandomRead)->Apply(ioSizes);
+
+auto BM_SequentialWrite(benchmark::State &state)
+{
+  Volume volume {VOLUME_SECTORS, 1, FILE_SECTORS};
+  auto dir = Directory {volume.cache.get()};
+  OpenFileTable oft {&dir, volume.cache.get()};
+
+  auto fd = oft.openFile(Volume::fileName(0));
+  auto buffer = vector<char>(state.range(0), 'x');
+  auto offset = off_t {0};
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(oft.writeFile(fd, buffer.data(), buffer.size(), offset));
+    offset = (offset + buffer.size()) % FILE_BYTES;
+  }
+
+  state.SetBytesProcessed(state.iterations() * buffer.size());
+  oft.closeFile(fd);
+}
+BENCHMARK(BM_SequentialWrite)->Apply(ioSizes);
+
+auto BM_RandomWrite(benchmark::State &state)
+{
+  Volume volume {VOLUME_SECTORS, 1, FILE_SECTORS};
+  auto dir = Directory {volume.cache.get()};
+  OpenFileTable oft {&dir, volume.cache.get()};
+
+  auto fd = oft.openFile(Volume::fileName(0));
+  auto buffer = vector<char>(state.range(0), 'x');
+  auto random = std::minstd_rand {};
+  auto sectors = std::uniform_int_distribution<int> {0, static_cast<int>((FILE_BYTES - buffer.size()) / Block::SECTOR_SIZE)};
+
+  for (auto _ : state) {
+    auto offset = static_cast<off_t>(sectors(random)) * Block::SECTOR_SIZE;
+    benchmark::DoNotOptimize(oft.writeFile(fd, buffer.data(), buffer.size(), offset));
+  }
+
+  state.SetBytesProcessed(state.iterations() * buffer.size());
+  oft.closeFile(fd);
+}
+BENCHMARK(BM_RandomWrite)->Apply(ioSizes);
+
+auto BM_CreateWriteClose(benchmark::State &state)
+{
+  // each iteration creates a file of the given number of sectors by 
+  // appending to it, then closes and deletes it
+  Volume volume {VOLUME_SECTORS, 0, 0};
+  auto dir = Directory {volume.cache.get()};
+  OpenFileTable oft {&dir, volume.cache.get()};
+
+  auto buffer = vector<char>(64 * Block::SECTOR_SIZE, 'x');
+  auto bytes = static_cast<off_t>(state.range(0)) * Block::SECTOR_SIZE;
+
+  for (auto _ : state) {
+    auto fd = oft.createFile("BIG.DAT");
+    for (auto offset = off_t {0}; offset < bytes; offset += buffer.size()) {
+      oft.writeFile(fd, buffer.data(), buffer.size(), offset);
+    }
+    oft.closeFile(fd);
+    oft.unlink("BIG.DAT");
+  }
+
+  state.SetBytesProcessed(state.iterations() * bytes);
+}
+BENCHMARK(BM_CreateWriteClose)->RangeMultiplier(4)->Range(64, 4096);
+}
@@ -0,0 +1,96 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __VOLUME_H_
+#define __VOLUME_H_
+
+#include "Block.h"
+#include "BlockCache.h"
+#include "DirConst.h"
+#include "DirectoryBuilder.h"
+#include "MemoryDataSource.h"
+#include "Rad50.h"
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * A synthetic volume in memory for benchmarks.
+ *
+ * The volume holds `files' permanent files of `fileSectors' sectors each,
+ * named as by `fileName', followed by free space to the end of the volume.
+ */
+class Volume
+{
+public:
+  static const int FILES_PER_SEGMENT = 48;        /*!< leaves room in each segment to insert entries */
+  static const int DIR_SEGMENTS = 31;
+
+  Volume(
+    int sectors, 
+    int files, 
+    int fileSectors, 
+    size_t cacheBytes = RT11FS::BlockCache::DEFAULT_MAX_BYTES)
+    : dataSource(sectors * RT11FS::Block::SECTOR_SIZE)
+  {
+    using Ent = DirectoryBuilder::DirEntry;
+
+    auto entries = std::vector<std::vector<Ent>> {};
+    for (auto i = 0; i < files; i++) {
+      if (i % FILES_PER_SEGMENT == 0) {
+        entries.emplace_back();
+      }
+      entries.back().push_back(Ent {RT11FS::Dir::E_PERM, static_cast<uint16_t>(fileSectors), rad50Name(i)});
+    }
+
+    if (entries.empty()) {
+      entries.emplace_back();
+    }
+
+    for (auto &segment : entries) {
+      if (&segment == &entries.back()) {
+        segment.push_back(Ent {RT11FS::Dir::E_MPTY, DirectoryBuilder::REST_OF_DATA});
+      }
+      segment.push_back(Ent {RT11FS::Dir::E_EOS});
+    }
+
+    DirectoryBuilder {dataSource}.formatWithEntries(DIR_SEGMENTS, entries);
+    cache = std::make_unique<RT11FS::BlockCache>(&dataSource, cacheBytes);
+  }
+
+  Volume(const Volume &) = delete;
+  auto operator=(const Volume &) -> Volume & = delete;
+
+  /**
+   * @return the name of the `i'th file. Names repeat after 100000 files,
+   * since an RT-11 name is only six characters.
+   */
+  static auto fileName(int i) -> std::string
+  {
+    char name[RT11FS::Rad50::NAME_BUFFER_SIZE];
+    snprintf(name, sizeof(name), "F%05u.DAT", static_cast<unsigned>(i) % 100000u);
+    return std::string {name};
+  }
+
+  /**
+   * @return the Rad50 name of the `i'th file.
+   */
+  static auto rad50Name(int i) -> RT11FS::Dir::Rad50Name
+  {
+    auto name = fileName(i);
+    auto rad50 = RT11FS::Dir::Rad50Name {};
+
+    RT11FS::Rad50::encodeWord(&name[0], rad50[0]);
+    RT11FS::Rad50::encodeWord(&name[3], rad50[1]);
+    RT11FS::Rad50::encodeWord(&name[7], rad50[2]);
+
+    return rad50;
+  }
+
+  RT11FS::MemoryDataSource dataSource;
+  std::unique_ptr<RT11FS::BlockCache> cache;
+};
+
+#endif
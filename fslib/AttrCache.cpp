@@ -0,0 +1,72 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "AttrCache.h"
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+
+namespace RT11FS {
+
+const size_t AttrCache::MAX_ENTRIES;
+
+AttrCache::AttrCache()
+  : generation(0)
+{
+}
+
+/**
+ * Look for the result of an earlier lookup of a path.
+ *
+ * @param path the path which was looked up.
+ * @param generation the current generation of the directory.
+ * @param attr on success, the result of the lookup.
+ * @return true if the path was found in the cache.
+ */
+auto AttrCache::lookup(const string &path, unsigned generation, Attr &attr) -> bool
+{
+  lock_guard<mutex> lock {cacheLock};
+
+  if (generation != this->generation) {
+    entries.clear();
+    this->generation = generation;
+    return false;
+  }
+
+  auto iter = entries.find(path);
+  if (iter == end(entries)) {
+    return false;
+  }
+
+  attr = iter->second;
+  return true;
+}
+
+/**
+ * Remember the result of looking up a path.
+ *
+ * Once the cache is full it's emptied and starts again, which keeps a stream
+ * of probes for different missing names from growing it without bound.
+ *
+ * @param path the path which was looked up.
+ * @param generation the generation of the directory the lookup was made in.
+ * @param attr the result of the lookup.
+ */
+auto AttrCache::insert(const string &path, unsigned generation, const Attr &attr) -> void
+{
+  lock_guard<mutex> lock {cacheLock};
+
+  if (generation != this->generation) {
+    entries.clear();
+    this->generation = generation;
+  }
+
+  if (entries.size() >= MAX_ENTRIES) {
+    entries.clear();
+  }
+
+  entries[path] = attr;
+}
+
+}
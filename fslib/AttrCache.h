@@ -0,0 +1,51 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __ATTRCACHE_H_
+#define __ATTRCACHE_H_
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+
+namespace RT11FS {
+/**
+ * Remembers the result of looking up a path for getattr, including lookups
+ * which failed, so that repeated probes don't go back to the directory.
+ *
+ * Every entry is tagged with the directory generation it was looked up in.
+ * The cache is emptied as soon as a lookup is made in a later generation, 
+ * so nothing is ever returned from a directory which has since changed.
+ *
+ * Lookups may be made from several threads at once.
+ */
+class AttrCache
+{
+public:
+  static const size_t MAX_ENTRIES = 4096;
+
+  /**
+   * The result of looking up a path.
+   */
+  struct Attr {
+    int err;              /*!< 0, or the negated errno the lookup failed with */
+    struct stat st;       /*!< on success, the attributes of the file */
+    int segment;          /*!< on success, where the file's entry is */
+    int index;
+  };
+
+  AttrCache();
+
+  auto lookup(const std::string &path, unsigned generation, Attr &attr) -> bool;
+  auto insert(const std::string &path, unsigned generation, const Attr &attr) -> void;
+
+private:
+  std::mutex cacheLock;                           /*!< protects all of the below */
+  unsigned generation;                            /*!< the generation of every entry */
+  std::unordered_map<std::string, Attr> entries;
+};
+}
+
+#endif
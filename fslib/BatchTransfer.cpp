@@ -0,0 +1,218 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#include "BatchTransfer.h"
+
+#include "Block.h"
+#include "DataSource.h"
+#include "Directory.h"
+#include "FilesystemException.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <memory>
+#include <set>
+
+using std::min;
+using std::set;
+using std::sort;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace RT11FS {
+
+const int BatchTransfer::TRANSFER_SECTORS;
+
+namespace {
+// the largest file a directory entry can describe
+const auto MAX_FILE_SECTORS = 0xffff;
+}
+
+BatchTransfer::BatchTransfer(Directory *directory, BlockCache *cache)
+  : directory(directory)
+  , cache(cache)
+{
+}
+
+/**
+ * Copy files onto the volume, replacing any files of the same names.
+ *
+ * Files are allocated largest first, which packs them best. If any file
+ * can't be allocated or written, none of the new files are kept; files they
+ * would have replaced are gone either way.
+ *
+ * @param files the files to put. The length of each file is the size of
+ * its data source, rounded up to whole sectors.
+ * @return 0 on success or a negated errno
+ */
+auto BatchTransfer::put(const vector<File> &files) -> int
+{
+  struct Placement {
+    const File *file;
+    int sectors;
+    int sector0;
+  };
+
+  auto placements = vector<Placement> {};
+  auto names = set<string> {};
+
+  for (const auto &file : files) {
+    struct stat st;
+    auto err = file.data->stat(&st);
+    if (err < 0) {
+      return err;
+    }
+
+    auto sectors = (st.st_size + Block::SECTOR_SIZE - 1) / Block::SECTOR_SIZE;
+    if (sectors > MAX_FILE_SECTORS) {
+      return -EFBIG;
+    }
+
+    if (!names.insert(file.name).second) {
+      return -EINVAL;
+    }
+
+    placements.push_back(Placement {&file, static_cast<int>(sectors), 0});
+  }
+
+  auto moves = vector<DirChangeTracker::Entry> {};
+  for (const auto &placement : placements) {
+    auto ent = DirEnt {};
+    if (directory->getEnt(placement.file->name, ent) == 0) {
+      auto err = directory->removeEntry(placement.file->name, moves);
+      if (err < 0) {
+        return err;
+      }
+    }
+  }
+
+  sort(begin(placements), end(placements), [](const Placement &a, const Placement &b) {
+    return a.sectors > b.sectors;
+  });
+
+  auto allocated = 0;
+  auto rollback = [this, &placements, &allocated, &moves]() {
+    for (auto i = 0; i < allocated; i++) {
+      directory->removeEntry(placements[i].file->name, moves);
+    }
+  };
+
+  for (auto &placement : placements) {
+    auto dirpp = unique_ptr<DirPtr> {};
+    auto err = directory->allocateEntry(placement.file->name, placement.sectors, dirpp, moves);
+    if (err < 0) {
+      rollback();
+      return err;
+    }
+
+    placement.sector0 = dirpp->getDataSector();
+    allocated++;
+  }
+
+  // write in volume order, so the data goes out as one sweep across the disk
+  sort(begin(placements), end(placements), [](const Placement &a, const Placement &b) {
+    return a.sector0 < b.sector0;
+  });
+
+  try {
+    for (const auto &placement : placements) {
+      auto err = writeData(placement.file->data, placement.sector0, placement.sectors);
+      if (err < 0) {
+        rollback();
+        return err;
+      }
+    }
+  } catch (FilesystemException &) {
+    rollback();
+    throw;
+  }
+
+  directory->sync();
+  return 0;
+}
+
+/**
+ * Copy files off of the volume.
+ *
+ * @param files the files to get. Each file's whole sectors are written to
+ * its data source from offset 0.
+ * @return 0 on success or a negated errno
+ */
+auto BatchTransfer::get(const vector<File> &files) -> int
+{
+  auto buffer = vector<char>(TRANSFER_SECTORS * Block::SECTOR_SIZE);
+
+  for (const auto &file : files) {
+    auto ent = DirEnt {};
+    auto err = directory->getEnt(file.name, ent);
+    if (err < 0) {
+      return err;
+    }
+
+    for (auto offset = off_t {0}; offset < ent.length; offset += buffer.size()) {
+      auto bytes = min<off_t>(buffer.size(), ent.length - offset);
+      cache->readDirect(static_cast<off_t>(ent.sector0) * Block::SECTOR_SIZE + offset, bytes, buffer.data());
+
+      auto xfer = file.data->write(buffer.data(), bytes, offset);
+      if (xfer < 0) {
+        return static_cast<int>(xfer);
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Write a file's data into the sectors allocated for it, TRANSFER_SECTORS at
+ * a time. The last sector is padded with zeroes.
+ *
+ * @param data the file's contents.
+ * @param sector0 the first sector of the file.
+ * @param sectors the length of the file.
+ * @return 0 on success or a negated errno
+ */
+auto BatchTransfer::writeData(DataSource *data, int sector0, int sectors) -> int
+{
+  struct stat st;
+  auto err = data->stat(&st);
+  if (err < 0) {
+    return err;
+  }
+
+  // space which was just freed may still be cached, in blocks which don't
+  // line up with the runs written here. write out anything dirty and drop
+  // the rest, so each run can be overwritten as one new block.
+  cache->syncRange(sector0, sectors);
+  if (!cache->discard(sector0, sectors)) {
+    return -EBUSY;
+  }
+
+  auto buffer = vector<char>(TRANSFER_SECTORS * Block::SECTOR_SIZE);
+
+  for (auto done = 0; done < sectors; done += TRANSFER_SECTORS) {
+    auto count = min(TRANSFER_SECTORS, sectors - done);
+    auto offset = static_cast<off_t>(done) * Block::SECTOR_SIZE;
+    auto bytes = static_cast<int>(min<off_t>(count * Block::SECTOR_SIZE, st.st_size - offset));
+
+    auto xfer = data->read(buffer.data(), bytes, offset);
+    if (xfer < 0) {
+      return static_cast<int>(xfer);
+    }
+
+    auto bp = cache->getBlockForOverwrite(sector0 + done, count);
+    bp->copyIn(0, bytes, buffer.data());
+    if (bytes < count * Block::SECTOR_SIZE) {
+      bp->zeroFill(bytes, count * Block::SECTOR_SIZE - bytes);
+    }
+    cache->putBlock(bp);
+
+    // write each run as it's filled, so the cache never holds more than one
+    cache->syncRange(sector0 + done, count);
+  }
+
+  return 0;
+}
+
+}
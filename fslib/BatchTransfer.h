@@ -0,0 +1,54 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __BATCHTRANSFER_H_
+#define __BATCHTRANSFER_H_
+
+#include "BlockCache.h"
+
+#include <string>
+#include <vector>
+
+namespace RT11FS {
+class DataSource;
+class Directory;
+
+/**
+ * Copies many files onto or off of a volume at once, working on the directory
+ * and block cache directly rather than through open files.
+ *
+ * Since the sizes of the files being put are known up front, every file is
+ * allocated at its final size in one pass over the directory, each into the
+ * smallest free block which holds it, so nothing is ever grown or moved. The
+ * data is then written in large sequential runs which bypass reading, and
+ * the directory is written once at the end.
+ *
+ * The volume must not have any files open while a transfer runs.
+ */
+class BatchTransfer
+{
+public:
+  /**
+   * A file to transfer, and the host data it's copied from or to.
+   */
+  struct File {
+    std::string name;       /*!< the name of the file on the volume */
+    DataSource *data;       /*!< the file's contents on the host */
+  };
+
+  BatchTransfer(Directory *directory, BlockCache *cache);
+
+  auto put(const std::vector<File> &files) -> int;
+  auto get(const std::vector<File> &files) -> int;
+
+  static const int TRANSFER_SECTORS = BlockCache::MAX_WRITE_SECTORS;
+
+private:
+  Directory *directory;
+  BlockCache *cache;
+
+  auto writeData(DataSource *data, int sector0, int sectors) -> int;
+};
+}
+
+#endif
@@ -2,23 +2,163 @@
 // MIT license as described in the file LICENSE.txt.
 
 #include "Block.h"
+#include "BufferPool.h"
 #include "DataSource.h"
 #include "FilesystemException.h"
 
+#include <algorithm>
 #include <cerrno>
+#include <cstring>
+#include <stdexcept>
 #include <unistd.h>
 
 using std::exception;
+using std::out_of_range;
 
 namespace RT11FS {
 
+const int Block::SECTOR_SIZE;
+
+/**
+ * Construct a block with zero filled storage from the heap.
+ *
+ * @param sector the starting sector of the block.
+ * @param count the number of sectors in the block.
+ */
 Block::Block(int sector, int count)
   : sector(sector)
   , count(count)
   , dirty(false)
   , refcount(0)
+  , generation(0)
+  , pool(nullptr)
+  , mapped(nullptr)
+{
+  storage = allocateStorage(count);
+  ::memset(storage, 0, size());
+}
+
+/**
+ * Construct a block whose storage comes from a buffer pool, if the pool's
+ * buffers are the right size.
+ *
+ * The storage is not initialized; the block is expected to be read or
+ * filled before it is used.
+ *
+ * @param sector the starting sector of the block.
+ * @param count the number of sectors in the block.
+ * @param pool the pool to take storage from.
+ */
+Block::Block(int sector, int count, BufferPool *pool)
+  : sector(sector)
+  , count(count)
+  , dirty(false)
+  , refcount(0)
+  , generation(0)
+  , pool(pool)
+  , mapped(nullptr)
+{
+  storage = allocateStorage(count);
+}
+
+/**
+ * Construct a block which aliases memory owned by the data source.
+ *
+ * The block holds no storage of its own; reads and writes operate directly
+ * on `mapped', which must remain valid for the life of the block. See
+ * DataSource::map.
+ *
+ * @param sector the starting sector of the block.
+ * @param count the number of sectors in the block.
+ * @param mapped the data source's memory backing the block's sectors.
+ */
+Block::Block(int sector, int count, uint8_t *mapped)
+  : sector(sector)
+  , count(count)
+  , dirty(false)
+  , refcount(0)
+  , generation(0)
+  , storage(nullptr)
+  , pool(nullptr)
+  , mapped(mapped)
 {
-  data.resize(count * SECTOR_SIZE);
+}
+
+/**
+ * Move a block, taking over its storage.
+ *
+ * @param other the block to move from, which is left without storage.
+ */
+Block::Block(Block &&other) noexcept
+  : sector(other.sector)
+  , count(other.count)
+  , refcount(other.refcount)
+  , generation(other.generation)
+  , dirty(other.dirty)
+  , storage(other.storage)
+  , pool(other.pool)
+  , mapped(other.mapped)
+{
+  other.storage = nullptr;
+}
+
+Block::~Block()
+{
+  if (storage != nullptr) {
+    releaseStorage(storage, count);
+  }
+}
+
+/**
+ * Allocate storage for the block's data.
+ *
+ * Throws std::bad_alloc if there is no memory.
+ *
+ * @param sectors the size of the storage in sectors.
+ * @return the storage, which must be freed with `releaseStorage'
+ */
+auto Block::allocateStorage(int sectors) -> uint8_t *
+{
+  auto bytes = size_t(sectors) * SECTOR_SIZE;
+
+  if (pool != nullptr && bytes == pool->getBufferBytes()) {
+    return pool->allocate();
+  }
+
+  return BufferPool::allocateAligned(bytes);
+}
+
+/**
+ * Free storage from `allocateStorage'.
+ *
+ * @param buffer the storage to free.
+ * @param sectors the size of the storage in sectors.
+ */
+auto Block::releaseStorage(uint8_t *buffer, int sectors) -> void
+{
+  auto bytes = size_t(sectors) * SECTOR_SIZE;
+
+  if (pool != nullptr && bytes == pool->getBufferBytes()) {
+    pool->release(buffer);
+    return;
+  }
+
+  BufferPool::releaseAligned(buffer);
+}
+
+/**
+ * Ensure that `bytes' bytes starting at `offset' are inside the block.
+ *
+ * Throws std::out_of_range if they are not.
+ *
+ * @param offset the offset of the first byte.
+ * @param bytes the number of bytes to check.
+ */
+auto Block::checkRange(int offset, int bytes) -> void
+{
+  if (offset < 0 || offset + bytes > size()) {
+    throw out_of_range {"offset outside of block"};
+  }
 }
 
 /**
@@ -31,7 +171,8 @@ Block::Block(int sector, int count)
  */
 auto Block::getByte(int offset) -> uint8_t
 {
-  return data.at(offset);
+  checkRange(offset, 1);
+  return buffer()[offset];
 }
 
 /**
@@ -45,7 +186,8 @@ auto Block::getByte(int offset) -> uint8_t
  */
 auto Block::extractWord(int offset) -> uint16_t
 {
-  return data.at(offset) | (data.at(offset + 1) << 8);
+  checkRange(offset, 2);
+  return buffer()[offset] | (buffer()[offset + 1] << 8);
 }
 
 /**
@@ -58,8 +200,10 @@ auto Block::extractWord(int offset) -> uint16_t
  */
 auto Block::setByte(int offset, uint8_t value) -> void
 {
-  data.at(offset) = value;
+  checkRange(offset, 1);
+  buffer()[offset] = value;
   dirty = true;
+  generation++;
 }
 
 /**
@@ -73,9 +217,11 @@ auto Block::setByte(int offset, uint8_t value) -> void
  */
 auto Block::setWord(int offset, uint16_t value) -> void
 {
-  data.at(offset) = value & 0377;
-  data.at(offset + 1) = (value >> 8) & 0377;
+  checkRange(offset, 2);
+  buffer()[offset] = value & 0377;
+  buffer()[offset + 1] = (value >> 8) & 0377;
   dirty = true;
+  generation++;
 }
 
 /**
@@ -85,21 +231,31 @@ auto Block::setWord(int offset, uint16_t value) -> void
  * It is the responsibility of the caller to ensure that 
  * the block is first written if it is dirty.
  *
+ * A mapped block already aliases the data source, so there is nothing
+ * to transfer.
+ *
  * @param dataSource the interface to the underlying mounted data source.
  */
 auto Block::read(DataSource *dataSource) -> void
 {
+  if (mapped != nullptr) {
+    dirty = false;
+    generation++;
+    return;
+  }
+
   auto toSeek = sector * SECTOR_SIZE;
   auto toRead = count * SECTOR_SIZE;
 
   // Data source is defined to return an error if the entire read cannot 
   // be satisfied
-  int err = dataSource->read(&data[0], toRead, toSeek);
+  int err = dataSource->read(buffer(), toRead, toSeek);
   if (err < 0) {
     throw FilesystemException {err, "could not read block"};
   }
 
   dirty = false;
+  generation++;
 }
 
 /**
@@ -116,7 +272,7 @@ auto Block::write(DataSource *dataSource) -> void
 
   // Data source is defined to return an error if the entire write cannot 
   // be satisfied
-  int err = dataSource->write(&data[0], toWrite, toSeek);
+  int err = dataSource->write(buffer(), toWrite, toSeek);
   if (err < 0) {
     throw FilesystemException {err, "could not read block"};
   }
@@ -136,11 +292,11 @@ auto Block::write(DataSource *dataSource) -> void
  */
 auto Block::copyOut(int offset, int bytes, char *dest) -> void
 {
-  if (offset + bytes > data.size()) {
+  if (offset + bytes > size()) {
     throw FilesystemException {-EIO, "read past end of block"};
   }
 
-  memcpy(dest, &data[offset], bytes);
+  memcpy(dest, buffer() + offset, bytes);
 }
 
 /**
@@ -155,13 +311,15 @@ auto Block::copyOut(int offset, int bytes, char *dest) -> void
  */
 auto Block::copyIn(int offset, int bytes, const char *src) -> void 
 {
-  if (offset + bytes > data.size()) {
+  if (offset + bytes > size()) {
     throw FilesystemException {-EIO, "write past end of block"};
   }
 
-  memcpy(&data[offset], src, bytes);
+  memcpy(buffer() + offset, src, bytes);
   
-  dirty = true;  
+  dirty = true;
+  
+  generation++;
 }
 
 /**
@@ -187,17 +345,19 @@ auto Block::copyWithinBlock(int sourceOffset, int destOffset, int count) -> void
     sourceOffset + count <= 0 ||
     destOffset + count <= 0 ||
     // can't run off end of block
-    sourceOffset + count > data.size() ||
-    destOffset + count > data.size()) {
+    sourceOffset + count > size() ||
+    destOffset + count > size()) {
     throw FilesystemException {-EIO, "invalid copy ranges for moving data inside block"};    
   }
 
   ::memmove(
-    &data[destOffset],
-    &data[sourceOffset],
+    buffer() + destOffset,
+    buffer() + sourceOffset,
     count);
 
-  dirty = true;  
+  dirty = true;
+
+  generation++;
 }
 
 /**
@@ -221,18 +381,20 @@ auto Block::copyFromOtherBlock(Block *source, int sourceOffset, int destOffset,
     sourceOffset + count <= 0 ||
     destOffset + count <= 0 ||
     // can't run off end of block
-    sourceOffset + count > source->data.size() ||
-    destOffset + count > data.size()) {
+    sourceOffset + count > source->size() ||
+    destOffset + count > size()) {
     throw FilesystemException {-EIO, "invalid copy ranges for moving data between blocks"};    
   }
 
   // It's safe to use memcpy here because two blocks can never overlap
   ::memcpy(
-    &data[destOffset],
-    &source->data[sourceOffset],
+    buffer() + destOffset,
+    source->buffer() + sourceOffset,
     count);
 
   dirty = true;
+
+  generation++;
 }
 
 /**
@@ -248,13 +410,15 @@ auto Block::zeroFill(int offset, int count) -> void
   if (
     offset < 0 ||
     offset + count <= 0 ||
-    offset + count > data.size()) {
+    offset + count > size()) {
     throw FilesystemException {-EIO, "Invalid range for zero filling blocks"};
   }
 
-  ::memset(&data[offset], 0, count);
+  ::memset(buffer() + offset, 0, count);
 
   dirty = true;
+
+  generation++;
 }
 
 /**
@@ -273,7 +437,19 @@ auto Block::zeroFill(int offset, int count) -> void
  */
 auto Block::resize(int newCount, DataSource *dataSource) -> void
 {
-  data.resize(newCount * SECTOR_SIZE);  
+  if (mapped != nullptr) {
+    auto remapped = dataSource->map(sector * SECTOR_SIZE, newCount * SECTOR_SIZE);
+    if (remapped == nullptr) {
+      throw FilesystemException {-EIO, "could not map block"};
+    }
+    mapped = remapped;
+    count = newCount;
+    generation++;
+    return;
+  }
+
+  auto resized = allocateStorage(newCount);
+  ::memcpy(resized, storage, std::min(count, newCount) * SECTOR_SIZE);
 
   if (newCount > count) {
     auto toSeek = (sector + count) * SECTOR_SIZE;
@@ -281,17 +457,20 @@ auto Block::resize(int newCount, DataSource *dataSource) -> void
     auto at = count * SECTOR_SIZE;
 
     try {
-      int err = dataSource->read(&data[at], toRead, toSeek);
+      int err = dataSource->read(resized + at, toRead, toSeek);
       if (err < 0) {
         throw FilesystemException {err, "could not read block"};
       }
     } catch (exception) {
-      data.resize(count);
+      releaseStorage(resized, newCount);
       throw;
     }
   }
 
+  releaseStorage(storage, count);
+  storage = resized;
   count = newCount;
+  generation++;
 }
 
 }
@@ -5,9 +5,9 @@
 #define __BLOCK_H_
 
 #include <cstdint>
-#include <vector>
 
 namespace RT11FS {
+class BufferPool;
 class DataSource;
 
 
@@ -17,6 +17,9 @@ class DataSource;
  * A block may contain one more more sectors. A block tracks if it has been changed
  * (the dirty flag). A block should only be changed by one of the mutators in order
  * for the dirty flag to be maintained.
+ *
+ * A block's storage is aligned for direct I/O. Single sector blocks may take
+ * their storage from a BufferPool, which must outlive the block.
  */
 class Block
 {
@@ -24,6 +27,14 @@ public:
   static const int SECTOR_SIZE = 512;
 
   Block(int sector, int count);
+  Block(int sector, int count, BufferPool *pool);
+  Block(int sector, int count, uint8_t *mapped);
+  Block(Block &&other) noexcept;
+  ~Block();
+
+  Block(const Block &) = delete;
+  auto operator=(const Block &) -> Block & = delete;
+  auto operator=(Block &&) -> Block & = delete;
 
   auto getByte(int offset) -> uint8_t;
   auto extractWord(int offset) -> uint16_t;
@@ -54,17 +65,54 @@ public:
   auto addRef() { return ++refcount; }
   auto release() { return --refcount; }
 
+  /**
+   * @return the number of outstanding references to the block.
+   */
+  auto getRefCount() const { return refcount; }
+
   /**
    * @return true if the block needs to be written back to disk.
    */
   auto isDirty() const { return dirty; }
 
+  /**
+   * @return a count which changes whenever the block's contents do, so that
+   * anything decoded from the block can tell when it's out of date.
+   */
+  auto getGeneration() const { return generation; }
+
+  /**
+   * @return the block's data, for handing to vectored I/O.
+   */
+  auto getData() const -> const uint8_t * { return mapped ? mapped : storage; }
+
+  /**
+   * @return true if the block aliases the data source's memory rather than
+   * holding a copy.
+   */
+  auto isMapped() const { return mapped != nullptr; }
+
+  /**
+   * Flag the block as matching the disk, for use when the block's data has 
+   * been written by some means other than `write'.
+   */
+  auto markClean() { dirty = false; }
+
 private:
   int sector;
   int count;
   int refcount;
+  unsigned generation;  /*!< bumped by every change to the block's contents */
   bool dirty;
-  std::vector<uint8_t> data;
+  uint8_t *storage;
+  BufferPool *pool;     /*!< where `storage' came from, or nullptr if from the heap */
+  uint8_t *mapped;
+
+  auto buffer() -> uint8_t * { return mapped ? mapped : storage; }
+  auto size() const -> int { return count * SECTOR_SIZE; }
+  auto checkRange(int offset, int bytes) -> void;
+  auto allocateStorage(int sectors) -> uint8_t *;
+  auto releaseStorage(uint8_t *buffer, int sectors) -> void;
 };
 }
 
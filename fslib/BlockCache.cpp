@@ -4,25 +4,51 @@
 #include "BlockCache.h"
 #include "DataSource.h"
 #include "FilesystemException.h"
+#include "Statistics.h"
 
 #include <algorithm>
 #include <cerrno>
+#include <iterator>
 #include <memory>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <vector>
 
+using std::chrono::steady_clock;
+using std::lock_guard;
 using std::move;
-using std::unique_ptr;
+using std::mutex;
+using std::unique_lock;
 
 namespace RT11FS {
 
+const size_t BlockCache::DEFAULT_MAX_BYTES;
+const int BlockCache::MAX_WRITE_SECTORS;
+
 /**
  * Construct a block cache.
  *
  * @param dataSource the data source containing the physical data
  * storage for the blocks.
+ * @param maxBytes the amount of sector data the cache will try to stay under.
+ * @param budget if not null, a cap shared with other caches which this one
+ * also tries to keep under.
  */
-BlockCache::BlockCache(DataSource *dataSource) 
+BlockCache::BlockCache(DataSource *dataSource, size_t maxBytes, CacheBudget *budget) 
   : dataSource(dataSource)
+  , maxBytes(maxBytes)
+  , cachedBytes(0)
+  , budget(budget)
+  , sectorBuffers(Block::SECTOR_SIZE)
+  , blocks(std::less<int> {}, BlockMap::allocator_type {&nodes})
+  , lru(LruList::allocator_type {&nodes})
+  , writeEpoch(0)
+  , dirtyBytes(0)
+  , flushLimits {}
+  , flusherRunning(false)
+  , stopping(false)
+  , flushWake(false)
+  , flushError(0)
 {
   struct stat st;
 
@@ -36,6 +62,11 @@ BlockCache::BlockCache(DataSource *dataSource)
 
 BlockCache::~BlockCache()
 {
+  stopFlusher();
+
+  if (budget != nullptr) {
+    budget->charge(-static_cast<ptrdiff_t>(cachedBytes));
+  }
 }
 
 /**
@@ -57,45 +88,134 @@ BlockCache::~BlockCache()
  */
 auto BlockCache::getBlock(int sector, int count) -> Block *
 {
-  auto cacheIter = begin(blocks);
+  auto lock = unique_lock<mutex> {cacheLock};
 
-  for (; cacheIter != end(blocks); cacheIter++) {
-    auto bp = cacheIter->get();
+  auto bp = findBlock(sector, count);
+  if (bp != nullptr) {
+    Statistics::count(Statistics::Counter::CacheHits);
+    return bp;
+  }
 
-    if (bp->getSector() == sector) {
-      if (bp->getCount() != count) {
-        throw FilesystemException {-EINVAL, "Asking for wrong number of sectors in block cache"};
-      }
-      bp->addRef();
-      return bp;
-    }
+  Statistics::count(Statistics::Counter::CacheMisses);
 
-    if (sector >= bp->getSector() + bp->getCount()) {
-      continue;
-    }
+  // if the data source can expose the sectors directly, alias them rather than
+  // copying them into the cache
+  auto mapped = dataSource->map(off_t(sector) * Block::SECTOR_SIZE, count * Block::SECTOR_SIZE);
+  auto block = mapped != nullptr 
+    ? Block {sector, count, mapped} 
+    : Block {sector, count, &sectorBuffers};
 
-    if (sector + count <= bp->getSector()) {
-      break;
-    }
+  // Fill the block without holding the lock, so a miss doesn't stall other threads.
+  // If anything was written back in the meantime the data may be stale, so read 
+  // it again.
+  auto epoch = writeEpoch;
+  lock.unlock();
+  block.read(dataSource);
+  lock.lock();
 
-    if (bp->getCount() != count) {
-      throw FilesystemException {-EINVAL, "Block cache request would overlap existing block"};
-    }
+  bp = findBlock(sector, count);
+  if (bp != nullptr) {
+    // another thread cached the same block first; use theirs
+    return bp;
   }
 
-  auto bp = new Block {sector, count};
-  bp->read(dataSource);
+  if (epoch != writeEpoch) {
+    block.read(dataSource);
+  }
+  block.addRef();
+
+  auto iter = blocks.emplace(sector, CacheEntry {move(block), end(lru), false, steady_clock::time_point {}}).first;
+  bp = &iter->second.block;
+  account(count * Block::SECTOR_SIZE);
+
+  evict();
+
+  return bp;
+}
+
+/**
+ * Retrieve a block which the caller is going to overwrite completely.
+ *
+ * This is `getBlock' without the read: if the block isn't cached, it's 
+ * created with undefined contents. The caller must overwrite every byte of 
+ * the block through the mutators, which mark it dirty, before releasing it.
+ *
+ * @param sector the starting sector of the requested block.
+ * @param count the number of sectors to return.
+ * @return a pointer to the block
+ */
+auto BlockCache::getBlockForOverwrite(int sector, int count) -> Block *
+{
+  lock_guard<mutex> lock {cacheLock};
+
+  auto bp = findBlock(sector, count);
+  if (bp != nullptr) {
+    Statistics::count(Statistics::Counter::CacheHits);
+    return bp;
+  }
+
+  Statistics::count(Statistics::Counter::CacheMisses);
+
+  auto mapped = dataSource->map(off_t(sector) * Block::SECTOR_SIZE, count * Block::SECTOR_SIZE);
+  auto block = mapped != nullptr 
+    ? Block {sector, count, mapped} 
+    : Block {sector, count, &sectorBuffers};
+  block.addRef();
+
+  auto iter = blocks.emplace(sector, CacheEntry {move(block), end(lru), false, steady_clock::time_point {}}).first;
+  bp = &iter->second.block;
+  account(count * Block::SECTOR_SIZE);
+
+  evict();
 
-  blocks.insert(cacheIter, move(unique_ptr<Block>{bp}));
   return bp;
 }
 
 /**
  * Release ownership of a block.
+ *
+ * When the last reference to a clean block is released, the block becomes a
+ * candidate for eviction. When the last reference to a dirty block is released,
+ * it is counted as dirty for the background flusher; if that puts the cache
+ * over the flusher's hard limit, this waits until the flusher has caught up.
+ * Throws if a background write has failed since the error was last reported.
  */
 auto BlockCache::putBlock(Block *bp) -> void
 {  
-  bp->release();
+  auto lock = unique_lock<mutex> {cacheLock};
+
+  if (bp->release() > 0) {
+    return;
+  }
+
+  auto iter = blocks.find(bp->getSector());
+  if (iter == end(blocks) || &iter->second.block != bp) {
+    throw FilesystemException {-EINVAL, "Block cache asked to release nonexistent block"};
+  }
+
+  // a clean block may be evicted right away, so check before it goes
+  auto dirty = bp->isDirty();
+  if (dirty) {
+    countDirty(iter->second);
+  }
+
+  makeEvictable(iter);
+  evict();
+
+  if (!dirty) {
+    return;
+  }
+
+  if (flusherRunning && dirtyBytes > flushLimits.highWaterBytes) {
+    flushWake = true;
+    flushNeeded.notify_one();
+  }
+
+  flushed.wait(lock, [this]() {
+    return !flusherRunning || flushError < 0 || dirtyBytes <= flushLimits.hardLimitBytes;
+  });
+
+  takeFlushError();
 }
 
 /** 
@@ -117,33 +237,886 @@ auto BlockCache::resizeBlock(Block *bp, int count) -> void
     throw FilesystemException {-EINVAL, "Block resize to non-positive size"};    
   }
 
-  auto cacheIter = find_if(begin(blocks), end(blocks), [bp](const auto &bup) { return bup.get() == bp; });
+  lock_guard<mutex> lock {cacheLock};
+
+  // `bp' isn't trusted until it's been found in the cache, so search by pointer 
+  // rather than by its sector. Resizing is rare (it's used to expand the directory
+  // once at mount time) so the linear search doesn't matter.
+  auto cacheIter = find_if(begin(blocks), end(blocks), [bp](const auto &entry) { 
+    return &entry.second.block == bp; 
+  });
   if (cacheIter == end(blocks)) {
     throw FilesystemException {-EINVAL, "Block cache ask to resize nonexistent block"};
   }
 
-  cacheIter++;
+  auto next = std::next(cacheIter);
 
-  if (cacheIter != end(blocks) && bp->getSector() + count > (*cacheIter)->getSector()) {
+  if (next != end(blocks) && bp->getSector() + count > next->first) {
     throw FilesystemException {-EINVAL, "Block resize would cause overlap, or non-positive size"};    
   }
 
+  auto oldCount = bp->getCount();
   bp->resize(count, dataSource);
+
+  account((count - oldCount) * Block::SECTOR_SIZE);
+  if (cacheIter->second.dirtyCounted) {
+    dirtyBytes = dirtyBytes + count * Block::SECTOR_SIZE - oldCount * Block::SECTOR_SIZE;
+  }
 }
 
 /**
- * Write all dirty blocks to disk.
+ * Read a range of the volume straight from the data source.
+ *
+ * The range is read with one request regardless of how many sectors it 
+ * covers, and no blocks are added to the cache. Dirty blocks in the range 
+ * hold data newer than what is on disk, so they are copied over the result.
+ * If the whole range is already cached (for instance, because it was 
+ * prefetched) it is copied from the cache without reading anything.
+ *
+ * The read is done without holding the cache lock. If blocks were written back
+ * while it was in progress, a dirty block might have been cleaned before it 
+ * could be copied over the result, so the range is read again under the lock.
+ *
+ * Will throw on I/O problems.
+ *
+ * @param offset the byte offset on the volume to start reading from.
+ * @param bytes the number of bytes to read.
+ * @param buffer the buffer to read into.
+ */
+auto BlockCache::readDirect(off_t offset, size_t bytes, char *buffer) -> void
+{
+  if (bytes == 0) {
+    return;
+  }
+
+  auto lock = unique_lock<mutex> {cacheLock};
+  if (copyOutCached(offset, bytes, buffer)) {
+    return;
+  }
+
+  auto epoch = writeEpoch;
+  lock.unlock();
+
+  auto err = dataSource->read(buffer, bytes, offset);
+  if (err < 0) {
+    throw FilesystemException {static_cast<int>(err), "could not read sectors"};
+  }
+
+  lock.lock();
+  if (epoch != writeEpoch) {
+    err = dataSource->read(buffer, bytes, offset);
+    if (err < 0) {
+      throw FilesystemException {static_cast<int>(err), "could not read sectors"};
+    }
+  }
+
+  auto rangeEnd = static_cast<off_t>(offset + bytes);
+  auto firstSector = static_cast<int>(offset / Block::SECTOR_SIZE);
+  auto lastSector = static_cast<int>((rangeEnd - 1) / Block::SECTOR_SIZE);
+
+  // start with the block that might contain the first sector
+  auto iter = blocks.upper_bound(firstSector);
+  if (iter != begin(blocks)) {
+    --iter;
+  }
+
+  for (; iter != end(blocks) && iter->first <= lastSector; ++iter) {
+    auto bp = &iter->second.block;
+    if (!bp->isDirty()) {
+      continue;
+    }
+
+    auto blockStart = static_cast<off_t>(bp->getSector()) * Block::SECTOR_SIZE;
+    auto blockEnd = blockStart + bp->getCount() * Block::SECTOR_SIZE;
+    auto from = std::max(blockStart, offset);
+    auto to = std::min(blockEnd, rangeEnd);
+
+    if (from < to) {
+      bp->copyOut(from - blockStart, to - from, buffer + (from - offset));
+    }
+  }
+}
+
+/**
+ * Read sectors into the cache ahead of a client asking for them.
+ *
+ * Sectors which aren't already cached are read with one request per run of
+ * missing sectors, and added as one-sector blocks which are candidates for
+ * eviction like any other unreferenced clean block. At most half of the cache
+ * is used, so that reading ahead doesn't push out everything else. If the data 
+ * source maps the volume into memory, there is nothing to gain and nothing is 
+ * done.
+ *
+ * Will throw on I/O problems.
+ *
+ * @param sector the first sector to read.
+ * @param count the number of sectors to read.
+ */
+auto BlockCache::prefetch(int sector, int count) -> void
+{
+  auto lock = unique_lock<mutex> {cacheLock};
+
+  count = std::min(count, sectors - sector);
+  count = std::min(count, static_cast<int>(maxBytes / 2 / Block::SECTOR_SIZE));
+  if (count <= 0) {
+    return;
+  }
+
+  if (dataSource->map(off_t(sector) * Block::SECTOR_SIZE, count * Block::SECTOR_SIZE) != nullptr) {
+    return;
+  }
+
+  // find the runs of sectors which aren't cached
+  auto runs = std::vector<std::pair<int, int>> {};
+  for (auto s = sector; s < sector + count; s++) {
+    auto range = overlapping(s, 1);
+    if (range.first != range.second) {
+      continue;
+    }
+
+    if (!runs.empty() && runs.back().first + runs.back().second == s) {
+      runs.back().second++;
+    } else {
+      runs.emplace_back(s, 1);
+    }
+  }
+
+  if (runs.empty()) {
+    return;
+  }
+
+  // as in `getBlock', read without the lock and check nothing was written
+  // back meanwhile
+  auto epoch = writeEpoch;
+  lock.unlock();
+
+  // the runs are read as one batch, each straight into its blocks
+  auto fetched = std::vector<Block> {};
+  auto iov = std::vector<struct iovec> {};
+  auto requests = std::vector<DataSource::Request> {};
+
+  fetched.reserve(count);
+  for (const auto &run : runs) {
+    auto request = DataSource::Request {};
+    request.write = false;
+    request.iovcnt = run.second;
+    request.offset = off_t(run.first) * Block::SECTOR_SIZE;
+    requests.push_back(request);
+
+    for (auto i = 0; i < run.second; i++) {
+      fetched.emplace_back(run.first + i, 1, &sectorBuffers);
+
+      // reading into the block directly leaves it clean
+      auto vec = iovec {};
+      vec.iov_base = const_cast<uint8_t *>(fetched.back().getData());
+      vec.iov_len = Block::SECTOR_SIZE;
+      iov.push_back(vec);
+    }
+  }
+
+  auto next = size_t {0};
+  for (auto &request : requests) {
+    request.iov = &iov[next];
+    next += request.iovcnt;
+  }
+
+  auto err = dataSource->submit(&requests[0], requests.size());
+  if (err < 0) {
+    throw FilesystemException {err, "could not read sectors"};
+  }
+
+  lock.lock();
+  if (epoch != writeEpoch) {
+    return;
+  }
+
+  for (auto &block : fetched) {
+    auto blockSector = block.getSector();
+
+    // another thread may have cached the sector in the meantime
+    auto range = overlapping(blockSector, 1);
+    if (range.first != range.second) {
+      continue;
+    }
+
+    auto iter = blocks.emplace(blockSector, CacheEntry {move(block), end(lru), false, steady_clock::time_point {}}).first;
+    account(Block::SECTOR_SIZE);
+    makeEvictable(iter);
+  }
+
+  evict();
+}
+
+/**
+ * Copy a range of sectors on the volume to another location.
+ *
+ * The copy is done by the data source in large pieces rather than through
+ * cached blocks. Dirty blocks in the source range are written first so the 
+ * copy sees their data. Afterwards, cached blocks in the destination range
+ * no longer match the disk; unreferenced ones are dropped and referenced 
+ * ones are read again.
  *
  * Will throw on I/O problems.
+ *
+ * @param source the first sector to copy from.
+ * @param dest the first sector to copy to.
+ * @param count the number of sectors to copy.
+ */
+auto BlockCache::copySectors(int source, int dest, int count) -> void
+{
+  if (count <= 0 || source == dest) {
+    return;
+  }
+
+  lock_guard<mutex> lock {cacheLock};
+
+  auto range = overlapping(source, count);
+  writeBack(range.first, range.second);
+
+  // a dirty block only partly inside the destination still has data outside
+  // it which must survive being read back
+  range = overlapping(dest, count);
+  writeBack(range.first, range.second);
+
+  writeEpoch++;
+  auto err = dataSource->copy(
+    static_cast<off_t>(source) * Block::SECTOR_SIZE,
+    static_cast<off_t>(dest) * Block::SECTOR_SIZE,
+    static_cast<size_t>(count) * Block::SECTOR_SIZE);
+  if (err < 0) {
+    throw FilesystemException {err, "could not copy sectors"};
+  }
+
+  range = overlapping(dest, count);
+  for (auto iter = range.first; iter != range.second;) {
+    auto &entry = iter->second;
+
+    if (entry.block.getRefCount() > 0) {
+      entry.block.read(dataSource);
+      ++iter;
+      continue;
+    }
+
+    if (entry.lru != end(lru)) {
+      lru.erase(entry.lru);
+    }
+    account(-entry.block.getCount() * Block::SECTOR_SIZE);
+    iter = blocks.erase(iter);
+  }
+}
+
+/**
+ * Change the memory cap of the cache.
+ *
+ * If the cache is over the new cap, unreferenced clean blocks will be evicted
+ * immediately.
+ *
+ * @param bytes the new cap, in bytes.
+ */
+auto BlockCache::setMaxBytes(size_t bytes) -> void
+{
+  lock_guard<mutex> lock {cacheLock};
+  maxBytes = bytes;
+  evict();
+}
+
+/**
+ * Check that the volume holds the latest data for a range of sectors, so 
+ * that it can be read without going through the cache.
+ *
+ * @param sector the first sector of the range.
+ * @param count the number of sectors in the range.
+ * @return true if no cached block in the range is dirty.
+ */
+auto BlockCache::isClean(int sector, int count) -> bool
+{
+  lock_guard<mutex> lock {cacheLock};
+
+  auto range = overlapping(sector, count);
+  return std::none_of(range.first, range.second, [](const auto &entry) {
+    return entry.second.block.isDirty();
+  });
+}
+
+/**
+ * Drop the cached blocks in a range of sectors, so that the range can be 
+ * written without going through the cache.
+ *
+ * Nothing is dropped if any block in the range is dirty or referenced.
+ *
+ * @param sector the first sector of the range.
+ * @param count the number of sectors in the range.
+ * @return true if the cache no longer holds any of the range.
+ */
+auto BlockCache::discard(int sector, int count) -> bool
+{
+  lock_guard<mutex> lock {cacheLock};
+
+  auto range = overlapping(sector, count);
+  auto busy = std::any_of(range.first, range.second, [](const auto &entry) {
+    return entry.second.block.isDirty() || entry.second.block.getRefCount() > 0;
+  });
+
+  if (busy) {
+    return false;
+  }
+
+  // a read racing this one may have fetched the old data 
+  writeEpoch++;
+
+  for (auto iter = range.first; iter != range.second; ) {
+    auto &entry = iter->second;
+    if (entry.lru != end(lru)) {
+      lru.erase(entry.lru);
+    }
+    account(-entry.block.getCount() * Block::SECTOR_SIZE);
+    iter = blocks.erase(iter);
+  }
+
+  return true;
+}
+
+/**
+ * Write all dirty blocks to disk.
+ *
+ * Will throw on I/O problems, including a failed background write which 
+ * hasn't been reported yet.
  */
 auto BlockCache::sync() -> void
 {
-  for (auto &bp : blocks) {
-    if (bp->isDirty()) {
-      bp->write(dataSource);
+  lock_guard<mutex> lock {cacheLock};
+  writeBack(begin(blocks), end(blocks));
+  evict();
+  takeFlushError();
+}
+
+/**
+ * Write the dirty blocks which overlap a range of sectors to disk.
+ *
+ * This allows the data of one file to be flushed without writing
+ * everything else that is dirty on the volume.
+ *
+ * Will throw on I/O problems, including a failed background write which 
+ * hasn't been reported yet.
+ *
+ * @param sector the first sector of the range.
+ * @param count the number of sectors in the range.
+ */
+auto BlockCache::syncRange(int sector, int count) -> void
+{
+  if (count <= 0) {
+    return;
+  }
+
+  lock_guard<mutex> lock {cacheLock};
+
+  auto range = overlapping(sector, count);
+  writeBack(range.first, range.second);
+  evict();
+  takeFlushError();
+}
+
+/**
+ * Write the dirty blocks in a range of the cache.
+ *
+ * Blocks are visited in sector order, and runs of adjacent dirty blocks are
+ * merged into one vectored write of up to MAX_WRITE_SECTORS sectors. All of
+ * the runs are handed to the data source as one batch.
+ *
+ * @param first the first cache entry to consider.
+ * @param last one past the last cache entry to consider.
+ */
+auto BlockCache::writeBack(BlockMap::iterator first, BlockMap::iterator last) -> void
+{
+  auto runs = std::vector<std::pair<BlockMap::iterator, BlockMap::iterator>> {};
+
+  while (first != last) {
+    if (!first->second.block.isDirty()) {
+      ++first;
+      continue;
+    }
+
+    auto runEnd = std::next(first);
+    auto runSectors = first->second.block.getCount();
+    auto nextSector = first->first + runSectors;
+
+    while (
+      runEnd != last && 
+      runEnd->first == nextSector &&
+      runEnd->second.block.isDirty() &&
+      runSectors + runEnd->second.block.getCount() <= MAX_WRITE_SECTORS
+    ) {
+      runSectors += runEnd->second.block.getCount();
+      nextSector += runEnd->second.block.getCount();
+      ++runEnd;
+    }
+
+    runs.emplace_back(first, runEnd);
+    first = runEnd;
+  }
+
+  if (!runs.empty()) {
+    writeRuns(runs);
+  }
+}
+
+/**
+ * Write runs of adjacent dirty blocks, with one vectored request per run, 
+ * submitted together.
+ *
+ * Runs which were written are marked clean even if others failed.
+ *
+ * @param runs the first and one past the last block of each run.
+ */
+auto BlockCache::writeRuns(const std::vector<std::pair<BlockMap::iterator, BlockMap::iterator>> &runs) -> void
+{
+  writeEpoch++;
+
+  auto iov = std::vector<struct iovec> {};
+  auto requests = std::vector<DataSource::Request> {};
+
+  for (const auto &run : runs) {
+    auto request = DataSource::Request {};
+    request.write = true;
+    request.iovcnt = 0;
+    request.offset = static_cast<off_t>(run.first->first) * Block::SECTOR_SIZE;
+
+    for (auto iter = run.first; iter != run.second; ++iter) {
+      auto bp = &iter->second.block;
+
+      // the data source only reads from the buffers on a write
+      auto vec = iovec {};
+      vec.iov_base = const_cast<uint8_t *>(bp->getData());
+      vec.iov_len = bp->getCount() * Block::SECTOR_SIZE;
+      iov.push_back(vec);
+      request.iovcnt++;
+    }
+
+    requests.push_back(request);
+  }
+
+  // `iov' is complete, so it's safe to point into it now
+  auto next = size_t {0};
+  for (auto &request : requests) {
+    request.iov = &iov[next];
+    next += request.iovcnt;
+  }
+
+  auto err = dataSource->submit(&requests[0], requests.size());
+
+  for (auto i = size_t {0}; i < runs.size(); i++) {
+    if (requests[i].result < 0) {
+      continue;
+    }
+    Statistics::count(Statistics::Counter::BytesWritten, requests[i].result);
+
+    for (auto iter = runs[i].first; iter != runs[i].second; ++iter) {
+      iter->second.block.markClean();
+      uncountDirty(iter->second);
+      iter->second.dirtySince = steady_clock::time_point {};
+      makeEvictable(iter);
+    }
+  }
+
+  flushed.notify_all();
+
+  if (err < 0) {
+    throw FilesystemException {err, "could not write blocks"};
+  }
+}
+
+/**
+ * Count a released dirty block's bytes as waiting to be written, if they 
+ * aren't already. Its age runs from the first time it was released dirty,
+ * however often it's been taken again since.
+ *
+ * Must be called with the cache lock held.
+ *
+ * @param entry the cache entry of the block.
+ */
+auto BlockCache::countDirty(CacheEntry &entry) -> void
+{
+  if (entry.dirtyCounted) {
+    return;
+  }
+
+  entry.dirtyCounted = true;
+  if (entry.dirtySince == steady_clock::time_point {}) {
+    entry.dirtySince = steady_clock::now();
+  }
+  dirtyBytes += entry.block.getCount() * Block::SECTOR_SIZE;
+}
+
+/**
+ * Stop counting a block's bytes as dirty, because it's been written or 
+ * someone has taken it again and the flusher can't write it.
+ *
+ * Must be called with the cache lock held.
+ *
+ * @param entry the cache entry of the block.
+ */
+auto BlockCache::uncountDirty(CacheEntry &entry) -> void
+{
+  if (!entry.dirtyCounted) {
+    return;
+  }
+
+  entry.dirtyCounted = false;
+  dirtyBytes -= entry.block.getCount() * Block::SECTOR_SIZE;
+}
+
+/**
+ * Throw a failed background write's error, if there is one which hasn't been
+ * reported yet. It's only reported once.
+ *
+ * Must be called with the cache lock held.
+ */
+auto BlockCache::takeFlushError() -> void
+{
+  if (flushError < 0) {
+    auto err = flushError;
+    flushError = 0;
+    throw FilesystemException {err, "could not write blocks in the background"};
+  }
+}
+
+/**
+ * Start a thread which writes dirty blocks in the background.
+ *
+ * If a flusher is already running, its limits are replaced.
+ *
+ * @param limits when to write dirty blocks.
+ */
+auto BlockCache::startFlusher(const FlushLimits &limits) -> void
+{
+  lock_guard<mutex> lock {cacheLock};
+
+  // the flusher only hurries once the high watermark is passed, so writers
+  // held at a lower hard limit would wait for blocks to age out
+  flushLimits = limits;
+  flushLimits.highWaterBytes = std::min(limits.highWaterBytes, limits.hardLimitBytes);
+  if (flusherRunning) {
+    flushWake = true;
+    flushNeeded.notify_one();
+    return;
+  }
+
+  flusherRunning = true;
+  stopping = false;
+  flushWake = false;
+  flusher = std::thread {&BlockCache::flushLoop, this};
+}
+
+/**
+ * Stop the background flusher, if it is running. 
+ *
+ * Blocks it had not gotten to are left dirty in the cache.
+ */
+auto BlockCache::stopFlusher() -> void
+{
+  auto lock = unique_lock<mutex> {cacheLock};
+  if (!flusherRunning) {
+    return;
+  }
+
+  stopping = true;
+  flushNeeded.notify_one();
+  lock.unlock();
+
+  flusher.join();
+
+  lock.lock();
+  flusherRunning = false;
+  flushed.notify_all();
+}
+
+/**
+ * The body of the background flusher.
+ *
+ * While too much is dirty, the flusher writes unreferenced dirty blocks until
+ * half the high watermark is left; otherwise, it writes blocks which have 
+ * reached the age limit. Either way the blocks are written in sector order, 
+ * merged into runs, one run at a time so that other threads can use the 
+ * cache in between.
+ *
+ * After a pass which wrote nothing, or hit an error, the flusher sleeps 
+ * until it's woken or the next check is due, so that it never holds the 
+ * cache while there's nothing it can do. A failed write is kept to be 
+ * reported by the next sync, and its blocks stay dirty to be tried again.
+ */
+auto BlockCache::flushLoop() -> void
+{
+  auto lock = unique_lock<mutex> {cacheLock};
+  auto wrote = false;
+
+  while (!stopping) {
+    if (!wrote || dirtyBytes <= flushLimits.highWaterBytes) {
+      auto interval = std::max(flushLimits.maxAge / 2, std::chrono::milliseconds {10});
+      flushNeeded.wait_for(lock, interval, [this]() { return stopping || flushWake; });
+      flushWake = false;
+    }
+
+    auto pressure = dirtyBytes > flushLimits.highWaterBytes;
+    auto sector = 0;
+    wrote = false;
+
+    while (!stopping) {
+      if (pressure && dirtyBytes <= flushLimits.highWaterBytes / 2) {
+        pressure = false;
+      }
+
+      auto now = steady_clock::now();
+      auto eligible = [this, now, pressure](const CacheEntry &entry) {
+        return 
+          entry.dirtyCounted && 
+          entry.block.getRefCount() == 0 &&
+          (pressure || now - entry.dirtySince >= flushLimits.maxAge);
+      };
+
+      // find the next run to write; blocks may have come and gone since the 
+      // last one, so look it up again by sector
+      auto first = blocks.lower_bound(sector);
+      while (first != end(blocks) && !(first->second.block.isDirty() && eligible(first->second))) {
+        ++first;
+      }
+
+      if (first == end(blocks)) {
+        break;
+      }
+
+      auto last = std::next(first);
+      auto runSectors = first->second.block.getCount();
+      while (
+        last != end(blocks) &&
+        last->first == first->first + runSectors &&
+        last->second.block.isDirty() && 
+        eligible(last->second) &&
+        runSectors + last->second.block.getCount() <= MAX_WRITE_SECTORS
+      ) {
+        runSectors += last->second.block.getCount();
+        ++last;
+      }
+
+      sector = first->first + runSectors;
+      try {
+        writeRuns({{first, last}});
+      } catch (const FilesystemException &ex) {
+        // let writers waiting on the hard limit see the error rather than wait
+        // on blocks which can't be written
+        if (flushError == 0) {
+          flushError = ex.getError();
+        }
+        flushed.notify_all();
+        wrote = false;
+        break;
+      }
+      wrote = true;
+
+      lock.unlock();
+      std::this_thread::yield();
+      lock.lock();
+    }
+
+    evict();
+  }
+}
+
+/**
+ * @return the number of bytes in released dirty blocks which have not been
+ * written yet.
+ */
+auto BlockCache::getDirtyBytes() const -> size_t
+{
+  lock_guard<mutex> lock {cacheLock};
+  return dirtyBytes;
+}
+
+/**
+ * @return the memory cap of the cache, in bytes.
+ */
+auto BlockCache::getMaxBytes() const -> size_t
+{
+  lock_guard<mutex> lock {cacheLock};
+  return maxBytes;
+}
+
+/**
+ * @return the number of bytes of sector data currently held by the cache.
+ */
+auto BlockCache::getCachedBytes() const -> size_t
+{
+  lock_guard<mutex> lock {cacheLock};
+  return cachedBytes;
+}
+
+/**
+ * Find the cached blocks which overlap a range of sectors.
+ *
+ * Must be called with the cache lock held.
+ *
+ * @param sector the first sector of the range.
+ * @param count the number of sectors in the range.
+ * @return the first overlapping cache entry, and one past the last.
+ */
+auto BlockCache::overlapping(int sector, int count) -> std::pair<BlockMap::iterator, BlockMap::iterator>
+{
+  auto first = blocks.upper_bound(sector);
+  if (first != begin(blocks)) {
+    auto prev = std::prev(first);
+    if (prev->first + prev->second.block.getCount() > sector) {
+      first = prev;
+    }
+  }
+
+  return std::make_pair(first, blocks.lower_bound(sector + count));
+}
+
+/**
+ * Copy a range of the volume out of the cache, if every sector of it is cached.
+ *
+ * Must be called with the cache lock held.
+ *
+ * @param offset the byte offset on the volume to start reading from.
+ * @param bytes the number of bytes to read.
+ * @param buffer the buffer to read into.
+ * @return true if the range was cached and has been copied.
+ */
+auto BlockCache::copyOutCached(off_t offset, size_t bytes, char *buffer) -> bool
+{
+  auto rangeEnd = static_cast<off_t>(offset + bytes);
+  auto firstSector = static_cast<int>(offset / Block::SECTOR_SIZE);
+  auto lastSector = static_cast<int>((rangeEnd - 1) / Block::SECTOR_SIZE);
+  auto range = overlapping(firstSector, lastSector - firstSector + 1);
+
+  // the blocks must cover the range without gaps
+  auto next = firstSector;
+  for (auto iter = range.first; iter != range.second; ++iter) {
+    if (iter->first > next) {
+      return false;
+    }
+    next = iter->first + iter->second.block.getCount();
+  }
+
+  if (next <= lastSector) {
+    return false;
+  }
+
+  for (auto iter = range.first; iter != range.second; ++iter) {
+    auto bp = &iter->second.block;
+    auto blockStart = static_cast<off_t>(bp->getSector()) * Block::SECTOR_SIZE;
+    auto blockEnd = blockStart + bp->getCount() * Block::SECTOR_SIZE;
+    auto from = std::max(blockStart, offset);
+    auto to = std::min(blockEnd, rangeEnd);
+
+    bp->copyOut(from - blockStart, to - from, buffer + (from - offset));
+
+    // a clean unreferenced block was used, so it's the most recently used now
+    auto &entry = iter->second;
+    if (entry.lru != end(lru)) {
+      lru.splice(end(lru), lru, entry.lru);
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Look up a block and take a reference to it.
+ *
+ * Must be called with the cache lock held. Throws if the requested block
+ * would overlap a cached block other than itself.
+ *
+ * @param sector the starting sector of the requested block.
+ * @param count the number of sectors in the requested block.
+ * @return the block, or nullptr if it is not in the cache.
+ */
+auto BlockCache::findBlock(int sector, int count) -> Block *
+{
+  // the first block that starts after `sector'; the block before it (if any) 
+  // is the only one that can contain `sector'.
+  auto next = blocks.upper_bound(sector);
+
+  if (next != begin(blocks)) {
+    auto &entry = std::prev(next)->second;
+    auto bp = &entry.block;
+
+    if (bp->getSector() == sector) {
+      if (bp->getCount() != count) {
+        throw FilesystemException {-EINVAL, "Asking for wrong number of sectors in block cache"};
+      }
+
+      if (entry.lru != end(lru)) {
+        lru.erase(entry.lru);
+        entry.lru = end(lru);
+      }
+
+      // the flusher can't write a block while it's held
+      uncountDirty(entry);
+      bp->addRef();
+      return bp;
+    }
+
+    if (sector < bp->getSector() + bp->getCount()) {
+      throw FilesystemException {-EINVAL, "Block cache request would overlap existing block"};
     }
   }
+
+  if (next != end(blocks) && sector + count > next->first) {
+    throw FilesystemException {-EINVAL, "Block cache request would overlap existing block"};
+  }
+
+  return nullptr;
+}
+
+/**
+ * Put a block on the LRU list if it's clean and no one is holding a reference
+ * to it.
+ *
+ * Dirty blocks are kept off the list so eviction never has to skip over them;
+ * they are added once `sync' has written them.
+ *
+ * @param iter the cache entry of the block.
+ */
+auto BlockCache::makeEvictable(BlockMap::iterator iter) -> void
+{
+  auto &entry = iter->second;
+  auto bp = &entry.block;
+
+  if (bp->getRefCount() > 0 || bp->isDirty() || entry.lru != end(lru)) {
+    return;
+  }
+
+  entry.lru = lru.insert(end(lru), iter->first);
+}
+
+/**
+ * Evict least recently used blocks until the cache is back under its memory cap
+ * and any shared budget, or there is nothing left that can be evicted.
+ */
+auto BlockCache::evict() -> void
+{
+  while ((cachedBytes > maxBytes || (budget != nullptr && budget->isOver())) && !lru.empty()) {
+    auto iter = blocks.find(lru.front());
+    lru.pop_front();
+
+    account(-iter->second.block.getCount() * Block::SECTOR_SIZE);
+    blocks.erase(iter);
+    Statistics::count(Statistics::Counter::CacheEvictions);
+  }
 }
 
+/**
+ * Account for the cache's sector data growing or shrinking, against both
+ * its own cap and any shared budget.
+ *
+ * @param bytes the change in size, which may be negative.
+ */
+auto BlockCache::account(ptrdiff_t bytes) -> void
+{
+  cachedBytes += bytes;
+  if (budget != nullptr) {
+    budget->charge(bytes);
+  }
+}
 
 }
@@ -5,9 +5,20 @@
 #define __BLOCK_CACHE_H_
 
 #include "Block.h"
+#include "BufferPool.h"
+#include "CacheBudget.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <sys/types.h>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace RT11FS {
 class DataSource;
@@ -22,22 +33,120 @@ class DataSource;
  * It is an error for any two blocks in the cache to overlap, as this would
  * cause the same data on disk to be represented in two different blocks.
  *
+ * Blocks are indexed by their starting sector. The cache tries to stay under
+ * a memory cap by evicting clean, unreferenced blocks in least recently used
+ * order. Referenced and dirty blocks are never evicted, so the cap may be
+ * exceeded while they are outstanding. Caches may also share a CacheBudget,
+ * which caps their memory together.
+ *
+ * The cache's own structures are protected by an internal lock, so blocks may be
+ * fetched and released from any thread. The cache does not serialize access to
+ * the contents of blocks; clients which modify a block must not do so while
+ * another thread may be reading it.
+ *
+ * Optionally, a background thread writes dirty blocks once too many bytes are
+ * dirty or they have been dirty for too long. It only writes blocks which no 
+ * one holds a reference to, so it never sees a block being modified; a block
+ * which is held for as long as the cache is used, like the directory, has to
+ * be written by its holder. A block's dirty data is counted from when its 
+ * last reference is released until it's written or taken again, so every
+ * counted byte is one the thread can write. If the dirty bytes reach a hard
+ * limit, releasing a dirty block waits for the thread to catch up. If a 
+ * background write fails, its blocks stay dirty and the error is thrown from
+ * the next `sync', `syncRange' or release of a dirty block.
+ *
+ * Single sector blocks take their storage from a buffer pool, and the cache's
+ * index and LRU list take their nodes from an arena, so a cache which has 
+ * reached its working set doesn't go to the heap for each miss.
  */
 class BlockCache {
 public:
-  BlockCache(DataSource *dataSource);
+  static const size_t DEFAULT_MAX_BYTES = 4 * 1024 * 1024;
+  static const int MAX_WRITE_SECTORS = 256;
+
+  /**
+   * When the background flusher writes dirty blocks.
+   */
+  struct FlushLimits {
+    size_t highWaterBytes;            /*!< start writing when more than this is dirty */
+    size_t hardLimitBytes;            /*!< make writers wait when more than this is dirty; the high watermark is capped at this */
+    std::chrono::milliseconds maxAge; /*!< write blocks which have been dirty this long */
+  };
+
+  BlockCache(DataSource *dataSource, size_t maxBytes = DEFAULT_MAX_BYTES, CacheBudget *budget = nullptr);
   ~BlockCache();
 
   auto getBlock(int sector, int count) -> Block *;
+  auto getBlockForOverwrite(int sector, int count) -> Block *;
   auto putBlock(Block *bp) -> void;
   auto resizeBlock(Block *bp, int count) -> void;
+  auto readDirect(off_t offset, size_t bytes, char *buffer) -> void;
+  auto prefetch(int sector, int count) -> void;
+  auto copySectors(int source, int dest, int count) -> void;
+  auto isClean(int sector, int count) -> bool;
+  auto discard(int sector, int count) -> bool;
   auto getVolumeSectors() { return sectors; }
   auto sync() -> void;
+  auto syncRange(int sector, int count) -> void;
+
+  auto getMaxBytes() const -> size_t;
+  auto setMaxBytes(size_t bytes) -> void;
+  auto getCachedBytes() const -> size_t;
+  auto getDirtyBytes() const -> size_t;
+
+  auto startFlusher(const FlushLimits &limits) -> void;
+  auto stopFlusher() -> void;
 
 private:
+  using LruList = std::list<int, ArenaAllocator<int>>;
+
+  struct CacheEntry {
+    Block block;
+    LruList::iterator lru;            /*!< position in `lru', or the end of `lru' if not evictable */
+    bool dirtyCounted;                /*!< the block's bytes are included in `dirtyBytes' */
+    std::chrono::steady_clock::time_point dirtySince;   /*!< when the block was first released dirty since it was last written */
+  };
+
+  using BlockMap = std::map<
+    int, 
+    CacheEntry, 
+    std::less<int>, 
+    ArenaAllocator<std::pair<const int, CacheEntry>>>;
+
   DataSource *dataSource;
   int sectors;
-  std::list<std::unique_ptr<Block>> blocks;
+  size_t maxBytes;
+  size_t cachedBytes;
+  CacheBudget *budget;                /*!< the cap shared with other caches, or null */
+  BufferPool sectorBuffers;           /*!< storage for single sector blocks */
+  NodeArena nodes;                    /*!< nodes of `blocks' and `lru'; must outlive them */
+  BlockMap blocks;                    /*!< every cached block, keyed by starting sector */
+  LruList lru;                        /*!< clean unreferenced blocks, least recently used first */
+  unsigned writeEpoch;                /*!< bumped on every write back, to detect reads that raced one */
+  size_t dirtyBytes;                  /*!< bytes of released dirty blocks not yet written */
+  FlushLimits flushLimits;
+  bool flusherRunning;
+  bool stopping;                      /*!< the flusher has been asked to exit */
+  bool flushWake;                     /*!< the flusher has been woken for more work */
+  int flushError;                     /*!< a failed background write not yet reported, or 0 */
+  mutable std::mutex cacheLock;       /*!< protects all of the above */
+  std::condition_variable flushNeeded;  /*!< wakes the flusher early */
+  std::condition_variable flushed;      /*!< wakes writers waiting on the hard limit */
+  std::thread flusher;
+
+  auto findBlock(int sector, int count) -> Block *;
+  auto overlapping(int sector, int count) -> std::pair<BlockMap::iterator, BlockMap::iterator>;
+  auto copyOutCached(off_t offset, size_t bytes, char *buffer) -> bool;
+
+  auto writeBack(BlockMap::iterator first, BlockMap::iterator last) -> void;
+  auto writeRuns(const std::vector<std::pair<BlockMap::iterator, BlockMap::iterator>> &runs) -> void;
+  auto countDirty(CacheEntry &entry) -> void;
+  auto uncountDirty(CacheEntry &entry) -> void;
+  auto takeFlushError() -> void;
+  auto flushLoop() -> void;
+  auto makeEvictable(BlockMap::iterator iter) -> void;
+  auto evict() -> void;
+  auto account(ptrdiff_t bytes) -> void;
 };
 }
 
@@ -0,0 +1,190 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "BufferPool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+using std::lock_guard;
+using std::mutex;
+
+namespace RT11FS {
+
+const size_t BufferPool::ALIGNMENT;
+
+/**
+ * Construct a buffer pool.
+ *
+ * @param bufferBytes the size of each buffer.
+ * @param buffersPerSlab how many buffers to allocate from the heap at once.
+ */
+BufferPool::BufferPool(size_t bufferBytes, int buffersPerSlab)
+  : bufferBytes(bufferBytes)
+  , buffersPerSlab(buffersPerSlab)
+{
+}
+
+BufferPool::~BufferPool()
+{
+  for (auto slab : slabs) {
+    releaseAligned(slab);
+  }
+}
+
+/**
+ * Get a buffer from the pool.
+ *
+ * The contents of the buffer are undefined. Throws std::bad_alloc if the pool 
+ * needs another slab and there is no memory for it.
+ *
+ * @return a buffer of `getBufferBytes' bytes
+ */
+auto BufferPool::allocate() -> uint8_t *
+{
+  lock_guard<mutex> lock {poolLock};
+
+  if (freeBuffers.empty()) {
+    auto slab = allocateAligned(bufferBytes * buffersPerSlab);
+    slabs.push_back(slab);
+
+    // hand out the start of the slab first
+    for (auto i = buffersPerSlab; i--; ) {
+      freeBuffers.push_back(slab + i * bufferBytes);
+    }
+  }
+
+  auto buffer = freeBuffers.back();
+  freeBuffers.pop_back();
+  return buffer;
+}
+
+/**
+ * Return a buffer to the pool.
+ *
+ * @param buffer a buffer which came from `allocate' on this pool.
+ */
+auto BufferPool::release(uint8_t *buffer) -> void
+{
+  lock_guard<mutex> lock {poolLock};
+  freeBuffers.push_back(buffer);
+}
+
+/**
+ * Allocate memory from the heap with the pool alignment.
+ *
+ * Used for buffers which aren't the size of any pool. Throws std::bad_alloc
+ * if there is no memory.
+ *
+ * @param bytes the size of the buffer.
+ * @return the buffer, which must be freed with `releaseAligned'
+ */
+auto BufferPool::allocateAligned(size_t bytes) -> uint8_t *
+{
+  void *buffer = nullptr;
+  if (posix_memalign(&buffer, ALIGNMENT, std::max(bytes, size_t {1})) != 0) {
+    throw std::bad_alloc {};
+  }
+
+  return static_cast<uint8_t *>(buffer);
+}
+
+/**
+ * Free memory from `allocateAligned'.
+ *
+ * @param buffer the buffer to free.
+ */
+auto BufferPool::releaseAligned(uint8_t *buffer) -> void
+{
+  free(buffer);
+}
+
+/**
+ * Construct a node arena.
+ *
+ * @param nodesPerSlab how many nodes of a size to allocate from the heap at once.
+ */
+NodeArena::NodeArena(int nodesPerSlab)
+  : nodesPerSlab(nodesPerSlab)
+{
+}
+
+NodeArena::~NodeArena()
+{
+  for (auto slab : slabs) {
+    ::operator delete(slab);
+  }
+}
+
+/**
+ * Get memory for one node.
+ *
+ * @param bytes the size of the node.
+ * @return memory suitably aligned for any object of that size
+ */
+auto NodeArena::allocate(size_t bytes) -> void *
+{
+  bytes = roundUp(bytes);
+
+  // containers use only a handful of node sizes, so a linear search is fine
+  auto sizeClass = std::find_if(begin(classes), end(classes), [bytes](const auto &c) {
+    return c.bytes == bytes;
+  });
+
+  if (sizeClass == end(classes)) {
+    classes.push_back(SizeClass {bytes, nullptr});
+    sizeClass = std::prev(end(classes));
+  }
+
+  if (sizeClass->free == nullptr) {
+    auto slab = static_cast<uint8_t *>(::operator new(bytes * nodesPerSlab));
+    slabs.push_back(slab);
+
+    for (auto i = nodesPerSlab; i--; ) {
+      auto node = reinterpret_cast<FreeNode *>(slab + i * bytes);
+      node->next = sizeClass->free;
+      sizeClass->free = node;
+    }
+  }
+
+  auto node = sizeClass->free;
+  sizeClass->free = node->next;
+  return node;
+}
+
+/**
+ * Return a node's memory to the arena.
+ *
+ * @param node memory from `allocate'.
+ * @param bytes the size which was passed to `allocate'.
+ */
+auto NodeArena::release(void *node, size_t bytes) -> void
+{
+  bytes = roundUp(bytes);
+
+  auto sizeClass = std::find_if(begin(classes), end(classes), [bytes](const auto &c) {
+    return c.bytes == bytes;
+  });
+
+  auto freeNode = static_cast<FreeNode *>(node);
+  freeNode->next = sizeClass->free;
+  sizeClass->free = freeNode;
+}
+
+/**
+ * Round a node size up so that every node in a slab is aligned for any type,
+ * and can hold a free list link.
+ *
+ * @param bytes the size of the node.
+ * @return the size to allocate
+ */
+auto NodeArena::roundUp(size_t bytes) -> size_t
+{
+  auto align = alignof(std::max_align_t);
+  bytes = std::max(bytes, sizeof(FreeNode));
+  return (bytes + align - 1) / align * align;
+}
+
+}
@@ -0,0 +1,141 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __BUFFERPOOL_H_
+#define __BUFFERPOOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace RT11FS {
+
+/**
+ * A pool of fixed size data buffers.
+ *
+ * Buffers are carved out of larger slabs which are never returned to the heap
+ * until the pool is destroyed, so once the pool has grown to its working set, 
+ * allocating a buffer is just popping a free list. Slabs are aligned to 
+ * ALIGNMENT, and each buffer is aligned to its own size (if that divides 
+ * ALIGNMENT), so sector buffers are suitable for O_DIRECT I/O.
+ *
+ * The pool is internally locked, so buffers may be allocated and released
+ * from any thread.
+ */
+class BufferPool
+{
+public:
+  static const size_t ALIGNMENT = 4096;
+
+  BufferPool(size_t bufferBytes, int buffersPerSlab = 64);
+  ~BufferPool();
+
+  BufferPool(const BufferPool &) = delete;
+  auto operator=(const BufferPool &) -> BufferPool & = delete;
+
+  auto allocate() -> uint8_t *;
+  auto release(uint8_t *buffer) -> void;
+
+  /**
+   * @return the size of each buffer in the pool, in bytes.
+   */
+  auto getBufferBytes() const { return bufferBytes; }
+
+  static auto allocateAligned(size_t bytes) -> uint8_t *;
+  static auto releaseAligned(uint8_t *buffer) -> void;
+
+private:
+  size_t bufferBytes;
+  int buffersPerSlab;
+  std::vector<uint8_t *> slabs;
+  std::vector<uint8_t *> freeBuffers;
+  std::mutex poolLock;              /*!< protects all of the above */
+};
+
+/**
+ * An arena of small fixed size objects, such as the nodes of node based
+ * containers.
+ *
+ * Memory is handed out from slabs and, once released, kept on a free list
+ * for its size, so a container whose size is steady stops touching the heap.
+ * The arena is not locked; it must only be used by containers which are 
+ * themselves protected by a lock.
+ */
+class NodeArena
+{
+public:
+  NodeArena(int nodesPerSlab = 256);
+  ~NodeArena();
+
+  NodeArena(const NodeArena &) = delete;
+  auto operator=(const NodeArena &) -> NodeArena & = delete;
+
+  auto allocate(size_t bytes) -> void *;
+  auto release(void *node, size_t bytes) -> void;
+
+private:
+  struct FreeNode {
+    FreeNode *next;
+  };
+
+  struct SizeClass {
+    size_t bytes;
+    FreeNode *free;
+  };
+
+  int nodesPerSlab;
+  std::vector<SizeClass> classes;
+  std::vector<void *> slabs;
+
+  static auto roundUp(size_t bytes) -> size_t;
+};
+
+/**
+ * A standard allocator which takes single objects from a NodeArena.
+ *
+ * Requests for more than one object, which node based containers don't
+ * make, go to the heap.
+ */
+template <typename T>
+class ArenaAllocator
+{
+public:
+  using value_type = T;
+
+  ArenaAllocator(NodeArena *arena) : arena(arena) {}
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+  auto allocate(size_t n) -> T *
+  {
+    if (n == 1) {
+      return static_cast<T *>(arena->allocate(sizeof(T)));
+    }
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+
+  auto deallocate(T *p, size_t n) -> void
+  {
+    if (n == 1) {
+      arena->release(p, sizeof(T));
+      return;
+    }
+    ::operator delete(p);
+  }
+
+  template <typename U>
+  auto operator==(const ArenaAllocator<U> &other) const { return arena == other.arena; }
+
+  template <typename U>
+  auto operator!=(const ArenaAllocator<U> &other) const { return arena != other.arena; }
+
+private:
+  template <typename U> friend class ArenaAllocator;
+
+  NodeArena *arena;
+};
+}
+
+#endif
@@ -0,0 +1,51 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __CACHEBUDGET_H_
+#define __CACHEBUDGET_H_
+
+#include <atomic>
+#include <cstddef>
+
+namespace RT11FS {
+/**
+ * A memory cap shared by several block caches.
+ *
+ * Each cache charges the budget for the sector data it holds, on top of 
+ * keeping to its own cap. While the caches together are over the budget, 
+ * any of them which grows evicts its own least recently used clean blocks, 
+ * so the memory goes to the volumes which are busy. A cache which is idle
+ * keeps what it has until it's used again or destroyed.
+ */
+class CacheBudget {
+public:
+  CacheBudget(size_t maxBytes) 
+    : maxBytes(maxBytes)
+    , usedBytes(0)
+  {
+  }
+
+  CacheBudget(const CacheBudget &) = delete;
+  auto operator=(const CacheBudget &) -> CacheBudget & = delete;
+
+  auto getMaxBytes() const { return maxBytes; }
+  auto getUsedBytes() const -> size_t { return usedBytes.load(std::memory_order_relaxed); }
+  auto isOver() const { return getUsedBytes() > maxBytes; }
+
+  /**
+   * Account for a cache's data growing or shrinking.
+   *
+   * @param bytes the change in the cache's size, which may be negative.
+   */
+  auto charge(ptrdiff_t bytes) -> void 
+  { 
+    usedBytes.fetch_add(static_cast<size_t>(bytes), std::memory_order_relaxed); 
+  }
+
+private:
+  size_t maxBytes;
+  std::atomic<size_t> usedBytes;
+};
+}
+
+#endif
@@ -0,0 +1,340 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#include "CompressedDataSource.h"
+
+#include "FilesystemException.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using std::all_of;
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::vector;
+
+namespace RT11FS {
+
+const char CompressedDataSource::MAGIC[8] = {'R', 'T', '1', '1', 'C', 'M', 'P', '1'};
+const size_t CompressedDataSource::DEFAULT_CHUNK_BYTES;
+const int CompressedDataSource::DEFAULT_CACHE_CHUNKS;
+
+namespace {
+auto preadAll(int fd, void *buffer, size_t bytes, off_t offset) -> int
+{
+  auto xfer = ::pread(fd, buffer, bytes, offset);
+  if (xfer == -1) {
+    return -errno;
+  } else if (xfer != bytes) {
+    return -EIO;
+  }
+  return 0;
+}
+
+auto pwriteAll(int fd, const void *buffer, size_t bytes, off_t offset) -> int
+{
+  auto xfer = ::pwrite(fd, buffer, bytes, offset);
+  if (xfer == -1) {
+    return -errno;
+  } else if (xfer != bytes) {
+    return -EIO;
+  }
+  return 0;
+}
+}
+
+/**
+ * Open a container.
+ *
+ * @param fd an open descriptor for the container, which the data source
+ * takes ownership of.
+ * @param cacheChunks the number of decompressed chunks to keep.
+ */
+CompressedDataSource::CompressedDataSource(int fd, int cacheChunks)
+  : fd(fd)
+  , chunkCache(std::max(cacheChunks, 1))
+  , useClock(0)
+  , decompressions(0)
+{
+  auto err = preadAll(fd, &header, sizeof(header), 0);
+  if (err == 0 && memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+    err = -EINVAL;
+  }
+
+  if (err == 0 && (
+    header.chunkBytes == 0 ||
+    header.chunks != header.imageBytes / header.chunkBytes + (header.imageBytes % header.chunkBytes != 0))) {
+    err = -EINVAL;
+  }
+
+  // the header is checked against the container's size before anything is
+  // sized from it, so a damaged one can't ask for an enormous index
+  struct stat st;
+  if (err == 0 && ::fstat(fd, &st) == -1) {
+    err = -errno;
+  }
+
+  auto fileBytes = err == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+  if (err == 0 && sizeof(header) + static_cast<uint64_t>(header.chunks) * sizeof(IndexEntry) > fileBytes) {
+    err = -EINVAL;
+  }
+
+  if (err == 0) {
+    index.resize(header.chunks);
+    err = preadAll(fd, index.data(), index.size() * sizeof(IndexEntry), sizeof(header));
+  }
+
+  for (auto i = 0u; err == 0 && i < index.size(); i++) {
+    const auto &entry = index[i];
+    if (entry.bytes > header.chunkBytes || entry.offset > fileBytes || entry.bytes > fileBytes - entry.offset) {
+      err = -EINVAL;
+    }
+  }
+
+  if (err < 0) {
+    ::close(fd);
+    throw FilesystemException {err, "compressed image container could not be read"};
+  }
+
+  for (auto &entry : chunkCache) {
+    entry.chunk = -1;
+    entry.lastUse = 0;
+  }
+}
+
+CompressedDataSource::~CompressedDataSource()
+{
+  ::close(fd);
+}
+
+/**
+ * Returns the status of the container file, but with the size of the image
+ * it holds.
+ */
+auto CompressedDataSource::stat(struct stat *st) -> int
+{
+  if (::fstat(fd, st) == -1) {
+    return -errno;
+  }
+
+  st->st_size = header.imageBytes;
+  return 0;
+}
+
+auto CompressedDataSource::read(void *buffer, size_t bytes, off_t offset) -> ssize_t
+{
+  if (offset < 0 || offset + bytes > header.imageBytes) {
+    return -EIO;
+  }
+
+  auto out = static_cast<uint8_t *>(buffer);
+  auto end = static_cast<uint64_t>(offset) + bytes;
+  auto at = static_cast<uint64_t>(offset);
+
+  while (at < end) {
+    auto chunk = static_cast<int>(at / header.chunkBytes);
+    auto inChunk = at % header.chunkBytes;
+    auto count = min(end - at, header.chunkBytes - inChunk);
+
+    if (index[chunk].bytes == 0) {
+      memset(out, 0, count);
+    } else {
+      lock_guard<mutex> lock {cacheLock};
+      auto data = getChunk(chunk);
+      if (data == nullptr) {
+        return -EIO;
+      }
+      memcpy(out, data + inChunk, count);
+    }
+
+    out += count;
+    at += count;
+  }
+
+  return bytes;
+}
+
+auto CompressedDataSource::write(void *buffer, size_t bytes, off_t offset) -> ssize_t
+{
+  return -EROFS;
+}
+
+auto CompressedDataSource::readv(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t
+{
+  auto total = ssize_t {0};
+  for (auto i = 0; i < iovcnt; i++) {
+    auto err = read(iov[i].iov_base, iov[i].iov_len, offset + total);
+    if (err < 0) {
+      return err;
+    }
+    total += iov[i].iov_len;
+  }
+
+  return total;
+}
+
+auto CompressedDataSource::writev(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t
+{
+  return -EROFS;
+}
+
+/**
+ * @return the number of chunks decompressed so far.
+ */
+auto CompressedDataSource::getDecompressions() -> int
+{
+  lock_guard<mutex> lock {cacheLock};
+  return decompressions;
+}
+
+/**
+ * Check if a file is a compressed image container.
+ *
+ * @param fd an open descriptor for the file.
+ * @return true if the file starts with the container's magic number
+ */
+auto CompressedDataSource::isContainer(int fd) -> bool
+{
+  char magic[sizeof(MAGIC)];
+  return
+    preadAll(fd, magic, sizeof(magic), 0) == 0 &&
+    memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+/**
+ * Write an image into a new container.
+ *
+ * @param image the image to compress.
+ * @param fd an open, writable descriptor for the container, which should be
+ * empty.
+ * @param chunkBytes the size of the chunks to compress the image in.
+ * @return 0 on success or a negated errno
+ */
+auto CompressedDataSource::create(DataSource *image, int fd, size_t chunkBytes) -> int
+{
+  struct stat st;
+  auto err = image->stat(&st);
+  if (err < 0) {
+    return err;
+  }
+
+  if (chunkBytes == 0 || chunkBytes > UINT32_MAX) {
+    return -EINVAL;
+  }
+
+  auto header = Header {};
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.chunkBytes = static_cast<uint32_t>(chunkBytes);
+  header.imageBytes = st.st_size;
+  header.chunks = static_cast<uint32_t>((header.imageBytes + chunkBytes - 1) / chunkBytes);
+
+  auto index = vector<IndexEntry>(header.chunks);
+  auto raw = vector<uint8_t>(chunkBytes);
+  auto packed = vector<uint8_t>(compressBound(chunkBytes));
+  auto next = static_cast<off_t>(sizeof(header) + index.size() * sizeof(IndexEntry));
+
+  for (auto chunk = uint32_t {0}; chunk < header.chunks; chunk++) {
+    auto offset = static_cast<uint64_t>(chunk) * chunkBytes;
+    auto length = min<uint64_t>(chunkBytes, header.imageBytes - offset);
+
+    auto xfer = image->read(raw.data(), length, offset);
+    if (xfer < 0) {
+      return static_cast<int>(xfer);
+    }
+
+    auto &entry = index[chunk];
+    if (all_of(raw.begin(), raw.begin() + length, [](uint8_t byte) { return byte == 0; })) {
+      continue;
+    }
+
+    auto packedBytes = static_cast<uLongf>(packed.size());
+    if (compress2(packed.data(), &packedBytes, raw.data(), length, Z_BEST_COMPRESSION) != Z_OK) {
+      return -EIO;
+    }
+
+    // a chunk stored at its full length is stored uncompressed
+    auto stored = packedBytes < length ? packed.data() : raw.data();
+    entry.bytes = static_cast<uint32_t>(min<uint64_t>(packedBytes, length));
+    entry.offset = next;
+
+    err = pwriteAll(fd, stored, entry.bytes, next);
+    if (err < 0) {
+      return err;
+    }
+    next += entry.bytes;
+  }
+
+  err = pwriteAll(fd, index.data(), index.size() * sizeof(IndexEntry), sizeof(header));
+  if (err < 0) {
+    return err;
+  }
+
+  return pwriteAll(fd, &header, sizeof(header), 0);
+}
+
+/**
+ * @return the length of the image data in a chunk; only the last chunk may
+ * be short.
+ */
+auto CompressedDataSource::chunkLength(int chunk) const -> size_t
+{
+  auto offset = static_cast<uint64_t>(chunk) * header.chunkBytes;
+  return min<uint64_t>(header.chunkBytes, header.imageBytes - offset);
+}
+
+/**
+ * Get a chunk's data, decompressing it into the cache if it isn't there.
+ * The caller must hold the cache lock, and the data is only valid until the
+ * lock is released.
+ *
+ * @param chunk the chunk to get, which must be stored in the container.
+ * @return the chunk's data, or nullptr if it could not be read
+ */
+auto CompressedDataSource::getChunk(int chunk) -> const uint8_t *
+{
+  auto victim = &chunkCache[0];
+  for (auto &entry : chunkCache) {
+    if (entry.chunk == chunk) {
+      entry.lastUse = ++useClock;
+      return entry.data.data();
+    }
+
+    if (entry.lastUse < victim->lastUse) {
+      victim = &entry;
+    }
+  }
+
+  auto &entry = index[chunk];
+  auto length = chunkLength(chunk);
+
+  victim->chunk = -1;
+  victim->data.resize(length);
+
+  if (entry.bytes == length) {
+    if (preadAll(fd, victim->data.data(), length, entry.offset) < 0) {
+      return nullptr;
+    }
+  } else {
+    auto packed = vector<uint8_t>(entry.bytes);
+    if (preadAll(fd, packed.data(), packed.size(), entry.offset) < 0) {
+      return nullptr;
+    }
+
+    auto rawBytes = static_cast<uLongf>(length);
+    if (uncompress(victim->data.data(), &rawBytes, packed.data(), packed.size()) != Z_OK || rawBytes != length) {
+      return nullptr;
+    }
+  }
+
+  decompressions++;
+  victim->chunk = chunk;
+  victim->lastUse = ++useClock;
+  return victim->data.data();
+}
+
+}
@@ -0,0 +1,83 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __COMPRESSEDDATASOURCE_H_
+#define __COMPRESSEDDATASOURCE_H_
+
+#include "DataSource.h"
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace RT11FS {
+/**
+ * A read only data source over a compressed image container.
+ *
+ * The container holds the image in fixed size chunks, each compressed on its
+ * own with zlib so that any chunk can be read without the others. Chunks
+ * which are entirely zero aren't stored at all, and chunks which don't
+ * compress are stored as is.
+ *
+ * The container is a header, an index giving where each chunk is stored,
+ * and the chunk data. Chunks are decompressed as they're read into a small
+ * cache of the most recently used ones, so reading a chunk sector by sector
+ * only decompresses it once.
+ *
+ * Writes fail with EROFS; to change a compressed image, put an
+ * OverlayDataSource over it.
+ */
+class CompressedDataSource : public DataSource {
+public:
+  CompressedDataSource(int fd, int cacheChunks = DEFAULT_CACHE_CHUNKS);
+  ~CompressedDataSource();
+
+  auto stat(struct stat *st) -> int override;
+  auto read(void *buffer, size_t bytes, off_t offset) -> ssize_t override;
+  auto write(void *buffer, size_t bytes, off_t offset) -> ssize_t override;
+  auto readv(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t override;
+  auto writev(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t override;
+
+  auto getDecompressions() -> int;
+
+  static auto isContainer(int fd) -> bool;
+  static auto create(DataSource *image, int fd, size_t chunkBytes = DEFAULT_CHUNK_BYTES) -> int;
+
+  static const char MAGIC[8];
+  static const size_t DEFAULT_CHUNK_BYTES = 64 * 1024;
+  static const int DEFAULT_CACHE_CHUNKS = 16;
+
+private:
+  struct Header {
+    char magic[8];
+    uint32_t chunkBytes;
+    uint32_t chunks;
+    uint64_t imageBytes;
+  };
+
+  struct IndexEntry {
+    uint64_t offset;        /*!< where the chunk is stored in the container */
+    uint32_t bytes;         /*!< the stored size of the chunk, or 0 if it's all zeroes */
+    uint32_t reserved;
+  };
+
+  struct CachedChunk {
+    int chunk;              /*!< the chunk held, or -1 if the entry is unused */
+    uint64_t lastUse;
+    std::vector<uint8_t> data;
+  };
+
+  int fd;
+  Header header;
+  std::vector<IndexEntry> index;
+  std::vector<CachedChunk> chunkCache;
+  uint64_t useClock;
+  int decompressions;
+  std::mutex cacheLock;     /*!< protects the chunk cache */
+
+  auto chunkLength(int chunk) const -> size_t;
+  auto getChunk(int chunk) -> const uint8_t *;
+};
+}
+
+#endif
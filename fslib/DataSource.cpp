@@ -0,0 +1,67 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "DataSource.h"
+
+#include <algorithm>
+#include <vector>
+
+using std::min;
+using std::vector;
+
+namespace RT11FS {
+
+const size_t DataSource::COPY_CHUNK_BYTES;
+
+auto DataSource::copy(off_t from, off_t to, size_t bytes) -> int
+{
+  if (from == to || bytes == 0) {
+    return 0;
+  }
+
+  auto buffer = vector<uint8_t>(min(bytes, COPY_CHUNK_BYTES));
+
+  // as with memmove, copying towards the end of the data source has to start
+  // at the back so overlapping data is read before it's overwritten
+  auto backwards = to > from;
+  auto done = size_t {0};
+
+  while (done < bytes) {
+    auto chunk = min(bytes - done, buffer.size());
+    auto at = backwards ? bytes - done - chunk : done;
+
+    auto err = read(&buffer[0], chunk, from + at);
+    if (err < 0) {
+      return err;
+    }
+
+    err = write(&buffer[0], chunk, to + at);
+    if (err < 0) {
+      return err;
+    }
+
+    done += chunk;
+  }
+
+  return 0;
+}
+
+auto DataSource::submit(Request *requests, int count) -> int
+{
+  auto err = 0;
+
+  for (auto i = 0; i < count; i++) {
+    auto &request = requests[i];
+    request.result = request.write
+      ? writev(request.iov, request.iovcnt, request.offset)
+      : readv(request.iov, request.iovcnt, request.offset);
+
+    if (request.result < 0 && err == 0) {
+      err = static_cast<int>(request.result);
+    }
+  }
+
+  return err;
+}
+
+}
@@ -4,13 +4,34 @@
 #ifndef __DATASOURCE_H_
 #define __DATASOURCE_H_
 
+#include <cstdint>
 #include <cstdio>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 namespace RT11FS {
+/**
+ * The interface to the storage holding a volume image.
+ *
+ * All operations are positional; a data source has no notion of a current
+ * offset, so independent requests may be issued from different threads.
+ */
 class DataSource
 {
 public:
+  /**
+   * One read or write in a batch passed to `submit'.
+   */
+  struct Request {
+    bool write;                 /*!< write from `iov' if true, else read into it */
+    const struct iovec *iov;    /*!< the buffers, as for readv or writev */
+    int iovcnt;                 /*!< the number of entries in `iov' */
+    off_t offset;               /*!< the offset into the data source */
+    ssize_t result;             /*!< on return, what readv or writev would have returned */
+  };
+
+  virtual ~DataSource() {}
+
   /**
    * Follows the semantics of stat(2).
    *
@@ -41,6 +62,82 @@ public:
    * @return the number of bytes written, or a negated errno on failure
    */
   virtual auto write(void *buffer, size_t bytes, off_t offset) -> ssize_t = 0;
+
+  /**
+   * Follows the semantics of preadv(2).
+   *
+   * The buffers are filled in order from consecutive bytes of the data source.
+   * Any failure to fill all of them is an error.
+   *
+   * @param iov the buffers to read into.
+   * @param iovcnt the number of entries in `iov'.
+   * @param offset the offset into the data source to read from.
+   * @return the number of bytes read, or a negated errno on failure
+   */
+  virtual auto readv(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t = 0;
+
+  /**
+   * Follows the semantics of pwritev(2).
+   *
+   * The buffers are written in order to consecutive bytes of the data source.
+   * Any failure to write all of them is an error.
+   *
+   * @param iov the buffers to write from.
+   * @param iovcnt the number of entries in `iov'.
+   * @param offset the offset into the data source to write into.
+   * @return the number of bytes written, or a negated errno on failure
+   */
+  virtual auto writev(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t = 0;
+
+  /**
+   * Get direct access to the data source's storage.
+   *
+   * Data sources which hold the volume in memory may return a pointer to
+   * the range so that callers can work on it in place, without copying. 
+   * Writes made through the pointer are visible immediately to `read'; they
+   * are durable only after being passed back to `write' with the same
+   * pointer. The pointer remains valid for the life of the data source.
+   *
+   * @param offset the offset into the data source of the range.
+   * @param bytes the length of the range.
+   * @return a pointer to the range, or nullptr if the data source cannot
+   * provide one.
+   */
+  virtual auto map(off_t offset, size_t bytes) -> uint8_t * { return nullptr; }
+
+  /**
+   * Copy a range of the data source to another offset, with the semantics of
+   * memmove(3): the ranges may overlap.
+   *
+   * The default implementation streams the data through a bounce buffer in 
+   * COPY_CHUNK_BYTES pieces. Data sources which can copy in place should 
+   * override it.
+   *
+   * @param from the offset to copy from.
+   * @param to the offset to copy to.
+   * @param bytes the number of bytes to copy.
+   * @return 0 on success, or a negated errno on failure
+   */
+  virtual auto copy(off_t from, off_t to, size_t bytes) -> int;
+
+  /**
+   * Carry out a batch of independent reads and writes, returning once all of
+   * them have completed.
+   *
+   * The requests may be carried out concurrently and in any order, so no two
+   * of them may touch the same bytes unless both are reads. The default 
+   * implementation issues them one at a time with `readv' and `writev'. Data
+   * sources which can have many requests outstanding at once should override
+   * it.
+   *
+   * @param requests the requests. Each one's `result' is filled in.
+   * @param count the number of requests.
+   * @return 0 if every request succeeded, or the first failing request's 
+   * negated errno
+   */
+  virtual auto submit(Request *requests, int count) -> int;
+
+  static const size_t COPY_CHUNK_BYTES = 64 * 1024;
 };
 }
 
@@ -3,6 +3,7 @@
 
 #include "DirChangeTracker.h"
 #include "DirConst.h"
+#include "Statistics.h"
 
 #include <algorithm>
 #include <cassert>
@@ -12,7 +13,9 @@ using namespace RT11FS;
 
 using std::cerr;
 using std::endl;
-using std::find_if;
+using std::make_pair;
+using std::remove_if;
+using std::vector;
 
 /** 
  * Construct a tracker
@@ -20,6 +23,7 @@ using std::find_if;
 DirChangeTracker::DirChangeTracker()
   : transaction(-1)
   , inTransaction(false)
+  , hasNoOps(false)
 {
 }
  
@@ -49,51 +53,108 @@ auto DirChangeTracker::moveDirEntry(const DirPtr &src, const DirPtr &dst) -> voi
     return;
   }
 
+  Statistics::count(Statistics::Counter::EntryMoves);
+
   // we're looking for an entry that has already been moved in a previous transaction,
-  // that is now being moved again.
-  auto iter = std::find_if(begin(moves), end(moves), [src, this](const auto &e) {
-    return 
-      e.newSegment == src.getSegment() && 
-      e.newIndex == src.getIndex() && 
-      e.moveTransaction != transaction;
-  });
-
-  if (iter != end(moves)) {
-    iter->moveTransaction = transaction;
-    iter->newSegment = dst.getSegment();
-    iter->newIndex = dst.getIndex();
+  // that is now being moved again. `positions' isn't updated until the end of the
+  // transaction, so it only holds where entries were before this one started.
+  auto iter = positions.find(make_pair(src.getSegment(), src.getIndex()));
+
+  if (iter != end(positions)) {
+    auto &entry = moves[iter->second];
+    entry.moveTransaction = transaction;
+    entry.newSegment = dst.getSegment();
+    entry.newIndex = dst.getIndex();
+    moved.push_back(iter->second);
+    positions.erase(iter);
   } else {
     Entry entry {
       .oldSegment = src.getSegment(),
       .oldIndex = src.getIndex(),
+      .moveTransaction = transaction,
       .newSegment = dst.getSegment(),
       .newIndex = dst.getIndex(),
-      .moveTransaction = transaction
     };
+    moved.push_back(moves.size());
     moves.push_back(entry);
   }
 }
 
 /**
- * Finish a transaction. If entries have moved and wound up back where they 
- * started, they will be filtered out before the transaction is finalized.
+ * Finish a transaction. 
+ *
+ * There are times when an entry gets moved multiple times and lands where it
+ * started. Such entries are filtered out when the moves are retrieved.
  */
 auto DirChangeTracker::endTransaction() -> void
 {
   assert(inTransaction);
   inTransaction = false;
 
-  // there are times when an entry gets moved multiple times and lands where it
-  // started.
-  auto iter = begin(moves);
-  while (iter != end(moves)) {
-    if (iter->oldSegment == iter->newSegment && iter->oldIndex == iter->newIndex) {
-      iter = moves.erase(iter);
-    } else {
-      ++iter;
+  for (auto index : moved) {
+    const auto &entry = moves[index];
+    positions[make_pair(entry.newSegment, entry.newIndex)] = index;
+
+    if (entry.oldSegment == entry.newSegment && entry.oldIndex == entry.newIndex) {
+      hasNoOps = true;
     }
   }
 
+  moved.clear();
+}
+
+/**
+ * Get the moves recorded so far.
+ *
+ * @return the moves, excluding entries which wound up where they started.
+ */
+auto DirChangeTracker::getMoves() -> const vector<Entry> &
+{
+  assert(!inTransaction);
+  compact();
+  return moves;
+}
+
+/**
+ * Take the moves recorded so far, leaving the tracker empty.
+ *
+ * @return the moves, excluding entries which wound up where they started.
+ */
+auto DirChangeTracker::takeMoves() -> vector<Entry>
+{
+  assert(!inTransaction);
+  compact();
+
+  auto taken = std::move(moves);
+  moves.clear();
+  positions.clear();
+
+  return taken;
+}
+
+/**
+ * Remove entries which wound up where they started, and rebuild the 
+ * position index to match.
+ */
+auto DirChangeTracker::compact() -> void
+{
+  if (!hasNoOps) {
+    return;
+  }
+
+  hasNoOps = false;
+
+  moves.erase(
+    remove_if(begin(moves), end(moves), [](const auto &e) {
+      return e.oldSegment == e.newSegment && e.oldIndex == e.newIndex;
+    }),
+    end(moves)
+  );
+
+  positions.clear();
+  for (auto i = size_t {0}; i < moves.size(); i++) {
+    positions[make_pair(moves[i].newSegment, moves[i].newIndex)] = i;
+  }
 }
 
 /**
@@ -101,8 +162,7 @@ auto DirChangeTracker::endTransaction() -> void
  */
 auto DirChangeTracker::dump() -> void
 {
-  for (const auto &move : moves) {
+  for (const auto &move : getMoves()) {
     cerr << move.oldSegment << ":" << move.oldIndex << " -> " << move.newSegment << ":" << move.newIndex << endl;
   }
 }
-
@@ -6,6 +6,11 @@
 
 #include "DirChange.h"
 #include "DirPtr.h"
+
+#include <cstddef>
+#include <functional>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 /**
@@ -16,6 +21,9 @@
  * as two entries. However, if 1:1 moves to 1:2 in one transaction, and 1:2 moves to 1:3
  * in a later transaction, then 1:1 will be tracked as moving to 1:3. This is needed to 
  * support block moves where a portion of a directory segment is moved at once.
+ *
+ * The current position of every tracked entry is hashed, so recording a move 
+ * takes constant time no matter how many entries have already moved.
  */
 class DirChangeTracker
 {
@@ -33,12 +41,27 @@ public:
   auto moveDirEntry(const RT11FS::DirPtr &src, const RT11FS::DirPtr &dst) -> void;
   auto endTransaction() -> void;
   auto dump() -> void;
-  auto getMoves() -> std::vector<Entry> { return moves; }
+  auto getMoves() -> const std::vector<Entry> &;
+  auto takeMoves() -> std::vector<Entry>;
 
 private:
+  struct PositionHash {
+    auto operator()(const std::pair<int, int> &pos) const -> size_t
+    {
+      return std::hash<int>{}(pos.first) * 31 + std::hash<int>{}(pos.second);
+    }
+  };
+
+  using PositionIndex = std::unordered_map<std::pair<int, int>, size_t, PositionHash>;
+
   int transaction;
   bool inTransaction;
   std::vector<Entry> moves;
+  PositionIndex positions;            /*!< index in `moves' of the entry now at each position */
+  std::vector<size_t> moved;          /*!< entries moved in the current transaction */
+  bool hasNoOps;                      /*!< some entry may be back where it started */
+
+  auto compact() -> void;
 };
 
 #endif
@@ -5,6 +5,7 @@
 #define __DIRCONST_H_
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
 
 namespace RT11FS {
@@ -48,6 +49,20 @@ inline auto operator ==(const Rad50Name &left, const Rad50Name &right)
     left.at(2) == right.at(2);
 }
 
+/**
+ * Hash for keying unordered containers by Rad50 file name.
+ */
+struct Rad50NameHash {
+  auto operator()(const Rad50Name &name) const -> size_t
+  {
+    // three 16-bit words fit losslessly in the 64-bit result
+    return 
+      static_cast<size_t>(name[0]) | 
+      (static_cast<size_t>(name[1]) << 16) | 
+      (static_cast<uint64_t>(name[2]) << 32);
+  }
+};
+
 }}
 
 #endif
@@ -306,4 +306,30 @@ auto DirPtr::setSegment(int seg) -> void
   segbase = (segment - 1) * SECTORS_PER_SEGMENT * Block::SECTOR_SIZE;
 }
 
-}
\ No newline at end of file
+/**
+ * Point at a given entry.
+ *
+ * Unlike setting the segment and index directly, this also finds the entry's
+ * starting data sector, by summing the lengths of the entries before it in 
+ * its segment. Segment 0 points past the end of the directory.
+ *
+ * @param seg the one-based index of the segment.
+ * @param idx the zero-based index of the entry in the segment.
+ */
+auto DirPtr::seek(int seg, int idx) -> void
+{
+  if (seg == 0) {
+    segment = 0;
+    index = 0;
+    return;
+  }
+
+  setSegment(seg);
+  datasec = dirblk->extractWord(segbase + SEGMENT_DATA_BLOCK);
+
+  for (index = 0; index < idx; index++) {
+    datasec += getWord(TOTAL_LENGTH_WORD);
+  }
+}
+
+}
@@ -25,6 +25,7 @@ public:
   auto offset(int delta = 0) const -> int;
   auto setSegment(int seg) -> void;
   auto setIndex(int idx) { index = idx; }
+  auto seek(int seg, int idx) -> void;
   auto getSegment() const { return segment; }
   auto getIndex() const { return index; }
   auto incIndex() { index++; }
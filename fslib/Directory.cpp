@@ -5,11 +5,15 @@
 #include "Directory.h"
 #include "FilesystemException.h"
 #include "Rad50.h"
+#include "Statistics.h"
 
 #include <cassert>
 #include <cerrno>
+#include <cstring>
 #include <ctime>
 
+using std::make_pair;
+using std::max;
 using std::min;
 using std::string;
 using std::unique_ptr;
@@ -18,6 +22,51 @@ using std::vector;
 namespace RT11FS {
 using namespace Dir;
 
+namespace {
+const auto FIRST_YEAR = 1972;         /*!< the year of a timestamp with age and year 0 */
+const auto TIMESTAMP_YEARS = 4 * 32;  /*!< the number of years a timestamp can hold */
+
+/**
+ * Day numbers for converting directory timestamps.
+ */
+struct DateTables {
+  std::array<int, TIMESTAMP_YEARS + 1> yearStartDays;     /*!< days from the epoch to January 1 of each year */
+  std::array<std::array<int, 13>, 2> monthStartDays;      /*!< days from January 1 to each month, in a common and a leap year */
+};
+
+auto isLeap(int year)
+{
+  return (year % 4) == 0 && ((year % 100) != 0 || (year % 400) == 0);
+}
+
+auto dateTables() -> const DateTables &
+{
+  static const auto tables = []() {
+    auto tables = DateTables {};
+    const int monthLengths[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+    for (auto leap = 0; leap < 2; leap++) {
+      auto &months = tables.monthStartDays[leap];
+      months[0] = 0;
+      for (auto mon = 0; mon < 12; mon++) {
+        months[mon + 1] = months[mon] + monthLengths[mon] + (leap && mon == 1 ? 1 : 0);
+      }
+    }
+
+    // 1970 and 1971 come before the first year
+    auto days = 365 + 365;
+    for (auto year = 0; year <= TIMESTAMP_YEARS; year++) {
+      tables.yearStartDays[year] = days;
+      days += isLeap(FIRST_YEAR + year) ? 366 : 365;
+    }
+
+    return tables;
+  }();
+
+  return tables;
+}
+}
+
 /** 
  * Constructor for a directory.
  *
@@ -28,6 +77,8 @@ using namespace Dir;
 Directory::Directory(BlockCache *cache)
   : cache(cache)
   , dirblk(nullptr)
+  , freeBlocks(0)
+  , usedInodes(0)
 {
   auto max_seg = (cache->getVolumeSectors() - FIRST_SEGMENT_SECTOR) / SECTORS_PER_SEGMENT;
 
@@ -42,7 +93,10 @@ Directory::Directory(BlockCache *cache)
   cache->resizeBlock(dirblk, totseg * SECTORS_PER_SEGMENT);
 
   auto extra = dirblk->extractWord(EXTRA_BYTES);
+  entrySize = ENTRY_LENGTH + extra;
+
   auto segment = 1;
+  auto visited = 0;
 
   // sanity: the extra bytes word had better be the same across all dir segments
   // (it's an attribute set when the directory is created.)
@@ -53,13 +107,49 @@ Directory::Directory(BlockCache *cache)
       throw FilesystemException {-EINVAL, "directory segments are not consistent"};
     }
 
+    // every scan stops at the end of segment marker, so it had better be there
+    auto entry = 0;
+    while (
+      entry < maxEntriesPerSegment() && 
+      (dirblk->extractWord(base + FIRST_ENTRY_OFFSET + entry * entrySize + STATUS_WORD) & E_EOS) == 0
+    ) {
+      entry++;
+    }
+    if (entry == maxEntriesPerSegment()) {
+      throw FilesystemException {-EINVAL, "directory segment has no end marker"};
+    }
+
+    // a list which visits more segments than there are must loop
     segment = dirblk->extractWord(base + NEXT_SEGMENT);
-    if (segment > totseg) {
+    if (segment > totseg || ++visited > totseg) {
       throw FilesystemException {-EINVAL, "directory segment list is corrupt"};
     }
   }
 
-  entrySize = ENTRY_LENGTH + extra;
+  buildNameIndex();
+  scanUsage(freeBlocks, usedInodes, freeExtents);
+  for (const auto &extent : freeExtents) {
+    freeBySize.emplace(extent.second, extent.first);
+  }
+}
+
+/**
+ * Move a directory, taking over its hold on the directory block.
+ *
+ * @param other the directory to move from, which is left empty.
+ */
+Directory::Directory(Directory &&other)
+  : entrySize(other.entrySize)
+  , cache(other.cache)
+  , dirblk(other.dirblk)
+  , nameIndex(std::move(other.nameIndex))
+  , freeBlocks(other.freeBlocks)
+  , usedInodes(other.usedInodes)
+  , freeExtents(std::move(other.freeExtents))
+  , freeBySize(std::move(other.freeBySize))
+  , entryTable(std::move(other.entryTable))
+{
+  other.dirblk = nullptr;
 }
 
 /** 
@@ -75,9 +165,8 @@ Directory::~Directory()
 /** 
  * Retrieve the directory entry for a named file
  *
- * Scans the directory looking for the named file and fills in `ent'.
- * Will return entries for any object other than end of segment (such as 
- * temporary entries.)
+ * Looks up the named file and fills in `ent'. Will return entries for 
+ * permanent or tentative files.
  * 
  * @param name the name of the file to search for.
  * @param ent on success, the directory entry for `name'.
@@ -100,7 +189,7 @@ auto Directory::getEnt(const std::string &name, DirEnt &ent) -> int
 /** 
  * Retrieve the directory entry for a named file
  *
- * Scans the directory looking for the named file and returns a pointer to it.
+ * Looks up the named file in the name index and returns a pointer to it.
  * Will return entries for any object other than end of segment or free space 
  * (such as temporary entries.)
  * 
@@ -117,31 +206,19 @@ auto Directory::getDirPointer(const std::string &name, unique_ptr<DirPtr> &dirpp
     return -EINVAL;
   }
 
-  auto dirp = startScan();
-
-  while (++dirp) {
-    if (dirp.hasStatus(E_MPTY) || dirp.hasStatus(E_EOS)) {
-      continue;
-    }
-
-    if (
-      rad50Name[0] == dirp.getWord(FILENAME_WORDS) &&
-      rad50Name[1] == dirp.getWord(FILENAME_WORDS + 2) &&
-      rad50Name[2] == dirp.getWord(FILENAME_WORDS + 4)
-    ) {
-      dirpp.reset(new DirPtr {dirp});
-      return 0;
-    }
+  auto dirp = lookupName(rad50Name);
+  if (dirp.afterEnd()) {
+    return -ENOENT;
   }
 
-  return -ENOENT;
+  dirpp.reset(new DirPtr {dirp});
+  return 0;
 }
 
 /** 
  * Gets a directory pointer to the named file.
  *
- * Returns the entry for any file status except end of segment.
- * TODO this should probably be tighter.
+ * Returns the entry for a permanent or tentative file.
  *
  * @param name the Rad50 representation of the filename.
  * @return a pointer to the entry, or a pointer past the end of the directory if
@@ -149,35 +226,7 @@ auto Directory::getDirPointer(const std::string &name, unique_ptr<DirPtr> &dirpp
  */
 auto Directory::getDirPointer(const Dir::Rad50Name &name) -> DirPtr
 {
-  auto ds = startScan();
-
-  while (++ds) {
-    if (ds.hasStatus(E_EOS)) {
-      continue;
-    }
-
-    if (
-      name[0] == ds.getWord(FILENAME_WORDS) &&
-      name[1] == ds.getWord(FILENAME_WORDS + 2) &&
-      name[2] == ds.getWord(FILENAME_WORDS + 4)
-    ) {
-      break;
-    }
-  }
-
-  return ds;
-}
-
-static auto rtrim(const string &str)
-{
-  int i = str.size() - 1;
-  for (; i >= 0; i--) {
-    if (str[i] != ' ') {
-      break;
-    }
-  }
-
-  return str.substr(0, i + 1);
+  return lookupName(name);
 }
 
 /** 
@@ -193,33 +242,51 @@ auto Directory::getEnt(const DirPtr &ptr, DirEnt &ent) -> bool
     return false;
   }
 
-  for (auto i = 0; i < ent.rad50_name.size(); i++) {
-    ent.rad50_name[i] = ptr.getWord(FILENAME_WORDS + i * sizeof(uint16_t));
-  }
-
-  ent.name = Rad50::fromRad50(ent.rad50_name[0]);
-  ent.name += Rad50::fromRad50(ent.rad50_name[1]);
-
-  ent.name = rtrim(ent.name);
-  ent.name += ".";
-  
-  ent.name += Rad50::fromRad50(ent.rad50_name[2]);
-  ent.name = rtrim(ent.name);
-
-  ent.status = ptr.getWord(STATUS_WORD);
-  ent.length = ptr.getWord(TOTAL_LENGTH_WORD) * Block::SECTOR_SIZE;
-  ent.sector0 = ptr.getDataSector();
+  decodeEnt(
+    ptr.getWord(STATUS_WORD),
+    entryName(ptr),
+    ptr.getWord(TOTAL_LENGTH_WORD),
+    ptr.getDataSector(),
+    ptr.getWord(CREATION_DATE_WORD),
+    ent);
+  return true;
+}
 
-  struct tm tm;
-  memset(&tm, 0, sizeof(tm));
+/**
+ * Retrieve a directory entry from the decoded entry table.
+ *
+ * @param entries the table returned by `getEntries'.
+ * @param row a row of the table.
+ * @param ent on return, the directory entry at `row'.
+ */
+auto Directory::getEnt(const EntryTable &entries, int row, DirEnt &ent) -> void
+{
+  decodeEnt(
+    entries.getStatus(row),
+    entries.getName(row),
+    entries.getLength(row),
+    entries.getSector0(row),
+    entries.getDate(row),
+    ent);
+}
 
-  auto dateWord = ptr.getWord(CREATION_DATE_WORD);
-  
-  // on an invalid date, tm will remain empty
-  dirTimeToTime(dateWord, tm);
+/**
+ * Get the decoded table of every directory entry.
+ *
+ * The table is rebuilt here if the directory has changed since it was last
+ * built. It stays valid until the directory is next changed, so callers which
+ * only read the directory may hold on to it while they scan.
+ *
+ * @return the entry table.
+ */
+auto Directory::getEntries() -> const EntryTable &
+{
+  std::lock_guard<std::mutex> lock {entryTableLock};
+  if (!entryTable.isCurrent(dirblk)) {
+    entryTable.rebuild(dirblk);
+  }
 
-  ent.create_time = mktime(&tm);
-  return true;
+  return entryTable;
 }
 
 /** 
@@ -260,6 +327,10 @@ auto Directory::moveNextFiltered(DirPtr &ptr, uint16_t mask) -> bool
 /**
  * Returns metadata about the file system
  * 
+ * The usage figures come from counters which are kept up to date as the 
+ * directory changes, so no scan is needed. Building with RT11FS_VERIFY_USAGE
+ * defined checks them against a scan on every call.
+ *
  * @param vfs the struct to fill with data about the volume's file system.
  * @return 0 for success or a negated errno.
  */
@@ -278,30 +349,14 @@ auto Directory::statfs(struct statvfs *vfs) -> int
 
   vfs->f_blocks = cache->getVolumeSectors() - (FIRST_SEGMENT_SECTOR + segs * SECTORS_PER_SEGMENT);
 
-  auto ptr = startScan();
-    
-  auto usedinodes = 0;
-  auto usedblocks = 0;
-  auto freeblocks = 0;
+#ifdef RT11FS_VERIFY_USAGE
+  assert(verifyUsage());
+#endif
 
-  while (++ptr) {
-    auto status = ptr.getWord(STATUS_WORD);
-    auto length = ptr.getWord(TOTAL_LENGTH_WORD);
-
-    if ((status & E_MPTY) != 0) {
-      freeblocks += length;
-    } else {
-      usedblocks += length;
-      if ((status & E_EOS) == 0) {
-        usedinodes++;
-      }
-    }
-  }
-
-  vfs->f_bfree = freeblocks;
-  vfs->f_bavail = freeblocks;
+  vfs->f_bfree = freeBlocks;
+  vfs->f_bavail = freeBlocks;
   vfs->f_files = inodes;
-  vfs->f_ffree = inodes - usedinodes;
+  vfs->f_ffree = inodes - usedInodes;
   vfs->f_favail = vfs->f_ffree;
 
   return 0;
@@ -346,9 +401,7 @@ auto Directory::truncate(DirPtr &dirp, off_t newSize, vector<DirChangeTracker::E
     return err;
   }
 
-  moves.clear();
-  auto gotMoves = tracker.getMoves();
-  copy(begin(gotMoves), end(gotMoves), back_inserter(moves));
+  moves = tracker.takeMoves();
 
   return 0;
 }
@@ -374,6 +427,10 @@ auto Directory::removeEntry(const std::string &name, vector<DirChangeTracker::En
   auto tracker = DirChangeTracker {};
 
   // first, turn the file into free space
+  freeBlocks += dirp->getWord(TOTAL_LENGTH_WORD);
+  usedInodes--;
+  addFreeExtent(dirp->getDataSector(), dirp->getWord(TOTAL_LENGTH_WORD));
+  unindexEntry(*dirp);
   dirp->setWord(STATUS_WORD, E_MPTY);
   for (auto i = 0; i < FILENAME_LENGTH; i++) {
     dirp->setWord(FILENAME_WORDS + 2*i, 0);
@@ -382,9 +439,7 @@ auto Directory::removeEntry(const std::string &name, vector<DirChangeTracker::En
   // combine free blocks
   coalesceNeighboringFreeBlocks(*dirp, tracker);
 
-  moves.clear();
-  auto gotMoves = tracker.getMoves();
-  copy(begin(gotMoves), end(gotMoves), back_inserter(moves));
+  moves = tracker.takeMoves();
 
   return 0;
 }
@@ -424,9 +479,11 @@ auto Directory::rename(const std::string &oldName, const std::string &newName) -
     // TODO unlink
   }
 
+  unindexEntry(oldp);
   for (auto i = 0; i < FILENAME_LENGTH; i++) {
     oldp.setWord(FILENAME_WORDS + 2 * i, newRad50[i]);
   }
+  indexEntry(oldp);
 
   cache->sync();
   return 0;
@@ -493,8 +550,81 @@ auto Directory::createEntry(const string &name, unique_ptr<DirPtr> &dirpp, vecto
   timeToDirTime(*tm, dirtime);
   
   dirp.setWord(CREATION_DATE_WORD, dirtime);
+  indexEntry(dirp);
+  usedInodes++;
 
   dirpp.reset(new DirPtr {dirp});
+  moves = tracker.takeMoves();
+
+  return 0;
+}
+
+/**
+ * Create a new permanent file of a known size.
+ *
+ * Unlike `createEntry', the file is placed in the smallest free block which
+ * will hold it, and is given its final size at once, so it never has to grow
+ * or move. Its data is left as whatever the free space held.
+ *
+ * @param name the name of the file to create, which must not already exist.
+ * @param sectors the length of the file.
+ * @param dirpp on success, set to the new entry.
+ * @param moves a vector which will, on success, record how file entries were moved.
+ * @return 0 on success or a negative errno
+ */
+auto Directory::allocateEntry(const string &name, int sectors, unique_ptr<DirPtr> &dirpp, vector<DirChangeTracker::Entry> &moves) -> int
+{
+  auto rad50Name = Rad50Name {};
+  if (!parseFilename(name, rad50Name) || sectors < 0) {
+    return -EINVAL;
+  }
+
+  if (!lookupName(rad50Name).afterEnd()) {
+    return -EEXIST;
+  }
+
+  auto dirp = findBestFitFreeBlock(sectors);
+  if (dirp.afterEnd()) {
+    return -ENOSPC;
+  }
+
+  auto tracker = DirChangeTracker {};
+
+  if (sectors == 0) {
+    // an empty file is a zero length entry in front of the free block
+    auto err = insertEmptyAt(dirp, tracker);
+    if (err < 0) {
+      return err;
+    }
+  } else {
+    auto err = carveFreeBlock(dirp, sectors, tracker);
+    if (err < 0) {
+      return err;
+    }
+
+    removeFreeExtent(dirp.getDataSector(), sectors);
+    freeBlocks -= sectors;
+  }
+
+  dirp.setWord(STATUS_WORD, E_PERM);
+  for (auto i = 0; i < FILENAME_LENGTH; i++) {
+    dirp.setWord(FILENAME_WORDS + 2*i, rad50Name[i]);
+  }
+  dirp.setByte(JOB_BYTE, 0);
+  dirp.setByte(CHANNEL_BYTE, 0);
+
+  auto now = time(nullptr);
+  auto tm = localtime(&now);
+  auto dirtime = uint16_t {0};
+
+  timeToDirTime(*tm, dirtime);
+
+  dirp.setWord(CREATION_DATE_WORD, dirtime);
+  indexEntry(dirp);
+  usedInodes++;
+
+  dirpp.reset(new DirPtr {dirp});
+  moves = tracker.takeMoves();
 
   return 0;
 }
@@ -513,6 +643,91 @@ auto Directory::makeEntryPermanent(DirPtr &dirp) -> void
   }
 }
 
+/**
+ * Write the directory back to disk if it has changed.
+ *
+ * Only the directory's own sectors are written; file data is left to the
+ * caller.
+ */
+auto Directory::sync() -> void
+{
+  cache->syncRange(dirblk->getSector(), dirblk->getCount());
+}
+
+/**
+ * Compact the volume by moving files toward its start.
+ *
+ * The first free space entry on the volume is repeatedly swapped with the 
+ * file after it, sliding the file's data down over the free space, and merged
+ * with any free space it runs into. When done, all free space is in one entry
+ * at the end of the volume.
+ *
+ * A file longer than the free space before it is copied out to other free
+ * space and back, so that no copy overwrites the data it's copying. If 
+ * there's no free space large enough for that, the file and the free space 
+ * before it are left where they are, and compaction carries on after the 
+ * file.
+ *
+ * The work can be done in pieces, so that a mounted volume isn't stalled for
+ * the time it takes to rewrite every file. Since each call starts from the 
+ * first free space entry, no state is kept between calls.
+ *
+ * @param sectorBudget the number of sectors of file data to move before 
+ * returning, or 0 for no limit. At least one file is moved if there is work to 
+ * do, even if it is larger than the budget.
+ * @param moves a vector which will, on success, record how file entries were moved 
+ * @return 1 if there is more to do, 0 if the volume is fully compacted, or
+ * a negated errno
+ */
+auto Directory::squeeze(int sectorBudget, vector<DirChangeTracker::Entry> &moves) -> int
+{
+  auto tracker = DirChangeTracker {};
+  auto copied = 0;
+  auto more = 0;
+
+  // free space before this sector is stuck behind a file which can't be 
+  // moved safely
+  auto floor = 0;
+
+  while (true) {
+    auto iter = freeExtents.lower_bound(floor);
+    if (iter == end(freeExtents)) {
+      break;
+    }
+
+    auto dirp = pointerToSector(iter->first);
+    auto next = nextEntry(dirp);
+
+    // the free space is the last entry on the volume, so there's nothing after it
+    if (next.afterEnd()) {
+      break;
+    }
+
+    if (next.hasStatus(E_MPTY)) {
+      mergeFreeForward(dirp, next, tracker);
+      continue;
+    }
+
+    if (sectorBudget > 0 && copied >= sectorBudget) {
+      more = 1;
+      break;
+    }
+
+    auto fileEnd = next.getDataSector() + next.getWord(TOTAL_LENGTH_WORD);
+    auto moved = slideEntryDown(dirp, next, tracker);
+    if (moved < 0) {
+      floor = fileEnd;
+      continue;
+    }
+
+    copied += moved;
+  }
+
+  moves = tracker.takeMoves();
+
+  return more;
+}
+
 /**
  * Shrink the given entry.
  * 
@@ -546,8 +761,11 @@ auto Directory::shrinkEntry(DirPtr &dirp, int newSize, DirChangeTracker &tracker
 
   auto delta = dirp.getWord(TOTAL_LENGTH_WORD) - newSize;
   assert(delta > 0);
+  removeFreeExtent(nextp.getDataSector(), nextp.getWord(TOTAL_LENGTH_WORD));
   dirp.setWord(TOTAL_LENGTH_WORD, newSize);
   nextp.setWord(TOTAL_LENGTH_WORD, nextp.getWord(TOTAL_LENGTH_WORD) + delta);
+  freeBlocks += delta;
+  addFreeExtent(dirp.getDataSector() + newSize, nextp.getWord(TOTAL_LENGTH_WORD));
   return 0;
 }
 
@@ -558,9 +776,9 @@ auto Directory::shrinkEntry(DirPtr &dirp, int newSize, DirChangeTracker &tracker
  * block.
  *
  * If there is a free space block directly following `dirp', then
- * steal space from it if it's big enough. Otherwise, search the
- * directory for a free block big enough to hold the new requested
- * file size. If there is none, then there aren't enough
+ * steal space from it if it's big enough. Otherwise, move it to the
+ * smallest free block big enough to hold the new requested file
+ * size. If there is none, then there aren't enough
  * contiguous free blocks and the volume should be compacted.
  *
  * @param dirp points to the entry to grow.
@@ -578,9 +796,11 @@ auto Directory::growEntry(DirPtr &dirp, int newSize, DirChangeTracker &tracker)
     if (newSize <= available) {
       // transfer size
       auto delta = newSize - dirp.getWord(TOTAL_LENGTH_WORD);
+      removeFreeExtent(next.getDataSector(), next.getWord(TOTAL_LENGTH_WORD));
       dirp.setWord(TOTAL_LENGTH_WORD, newSize);
       next.setWord(TOTAL_LENGTH_WORD, next.getWord(TOTAL_LENGTH_WORD) - delta);
-    
+      freeBlocks -= delta;
+      addFreeExtent(dirp.getDataSector() + newSize, next.getWord(TOTAL_LENGTH_WORD));
 
       if (next.getWord(TOTAL_LENGTH_WORD) == 0) {
         // delete empty free space entry
@@ -591,13 +811,36 @@ auto Directory::growEntry(DirPtr &dirp, int newSize, DirChangeTracker &tracker)
     }
   }
 
-  // we couldn't grow the file in place, so move it to a free block
-  // large enough to contain it
-  auto newp = findLargestFreeBlock();
-  if (newp.afterEnd() || newp.getWord(TOTAL_LENGTH_WORD) < newSize) {
+  // we couldn't grow the file in place, so move it to the smallest free
+  // block large enough to contain it, keeping larger blocks whole
+  auto newp = findBestFitFreeBlock(newSize);
+  if (newp.afterEnd()) {
     return -ENOSPC;
   }
 
+  return relocateEntry(dirp, newp, newSize, tracker);
+}
+
+/**
+ * Move a file into a free block, changing its size on the way.
+ *
+ * The file's data is copied into the free block before the directory 
+ * changes, and the directory is written first, so that the free block is 
+ * also free in the copy of the directory on disk. Until the directory is
+ * next written, the disk still describes the file at its old location, 
+ * which the copy didn't touch.
+ *
+ * @param dirp points to the entry to move. On success, it points to the 
+ * entry in its new place.
+ * @param newp points to the free block, which must hold at least `newSize'
+ * sectors.
+ * @param newSize the new size of the entry, in sectors.
+ * @param tracker a tracker to log entry movement.
+ * @return 0 on success or a negated errno (most commonly if the entire 
+ * directory is full.)
+ */
+auto Directory::relocateEntry(DirPtr &dirp, DirPtr &newp, int newSize, DirChangeTracker &tracker) -> int
+{
   auto name = Rad50Name {};
   name[0] = dirp.getWord(FILENAME_WORDS + 0);
   name[1] = dirp.getWord(FILENAME_WORDS + 2);
@@ -626,22 +869,22 @@ auto Directory::growEntry(DirPtr &dirp, int newSize, DirChangeTracker &tracker)
   auto dst = newp.getDataSector();
   auto cnt = dirp.getWord(TOTAL_LENGTH_WORD);
 
-  // Note that even if the cache is doing writethrough, this is safe to do
-  // before the directory gets updated because we're just writing data into
-  // the data area of a free block
-  while (cnt--) {
-    auto srcBlk = cache->getBlock(src++, 1);
-    auto dstBlk = cache->getBlock(dst++, 1);
-    dstBlk->copyFromOtherBlock(srcBlk, 0, 0, Block::SECTOR_SIZE);
-    cache->putBlock(srcBlk);
-    cache->putBlock(dstBlk);
-  }
+  // Note that this writes to disk before the directory gets updated, which is
+  // safe because we're just writing data into the data area of a free block
+  sync();
+  cache->copySectors(src, dst, cnt);
+  Statistics::count(Statistics::Counter::SectorsRelocated, cnt);
 
   moveEntryAcrossSegments(dirp, newp, tracker);
 
   // we just wrote over the new entry with the old size; put it back    
   newp.setWord(TOTAL_LENGTH_WORD, newSize);
 
+  // the free block we moved into is used, and the file's old space is free
+  freeBlocks += dirp.getWord(TOTAL_LENGTH_WORD) - newSize;
+  removeFreeExtent(newp.getDataSector(), newSize);
+  addFreeExtent(dirp.getDataSector(), dirp.getWord(TOTAL_LENGTH_WORD));
+
   dirp.setWord(STATUS_WORD, E_MPTY);
   dirp.setWord(FILENAME_WORDS, 0);
   dirp.setWord(FILENAME_WORDS + 2, 0);
@@ -859,34 +1102,130 @@ auto Directory::allocateNewSegment() -> int
 /**
  * Find the largest free block in the directory.
  *
+ * Uses the free extent index rather than scanning.
+ *
  * @return a directory pointer to the free block, which will be afterEnd 
  * if there is no free block.
  */
 auto Directory::findLargestFreeBlock() -> DirPtr
 {
-  auto largestBlock = -1;
-  auto largestBlockPtr = DirPtr {dirblk};
+  if (freeBySize.empty()) {
+    return pointerToSector(-1);
+  }
+
+  // of the largest blocks, take the first on the volume, which is the one a
+  // scan of the directory would find
+  auto largest = freeBySize.rbegin()->first;
+  auto iter = freeBySize.lower_bound(make_pair(largest, 0));
+
+  return pointerToSector(iter->second);
+}
+
+/**
+ * Find the smallest free block which will hold a given number of sectors.
+ *
+ * @param size the number of sectors needed.
+ * @return a directory pointer to the free block, which will be afterEnd 
+ * if there is no free block large enough.
+ */
+auto Directory::findBestFitFreeBlock(int size) -> DirPtr
+{
+  auto iter = freeBySize.lower_bound(make_pair(max(size, 1), 0));
+  if (iter == end(freeBySize)) {
+    return pointerToSector(-1);
+  }
+
+  return pointerToSector(iter->second);
+}
 
+/**
+ * Find the non-empty free space entry which starts at a given sector.
+ *
+ * Segments are laid out on the volume in list order, so this only has to
+ * walk the segment list and then one segment's entries.
+ *
+ * @param sector the start sector of the free space.
+ * @return a pointer to the entry, or a pointer past the end of the directory if
+ * there is no such entry.
+ */
+auto Directory::pointerToSector(int sector) -> DirPtr
+{
   auto dirp = startScan();
+  if (sector < 0) {
+    dirp.seek(0, 0);
+    return dirp;
+  }
 
-  while (++dirp) {
-    if (!dirp.hasStatus(E_MPTY)) {
-      continue;
+  auto segment = 1;
+  while (true) {
+    auto next = dirblk->extractWord((segment - 1) * SECTORS_PER_SEGMENT * Block::SECTOR_SIZE + NEXT_SEGMENT);
+    if (next == 0) {
+      break;
     }
 
-    auto length = dirp.getWord(TOTAL_LENGTH_WORD);
-    if (length > largestBlock) {
-      largestBlock = length;
-      largestBlockPtr = dirp;
+    auto nextStart = dirblk->extractWord((next - 1) * SECTORS_PER_SEGMENT * Block::SECTOR_SIZE + SEGMENT_DATA_BLOCK);
+    if (nextStart > sector) {
+      break;
     }
+
+    segment = next;
   }
 
-  if (largestBlock <= 0) {
-    // dirp is at the end now
-    largestBlockPtr = dirp;
+  dirp.seek(segment, 0);
+  while (!dirp.hasStatus(E_EOS) && dirp.getDataSector() <= sector) {
+    if (
+      dirp.getDataSector() == sector && 
+      dirp.hasStatus(E_MPTY) && 
+      dirp.getWord(TOTAL_LENGTH_WORD) > 0
+    ) {
+      return dirp;
+    }
+    ++dirp;
   }
 
-  return largestBlockPtr;
+  // the index is out of date
+  assert(false);
+  dirp.seek(0, 0);
+  return dirp;
+}
+
+/**
+ * Record a free space entry in the free extent index.
+ *
+ * Zero length entries hold no space and are not indexed.
+ *
+ * @param start the first sector of the free space.
+ * @param length the length of the free space.
+ */
+auto Directory::addFreeExtent(int start, int length) -> void
+{
+  if (length <= 0) {
+    return;
+  }
+
+  freeExtents[start] = length;
+  freeBySize.emplace(length, start);
+}
+
+/**
+ * Remove a free space entry from the free extent index.
+ *
+ * Zero length entries were never indexed, and are ignored. (Their start 
+ * sector may be shared with a real free space entry that follows them.)
+ *
+ * @param start the first sector of the free space.
+ * @param length the length of the free space.
+ */
+auto Directory::removeFreeExtent(int start, int length) -> void
+{
+  if (length <= 0) {
+    return;
+  }
+
+  assert(freeExtents.count(start) == 1 && freeExtents[start] == length);
+
+  freeExtents.erase(start);
+  freeBySize.erase(make_pair(length, start));
 }
 
 /**
@@ -920,9 +1259,13 @@ auto Directory::carveFreeBlock(DirPtr &dirp, int size, DirChangeTracker &tracker
     }
 
     auto delta = dirp.getWord(TOTAL_LENGTH_WORD) - size;
+    removeFreeExtent(dirp.getDataSector(), dirp.getWord(TOTAL_LENGTH_WORD));
     dirp.setWord(TOTAL_LENGTH_WORD, dirp.getWord(TOTAL_LENGTH_WORD) - delta);
     next.setWord(TOTAL_LENGTH_WORD, delta);
 
+    addFreeExtent(dirp.getDataSector(), size);
+    addFreeExtent(dirp.getDataSector() + size, delta);
+
     return 1;
   }
 
@@ -959,15 +1302,201 @@ auto Directory::coalesceNeighboringFreeBlocks(DirPtr &ptr, DirChangeTracker &tra
       break;
     }
 
-    auto len = first.getWord(TOTAL_LENGTH_WORD) + next.getWord(TOTAL_LENGTH_WORD);
+    auto nextLen = next.getWord(TOTAL_LENGTH_WORD);
+    auto len = first.getWord(TOTAL_LENGTH_WORD) + nextLen;
+
+    removeFreeExtent(first.getDataSector(), first.getWord(TOTAL_LENGTH_WORD));
+    removeFreeExtent(next.getDataSector(), nextLen);
 
     first.setWord(TOTAL_LENGTH_WORD, len);
     next.setWord(TOTAL_LENGTH_WORD, 0);
 
+    addFreeExtent(first.getDataSector(), len);
+
     deleteEmptyAt(next, tracker);
   }
 }
 
+/**
+ * Find the entry following `dirp', skipping end of segment markers.
+ *
+ * @param dirp the starting entry.
+ * @return the next entry which is either a file or free space, which may
+ * be in a following segment, or a pointer past the end of the directory.
+ */
+auto Directory::nextEntry(const DirPtr &dirp) -> DirPtr
+{
+  auto next = dirp.next();
+
+  while (!next.afterEnd() && next.hasStatus(E_EOS)) {
+    ++next;
+  }
+
+  return next;
+}
+
+/**
+ * Set the starting data sector of the segments between two entries.
+ *
+ * Every segment after the one containing `from', up to and including the 
+ * one containing `to', is updated. Segments in between have no entries of
+ * their own, so they all start at the same sector.
+ *
+ * @param from an entry in the last segment which keeps its start sector.
+ * @param to an entry in the last segment to update.
+ * @param sector the new starting data sector.
+ */
+auto Directory::setSegmentStarts(const DirPtr &from, const DirPtr &to, int sector) -> void
+{
+  auto segp = from;
+
+  while (segp.getSegment() != to.getSegment()) {
+    segp = advanceToEndOfSegment(segp);
+    ++segp;
+    assert(!segp.afterEnd());
+
+    segp.setSegmentWord(SEGMENT_DATA_BLOCK, sector);
+  }
+}
+
+/**
+ * Swap a free space entry with the file following it.
+ *
+ * The file's data is moved down to the start of the free space, and the
+ * free space then follows the file. If the file is the first entry in its
+ * segment, the free space ends up at the start of that segment and the
+ * file at the end of the previous one.
+ *
+ * @param dirp the free space entry.
+ * @param next the file entry following `dirp'.
+ * @param tracker a tracker to log entry movement.
+ * @return the number of sectors of file data moved, or a negated errno if
+ * the file couldn't be moved safely, in which case it hasn't moved
+ */
+auto Directory::slideEntryDown(DirPtr &dirp, DirPtr &next, DirChangeTracker &tracker) -> int
+{
+  assert(dirp.hasStatus(E_MPTY));
+  assert(!next.hasStatus(E_MPTY) && !next.hasStatus(E_EOS));
+
+  auto freeStart = dirp.getDataSector();
+  auto freeLength = dirp.getWord(TOTAL_LENGTH_WORD);
+  auto fileLength = next.getWord(TOTAL_LENGTH_WORD);
+
+  if (freeLength < fileLength) {
+    return slideThroughScratch(dirp, next, tracker);
+  }
+
+  // the file's new place doesn't overlap its old one, so the old copy is 
+  // intact until the directory pointing at the new one is written. the 
+  // directory is written first, so that what's overwritten is free space on
+  // disk too and not a file an earlier slide has only moved in memory.
+  sync();
+  cache->copySectors(next.getDataSector(), freeStart, fileLength);
+  Statistics::count(Statistics::Counter::SectorsRelocated, fileLength);
+
+  moveEntryAcrossSegments(next, dirp, tracker);
+
+  next.setWord(STATUS_WORD, E_MPTY);
+  next.setWord(FILENAME_WORDS, 0);
+  next.setWord(FILENAME_WORDS + 2, 0);
+  next.setWord(FILENAME_WORDS + 4, 0);
+  next.setWord(TOTAL_LENGTH_WORD, freeLength);
+  next.setByte(JOB_BYTE, 0);
+  next.setByte(CHANNEL_BYTE, 0);
+  next.setWord(CREATION_DATE_WORD, 0);
+
+  setSegmentStarts(dirp, next, freeStart + fileLength);
+
+  removeFreeExtent(freeStart, freeLength);
+  addFreeExtent(freeStart + fileLength, freeLength);
+
+  return fileLength;
+}
+
+/**
+ * Swap a free space entry with a file following it which is longer than the 
+ * free space.
+ *
+ * Sliding the file down would copy its data over itself, and a crash part 
+ * way through would leave the directory on disk pointing at half moved data.
+ * Instead, the file is moved out of the way into other free space, which 
+ * leaves its old space free and merged with the free space before it, and 
+ * then moved back into the start of the combined space. Neither copy 
+ * overlaps what it copies from, so the file is always intact where the 
+ * directory on disk says it is.
+ *
+ * @param dirp the free space entry.
+ * @param next the file entry following `dirp'.
+ * @param tracker a tracker to log entry movement.
+ * @return the number of sectors of file data moved, or -ENOSPC if there's
+ * no other free space large enough to hold the file
+ */
+auto Directory::slideThroughScratch(DirPtr &dirp, DirPtr &next, DirChangeTracker &tracker) -> int
+{
+  auto freeStart = dirp.getDataSector();
+  auto fileLength = next.getWord(TOTAL_LENGTH_WORD);
+  auto name = entryName(next);
+
+  auto scratch = findLargestFreeBlock();
+  if (scratch.afterEnd() || scratch.getWord(TOTAL_LENGTH_WORD) < fileLength) {
+    return -ENOSPC;
+  }
+
+  auto err = relocateEntry(next, scratch, fileLength, tracker);
+  if (err < 0) {
+    return err;
+  }
+
+  // the file's old space was merged with the free space before it, unless 
+  // they're in different segments
+  auto gap = pointerToSector(freeStart);
+  auto after = nextEntry(gap);
+  if (!after.afterEnd() && after.hasStatus(E_MPTY)) {
+    mergeFreeForward(gap, after, tracker);
+    gap = pointerToSector(freeStart);
+  }
+
+  // if there's no room in the directory to move the file back, it's left
+  // in the scratch space, which is just as safe
+  next = getDirPointer(name);
+  if (relocateEntry(next, gap, fileLength, tracker) < 0) {
+    return fileLength;
+  }
+
+  return 2 * fileLength;
+}
+
+/**
+ * Merge a free space entry into the free space entry following it.
+ *
+ * Unlike `coalesceNeighboringFreeBlocks', the entries may be in different
+ * segments, in which case the combined space moves to the start of the 
+ * later segment.
+ *
+ * @param dirp the first free space entry, which will be deleted.
+ * @param next the free space entry following `dirp'.
+ * @param tracker a tracker to log entry movement.
+ */
+auto Directory::mergeFreeForward(DirPtr &dirp, DirPtr &next, DirChangeTracker &tracker) -> void
+{
+  assert(dirp.hasStatus(E_MPTY) && next.hasStatus(E_MPTY));
+
+  auto start = dirp.getDataSector();
+  auto length = dirp.getWord(TOTAL_LENGTH_WORD);
+  auto nextLength = next.getWord(TOTAL_LENGTH_WORD);
+
+  removeFreeExtent(start, length);
+  removeFreeExtent(next.getDataSector(), nextLength);
+
+  next.setWord(TOTAL_LENGTH_WORD, length + nextLength);
+  dirp.setWord(TOTAL_LENGTH_WORD, 0);
+  setSegmentStarts(dirp, next, start);
+
+  addFreeExtent(start, length + nextLength);
+
+  deleteEmptyAt(dirp, tracker);
+}
+
 /**
  * Compute the maximum number of entries that will fit in one segment.
  *
@@ -1024,6 +1553,9 @@ auto Directory::moveEntriesWithinSegment(const DirPtr &src, const DirPtr &dst, i
   auto d = dst;
   for (auto c = count; c--; s++, d++) {
     tracker.moveDirEntry(s, d);
+    if (isIndexed(s)) {
+      nameIndex[entryName(s)] = EntryPos {d.getSegment(), d.getIndex()};
+    }
   }
   tracker.endTransaction();
 
@@ -1048,9 +1580,202 @@ auto Directory::moveEntryAcrossSegments(const DirPtr &src, const DirPtr &dst, Di
   tracker.moveDirEntry(src, dst);
   tracker.endTransaction();
 
+  if (isIndexed(src)) {
+    nameIndex[entryName(src)] = EntryPos {dst.getSegment(), dst.getIndex()};
+  }
+
   dirblk->copyWithinBlock(srcOffset, dstOffset, entrySize);
 }
 
+/**
+ * Cross-check the incremental usage counters and the free extent index 
+ * against a full directory scan.
+ *
+ * @return true if the counters and index are correct.
+ */
+auto Directory::verifyUsage() -> bool
+{
+  auto free = 0;
+  auto used = 0;
+  auto extents = std::map<int, int> {};
+  scanUsage(free, used, extents);
+
+  auto bySize = std::set<std::pair<int, int>> {};
+  for (const auto &extent : extents) {
+    bySize.emplace(extent.second, extent.first);
+  }
+
+  return 
+    free == freeBlocks && 
+    used == usedInodes && 
+    extents == freeExtents &&
+    bySize == freeBySize;
+}
+
+/**
+ * @return a count which changes whenever the directory does, so that anything
+ * looked up in it can tell when it's out of date.
+ */
+auto Directory::getGeneration() const -> unsigned
+{
+  return dirblk->getGeneration();
+}
+
+/**
+ * Count the free blocks and used entries by scanning the directory.
+ *
+ * @param free on return, the total length of all free space entries.
+ * @param used on return, the number of entries which are files.
+ * @param extents on return, the start and length of each non-empty free 
+ * space entry.
+ */
+auto Directory::scanUsage(int &free, int &used, std::map<int, int> &extents) -> void
+{
+  free = 0;
+  used = 0;
+  extents.clear();
+
+  const auto &table = getEntries();
+  for (auto row = 0; row < table.size(); row++) {
+    auto status = table.getStatus(row);
+
+    if ((status & E_MPTY) != 0) {
+      auto length = table.getLength(row);
+      free += length;
+      if (length > 0) {
+        extents[table.getSector0(row)] = length;
+      }
+    } else if ((status & E_EOS) == 0) {
+      used++;
+    }
+  }
+}
+
+/**
+ * Build the name index from scratch by scanning the directory.
+ *
+ * If a name appears more than once, the first entry in directory order
+ * wins, which is the one a scan would have found.
+ */
+auto Directory::buildNameIndex() -> void
+{
+  nameIndex.clear();
+
+  const auto &table = getEntries();
+  for (auto row = 0; row < table.size(); row++) {
+    if ((table.getStatus(row) & (E_MPTY | E_EOS)) == 0) {
+      nameIndex.emplace(table.getName(row), EntryPos {table.getSegment(row), table.getIndex(row)});
+    }
+  }
+}
+
+/**
+ * Add the file at `dirp' to the name index under its current name.
+ *
+ * @param dirp the entry to index.
+ */
+auto Directory::indexEntry(const DirPtr &dirp) -> void
+{
+  nameIndex[entryName(dirp)] = EntryPos {dirp.getSegment(), dirp.getIndex()};
+}
+
+/**
+ * Remove the file at `dirp' from the name index.
+ *
+ * This must be done while the entry still has its old name. Nothing is 
+ * removed if the index holds a different entry under the same name.
+ *
+ * @param dirp the entry to remove.
+ */
+auto Directory::unindexEntry(const DirPtr &dirp) -> void
+{
+  auto iter = nameIndex.find(entryName(dirp));
+  if (
+    iter != end(nameIndex) && 
+    iter->second.segment == dirp.getSegment() && 
+    iter->second.index == dirp.getIndex()
+  ) {
+    nameIndex.erase(iter);
+  }
+}
+
+/**
+ * Look up a file by name.
+ *
+ * @param name the Rad50 representation of the filename.
+ * @return a pointer to the entry, or a pointer past the end of the directory if
+ * the file does not exist.
+ */
+auto Directory::lookupName(const Rad50Name &name) -> DirPtr
+{
+  auto dirp = startScan();
+
+  auto iter = nameIndex.find(name);
+  if (iter == end(nameIndex)) {
+    dirp.seek(0, 0);
+    return dirp;
+  }
+
+  dirp.seek(iter->second.segment, iter->second.index);
+  assert(entryName(dirp) == name && isIndexed(dirp));
+
+  return dirp;
+}
+
+/**
+ * Check if an entry belongs in the name index.
+ *
+ * @param dirp the entry to check.
+ * @return true if the entry is a file rather than free space or an end of 
+ * segment marker.
+ */
+auto Directory::isIndexed(const DirPtr &dirp) -> bool
+{
+  return (dirp.getWord(STATUS_WORD) & (E_MPTY | E_EOS)) == 0;
+}
+
+/**
+ * @param dirp the entry to read.
+ * @return the entry's file name.
+ */
+auto Directory::entryName(const DirPtr &dirp) -> Rad50Name
+{
+  return Rad50Name {
+    dirp.getWord(FILENAME_WORDS),
+    dirp.getWord(FILENAME_WORDS + 2),
+    dirp.getWord(FILENAME_WORDS + 4),
+  };
+}
+
+/**
+ * Fill in a client directory entry from the fields of an on-disk entry.
+ *
+ * @param status the status word.
+ * @param name the Rad50 file name.
+ * @param length the length in sectors.
+ * @param sector0 the first data sector.
+ * @param date the packed creation date.
+ * @param ent on return, the decoded directory entry.
+ */
+auto Directory::decodeEnt(uint16_t status, const Rad50Name &name, int length, int sector0, uint16_t date, DirEnt &ent) -> void
+{
+  ent.rad50_name = name;
+
+  // a decoded name always fits in the string's internal buffer, so this 
+  // doesn't allocate
+  auto buffer = Rad50::NameBuffer {};
+  auto nameLength = Rad50::decodeName(ent.rad50_name, buffer);
+  ent.name.assign(&buffer[0], nameLength);
+
+  ent.status = status;
+  ent.length = length * Block::SECTOR_SIZE;
+  ent.sector0 = sector0;
+
+  // on an invalid date, the time is left at the epoch
+  ent.create_time = 0;
+  dirTimeToTime(date, ent.create_time);
+}
+
 /**
  * Parse a filename into RT11 RAD50 representation
  *
@@ -1065,70 +1790,68 @@ auto Directory::moveEntryAcrossSegments(const DirPtr &src, const DirPtr &dst, Di
  */
 auto Directory::parseFilename(const std::string &name, Rad50Name &rad50) -> bool
 {
-  auto base = string {};
-  auto ext = string {};
+  const auto BASE_CHARS = 2 * Rad50::CHARS_PER_WORD;
 
-  auto n = name.find('.');
-  if (n != string::npos) {
-    base = name.substr(0, n);
-    ext = name.substr(n + 1);
-  } else {
-    base = name;
-  }
+  auto dot = name.find('.');
+  auto baseLength = dot != string::npos ? dot : name.size();
+  auto extLength = dot != string::npos ? name.size() - dot - 1 : 0;
 
-  if (base.size() > 6 || ext.size() > 3) {
+  if (baseLength > BASE_CHARS || extLength > Rad50::CHARS_PER_WORD) {
     return false;
   }
 
-  base = (base + "      ").substr(0, 6);
-  ext = (ext + "   ").substr(0, 3);
+  // the name padded out with spaces to the full width of each part
+  char padded[FILENAME_LENGTH * Rad50::CHARS_PER_WORD];
+  memset(padded, ' ', sizeof(padded));
+  memcpy(padded, name.data(), baseLength);
+  if (extLength > 0) {
+    memcpy(padded + BASE_CHARS, name.data() + dot + 1, extLength);
+  }
 
-  if (
-    !Rad50::toRad50(base.substr(0, 3), rad50[0]) ||
-    !Rad50::toRad50(base.substr(3, 3), rad50[1]) ||
-    !Rad50::toRad50(ext, rad50[2])
-  ) {
-    return false;
+  for (auto i = 0; i < FILENAME_LENGTH; i++) {
+    if (!Rad50::encodeWord(&padded[i * Rad50::CHARS_PER_WORD], rad50[i])) {
+      return false;
+    }
   }
 
   return true;
 }
 
 /** 
- * Convert an RT-11 directory timestamp to a tm
+ * Convert an RT-11 directory timestamp to a time
+ *
+ * RT-11 keeps only the date, with no time zone. The date is converted to noon
+ * UTC, so every time zone from UTC-12 to UTC+11 shows the date as stored, and
+ * the result doesn't depend on the zone rt11fs runs in. The conversion is
+ * done with tables of the days before each year and month, so it's cheap 
+ * enough to do on every lookup.
  *
  * @param dirTime the time to convert
- * @param tm on success, `dirTime' as a tm struct
+ * @param time on success, `dirTime' as seconds since the epoch
  * @return true on success
  */
-auto Directory::dirTimeToTime(uint16_t dirTime, struct tm &tm) -> bool
+auto Directory::dirTimeToTime(uint16_t dirTime, time_t &time) -> bool
 {
   auto year = dirTime & 0b0000000000011111;
   auto day = (dirTime & 0b0000001111100000) >> 5;
   auto mon = (dirTime & 0b0011110000000000) >> 10;
   auto age = (dirTime & 0b1100000000000000) >> 14;
 
-
   if (mon < 1 || mon > 12) {
     return false;
   }
 
-  auto monthLengths = vector<int>{ 0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
-  auto leap = (year % 4) == 0 && ((year % 100) != 0 || (year % 400) == 0);
-  if (leap) {
-    monthLengths[2]++;
-  }
+  year += age * 32;
 
-  if (day < 1 || day > monthLengths.at(mon)) {
+  const auto &years = dateTables().yearStartDays;
+  const auto &months = dateTables().monthStartDays[isLeap(FIRST_YEAR + year) ? 1 : 0];
+  if (day < 1 || day > months[mon] - months[mon - 1]) {
     return false;
   }
 
-  year = 1972 + year + age * 32;
-
-  memset(&tm, 0, sizeof(struct tm));
-  tm.tm_year = year - 1900;
-  tm.tm_mon = mon - 1;
-  tm.tm_mday = day;
+  const auto SECONDS_PER_DAY = 24 * 60 * 60;
+  auto days = years[year] + months[mon - 1] + day - 1;
+  time = static_cast<time_t>(days) * SECONDS_PER_DAY + SECONDS_PER_DAY / 2;
 
   return true;
 }
@@ -7,12 +7,19 @@
 #include "DirChangeTracker.h"
 #include "DirConst.h"
 #include "DirPtr.h"
+#include "EntryTable.h"
 
 #include <array>
 #include <cstdint>
 #include <ctime>
 #include <fuse.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace RT11FS {
@@ -39,12 +46,15 @@ class Directory
 {
 public:
   Directory(BlockCache *cache);
+  Directory(Directory &&other);
   ~Directory();
 
   auto getEnt(const std::string &name, DirEnt &ent) -> int;
   auto getDirPointer(const std::string &name, std::unique_ptr<DirPtr> &dirpp) -> int;
   auto getDirPointer(const Dir::Rad50Name &name) -> DirPtr;
   auto getEnt(const DirPtr &ptr, DirEnt &ent) -> bool;
+  auto getEnt(const EntryTable &entries, int row, DirEnt &ent) -> void;
+  auto getEntries() -> const EntryTable &;
   auto startScan() -> DirPtr;
   auto moveNextFiltered(DirPtr &ptr, uint16_t mask) -> bool;
   auto statfs(struct statvfs *vfs) -> int;
@@ -52,23 +62,63 @@ public:
   auto removeEntry(const std::string &name, std::vector<DirChangeTracker::Entry> &moves) -> int;
   auto rename(const std::string &oldName, const std::string &newName) -> int;
   auto createEntry(const std::string &name, std::unique_ptr<DirPtr> &dirpp, std::vector<DirChangeTracker::Entry> &moves) -> int;
+  auto allocateEntry(const std::string &name, int sectors, std::unique_ptr<DirPtr> &dirpp, std::vector<DirChangeTracker::Entry> &moves) -> int;
   auto makeEntryPermanent(DirPtr &ptr) -> void;
+  auto sync() -> void;
+  auto squeeze(int sectorBudget, std::vector<DirChangeTracker::Entry> &moves) -> int;
+  auto verifyUsage() -> bool;
+  auto getGeneration() const -> unsigned;
 
 private:
+  /**
+   * The location of a directory entry.
+   */
+  struct EntryPos {
+    int segment;
+    int index;
+  };
+
+  using NameIndex = std::unordered_map<Dir::Rad50Name, EntryPos, Dir::Rad50NameHash>;
+
   int entrySize;
   BlockCache *cache;
   Block *dirblk;
+  NameIndex nameIndex;          /*!< where each file (permanent or tentative) lives */
+  int freeBlocks;               /*!< total length of all free space entries */
+  int usedInodes;               /*!< number of entries which are files */
+  std::map<int, int> freeExtents;           /*!< non-empty free space, start sector to length */
+  std::set<std::pair<int, int>> freeBySize; /*!< the same extents, as (length, start sector) */
+  EntryTable entryTable;        /*!< decoded entries, rebuilt after the directory changes */
+  std::mutex entryTableLock;    /*!< serializes rebuilding `entryTable' between readers */
+
+  auto buildNameIndex() -> void;
+  auto scanUsage(int &free, int &used, std::map<int, int> &extents) -> void;
+  auto indexEntry(const DirPtr &dirp) -> void;
+  auto unindexEntry(const DirPtr &dirp) -> void;
+  auto lookupName(const Dir::Rad50Name &name) -> DirPtr;
+  static auto isIndexed(const DirPtr &dirp) -> bool;
+  static auto entryName(const DirPtr &dirp) -> Dir::Rad50Name;
 
   auto shrinkEntry(DirPtr &dirp, int newSize, DirChangeTracker &tracker) -> int;
   auto growEntry(DirPtr &dirp, int newSize, DirChangeTracker &tracker) -> int;
+  auto relocateEntry(DirPtr &dirp, DirPtr &newp, int newSize, DirChangeTracker &tracker) -> int;
 
   auto insertEmptyAt(DirPtr &dirp, DirChangeTracker &tracker) -> int;
   auto deleteEmptyAt(DirPtr &dirp, DirChangeTracker &tracker) -> void;
   auto spillLastEntry(const DirPtr &dirp, DirChangeTracker &tracker) -> int;
   auto allocateNewSegment() -> int;
   auto findLargestFreeBlock() -> DirPtr;
+  auto findBestFitFreeBlock(int size) -> DirPtr;
+  auto pointerToSector(int sector) -> DirPtr;
+  auto addFreeExtent(int start, int length) -> void;
+  auto removeFreeExtent(int start, int length) -> void;
   auto carveFreeBlock(DirPtr &dirp, int size, DirChangeTracker &tracker) -> int;
   auto coalesceNeighboringFreeBlocks(DirPtr &ptr, DirChangeTracker &tracker) -> void;
+  auto nextEntry(const DirPtr &dirp) -> DirPtr;
+  auto setSegmentStarts(const DirPtr &from, const DirPtr &to, int sector) -> void;
+  auto slideEntryDown(DirPtr &dirp, DirPtr &next, DirChangeTracker &tracker) -> int;
+  auto slideThroughScratch(DirPtr &dirp, DirPtr &next, DirChangeTracker &tracker) -> int;
+  auto mergeFreeForward(DirPtr &dirp, DirPtr &next, DirChangeTracker &tracker) -> void;
 
   auto maxEntriesPerSegment() const -> int;
   auto advanceToEndOfSegment(const DirPtr &dirp) -> DirPtr;
@@ -76,8 +126,9 @@ private:
   auto moveEntriesWithinSegment(const DirPtr &src, const DirPtr &dst, int count, DirChangeTracker &tracker) -> void;
   auto moveEntryAcrossSegments(const DirPtr &src, const DirPtr &dst, DirChangeTracker &tracker) -> void;
 
+  static auto decodeEnt(uint16_t status, const Dir::Rad50Name &name, int length, int sector0, uint16_t date, DirEnt &ent) -> void;
   static auto parseFilename(const std::string &name, Dir::Rad50Name &rad50) -> bool;
-  static auto dirTimeToTime(uint16_t dirTime, struct tm &tm) -> bool;
+  static auto dirTimeToTime(uint16_t dirTime, time_t &time) -> bool;
   static auto timeToDirTime(const struct tm &tm, uint16_t &dirtime) -> bool;
 };
 }
@@ -0,0 +1,81 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#include "EntryTable.h"
+
+#include "Block.h"
+#include "DirPtr.h"
+
+namespace RT11FS {
+using namespace Dir;
+
+EntryTable::EntryTable()
+  : source(nullptr)
+  , generation(0)
+{
+}
+
+/**
+ * Decode every entry of a directory into the table.
+ *
+ * This is the only place the table walks the directory's segments; the
+ * arrays keep their capacity, so rebuilding a table of the same size doesn't
+ * allocate.
+ *
+ * @param dirblk the block holding the entire directory.
+ */
+auto EntryTable::rebuild(Block *dirblk) -> void
+{
+  status.clear();
+  name.clear();
+  length.clear();
+  sector0.clear();
+  date.clear();
+  segment.clear();
+  index.clear();
+
+  auto dirp = DirPtr {dirblk};
+  while (++dirp) {
+    status.push_back(dirp.getWord(STATUS_WORD));
+    name.push_back(Rad50Name {
+      dirp.getWord(FILENAME_WORDS),
+      dirp.getWord(FILENAME_WORDS + 2),
+      dirp.getWord(FILENAME_WORDS + 4),
+    });
+    length.push_back(dirp.getWord(TOTAL_LENGTH_WORD));
+    sector0.push_back(dirp.getDataSector());
+    date.push_back(dirp.getWord(CREATION_DATE_WORD));
+    segment.push_back(dirp.getSegment());
+    index.push_back(dirp.getIndex());
+  }
+
+  source = dirblk;
+  generation = dirblk->getGeneration();
+}
+
+/**
+ * @param dirblk the block holding the entire directory.
+ * @return true if the table was built from `dirblk' and it hasn't changed since.
+ */
+auto EntryTable::isCurrent(Block *dirblk) const -> bool
+{
+  return source == dirblk && generation == dirblk->getGeneration();
+}
+
+/**
+ * Find the next entry with any of the bits in `mask' set in its status word.
+ *
+ * @param row the first row to look at.
+ * @param mask the status bits to look for.
+ * @return the row of the matching entry, or size() if there is none.
+ */
+auto EntryTable::find(int row, uint16_t mask) const -> int
+{
+  auto rows = size();
+  while (row < rows && (status[row] & mask) == 0) {
+    row++;
+  }
+
+  return row;
+}
+}
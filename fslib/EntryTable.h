@@ -0,0 +1,60 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __ENTRYTABLE_H_
+#define __ENTRYTABLE_H_
+
+#include "DirConst.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace RT11FS {
+class Block;
+
+/**
+ * A decoded copy of every entry in a directory, in directory order.
+ *
+ * Each field is kept in its own array, so a scan which only looks at one or
+ * two fields (such as finding files by status) runs over contiguous memory
+ * without walking segments or assembling words.
+ *
+ * The table is a snapshot. It remembers the generation of the directory block
+ * it was built from, and must be rebuilt once the block has changed.
+ */
+class EntryTable
+{
+public:
+  EntryTable();
+
+  auto rebuild(Block *dirblk) -> void;
+  auto isCurrent(Block *dirblk) const -> bool;
+  auto find(int row, uint16_t mask) const -> int;
+
+  /**
+   * @return the number of entries, including end of segment markers.
+   */
+  auto size() const { return static_cast<int>(status.size()); }
+
+  auto getStatus(int row) const { return status[row]; }
+  auto getName(int row) const -> const Dir::Rad50Name & { return name[row]; }
+  auto getLength(int row) const { return length[row]; }
+  auto getSector0(int row) const { return sector0[row]; }
+  auto getDate(int row) const { return date[row]; }
+  auto getSegment(int row) const { return segment[row]; }
+  auto getIndex(int row) const { return index[row]; }
+
+private:
+  Block *source;                        /*!< the directory block the table was built from */
+  unsigned generation;                  /*!< the generation of `source' when it was built */
+  std::vector<uint16_t> status;
+  std::vector<Dir::Rad50Name> name;
+  std::vector<uint16_t> length;         /*!< in sectors */
+  std::vector<int> sector0;
+  std::vector<uint16_t> date;
+  std::vector<int> segment;
+  std::vector<int> index;
+};
+}
+
+#endif
@@ -4,10 +4,22 @@
 #include "FileDataSource.h"
 
 #include <cerrno>
+#include <sys/uio.h>
 #include <unistd.h>
 
 namespace RT11FS {
 
+namespace {
+auto totalBytes(const struct iovec *iov, int iovcnt) -> size_t
+{
+  auto total = size_t {0};
+  for (auto i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+}
+
 FileDataSource::FileDataSource(int fd)
   : fd(fd)
 {
@@ -30,14 +42,7 @@ auto FileDataSource::stat(struct stat *st) -> int
 
 auto FileDataSource::read(void *buffer, size_t bytes, off_t offset) -> ssize_t
 {
-  auto seek = ::lseek(fd, offset, SEEK_SET);
-  if (seek == -1) {
-    return -errno;
-  } else if (seek != offset) {
-    return -EIO;
-  }
-
-  auto xfer = ::read(fd, buffer, bytes);
+  auto xfer = ::pread(fd, buffer, bytes, offset);
   if (xfer == -1) {
     return -errno;  
   } else if (xfer != bytes) {
@@ -49,22 +54,38 @@ auto FileDataSource::read(void *buffer, size_t bytes, off_t offset) -> ssize_t
 
 auto FileDataSource::write(void *buffer, size_t bytes, off_t offset) -> ssize_t
 {
-  auto seek = ::lseek(fd, offset, SEEK_SET);
-  if (seek == -1) {
+  auto xfer = ::pwrite(fd, buffer, bytes, offset);
+  if (xfer == -1) {
     return -errno;
-  } else if (seek != offset) {
+  } else if (xfer != bytes) {
     return -EIO;
   }
 
-  auto xfer = ::write(fd, buffer, bytes);
+  return xfer;
+}
+
+auto FileDataSource::readv(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t
+{
+  auto xfer = ::preadv(fd, iov, iovcnt, offset);
   if (xfer == -1) {
     return -errno;
-  } else if (xfer != bytes) {
+  } else if (xfer != totalBytes(iov, iovcnt)) {
     return -EIO;
   }
 
   return xfer;
 }
 
+auto FileDataSource::writev(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t
+{
+  auto xfer = ::pwritev(fd, iov, iovcnt, offset);
+  if (xfer == -1) {
+    return -errno;
+  } else if (xfer != totalBytes(iov, iovcnt)) {
+    return -EIO;
+  }
+
+  return xfer;
+}
 
-}
\ No newline at end of file
+}
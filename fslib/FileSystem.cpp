@@ -2,17 +2,25 @@
 // MIT license as described in the file LICENSE.txt.
 
 #include "BlockCache.h"
+#include "CompressedDataSource.h"
 #include "Directory.h"
 #include "FileDataSource.h"
 #include "FileSystem.h"
 #include "FileSystemException.h"
+#include "MmapDataSource.h"
 #include "OpenFileTable.h"
+#include "OverlayDataSource.h"
+#include "Statistics.h"
+#include "UringDataSource.h"
 
 #include <algorithm>
 #include <cerrno>
+#include <cstdlib>
 #include <fcntl.h>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <shared_mutex>
 #include <stdexcept>
 #include <unistd.h>
 
@@ -20,39 +28,135 @@ using std::cout;
 using std::cerr;
 using std::endl;
 using std::find_if;
+using std::lock_guard;
 using std::make_unique;
+using std::mutex;
 using std::setfill;
 using std::setw;
+using std::shared_lock;
+using std::shared_timed_mutex;
 using std::string;
+using std::unique_lock;
+using std::unique_ptr;
 using std::vector;
 
 namespace RT11FS {
 
-FileSystem::FileSystem(const string &name)
+const int FileSystem::DEFAULT_MAX_DIRTY_SECONDS;
+const char FileSystem::STATS_PATH[];
+const int FileSystem::ATTR_TIMEOUT_SECONDS;
+const uint64_t FileSystem::STATS_HANDLE_BASE;
+
+using Operation = Statistics::Operation;
+
+FileSystem::FileSystem(const string &name, const FileSystemOptions &options)
   : fd(-1)
+  , overlay(nullptr)
+  , directImage(false)
+  , readOnly(false)
+  , squeezeSectors(options.squeezeSectors)
+  , writeBack(options.writeBack)
+  , maxDirtyAge(options.maxDirtySeconds ? options.maxDirtySeconds : DEFAULT_MAX_DIRTY_SECONDS)
+  , unflushed(false)
+  , backgroundFlush(options.backgroundFlush)
+  , ageArmed(false)
+  , ageStopping(false)
+  , nextStatsHandle(STATS_HANDLE_BASE)
 {
-  fd = ::open(name.c_str(), O_RDWR|O_EXLOCK);
+  if (options.overlay != nullptr) {
+    // the image may be shared by other overlaid mounts, so it's only locked
+    // against writers
+    fd = options.commitOverlay
+      ? ::open(name.c_str(), O_RDWR|O_EXLOCK)
+      : ::open(name.c_str(), O_RDONLY|O_SHLOCK);
+  } else {
+    fd = ::open(name.c_str(), O_RDWR|O_EXLOCK);
+  }
   if (fd == -1) {
     throw FilesystemException {-ENOENT, "volume file could not be opened"};
   }
 
-  dataSource = make_unique<FileDataSource>(fd);
+  auto compressed = CompressedDataSource::isContainer(fd);
+  auto image = unique_ptr<DataSource> {};
+  if (compressed) {
+    image = make_unique<CompressedDataSource>(fd);
+  } else if (options.mmap && options.overlay == nullptr) {
+    image = make_unique<MmapDataSource>(fd);
+  } else if (options.ioUring) {
+    image = UringDataSource::create(fd);
+  } else {
+    image = make_unique<FileDataSource>(fd);
+  }
+
+  if (options.overlay != nullptr) {
+    auto deltaFd = ::open(options.overlay, O_RDWR|O_CREAT|O_EXLOCK, 0644);
+    if (deltaFd == -1) {
+      throw FilesystemException {-errno, "overlay file could not be opened"};
+    }
+
+    auto overlaid = make_unique<OverlayDataSource>(std::move(image), deltaFd);
+    overlay = overlaid.get();
+    dataSource = std::move(overlaid);
+  } else {
+    dataSource = std::move(image);
+  }
+
+  directImage = !compressed && overlay == nullptr;
+  readOnly = compressed && overlay == nullptr;
+
+  auto cacheBytes = options.cacheBytes ? options.cacheBytes : BlockCache::DEFAULT_MAX_BYTES;
+
+  cache = make_unique<BlockCache>(dataSource.get(), cacheBytes, options.cacheBudget);
 
-  cache = make_unique<BlockCache>(dataSource.get());
+  flushLimits.highWaterBytes = options.dirtyHighWaterBytes ? options.dirtyHighWaterBytes : cacheBytes / 4;
+  flushLimits.hardLimitBytes = options.dirtyLimitBytes ? options.dirtyLimitBytes : cacheBytes / 2;
+  flushLimits.maxAge = maxDirtyAge;
   directory = make_unique<Directory>(cache.get());
-  oft = make_unique<OpenFileTable>(directory.get(), cache.get());
+  oft = make_unique<OpenFileTable>(directory.get(), cache.get(), writeBack, options.verbose);
 }
 
 FileSystem::~FileSystem()
 {
+  if (ageTimer.joinable()) {
+    {
+      lock_guard<mutex> lock {ageLock};
+      ageStopping = true;
+    }
+    ageWake.notify_one();
+    ageTimer.join();
+  }
+
+  wrapper(Operation::Flush, [this]() {
+    cache->sync();
+    return 0;
+  });
+
   if (fd == -1) {
     close(fd);
   }
 }
 
+/**
+ * Start any background threads.
+ *
+ * This is separate from construction because FUSE may fork to run in the
+ * background after the file system is created, and threads don't survive
+ * the fork. It should be called from FUSE's `init' callback.
+ */
+auto FileSystem::init() -> void
+{
+  if (backgroundFlush) {
+    cache->startFlusher(flushLimits);
+  }
+
+  if (writeBack != WriteBackPolicy::Immediate && !readOnly) {
+    ageTimer = std::thread {[this]() { ageTimerLoop(); }};
+  }
+}
+
 auto FileSystem::getattr(const char *path, struct stat *stbuf) -> int
 {
-  return wrapper([this, path, stbuf]() {
+  return readLocked(Operation::Getattr, [this, path, stbuf]() {
     memset(stbuf, 0, sizeof(struct stat));
     auto p = string {path};
 
@@ -62,27 +166,38 @@ auto FileSystem::getattr(const char *path, struct stat *stbuf) -> int
       return 0;
     }
 
-    auto parsedPath = string {path};
-    auto err = validatePath(parsedPath);
-    if (err < 0) {
-      return err;
+    if (p == STATS_PATH) {
+      stbuf->st_mode = S_IFREG | 0444;
+      stbuf->st_nlink = 1;
+      stbuf->st_size = statsReport().size();
+      return 0;
     }
 
-    auto ent = DirEnt {};
-    err = directory->getEnt(parsedPath, ent);
-    if (err < 0) {
-      return err;
+    auto generation = directory->getGeneration();
+    auto attr = AttrCache::Attr {};
+
+    if (attrCache.lookup(p, generation, attr)) {
+      Statistics::count(Statistics::Counter::AttrHits);
+    } else {
+      Statistics::count(Statistics::Counter::AttrMisses);
+      lookupAttr(p, attr);
+      attrCache.insert(p, generation, attr);
     }
 
-    uint16_t perm = 0444;
-    if ((ent.status & Dir::E_READ) == 0) {
-      perm |= 0222;
+    if (attr.err < 0) {
+      return attr.err;
     }
 
-    stbuf->st_mode = S_IFREG | perm;
-    stbuf->st_nlink = 1;
-    stbuf->st_size = ent.length;
-    stbuf->st_mtime = ent.create_time;
+    *stbuf = attr.st;
+
+    // a file being written may have space reserved past its end; that 
+    // doesn't change the directory, so it's looked up every time
+    auto dirp = directory->startScan();
+    dirp.seek(attr.segment, attr.index);
+    auto openLength = oft->getOpenLength(dirp);
+    if (openLength >= 0) {
+      stbuf->st_size = openLength * Block::SECTOR_SIZE;
+    }
 
     return 0;
   });
@@ -95,14 +210,18 @@ auto FileSystem::fgetattr(const char *path, struct stat *stbuf, struct fuse_file
 
 auto FileSystem::statfs(const char *path, struct statvfs *vfs) -> int
 {
-  return wrapper([this, path, vfs]() {
+  return readLocked(Operation::Statfs, [this, path, vfs]() {
     auto p = string {path};
 
     if (p != "/") {
       return -ENOENT;
     }
 
-    return directory->statfs(vfs);
+    auto err = directory->statfs(vfs);
+    if (err == 0 && readOnly) {
+      vfs->f_flag |= ST_RDONLY;
+    }
+    return err;
   });
 }
 
@@ -114,7 +233,7 @@ auto FileSystem::chmod(const char *, mode_t) -> int
 
 auto FileSystem::unlink(const char *path) -> int
 {
-  return wrapper([this, path](){
+  return writeLocked(Operation::Unlink, [this, path](){
     auto parsedPath = string {path};
     auto err = validatePath(parsedPath);
     return oft->unlink(parsedPath);
@@ -123,7 +242,7 @@ auto FileSystem::unlink(const char *path) -> int
 
 auto FileSystem::rename(const char *oldName, const char *newName) -> int
 {
-  return wrapper([this, oldName, newName]() {
+  return writeLocked(Operation::Rename, [this, oldName, newName]() {
     auto parsedOldPath = string {oldName};
     auto parsedNewPath = string {newName};
 
@@ -143,20 +262,43 @@ auto FileSystem::readdir(
   const char *path, void *buf, fuse_fill_dir_t filler,
   off_t offset, struct fuse_file_info *fi) -> int
 {
-  return wrapper([this, path, buf, filler, offset, fi]() {
+  return readLocked(Operation::Readdir, [this, path, buf, filler, offset, fi]() {
     auto p = string {path};
     if (p != "/") {
       return -ENOENT;
     }
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    // Offsets are 1 and 2 for the dot entries, followed by the files numbered in
+    // directory order. Each entry is returned with its offset so that FUSE can 
+    // resume a listing that didn't fit in one buffer.
+    if (offset < 1 && filler(buf, ".", NULL, 1)) {
+      return 0;
+    }
 
-    auto scan = directory->startScan();
-    while (directory->moveNextFiltered(scan, Dir::E_PERM)) {
-      auto ent = DirEnt {};
-      if (directory->getEnt(scan, ent)) {
-        filler(buf, ent.name.c_str(), NULL, 0);
+    if (offset < 2 && filler(buf, "..", NULL, 2)) {
+      return 0;
+    }
+
+    // the table can't change while the read lock is held
+    const auto &entries = directory->getEntries();
+    auto next = off_t {3};
+    auto ent = DirEnt {};
+    for (
+      auto row = entries.find(0, Dir::E_PERM); 
+      row < entries.size(); 
+      row = entries.find(row + 1, Dir::E_PERM)
+    ) {
+      auto entOffset = next++;
+      if (entOffset <= offset) {
+        continue;
+      }
+
+      directory->getEnt(entries, row, ent);
+
+      struct stat st;
+      fillStat(ent, &st);
+      if (filler(buf, ent.name.c_str(), &st, entOffset)) {
+        break;
       }
     }
 
@@ -166,13 +308,21 @@ auto FileSystem::readdir(
 
 auto FileSystem::open(const char *path, struct fuse_file_info *fi) -> int
 {
-  return wrapper([this, path, fi]() {
+  return readLocked(Operation::Open, [this, path, fi]() {
+    if (string {path} == STATS_PATH) {
+      return openStats(fi);
+    }
+
     auto parsedPath = string {path};
     auto err = validatePath(parsedPath);
     if (err < 0) {
       return err;
     }
 
+    if (readOnly && (fi->flags & O_ACCMODE) != O_RDONLY) {
+      return -EROFS;
+    }
+
     auto fd = oft->openFile(parsedPath);
     if (fd < 0) {
       return fd;
@@ -186,7 +336,7 @@ auto FileSystem::open(const char *path, struct fuse_file_info *fi) -> int
 
 auto FileSystem::create(const char *path, mode_t mode, struct fuse_file_info *fi) -> int
 {
-  return wrapper([this, path, mode, fi](){
+  return writeLocked(Operation::Create, [this, path, mode, fi](){
     auto parsedPath = string {path};
     auto err = validatePath(parsedPath);
     if (err < 0) {
@@ -211,9 +361,21 @@ auto FileSystem::create(const char *path, mode_t mode, struct fuse_file_info *fi
 
 auto FileSystem::release(const char *path, struct fuse_file_info *fi) -> int
 {
-  return wrapper([this, fi]() {
+  return writeLocked(Operation::Release, [this, fi]() {
+    if (isStatsHandle(fi->fh)) {
+      lock_guard<mutex> lock {statsLock};
+      statsFiles.erase(fi->fh);
+      return 0;
+    }
+
     auto err = oft->closeFile(fi->fh);
-    return err;
+    if (err < 0 || squeezeSectors <= 0) {
+      return err;
+    }
+
+    // compact a little at a time, so no one close pays for the whole volume
+    err = oft->squeeze(squeezeSectors);
+    return err < 0 ? err : 0;
   });
 }
 
@@ -222,7 +384,10 @@ auto FileSystem::read(
   const char *path, char *buf, size_t count, off_t offset, 
   struct fuse_file_info *fi) -> int 
 {
-  return wrapper([this, path, buf, count, offset, fi] {
+  return readLocked(Operation::Read, [this, path, buf, count, offset, fi] {
+    if (isStatsHandle(fi->fh)) {
+      return readStats(fi->fh, buf, count, offset);
+    }
     return oft->readFile(fi->fh, buf, count, offset);
   });
 }
@@ -231,27 +396,185 @@ auto FileSystem::write(
   const char *path, const char *buf, size_t count, off_t offset,
   struct fuse_file_info *fi) -> int
 {
-  return wrapper([this, path, buf, count, offset, fi] {
+  return writeLocked(Operation::Write, [this, path, buf, count, offset, fi] {
+    if (isStatsHandle(fi->fh)) {
+      return -EBADF;
+    }
     return oft->writeFile(fi->fh, buf, count, offset);
   });
 }
 
+/**
+ * Read from a file into a buffer for FUSE to reply with.
+ *
+ * RT-11 files are contiguous, so the read is one range of the image file, 
+ * which is read with a single request that bypasses the cache, except for 
+ * any sectors the cache holds newer data for.
+ *
+ * FUSE isn't handed the image file to read itself, since it would read it 
+ * after the file system lock is released, when a squeeze, a growing file 
+ * being moved or a freed file's space being reused could have put another
+ * file's data in the range.
+ *
+ * @param path the path of the file.
+ * @param bufp receives the buffer to reply with, which FUSE frees.
+ * @param count the number of bytes to read.
+ * @param offset the offset in the file to read from.
+ * @param fi the FUSE file info of the open file.
+ * @return 0 on success or a negated errno
+ */
+auto FileSystem::readBuf(
+  const char *path, struct fuse_bufvec **bufp, size_t count, off_t offset, 
+  struct fuse_file_info *fi) -> int
+{
+  return readLocked(Operation::Read, [this, bufp, count, offset, fi]() {
+    auto bufv = unique_ptr<fuse_bufvec, decltype(&free)> {
+      static_cast<fuse_bufvec *>(malloc(sizeof(fuse_bufvec))),
+      &free
+    };
+    if (!bufv) {
+      return -ENOMEM;
+    }
+    *bufv = FUSE_BUFVEC_INIT(0);
+
+    auto mem = unique_ptr<char, decltype(&free)> {static_cast<char *>(malloc(count)), &free};
+    if (!mem) {
+      return -ENOMEM;
+    }
+
+    auto got = 0;
+    if (isStatsHandle(fi->fh)) {
+      got = readStats(fi->fh, mem.get(), count, offset);
+    } else if (directImage) {
+      auto volumeOffset = off_t {0};
+      got = oft->mapRead(fi->fh, count, offset, volumeOffset);
+      if (got > 0) {
+        cache->readDirect(volumeOffset, got, mem.get());
+      }
+    } else {
+      got = oft->readFile(fi->fh, mem.get(), count, offset);
+    }
+
+    if (got < 0) {
+      return got;
+    }
+
+    bufv->buf[0].size = got;
+    bufv->buf[0].mem = mem.release();
+    *bufp = bufv.release();
+    return 0;
+  });
+}
+
+/**
+ * Write to a file, having FUSE transfer the data straight into the volume 
+ * image where possible.
+ *
+ * A write of whole sectors, none of which are dirty or in use in the cache,
+ * is copied by FUSE from its buffers to the image file, which the kernel may 
+ * do by splicing. Anything else is copied into memory and written as by 
+ * `write'.
+ *
+ * @param path the path of the file.
+ * @param bufv the data to write.
+ * @param offset the offset in the file to write to.
+ * @param fi the FUSE file info of the open file.
+ * @return the number of bytes written or a negated errno
+ */
+auto FileSystem::writeBuf(
+  const char *path, struct fuse_bufvec *bufv, off_t offset, 
+  struct fuse_file_info *fi) -> int
+{
+  return writeLocked(Operation::Write, [this, bufv, offset, fi]() -> int {
+    if (isStatsHandle(fi->fh)) {
+      return -EBADF;
+    }
+
+    auto count = fuse_buf_size(bufv);
+    auto wholeSectors = count > 0 && offset % Block::SECTOR_SIZE == 0 && count % Block::SECTOR_SIZE == 0;
+
+    if (wholeSectors && directImage) {
+      auto volumeOffset = off_t {0};
+      auto err = oft->mapWrite(fi->fh, count, offset, volumeOffset);
+      if (err < 0) {
+        return err;
+      }
+
+      if (cache->discard(volumeOffset / Block::SECTOR_SIZE, count / Block::SECTOR_SIZE)) {
+        auto dst = FUSE_BUFVEC_INIT(count);
+        dst.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        dst.buf[0].fd = fd;
+        dst.buf[0].pos = volumeOffset;
+
+        // the file only grows by what actually reached the image
+        auto copied = fuse_buf_copy(&dst, bufv, static_cast<fuse_buf_copy_flags>(0));
+        if (copied > 0) {
+          Statistics::count(Statistics::Counter::BytesWritten, copied);
+          err = oft->commitWrite(fi->fh, offset + copied);
+          if (err < 0) {
+            return err;
+          }
+        }
+        return static_cast<int>(copied);
+      }
+    }
+
+    auto data = vector<char>(count);
+    auto mem = FUSE_BUFVEC_INIT(count);
+    mem.buf[0].mem = data.data();
+
+    auto copied = fuse_buf_copy(&mem, bufv, static_cast<fuse_buf_copy_flags>(0));
+    if (copied < 0) {
+      return static_cast<int>(copied);
+    }
+
+    return oft->writeFile(fi->fh, data.data(), copied, offset);
+  });
+}
+
 auto FileSystem::ftruncate(const char *path, off_t size, struct fuse_file_info *fi) -> int
 {
-  return wrapper([this, size, fi]() {    
+  return writeLocked(Operation::Truncate, [this, size, fi]() {    
+    if (isStatsHandle(fi->fh)) {
+      return -EBADF;
+    }
     return oft->truncate(fi->fh, size);
   });
 }
 
 auto FileSystem::fsync(const char *path, int isdatasync, struct fuse_file_info *fi) -> int
 {
-  return wrapper([this] {
-    cache->sync();
-    return 0;
+  return writeLocked(Operation::Fsync, [this, fi] {
+    if (isStatsHandle(fi->fh)) {
+      return 0;
+    }
+    return oft->syncFile(fi->fh);
   });
 }
 
-auto FileSystem::wrapper(std::function<int(void)> fn) -> int
+/**
+ * Run a file system operation, turning exceptions into errors and 
+ * recording the call in the statistics.
+ *
+ * @param op the operation, for the statistics.
+ * @param fn the operation.
+ * @return the result of `fn', or a negated errno if it threw
+ */
+auto FileSystem::wrapper(Operation op, std::function<int(void)> fn) -> int
+{
+  auto start = std::chrono::steady_clock::now();
+  auto err = run(fn);
+  Statistics::record(op, std::chrono::steady_clock::now() - start, err < 0);
+  return err;
+}
+
+/**
+ * Run a function, turning exceptions into errors.
+ *
+ * @param fn the function.
+ * @return the result of `fn', or a negated errno if it threw
+ */
+auto FileSystem::run(std::function<int(void)> fn) -> int
 {
   auto err = 0;
 
@@ -271,6 +594,274 @@ auto FileSystem::wrapper(std::function<int(void)> fn) -> int
   return err;
 }
 
+/**
+ * Look up the attributes of a file in the directory.
+ *
+ * @param path the path of the file.
+ * @param attr on return, the result of the lookup, fit for the attribute cache.
+ */
+auto FileSystem::lookupAttr(const string &path, AttrCache::Attr &attr) -> void
+{
+  memset(&attr, 0, sizeof(attr));
+
+  auto parsedPath = path;
+  attr.err = validatePath(parsedPath);
+  if (attr.err < 0) {
+    return;
+  }
+
+  auto dirpp = unique_ptr<DirPtr> {};
+  attr.err = directory->getDirPointer(parsedPath, dirpp);
+  if (attr.err < 0) {
+    return;
+  }
+
+  auto ent = DirEnt {};
+  directory->getEnt(*dirpp, ent);
+  fillStat(ent, &attr.st);
+  attr.segment = dirpp->getSegment();
+  attr.index = dirpp->getIndex();
+}
+
+/**
+ * Fill in file attributes from a directory entry.
+ *
+ * @param ent the directory entry of the file.
+ * @param st the attributes to fill in.
+ */
+auto FileSystem::fillStat(const DirEnt &ent, struct stat *st) -> void
+{
+  memset(st, 0, sizeof(struct stat));
+
+  uint16_t perm = 0444;
+  if ((ent.status & Dir::E_READ) == 0) {
+    perm |= 0222;
+  }
+
+  st->st_mode = S_IFREG | perm;
+  st->st_nlink = 1;
+  st->st_size = ent.length;
+  st->st_mtime = ent.create_time;
+}
+
+/**
+ * Run a file system operation which doesn't modify the volume.
+ *
+ * Any number of these may run at once, but not alongside an operation 
+ * run by `writeLocked'.
+ *
+ * @param op the operation, for the statistics.
+ * @param fn the operation.
+ * @return the result of `wrapper'.
+ */
+auto FileSystem::readLocked(Operation op, std::function<int(void)> fn) -> int
+{
+  auto lock = shared_lock<shared_timed_mutex> {fsLock};
+  return wrapper(op, fn);
+}
+
+/**
+ * Run a file system operation which modifies the directory, the open file
+ * table, or cached data, with exclusive access to the file system.
+ *
+ * @param op the operation, for the statistics.
+ * @param fn the operation.
+ * @return the result of `wrapper'.
+ */
+auto FileSystem::writeLocked(Operation op, std::function<int(void)> fn) -> int
+{
+  // closing and syncing are harmless on a read only volume, since nothing can be dirty
+  if (readOnly && op != Operation::Release && op != Operation::Fsync) {
+    return -EROFS;
+  }
+
+  auto lock = unique_lock<shared_timed_mutex> {fsLock};
+  auto err = wrapper(op, fn);
+
+  auto flushErr = run([this]() { return flushIfDue(); });
+  return err < 0 ? err : (flushErr < 0 ? flushErr : err);
+}
+
+/**
+ * Note that the volume may have changed, and write everything to disk if it
+ * has had unwritten changes for longer than the dirty age limit.
+ *
+ * Called after every operation which may change the volume, with exclusive
+ * access to the file system. The first change after the volume was last 
+ * written arms the age timer, which writes the changes when they reach the
+ * limit if no later operation has. Together they bound how long the 
+ * directory stays unwritten when closes don't write it.
+ *
+ * @return 0 on success or a negated errno
+ */
+auto FileSystem::flushIfDue() -> int
+{
+  if (writeBack == WriteBackPolicy::Immediate) {
+    return 0;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+
+  if (!unflushed) {
+    unflushed = true;
+    unflushedSince = now;
+    armAgeTimer(now + maxDirtyAge);
+    return 0;
+  }
+
+  return flushAged(now);
+}
+
+/**
+ * Write everything to disk if the volume has had unwritten changes for
+ * longer than the dirty age limit.
+ *
+ * With a background flusher, which writes file data as it ages, only the
+ * directory is written. The flusher can't write the directory itself, since
+ * the directory holds its block for the life of the mount.
+ *
+ * Requires exclusive access to the file system.
+ *
+ * @param now the current time.
+ * @return 0 on success or a negated errno
+ */
+auto FileSystem::flushAged(std::chrono::steady_clock::time_point now) -> int
+{
+  if (unflushed && now - unflushedSince >= maxDirtyAge) {
+    if (backgroundFlush) {
+      directory->sync();
+    } else {
+      cache->sync();
+    }
+    unflushed = false;
+    Statistics::record(Operation::Flush, std::chrono::steady_clock::now() - now, false);
+  }
+
+  return 0;
+}
+
+/**
+ * Have the age timer check the volume at a given time. Does nothing if the
+ * timer isn't running.
+ *
+ * @param deadline when the oldest unwritten change reaches the age limit.
+ */
+auto FileSystem::armAgeTimer(std::chrono::steady_clock::time_point deadline) -> void
+{
+  {
+    lock_guard<mutex> lock {ageLock};
+    ageArmed = true;
+    ageDeadline = deadline;
+  }
+  ageWake.notify_one();
+}
+
+/**
+ * The body of the age timer thread, which writes changes that reach the 
+ * age limit while no operations are changing the volume.
+ */
+auto FileSystem::ageTimerLoop() -> void
+{
+  auto lock = unique_lock<mutex> {ageLock};
+
+  while (!ageStopping) {
+    if (!ageArmed) {
+      ageWake.wait(lock);
+      continue;
+    }
+
+    // the timer may be rearmed, or asked to stop, while waiting
+    auto deadline = ageDeadline;
+    ageWake.wait_until(lock, deadline);
+    if (ageStopping || !ageArmed || ageDeadline != deadline || std::chrono::steady_clock::now() < deadline) {
+      continue;
+    }
+    ageArmed = false;
+
+    // the file system lock is taken after the timer's, so let go of the 
+    // timer's first
+    lock.unlock();
+    {
+      auto fsl = unique_lock<shared_timed_mutex> {fsLock};
+      auto now = std::chrono::steady_clock::now();
+      auto err = run([this, now]() { return flushAged(now); });
+
+      // if the write failed, try again after another period rather than
+      // right away
+      if (unflushed) {
+        armAgeTimer(err < 0 ? now + maxDirtyAge : unflushedSince + maxDirtyAge);
+      }
+    }
+    lock.lock();
+  }
+}
+
+/**
+ * @return the current statistics, as the contents of the stats file.
+ */
+auto FileSystem::statsReport() -> string
+{
+  return Statistics::report(Statistics::snapshot(), cache->getDirtyBytes());
+}
+
+/**
+ * Open the stats file.
+ *
+ * The statistics are captured when the file is opened, so that a reader 
+ * sees one consistent report however it reads the file.
+ *
+ * @param fi the FUSE file info, which receives the stats file handle.
+ * @return 0 on success or a negated errno
+ */
+auto FileSystem::openStats(struct fuse_file_info *fi) -> int
+{
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    return -EACCES;
+  }
+
+  auto report = statsReport();
+
+  lock_guard<mutex> lock {statsLock};
+  auto handle = nextStatsHandle++;
+  statsFiles[handle] = std::move(report);
+
+  fi->fh = handle;
+
+  // the report's size may have changed since getattr, so don't let the
+  // kernel cut reads off at that size
+  fi->direct_io = 1;
+
+  return 0;
+}
+
+/**
+ * Read from an open stats file.
+ *
+ * @param handle the stats file handle from `openStats'.
+ * @param buffer the buffer to read into.
+ * @param count the number of bytes to read.
+ * @param offset the offset in the report to read from.
+ * @return the number of bytes read or a negated errno
+ */
+auto FileSystem::readStats(uint64_t handle, char *buffer, size_t count, off_t offset) -> int
+{
+  lock_guard<mutex> lock {statsLock};
+
+  auto iter = statsFiles.find(handle);
+  if (iter == end(statsFiles)) {
+    return -EBADF;
+  }
+
+  const auto &report = iter->second;
+  if (offset < 0 || static_cast<size_t>(offset) >= report.size()) {
+    return 0;
+  }
+
+  auto toCopy = std::min(count, report.size() - offset);
+  memcpy(buffer, report.data() + offset, toCopy);
+  return toCopy;
+}
+
 auto FileSystem::validatePath(string &path) -> int
 {
   if (path == "" || path[0] != '/') {
@@ -289,6 +880,96 @@ auto FileSystem::validatePath(string &path) -> int
   return 0;
 }
 
+/**
+ * Compact the entire volume, so that all free space is at the end.
+ *
+ * @return 0 on success or a negated errno
+ */
+auto FileSystem::squeeze() -> int
+{
+  return writeLocked(Operation::Squeeze, [this]() {
+    auto err = oft->squeeze(0);
+    if (err < 0) {
+      return err;
+    }
+
+    cache->sync();
+    return 0;
+  });
+}
+
+/**
+ * Copy files onto the volume in one batch; see BatchTransfer::put. No files
+ * may be open.
+ *
+ * @param files the files to put.
+ * @return 0 on success, -EBUSY if any files are open, or another negated
+ * errno
+ */
+auto FileSystem::put(const vector<BatchTransfer::File> &files) -> int
+{
+  return writeLocked(Operation::Write, [this, &files]() {
+    // the batch moves directory entries without telling the open file table
+    if (oft->hasOpenFiles()) {
+      return -EBUSY;
+    }
+
+    auto batch = BatchTransfer {directory.get(), cache.get()};
+    return batch.put(files);
+  });
+}
+
+/**
+ * Copy files off of the volume in one batch; see BatchTransfer::get.
+ *
+ * @param files the files to get.
+ * @return 0 on success or a negated errno
+ */
+auto FileSystem::get(const vector<BatchTransfer::File> &files) -> int
+{
+  return readLocked(Operation::Read, [this, &files]() {
+    auto batch = BatchTransfer {directory.get(), cache.get()};
+    return batch.get(files);
+  });
+}
+
+/**
+ * Write the changes kept in the overlay into the image, leaving the overlay
+ * empty. The volume must have been opened with `commitOverlay' set.
+ *
+ * @return 0 on success or a negated errno
+ */
+auto FileSystem::commitOverlay() -> int
+{
+  return writeLocked(Operation::Flush, [this]() {
+    if (overlay == nullptr) {
+      return -EINVAL;
+    }
+
+    cache->sync();
+    return overlay->commit();
+  });
+}
+
+/**
+ * Throw away the changes kept in the overlay. Since the contents of the 
+ * volume revert underneath the cache, this must be the last operation on
+ * the file system.
+ *
+ * @return 0 on success or a negated errno
+ */
+auto FileSystem::discardOverlay() -> int
+{
+  return writeLocked(Operation::Flush, [this]() {
+    if (overlay == nullptr) {
+      return -EINVAL;
+    }
+
+    cache->sync();
+    return overlay->discard();
+  });
+}
+
 auto FileSystem::lsdir() -> void
 {
   auto dirp = directory->startScan();
@@ -4,28 +4,72 @@
 #ifndef __FILESYSTEM_H_
 #define __FILESYSTEM_H_
 
+#include "AttrCache.h"
+#include "BatchTransfer.h"
+#include "BlockCache.h"
+#include "Statistics.h"
+#include "WriteBackPolicy.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <functional>
 #include <fuse.h>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace RT11FS {
 
-class BlockCache;
 class DataSource;
 class Directory;
 struct DirEnt;
 class File;
 class OpenFileTable;
+class OverlayDataSource;
+
+/**
+ * Tunable parameters for a mounted volume. A zeroed struct gives the defaults.
+ */
+struct FileSystemOptions {
+  size_t cacheBytes;      /*!< memory cap of the block cache, or 0 for the default */
+  bool mmap;              /*!< map the volume image into memory rather than using file I/O */
+  bool ioUring;           /*!< batch the block cache's I/O through io_uring where it's available */
+  int squeezeSectors;     /*!< sectors of file data to compact after each close, or 0 to only compact when space runs out */
+  bool verbose;           /*!< log file opens and closes to stderr */
+  WriteBackPolicy writeBack;  /*!< what to write when a file is closed */
+  int maxDirtySeconds;    /*!< how long data may stay unwritten, or 0 for the default */
+  bool backgroundFlush;   /*!< write dirty blocks from a background thread */
+  size_t dirtyHighWaterBytes; /*!< dirty bytes at which the background thread starts writing, or 0 for a quarter of the cache */
+  size_t dirtyLimitBytes; /*!< dirty bytes at which writers wait for the background thread, or 0 for half the cache */
+  const char *overlay;    /*!< a delta file to keep changes in, leaving the image read only, or null */
+  bool commitOverlay;     /*!< open the image under the overlay writable, so `commitOverlay' may be called */
+  CacheBudget *cacheBudget;   /*!< a memory cap the block cache shares with other volumes, or null */
+};
 
+/**
+ * The FUSE operations on a mounted volume.
+ *
+ * Besides the files on the volume, the root directory holds a read only 
+ * virtual file, STATS_PATH, which reports the Statistics of the mount.
+ */
 class FileSystem
 {
 public:
-  FileSystem(const std::string &name);
+  static const int DEFAULT_MAX_DIRTY_SECONDS = 5;
+  static constexpr char STATS_PATH[] = "/.rt11fs-stats";
+  static const int ATTR_TIMEOUT_SECONDS = 10;
+
+  FileSystem(const std::string &name, const FileSystemOptions &options = FileSystemOptions {});
   ~FileSystem();
 
   auto getDirectory() { return directory.get(); }
+  auto isReadOnly() const { return readOnly; }
+  auto init() -> void;
 
   auto getattr(const char *path, struct stat *stbuf) -> int;
   auto fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) -> int;
@@ -42,22 +86,69 @@ public:
   auto release(const char *path, struct fuse_file_info *fi) -> int;
   auto read(const char *path, char *buf, size_t count, off_t offset, struct fuse_file_info *fi) -> int;
   auto write(const char *path, const char *buf, size_t count, off_t offset, struct fuse_file_info *fi) -> int;
+  auto readBuf(const char *path, struct fuse_bufvec **bufp, size_t count, off_t offset, struct fuse_file_info *fi) -> int;
+  auto writeBuf(const char *path, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi) -> int;
 
   auto ftruncate(const char *path, off_t size, struct fuse_file_info *fi) -> int;
   auto fsync(const char *path, int isdatasync, struct fuse_file_info *fi) -> int;
 
   // utilities which aren't properly part of the file system
   auto lsdir() -> void;
+  auto squeeze() -> int;
+  auto commitOverlay() -> int;
+  auto put(const std::vector<BatchTransfer::File> &files) -> int;
+  auto get(const std::vector<BatchTransfer::File> &files) -> int;
+  auto discardOverlay() -> int;
 
 private:
   int fd;
   std::unique_ptr<DataSource> dataSource;
+  OverlayDataSource *overlay;                       /*!< `dataSource' if the image is overlaid, else null */
+  bool directImage;                                 /*!< the image file holds the volume as is, so FUSE may transfer to and from it */
+  bool readOnly;                                    /*!< the volume can't be changed */
   std::unique_ptr<BlockCache> cache;
   std::unique_ptr<Directory> directory;
   std::unique_ptr<OpenFileTable> oft;
+  AttrCache attrCache;                              /*!< results of getattr lookups, including failed ones */
+  int squeezeSectors;
+  WriteBackPolicy writeBack;
+  std::chrono::seconds maxDirtyAge;
+  bool unflushed;                                   /*!< the volume may have been changed since it was last synced */
+  std::chrono::steady_clock::time_point unflushedSince;
+  bool backgroundFlush;
+  BlockCache::FlushLimits flushLimits;
+
+  std::thread ageTimer;                             /*!< writes changes which reach the age limit while the volume is idle */
+  std::mutex ageLock;                               /*!< protects the timer's state below */
+  std::condition_variable ageWake;
+  bool ageArmed;                                    /*!< the timer is waiting for `ageDeadline' */
+  std::chrono::steady_clock::time_point ageDeadline;
+  bool ageStopping;                                 /*!< the timer has been asked to exit */
+
+  // open stats files have handles from here up, above any open file table slot
+  static const uint64_t STATS_HANDLE_BASE = uint64_t {1} << 32;
+
+  std::map<uint64_t, std::string> statsFiles;   /*!< the report captured by each open stats file */
+  uint64_t nextStatsHandle;
+  std::mutex statsLock;                         /*!< protects the stats files */
+
+  std::shared_timed_mutex fsLock;
 
-  static auto wrapper(std::function<int(void)> fn) -> int;
+  static auto wrapper(Statistics::Operation op, std::function<int(void)> fn) -> int;
+  static auto run(std::function<int(void)> fn) -> int;
+  static auto fillStat(const DirEnt &ent, struct stat *st) -> void;
+  static auto isStatsHandle(uint64_t handle) { return handle >= STATS_HANDLE_BASE; }
+  auto readLocked(Statistics::Operation op, std::function<int(void)> fn) -> int;
+  auto writeLocked(Statistics::Operation op, std::function<int(void)> fn) -> int;
+  auto flushIfDue() -> int;
+  auto flushAged(std::chrono::steady_clock::time_point now) -> int;
+  auto armAgeTimer(std::chrono::steady_clock::time_point deadline) -> void;
+  auto ageTimerLoop() -> void;
+  auto statsReport() -> std::string;
+  auto openStats(struct fuse_file_info *fi) -> int;
+  auto readStats(uint64_t handle, char *buffer, size_t count, off_t offset) -> int;
   auto validatePath(std::string &path) -> int;
+  auto lookupAttr(const std::string &path, AttrCache::Attr &attr) -> void;
 }; 
 
 };
@@ -0,0 +1,390 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#include "ImageScanner.h"
+
+#include "Block.h"
+#include "BlockCache.h"
+#include "CompressedDataSource.h"
+#include "DirConst.h"
+#include "Directory.h"
+#include "FileDataSource.h"
+#include "FilesystemException.h"
+#include "WorkStealingPool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <zlib.h>
+
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::set;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace RT11FS {
+using namespace Dir;
+
+const size_t ImageScanner::DEFAULT_CACHE_BYTES;
+const size_t ImageScanner::HASH_READ_BYTES;
+
+namespace {
+// one more than the largest valid Rad50 word
+const auto RAD50_WORD_LIMIT = 050 * 050 * 050;
+
+/**
+ * printf into a string.
+ */
+template <typename... Args>
+auto format(const char *fmt, Args... args) -> string
+{
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer), fmt, args...);
+  return buffer;
+}
+
+/**
+ * Append a string to JSON output as a quoted, escaped JSON string.
+ */
+auto appendJsonString(string &out, const string &s) -> void
+{
+  out += '"';
+  for (auto ch : s) {
+    switch (ch) {
+      case '"':   out += "\\\""; break;
+      case '\\':  out += "\\\\"; break;
+      case '\n':  out += "\\n"; break;
+      case '\t':  out += "\\t"; break;
+      default:
+        if (static_cast<unsigned char>(ch) < 0x20) {
+          out += format("\\u%04x", ch);
+        } else {
+          out += ch;
+        }
+    }
+  }
+  out += '"';
+}
+}
+
+/**
+ * @param options how to scan images.
+ */
+ImageScanner::ImageScanner(const ScanOptions &options)
+  : options(options)
+{
+  if (this->options.threads <= 0) {
+    this->options.threads = max(1u, std::thread::hardware_concurrency());
+  }
+
+  if (this->options.cacheBytes == 0) {
+    this->options.cacheBytes = DEFAULT_CACHE_BYTES;
+  }
+}
+
+/**
+ * Scan many images at once.
+ *
+ * @param images the paths of the images.
+ * @param emit called with the result of each image as a line of JSON,
+ * without the newline. Calls are never made concurrently.
+ * @return the number of images which had errors or problems.
+ */
+auto ImageScanner::scan(const vector<string> &images, const Emit &emit) -> int
+{
+  mutex emitLock;
+  auto failed = 0;
+
+  auto pool = WorkStealingPool {options.threads};
+  pool.run(images.size(), [this, &images, &emit, &emitLock, &failed](size_t task, int) {
+    auto result = scanImage(images[task]);
+    auto line = toJson(result, options.hash);
+
+    lock_guard<mutex> lock {emitLock};
+    if (!result.isOk()) {
+      failed++;
+    }
+    emit(line);
+  });
+
+  return failed;
+}
+
+/**
+ * Scan one image file. Images in the compressed container format are
+ * recognized by their contents.
+ *
+ * @param image the path of the image.
+ * @return what was found.
+ */
+auto ImageScanner::scanImage(const string &image) -> Result
+{
+  auto result = Result {};
+  result.image = image;
+
+  auto fd = ::open(image.c_str(), O_RDONLY);
+  if (fd == -1) {
+    result.error = strerror(errno);
+    return result;
+  }
+
+  try {
+    auto dataSource = unique_ptr<DataSource> {};
+    if (CompressedDataSource::isContainer(fd)) {
+      auto chunks = max<int>(1, options.cacheBytes / CompressedDataSource::DEFAULT_CHUNK_BYTES);
+      dataSource.reset(new CompressedDataSource {fd, chunks});
+    } else {
+      dataSource.reset(new FileDataSource {fd});
+    }
+
+    scanDataSource(dataSource.get(), result);
+  } catch (const std::exception &ex) {
+    // most likely a FilesystemException from loading the directory; a
+    // directory damaged badly enough can also send a read out of range
+    result.error = ex.what();
+  }
+
+  return result;
+}
+
+/**
+ * Scan an image held in a data source, which is only read.
+ *
+ * Will throw if the directory can't be loaded or on I/O errors.
+ *
+ * @param dataSource the image.
+ * @param result filled in with what was found.
+ */
+auto ImageScanner::scanDataSource(DataSource *dataSource, Result &result) -> void
+{
+  BlockCache cache {dataSource, options.cacheBytes};
+  result.volumeSectors = cache.getVolumeSectors();
+
+  Directory directory {&cache};
+  checkEntries(directory, result);
+
+  if (options.hash) {
+    hashFiles(cache, result);
+  }
+}
+
+/**
+ * Check every directory entry for damage, and list the files.
+ *
+ * @param directory the directory of the volume.
+ * @param result filled in with the files and any problems.
+ */
+auto ImageScanner::checkEntries(Directory &directory, Result &result) -> void
+{
+  struct statvfs vfs;
+  directory.statfs(&vfs);
+
+  auto firstDataSector = static_cast<int>(result.volumeSectors - vfs.f_blocks);
+  result.segments = (firstDataSector - FIRST_SEGMENT_SECTOR) / SECTORS_PER_SEGMENT;
+  result.freeSectors = vfs.f_bfree;
+
+  const auto &table = directory.getEntries();
+  auto extents = vector<std::tuple<int, int, int>> {};     // start, length, row
+  auto names = set<Rad50Name> {};
+  auto segment = 0;
+  auto expectedStart = firstDataSector;
+
+  auto describe = [&table](int row) {
+    return format("entry %d:%d", table.getSegment(row), table.getIndex(row));
+  };
+
+  for (auto row = 0; row < table.size(); row++) {
+    auto status = table.getStatus(row);
+    auto sector0 = table.getSector0(row);
+    auto length = table.getLength(row);
+
+    // each segment's data carries on from where the last one's ended
+    if (table.getSegment(row) != segment) {
+      segment = table.getSegment(row);
+      if (sector0 != expectedStart) {
+        result.problems.push_back(format("segment %d starts at sector %d, not %d", segment, sector0, expectedStart));
+      }
+    }
+
+    if ((status & E_EOS) != 0) {
+      expectedStart = sector0;
+      continue;
+    }
+    expectedStart = sector0 + length;
+
+    auto kind = status & (E_TENT | E_MPTY | E_PERM);
+    if (kind != E_TENT && kind != E_MPTY && kind != E_PERM) {
+      result.problems.push_back(format("%s has invalid status %06o", describe(row).c_str(), status));
+      continue;
+    }
+
+    if (length > 0) {
+      extents.emplace_back(sector0, length, row);
+    }
+
+    if (sector0 + length > result.volumeSectors) {
+      result.problems.push_back(format("%s runs past the end of the volume", describe(row).c_str()));
+    }
+
+    if (kind == E_MPTY) {
+      continue;
+    }
+
+    const auto &name = table.getName(row);
+    if (name[0] >= RAD50_WORD_LIMIT || name[1] >= RAD50_WORD_LIMIT || name[2] >= RAD50_WORD_LIMIT) {
+      result.problems.push_back(format("%s has an invalid name", describe(row).c_str()));
+      continue;
+    }
+
+    auto ent = DirEnt {};
+    directory.getEnt(table, row, ent);
+
+    if (kind == E_TENT) {
+      result.problems.push_back(format("%s was left open", ent.name.c_str()));
+      continue;
+    }
+
+    if (!names.insert(name).second) {
+      result.problems.push_back(format("%s appears more than once", ent.name.c_str()));
+    }
+
+    if (table.getDate(row) != 0 && ent.create_time == 0) {
+      result.problems.push_back(format("%s has an invalid date", ent.name.c_str()));
+    }
+
+    result.files.push_back(File {ent.name, sector0, length, ent.create_time, 0});
+  }
+
+  // an extent may reach past several which follow it, so compare each one
+  // with the furthest reaching extent before it rather than just its
+  // neighbor
+  std::sort(begin(extents), end(extents));
+  auto furthestEnd = 0;
+  auto furthestRow = -1;
+  for (const auto &extent : extents) {
+    auto start = std::get<0>(extent);
+    auto row = std::get<2>(extent);
+
+    if (furthestRow != -1 && furthestEnd > start) {
+      result.problems.push_back(format(
+        "%s overlaps %s",
+        describe(furthestRow).c_str(),
+        describe(row).c_str()));
+    }
+
+    if (furthestRow == -1 || start + std::get<1>(extent) > furthestEnd) {
+      furthestEnd = start + std::get<1>(extent);
+      furthestRow = row;
+    }
+  }
+}
+
+/**
+ * Compute the CRC-32 of each file's sectors, reading them in large pieces
+ * which bypass the cache.
+ *
+ * Files which run off the volume aren't hashed.
+ *
+ * @param cache the volume's block cache.
+ * @param result the files to hash.
+ */
+auto ImageScanner::hashFiles(BlockCache &cache, Result &result) -> void
+{
+  auto buffer = vector<char>(HASH_READ_BYTES);
+
+  for (auto &file : result.files) {
+    if (file.sector0 + file.sectors > result.volumeSectors) {
+      continue;
+    }
+
+    auto crc = crc32(0, Z_NULL, 0);
+    auto offset = static_cast<off_t>(file.sector0) * Block::SECTOR_SIZE;
+    auto remaining = static_cast<size_t>(file.sectors) * Block::SECTOR_SIZE;
+
+    while (remaining > 0) {
+      auto bytes = min(remaining, buffer.size());
+      cache.readDirect(offset, bytes, buffer.data());
+      crc = crc32(crc, reinterpret_cast<const Bytef *>(buffer.data()), bytes);
+      offset += bytes;
+      remaining -= bytes;
+    }
+
+    file.crc32 = static_cast<uint32_t>(crc);
+  }
+}
+
+/**
+ * Describe the result of a scan as one line of JSON, without the newline.
+ *
+ * @param result the result of the scan.
+ * @param hashed true if the files were hashed.
+ * @return the JSON.
+ */
+auto ImageScanner::toJson(const Result &result, bool hashed) -> string
+{
+  auto out = string {"{\"image\":"};
+  appendJsonString(out, result.image);
+  out += format(",\"ok\":%s", result.isOk() ? "true" : "false");
+
+  if (!result.error.empty()) {
+    out += ",\"error\":";
+    appendJsonString(out, result.error);
+    out += "}";
+    return out;
+  }
+
+  out += format(
+    ",\"volume_sectors\":%d,\"segments\":%d,\"free_sectors\":%d",
+    result.volumeSectors,
+    result.segments,
+    result.freeSectors);
+
+  out += ",\"problems\":[";
+  for (auto i = size_t {0}; i < result.problems.size(); i++) {
+    if (i) {
+      out += ',';
+    }
+    appendJsonString(out, result.problems[i]);
+  }
+
+  out += "],\"files\":[";
+  for (auto i = size_t {0}; i < result.files.size(); i++) {
+    const auto &file = result.files[i];
+    if (i) {
+      out += ',';
+    }
+
+    out += "{\"name\":";
+    appendJsonString(out, file.name);
+    out += format(",\"sector\":%d,\"sectors\":%d", file.sector0, file.sectors);
+
+    if (file.created != 0) {
+      struct tm tm;
+      gmtime_r(&file.created, &tm);
+      out += format(",\"created\":\"%04d-%02d-%02d\"", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    }
+
+    if (hashed) {
+      out += format(",\"crc32\":\"%08x\"", file.crc32);
+    }
+    out += '}';
+  }
+  out += "]}";
+
+  return out;
+}
+
+}
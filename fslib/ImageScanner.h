@@ -0,0 +1,92 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __IMAGESCANNER_H_
+#define __IMAGESCANNER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace RT11FS {
+class BlockCache;
+class DataSource;
+class Directory;
+
+/**
+ * How to scan images.
+ */
+struct ScanOptions {
+  int threads;            /*!< images to scan at once, or 0 for one per processor */
+  bool hash;              /*!< compute the CRC-32 of every file's data */
+  size_t cacheBytes;      /*!< memory cap of each image's block cache, or 0 for the default */
+};
+
+/**
+ * Checks and inventories volume images offline, many at a time.
+ *
+ * Each image is opened read only and its directory loaded, which makes all
+ * the checks the Directory constructor makes. The entries are then checked
+ * for problems which a mount would live with but which mean the volume is
+ * damaged: unknown entry types, segments which don't start where the last
+ * one ended, files which overlap or run off the volume, duplicate names and
+ * invalid names or dates.
+ *
+ * Images are scanned on a WorkStealingPool, one per thread at a time, each
+ * with its own small block cache. Results are reported one JSON object per
+ * line, in the order the scans finish.
+ */
+class ImageScanner
+{
+public:
+  static const size_t DEFAULT_CACHE_BYTES = 256 * 1024;
+  static const size_t HASH_READ_BYTES = 1024 * 1024;
+
+  /**
+   * A file found on a volume.
+   */
+  struct File {
+    std::string name;
+    int sector0;
+    int sectors;
+    time_t created;       /*!< the creation date, or 0 if there is none */
+    uint32_t crc32;       /*!< the CRC-32 of the file's sectors, if hashing */
+  };
+
+  /**
+   * What was found in one image.
+   */
+  struct Result {
+    std::string image;
+    std::string error;    /*!< why the image couldn't be scanned, or empty */
+    std::vector<std::string> problems;
+    int volumeSectors;
+    int segments;
+    int freeSectors;
+    std::vector<File> files;
+
+    auto isOk() const { return error.empty() && problems.empty(); }
+  };
+
+  using Emit = std::function<void(const std::string &line)>;
+
+  ImageScanner(const ScanOptions &options = ScanOptions {});
+
+  auto scan(const std::vector<std::string> &images, const Emit &emit) -> int;
+  auto scanImage(const std::string &image) -> Result;
+  auto scanDataSource(DataSource *dataSource, Result &result) -> void;
+
+  static auto toJson(const Result &result, bool hashed) -> std::string;
+
+private:
+  ScanOptions options;
+
+  auto checkEntries(Directory &directory, Result &result) -> void;
+  auto hashFiles(BlockCache &cache, Result &result) -> void;
+};
+}
+
+#endif
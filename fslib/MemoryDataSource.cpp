@@ -47,5 +47,57 @@ auto MemoryDataSource::write(void *buffer, size_t bytes, off_t offset) -> ssize_
   ::memcpy(&memory[offset], buffer, bytes);
   return bytes;
 }
+
+auto MemoryDataSource::readv(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t
+{
+  auto total = size_t {0};
+  for (auto i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+
+  if (offset < 0 || offset + total > memory.size()) {
+    return -EIO;
+  }
+
+  for (auto i = 0; i < iovcnt; i++) {
+    ::memcpy(iov[i].iov_base, &memory[offset], iov[i].iov_len);
+    offset += iov[i].iov_len;
+  }
+
+  return total;
+}
+
+auto MemoryDataSource::writev(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t
+{
+  auto total = size_t {0};
+  for (auto i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+
+  if (offset < 0 || offset + total > memory.size()) {
+    return -EIO;
+  }
+
+  for (auto i = 0; i < iovcnt; i++) {
+    ::memcpy(&memory[offset], iov[i].iov_base, iov[i].iov_len);
+    offset += iov[i].iov_len;
+  }
+
+  return total;
+}
   
-}
\ No newline at end of file
+auto MemoryDataSource::copy(off_t from, off_t to, size_t bytes) -> int
+{
+  if (
+    from < 0 || to < 0 ||               // NOTE off_t is signed
+    from + bytes > memory.size() ||
+    to + bytes > memory.size()
+  ) {
+    return -EIO;
+  }
+
+  ::memmove(&memory[to], &memory[from], bytes);
+  return 0;
+}
+
+}
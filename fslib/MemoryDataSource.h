@@ -20,6 +20,9 @@ public:
   auto stat(struct stat *st) -> int override;
   auto read(void *buffer, size_t bytes, off_t offset) -> ssize_t override;  
   auto write(void *buffer, size_t bytes, off_t offset) -> ssize_t override;  
+  auto readv(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t override;
+  auto writev(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t override;
+  auto copy(off_t from, off_t to, size_t bytes) -> int override;
 
 private:
   std::vector<uint8_t> memory;
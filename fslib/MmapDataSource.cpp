@@ -0,0 +1,214 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "MmapDataSource.h"
+#include "FilesystemException.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace RT11FS {
+
+/**
+ * Construct a data source by mapping an open file.
+ *
+ * The data source takes ownership of `fd'. Throws a FilesystemException
+ * if the file cannot be mapped. The size of the volume is fixed at the size
+ * of the file when it is mapped.
+ *
+ * @param fd a descriptor open for reading and writing on the volume image.
+ * @param zeroCopy true if `map' should expose the mapping to callers.
+ */
+MmapDataSource::MmapDataSource(int fd, bool zeroCopy)
+  : fd(fd)
+  , zeroCopy(zeroCopy)
+  , base(nullptr)
+  , length(0)
+{
+  struct stat st;
+  if (::fstat(fd, &st) == -1) {
+    auto err = errno;
+    ::close(fd);
+    throw FilesystemException {-err, "could not stat volume image"};
+  }
+
+  length = st.st_size;
+  if (length == 0) {
+    return;
+  }
+
+  auto addr = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    auto err = errno;
+    ::close(fd);
+    throw FilesystemException {-err, "could not map volume image"};
+  }
+
+  base = static_cast<uint8_t *>(addr);
+}
+
+MmapDataSource::~MmapDataSource()
+{
+  if (base != nullptr) {
+    ::msync(base, length, MS_SYNC);
+    ::munmap(base, length);
+  }
+  ::close(fd);
+}
+
+auto MmapDataSource::stat(struct stat *st) -> int
+{
+  if (::fstat(fd, st) == -1) {
+    return -errno;
+  }
+
+  return 0;
+}
+
+auto MmapDataSource::read(void *buffer, size_t bytes, off_t offset) -> ssize_t
+{
+  if (!inBounds(offset, bytes)) {
+    return -EIO;
+  }
+
+  ::memcpy(buffer, base + offset, bytes);
+  return bytes;
+}
+
+/**
+ * Write data into the mapping and schedule it to be written to the image.
+ *
+ * If `buffer' is the mapping itself (i.e. it came from `map'), the data is
+ * already in place and only the flush is done.
+ */
+auto MmapDataSource::write(void *buffer, size_t bytes, off_t offset) -> ssize_t
+{
+  if (!inBounds(offset, bytes)) {
+    return -EIO;
+  }
+
+  if (buffer != base + offset) {
+    ::memcpy(base + offset, buffer, bytes);
+  }
+
+  auto err = flush(offset, bytes);
+  if (err < 0) {
+    return err;
+  }
+
+  return bytes;
+}
+
+auto MmapDataSource::readv(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t
+{
+  auto total = size_t {0};
+  for (auto i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+
+  if (!inBounds(offset, total)) {
+    return -EIO;
+  }
+
+  auto at = base + offset;
+  for (auto i = 0; i < iovcnt; i++) {
+    ::memcpy(iov[i].iov_base, at, iov[i].iov_len);
+    at += iov[i].iov_len;
+  }
+
+  return total;
+}
+
+auto MmapDataSource::writev(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t
+{
+  auto total = size_t {0};
+  for (auto i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+
+  if (!inBounds(offset, total)) {
+    return -EIO;
+  }
+
+  auto at = base + offset;
+  for (auto i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_base != at) {
+      ::memcpy(at, iov[i].iov_base, iov[i].iov_len);
+    }
+    at += iov[i].iov_len;
+  }
+
+  auto err = flush(offset, total);
+  if (err < 0) {
+    return err;
+  }
+
+  return total;
+}
+
+/**
+ * Return a pointer into the mapping.
+ *
+ * Only available in zero-copy mode.
+ *
+ * @param offset the offset into the data source of the range.
+ * @param bytes the length of the range.
+ * @return a pointer to the range, or nullptr if zero-copy is disabled or
+ * the range is not inside the volume.
+ */
+auto MmapDataSource::map(off_t offset, size_t bytes) -> uint8_t *
+{
+  if (!zeroCopy || !inBounds(offset, bytes)) {
+    return nullptr;
+  }
+
+  return base + offset;
+}
+
+auto MmapDataSource::copy(off_t from, off_t to, size_t bytes) -> int
+{
+  if (!inBounds(from, bytes) || !inBounds(to, bytes)) {
+    return -EIO;
+  }
+
+  ::memmove(base + to, base + from, bytes);
+  return flush(to, bytes);
+}
+
+auto MmapDataSource::inBounds(off_t offset, size_t bytes) const -> bool
+{
+  return 
+    offset >= 0 &&                      // NOTE off_t is signed
+    offset + bytes <= length;
+}
+
+/**
+ * Schedule a written range of the mapping to be written to the image.
+ *
+ * This corresponds to what pwrite(2) guarantees: the data is handed to
+ * the kernel, which writes it out in its own time. msync(2) requires a 
+ * page aligned start address, so the range is widened to page boundaries.
+ *
+ * @param offset the offset of the range.
+ * @param bytes the length of the range.
+ * @return 0 on success or a negated errno
+ */
+auto MmapDataSource::flush(off_t offset, size_t bytes) -> int
+{
+  if (bytes == 0) {
+    return 0;
+  }
+
+  static const auto pageSize = static_cast<off_t>(::sysconf(_SC_PAGESIZE));
+  auto start = offset - offset % pageSize;
+
+  if (::msync(base + start, offset + bytes - start, MS_ASYNC) == -1) {
+    return -errno;
+  }
+
+  return 0;
+}
+
+}
@@ -0,0 +1,43 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __MMAPDATASOURCE_H_
+#define __MMAPDATASOURCE_H_
+
+#include "DataSource.h"
+
+namespace RT11FS {
+/**
+ * A data source which maps the entire volume image into memory.
+ *
+ * Reads and writes are memory copies to and from the mapping, and the kernel
+ * pages the image in and out. In zero-copy mode the data source also hands
+ * out pointers into the mapping (see DataSource::map), so cached blocks need
+ * no storage of their own; writing such a block back costs only an msync of 
+ * its pages.
+ */
+class MmapDataSource : public DataSource {
+public:
+  MmapDataSource(int fd, bool zeroCopy = true);
+  ~MmapDataSource();
+
+  auto stat(struct stat *st) -> int override;
+  auto read(void *buffer, size_t bytes, off_t offset) -> ssize_t override;  
+  auto write(void *buffer, size_t bytes, off_t offset) -> ssize_t override;  
+  auto readv(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t override;
+  auto writev(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t override;
+  auto map(off_t offset, size_t bytes) -> uint8_t * override;
+  auto copy(off_t from, off_t to, size_t bytes) -> int override;
+
+private:
+  int fd;
+  bool zeroCopy;
+  uint8_t *base;
+  size_t length;
+
+  auto inBounds(off_t offset, size_t bytes) const -> bool;
+  auto flush(off_t offset, size_t bytes) -> int;
+};
+}
+
+#endif
@@ -13,8 +13,11 @@
 
 using std::cerr;
 using std::endl;
-using std::find_if;
+using std::lock_guard;
+using std::max;
 using std::min;
+using std::mutex;
+using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 
@@ -25,10 +28,14 @@ namespace RT11FS {
  *
  * @param directory the directory containing the files.
  * @param cache the cache backing the volume containing the file system.
+ * @param policy what to write to disk when a file is closed.
+ * @param verbose if set, log opens and closes to stderr.
  */
-OpenFileTable::OpenFileTable(Directory *dir, BlockCache *cache)
+OpenFileTable::OpenFileTable(Directory *dir, BlockCache *cache, WriteBackPolicy policy, bool verbose)
   : directory(dir)
   , cache(cache)
+  , policy(policy)
+  , verbose(verbose)
 {
 }
 
@@ -48,7 +55,9 @@ auto OpenFileTable::openFile(const std::string &name) -> int
 
   auto err = directory->getDirPointer(name, dirpp);
   if (err < 0) {
-    cerr << "failed to open " << name << endl;
+    if (verbose) {
+      cerr << "failed to open " << name << endl;
+    }
     return err;
   }
 
@@ -89,33 +98,39 @@ auto OpenFileTable::createFile(const std::string &name) -> int
 
 auto OpenFileTable::open(const DirPtr &dirp) -> int
 {
-  auto iter = find_if(begin(openFiles), end(openFiles), [&dirp](auto &p) {
-    return dirp.getSegment() == p.dirp.getSegment() && dirp.getIndex() == p.dirp.getIndex();
-  });
+  lock_guard<mutex> lock {tableLock};
+
+  auto pos = positionOf(dirp);
 
-  if (iter != end(openFiles)) {
-    iter->refcnt++;
-    return iter - begin(openFiles);
+  auto iter = slotByPosition.find(pos);
+  if (iter != end(slotByPosition)) {
+    openFiles[iter->second].refcnt++;
+    return iter->second;
   }
 
   auto entry = OpenFileEntry {
+    .refcnt = 1,
     .dirp = dirp,
-    .refcnt = 1
+    .length = dirp.getWord(Dir::TOTAL_LENGTH_WORD),
+    .nextRead = 0,
+    .readAhead = 0,
+    .prefetchedTo = 0,
   };
 
-  iter = find_if(begin(openFiles), end(openFiles), [](auto &p) {
-    return p.refcnt == 0;
-  });
-
-  auto index = openFiles.size();
-  if (iter != end(openFiles)) {
-    index = iter - begin(openFiles);
+  auto index = static_cast<int>(openFiles.size());
+  if (!freeSlots.empty()) {
+    index = freeSlots.back();
+    freeSlots.pop_back();
     openFiles[index] = entry;
   } else {
     openFiles.push_back(entry);  
   }
 
-  cerr << "open " << index << endl;
+  slotByPosition[pos] = index;
+
+  if (verbose) {
+    cerr << "open " << index << endl;
+  }
 
   return index;
 }
@@ -124,14 +139,18 @@ auto OpenFileTable::open(const DirPtr &dirp) -> int
  * Release a file reference.
  *
  * If the last reference to a file is released, then the entry will be marked
- * available.
+ * available, and data will be written according to the write back policy.
+ * The file is closed even if the space reserved for appends can't be given
+ * back; it then keeps that space, and the error is returned.
  *
  * @param fd the file descriptor to release.
  * @return 0 on success or a negative errno
  */
 auto OpenFileTable::closeFile(int fd) -> int
 {
-  cerr << "close " << fd << endl;
+  if (verbose) {
+    cerr << "close " << fd << endl;
+  }
 
   auto &slot = openFiles.at(fd);
 
@@ -141,11 +160,37 @@ auto OpenFileTable::closeFile(int fd) -> int
 
   slot.refcnt--;
 
+  auto err = 0;
   if (slot.refcnt == 0) {
+    // give back whatever was reserved for appends. there may be no room in
+    // the directory to do so, but the slot must still be released
+    if (slot.length < slot.dirp.getWord(Dir::TOTAL_LENGTH_WORD)) {
+      auto moves = vector<DirChangeTracker::Entry> {};
+      err = directory->truncate(slot.dirp, slot.length * Block::SECTOR_SIZE, moves);
+      if (err == 0) {
+        applyMoves(moves);
+      }
+    }
+
     directory->makeEntryPermanent(slot.dirp);
-    cache->sync();
+
+    switch (policy) {
+    case WriteBackPolicy::Immediate:
+      cache->sync();
+      break;
+
+    case WriteBackPolicy::PerFile:
+      cache->syncRange(slot.dirp.getDataSector(), slot.length);
+      break;
+
+    case WriteBackPolicy::Deferred:
+      break;
+    }
+
+    slotByPosition.erase(positionOf(slot.dirp));
+    freeSlots.push_back(fd);
   }
-  return 0;
+  return err;
 }
 
 /**
@@ -159,23 +204,83 @@ auto OpenFileTable::closeFile(int fd) -> int
  */
 auto OpenFileTable::readFile(int fd, char *buffer, size_t count, off_t offset) -> int
 {
+  auto lock = unique_lock<mutex> {tableLock};
   if (openFiles.at(fd).refcnt <= 0) {
     return -EINVAL;
   }
 
-  const auto &dirp = openFiles.at(fd).dirp;
+  // a concurrent open may grow the table, so work from a copy of the entry
+  auto &slot = openFiles.at(fd);
+  const auto dirp = slot.dirp;
+  auto fileLength = slot.length;
 
-  auto fileLength = dirp.getWord(Dir::TOTAL_LENGTH_WORD);
   auto sector0 = dirp.getDataSector();
-  auto end = offset + count;
+  auto end = min(static_cast<off_t>(offset + count), static_cast<off_t>(fileLength) * Block::SECTOR_SIZE);
+
+  if (offset >= end) {
+    return 0;
+  }
+
+  // a read which picks up where the last one left off grows the read ahead 
+  // window; anything else turns read ahead off until reads are sequential again
+  if (offset == slot.nextRead) {
+    slot.readAhead = slot.readAhead ? min(slot.readAhead * 2, MAX_READ_AHEAD_SECTORS) : MIN_READ_AHEAD_SECTORS;
+  } else {
+    slot.readAhead = 0;
+    slot.prefetchedTo = 0;
+  }
+  slot.nextRead = end;
+
+  // only go back to the cache once the reader is halfway through what was
+  // already prefetched
+  auto prefetchFrom = static_cast<int>((end + Block::SECTOR_SIZE - 1) / Block::SECTOR_SIZE);
+  auto prefetchTo = min(prefetchFrom + slot.readAhead, fileLength);
+  if (prefetchFrom + slot.readAhead / 2 < slot.prefetchedTo) {
+    prefetchTo = prefetchFrom;
+  }
+  prefetchFrom = max(prefetchFrom, slot.prefetchedTo);
+  if (prefetchTo > prefetchFrom) {
+    slot.prefetchedTo = prefetchTo;
+  }
+
+  lock.unlock();
+
+  // the reader wants the data it asked for first, so fetch the following 
+  // sectors afterwards
+  auto got = readSectors(sector0, buffer, offset, end);
+
+  if (prefetchTo > prefetchFrom) {
+    cache->prefetch(sector0 + prefetchFrom, prefetchTo - prefetchFrom);
+  }
+
+  return got;
+}
+
+/**
+ * Read a range of a file's data.
+ *
+ * @param sector0 the first sector of the file.
+ * @param buffer the buffer to read into.
+ * @param offset the offset in the file to start reading at.
+ * @param end the offset in the file to stop reading at, which must be within
+ * the file.
+ * @return the number of bytes read
+ */
+auto OpenFileTable::readSectors(int sector0, char *buffer, off_t offset, off_t end) -> int
+{
   auto got = int {0};
 
+  // RT-11 files are contiguous, so anything spanning more than one sector can
+  // be read with one request for the whole range rather than sector by sector 
+  // through the cache.
+  if (offset / Block::SECTOR_SIZE != (end - 1) / Block::SECTOR_SIZE) {
+    auto bytes = static_cast<size_t>(end - offset);
+    cache->readDirect(static_cast<off_t>(sector0) * Block::SECTOR_SIZE + offset, bytes, buffer);
+    return bytes;
+  }
+
   while (offset < end) {
     auto sector = offset / Block::SECTOR_SIZE;
-    if (sector >= fileLength) {
-      break;
-    }
-
     auto secoffs = offset % Block::SECTOR_SIZE;
     auto blk = cache->getBlock(sector0 + sector, 1);
 
@@ -210,33 +315,39 @@ auto OpenFileTable::writeFile(int fd, const char *buffer, size_t count, off_t of
     return -EINVAL;
   }
 
-  auto &dirp = openFiles.at(fd).dirp;
+  auto &slot = openFiles.at(fd);
+  auto &dirp = slot.dirp;
 
   auto end = offset + count;
   auto got = int {0};
-  auto length = dirp.getWord(Dir::TOTAL_LENGTH_WORD) * Block::SECTOR_SIZE;
-  auto extendFile = end > length;
+  auto extendFile = end > static_cast<off_t>(slot.length) * Block::SECTOR_SIZE;
+  auto endSectors = static_cast<int>((end + Block::SECTOR_SIZE - 1) / Block::SECTOR_SIZE);
 
-  if (extendFile) {
-    auto moves = vector<DirChangeTracker::Entry> {};
-    auto err = directory->truncate(dirp, end, moves);
-    if (err < 0) {
-      return err;
-    }
+  auto err = reserve(slot, end);
+  if (err < 0) {
+    return err;
+  }
 
-    applyMoves(moves);
-    dirp = openFiles.at(fd).dirp;
+  auto oldLength = slot.length;
+  if (extendFile) {
+    slot.length = endSectors;
   }
 
   while (offset < end) {
     auto sector = offset / Block::SECTOR_SIZE;
     auto secoffs = offset % Block::SECTOR_SIZE;
-    auto blk = cache->getBlock(dirp.getDataSector() + sector, 1);
 
     size_t leftInRead = end - offset;
     size_t leftInBlock = Block::SECTOR_SIZE - secoffs;
     auto tocopy = min(leftInBlock, leftInRead);
 
+    // only read the sector if some of its old data will survive the write. a
+    // sector past the old end of the file has its tail zero filled below.
+    auto overwrite = secoffs == 0 && (tocopy == Block::SECTOR_SIZE || sector >= oldLength);
+    auto blk = overwrite
+      ? cache->getBlockForOverwrite(dirp.getDataSector() + sector, 1)
+      : cache->getBlock(dirp.getDataSector() + sector, 1);
+
     blk->copyIn(secoffs, tocopy, buffer);
 
     if (extendFile && secoffs + tocopy < Block::SECTOR_SIZE) {
@@ -255,23 +366,181 @@ auto OpenFileTable::writeFile(int fd, const char *buffer, size_t count, off_t of
   return got;
 }
 
+/**
+ * Make sure a file has space allocated up to an offset, growing its 
+ * directory entry if needed.
+ *
+ * @param slot the open file.
+ * @param end the end of the range which must be allocated.
+ * @return 0 on success or a negated errno
+ */
+auto OpenFileTable::reserve(OpenFileEntry &slot, off_t end) -> int
+{
+  auto &dirp = slot.dirp;
+  auto endSectors = static_cast<int>((end + Block::SECTOR_SIZE - 1) / Block::SECTOR_SIZE);
+  auto allocated = dirp.getWord(Dir::TOTAL_LENGTH_WORD);
+
+  if (endSectors > allocated) {
+    auto moves = vector<DirChangeTracker::Entry> {};
+    auto err = -ENOSPC;
+
+    // a file being created is probably being written sequentially, so reserve 
+    // room for more writes. if there isn't room for that, fall back to growing
+    // just enough for this write.
+    if (dirp.hasStatus(Dir::E_TENT)) {
+      auto reserved = max(endSectors, allocated * GROWTH_FACTOR);
+      err = directory->truncate(dirp, static_cast<off_t>(reserved) * Block::SECTOR_SIZE, moves);
+    }
+
+    if (err == -ENOSPC) {
+      err = directory->truncate(dirp, end, moves);
+    }
+
+    // there may be enough free space, just not in one piece
+    if (err == -ENOSPC) {
+      err = squeeze(0);
+      if (err >= 0) {
+        err = directory->truncate(dirp, end, moves);
+      }
+    }
+
+    if (err < 0) {
+      return err;
+    }
+
+    applyMoves(moves);
+  }
+
+  return 0;
+}
+
+/**
+ * Find where part of an open file lies on the volume, so that the caller can
+ * read it without going through the cache.
+ *
+ * @param fd the file to read.
+ * @param count the number of bytes to read.
+ * @param offset the offset in the file to read from.
+ * @param volumeOffset receives the offset on the volume of the file's data 
+ * at `offset'.
+ * @return the number of bytes which can be read, which stops at the end of
+ * the file, or a negated errno
+ */
+auto OpenFileTable::mapRead(int fd, size_t count, off_t offset, off_t &volumeOffset) -> int
+{
+  lock_guard<mutex> lock {tableLock};
+  if (openFiles.at(fd).refcnt <= 0) {
+    return -EINVAL;
+  }
+
+  const auto &slot = openFiles.at(fd);
+  auto end = min(static_cast<off_t>(offset + count), static_cast<off_t>(slot.length) * Block::SECTOR_SIZE);
+
+  volumeOffset = static_cast<off_t>(slot.dirp.getDataSector()) * Block::SECTOR_SIZE + offset;
+  return offset < end ? static_cast<int>(end - offset) : 0;
+}
+
+/**
+ * Prepare for a write to an open file which the caller will transfer to the
+ * volume itself, making room for it as `writeFile' would. The file's length
+ * isn't changed until the caller reports what it wrote with `commitWrite'.
+ *
+ * The caller must write whole sectors, and must make sure the cache holds
+ * none of them.
+ *
+ * @param fd the file to write.
+ * @param count the number of bytes to write, a multiple of the sector size.
+ * @param offset the offset in the file to write to, on a sector boundary.
+ * @param volumeOffset receives the offset on the volume of the file's data 
+ * at `offset'.
+ * @return 0 on success or a negated errno
+ */
+auto OpenFileTable::mapWrite(int fd, size_t count, off_t offset, off_t &volumeOffset) -> int
+{
+  if (openFiles.at(fd).refcnt <= 0) {
+    return -EINVAL;
+  }
+
+  if (offset % Block::SECTOR_SIZE != 0 || count % Block::SECTOR_SIZE != 0) {
+    return -EINVAL;
+  }
+
+  auto &slot = openFiles.at(fd);
+  auto end = static_cast<off_t>(offset + count);
+
+  auto err = reserve(slot, end);
+  if (err < 0) {
+    return err;
+  }
+
+  volumeOffset = static_cast<off_t>(slot.dirp.getDataSector()) * Block::SECTOR_SIZE + offset;
+  return 0;
+}
+
+/**
+ * Grow an open file to take in data the caller wrote to the volume after
+ * `mapWrite'.
+ *
+ * @param fd the file written.
+ * @param end the offset in the file just past the last byte actually written,
+ * which must be within what `mapWrite' made room for.
+ * @return 0 on success or a negated errno
+ */
+auto OpenFileTable::commitWrite(int fd, off_t end) -> int
+{
+  if (openFiles.at(fd).refcnt <= 0) {
+    return -EINVAL;
+  }
+
+  auto &slot = openFiles.at(fd);
+  auto sectors = static_cast<int>((end + Block::SECTOR_SIZE - 1) / Block::SECTOR_SIZE);
+  if (sectors > slot.dirp.getWord(Dir::TOTAL_LENGTH_WORD)) {
+    return -EINVAL;
+  }
+
+  slot.length = max(slot.length, sectors);
+  return 0;
+}
+
 auto OpenFileTable::truncate(int fd, off_t newSize) -> int
 {
   if (openFiles.at(fd).refcnt <= 0) {
     return -EINVAL;
   }
-  auto &dirp = openFiles.at(fd).dirp;
+  auto &slot = openFiles.at(fd);
 
   auto moves = vector<DirChangeTracker::Entry> {};
-  auto err = directory->truncate(dirp, newSize, moves);
+  auto err = directory->truncate(slot.dirp, newSize, moves);
   if (err < 0) {
     return err;
   }
 
   applyMoves(moves);
+  slot.length = slot.dirp.getWord(Dir::TOTAL_LENGTH_WORD);
   return err;
 }
 
+/**
+ * Write a file's data and the directory to disk.
+ *
+ * Dirty blocks belonging to other files are left in the cache.
+ *
+ * @param fd the file to sync.
+ * @return 0 on success or a negative errno
+ */
+auto OpenFileTable::syncFile(int fd) -> int
+{
+  if (openFiles.at(fd).refcnt <= 0) {
+    return -EINVAL;
+  }
+  const auto &slot = openFiles.at(fd);
+
+  cache->syncRange(slot.dirp.getDataSector(), slot.length);
+  directory->sync();
+
+  return 0;
+}
+
 auto OpenFileTable::unlink(const std::string &name) -> int
 {
   auto moves = vector<DirChangeTracker::Entry> {};
@@ -284,18 +553,75 @@ auto OpenFileTable::unlink(const std::string &name) -> int
   return err;
 }
 
+/**
+ * Get the length of an open file.
+ *
+ * While a file is open for writing, its directory entry may include space
+ * reserved for appends, so its true length is only known here.
+ *
+ * @param dirp the directory entry of the file.
+ * @return the length of the file in sectors, or -1 if the file isn't open.
+ */
+auto OpenFileTable::getOpenLength(const DirPtr &dirp) -> int
+{
+  lock_guard<mutex> lock {tableLock};
+
+  auto iter = slotByPosition.find(positionOf(dirp));
+  return iter == end(slotByPosition) ? -1 : openFiles[iter->second].length;
+}
+
+/**
+ * Compact the volume, keeping open files valid.
+ *
+ * @param sectorBudget the number of sectors of file data to move, or 0 to
+ * compact the entire volume.
+ * @return 1 if there is more to do, 0 if the volume is fully compacted, or
+ * a negated errno
+ */
+auto OpenFileTable::squeeze(int sectorBudget) -> int
+{
+  auto moves = vector<DirChangeTracker::Entry> {};
+  auto err = directory->squeeze(sectorBudget, moves);
+  if (err < 0) {
+    return err;
+  }
+
+  applyMoves(moves);
+  directory->sync();
+
+  return err;
+}
+
 auto OpenFileTable::applyMoves(const std::vector<DirChangeTracker::Entry> &moves) -> void
 {
-  for (const auto &move : moves) {
-    auto iter = find_if(begin(openFiles), end(openFiles), [move](const auto &file) {
-      return move.oldSegment == file.dirp.getSegment() && move.oldIndex == file.dirp.getIndex();
-    });
+  // take every moved file out of the position map before putting any back, 
+  // since one file may move into the slot another one vacated
+  auto moved = vector<std::pair<int, const DirChangeTracker::Entry*>> {};
 
-    if (iter != end(openFiles)) {
-      iter->dirp.setSegment(move.newSegment);
-      iter->dirp.setIndex(move.newIndex);
+  for (const auto &move : moves) {
+    auto iter = slotByPosition.find(EntryPos {move.oldSegment, move.oldIndex});
+    if (iter != end(slotByPosition)) {
+      moved.emplace_back(iter->second, &move);
+      slotByPosition.erase(iter);
     }
   }
+
+  // the file's data may have moved too, so find its start sector again
+  for (const auto &m : moved) {
+    openFiles[m.first].dirp.seek(m.second->newSegment, m.second->newIndex);
+    slotByPosition[EntryPos {m.second->newSegment, m.second->newIndex}] = m.first;
+  }
+}
+
+/**
+ * Get the key of a directory entry in the position map.
+ *
+ * @param dirp the directory entry.
+ * @return the segment and index of the entry
+ */
+auto OpenFileTable::positionOf(const DirPtr &dirp) -> EntryPos
+{
+  return EntryPos {dirp.getSegment(), dirp.getIndex()};
 }
 
 }
\ No newline at end of file
@@ -6,8 +6,12 @@
 
 #include "DirChangeTracker.h"
 #include "DirPtr.h"
+#include "WriteBackPolicy.h"
 
+#include <map>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace RT11FS {
@@ -22,32 +26,74 @@ class BlockCache;
  *
  * The OFT tracks file entries in the directory. The directory is responsible for 
  * updating the OFT when files move on disk.
+ *
+ * Files which are still being created (tentative entries) are grown 
+ * geometrically as they are appended to, so that a sequential writer doesn't
+ * resize the directory entry on every write. The reserved space is trimmed
+ * off when the file is closed.
+ *
+ * When a file is read sequentially, the following sectors are read into the
+ * cache ahead of the reader, in a window which doubles with each sequential 
+ * read up to MAX_READ_AHEAD_SECTORS.
+ *
+ * `openFile' and `readFile' may be called concurrently from multiple threads, as
+ * long as nothing is modifying the directory at the same time. All other calls
+ * require exclusive access to the table.
  */
 class OpenFileTable
 {
 public:
-  OpenFileTable(Directory *dir, BlockCache *cache);
+  OpenFileTable(
+    Directory *dir, 
+    BlockCache *cache, 
+    WriteBackPolicy policy = WriteBackPolicy::Immediate, 
+    bool verbose = false);
 
   auto openFile(const std::string &name) -> int;
   auto createFile(const std::string &name) -> int;
   auto closeFile(int fd) -> int;
   auto readFile(int fd, char *buffer, size_t count, off_t offset) -> int;
   auto writeFile(int fd, const char *buffer, size_t count, off_t offset) -> int;
+  auto mapRead(int fd, size_t count, off_t offset, off_t &volumeOffset) -> int;
+  auto mapWrite(int fd, size_t count, off_t offset, off_t &volumeOffset) -> int;
+  auto commitWrite(int fd, off_t end) -> int;
   auto truncate(int fd, off_t newSize) -> int;
+  auto syncFile(int fd) -> int;
   auto unlink(const std::string &name) -> int;
+  auto getOpenLength(const DirPtr &dirp) -> int;
+  auto squeeze(int sectorBudget) -> int;
+  auto hasOpenFiles() const { return !slotByPosition.empty(); }
+
+  static const int GROWTH_FACTOR = 2;
+  static const int MIN_READ_AHEAD_SECTORS = 8;
+  static const int MAX_READ_AHEAD_SECTORS = 128;
 
 private:
   Directory *directory;
   BlockCache *cache;
+  WriteBackPolicy policy;
+  bool verbose;
 
   struct OpenFileEntry {
     int refcnt;
     DirPtr dirp;    
+    int length;         /*!< the file's length in sectors, excluding space reserved for appends */
+    off_t nextRead;     /*!< the offset a sequential reader would read next */
+    int readAhead;      /*!< the number of sectors to read ahead, or 0 if reads aren't sequential */
+    int prefetchedTo;   /*!< the end of the sectors already read ahead, relative to the file */
   };
 
+  using EntryPos = std::pair<int, int>;
+
   std::vector<OpenFileEntry> openFiles;
+  std::vector<int> freeSlots;               /*!< closed entries in `openFiles' which may be reused */
+  std::map<EntryPos, int> slotByPosition;   /*!< the open file at each (segment, index) in the directory */
+  std::mutex tableLock;                     /*!< protects the table between concurrent opens and reads */
 
+  static auto positionOf(const DirPtr &dirp) -> EntryPos;
   auto open(const DirPtr &dirp) -> int;
+  auto readSectors(int sector0, char *buffer, off_t offset, off_t end) -> int;
+  auto reserve(OpenFileEntry &slot, off_t end) -> int;
   auto applyMoves(const std::vector<DirChangeTracker::Entry> &moves) -> void;
 };
 }
@@ -0,0 +1,367 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#include "OverlayDataSource.h"
+
+#include "Block.h"
+#include "FilesystemException.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::unique_ptr;
+
+namespace RT11FS {
+
+const char OverlayDataSource::MAGIC[8] = {'R', 'T', '1', '1', 'O', 'V', 'L', '1'};
+const int OverlayDataSource::NO_SLOT;
+const off_t OverlayDataSource::RECORD_HEADER_BYTES;
+
+namespace {
+const auto SECTOR_SIZE = Block::SECTOR_SIZE;
+
+auto preadAll(int fd, void *buffer, size_t bytes, off_t offset) -> int
+{
+  auto xfer = ::pread(fd, buffer, bytes, offset);
+  if (xfer == -1) {
+    return -errno;
+  } else if (xfer != bytes) {
+    return -EIO;
+  }
+  return 0;
+}
+
+auto pwriteAll(int fd, const void *buffer, size_t bytes, off_t offset) -> int
+{
+  auto xfer = ::pwrite(fd, buffer, bytes, offset);
+  if (xfer == -1) {
+    return -errno;
+  } else if (xfer != bytes) {
+    return -EIO;
+  }
+  return 0;
+}
+}
+
+/**
+ * Construct an overlay.
+ *
+ * An empty delta file is initialized; a delta file from an earlier mount must
+ * have been made against a base of the same size.
+ *
+ * @param base the image to read unmodified sectors from. It is only written
+ * to by `commit'.
+ * @param deltaFd an open, writable descriptor for the delta file, which the
+ * overlay takes ownership of.
+ */
+OverlayDataSource::OverlayDataSource(unique_ptr<DataSource> base, int deltaFd)
+  : base(std::move(base))
+  , deltaFd(deltaFd)
+  , sectors(0)
+  , nextSlot(0)
+  , modified(0)
+{
+  struct stat st;
+  auto err = this->base->stat(&st);
+  if (err < 0) {
+    ::close(deltaFd);
+    throw FilesystemException {err, "could not stat overlay base"};
+  }
+
+  sectors = static_cast<int>(st.st_size / SECTOR_SIZE);
+  slots.assign(sectors, NO_SLOT);
+
+  try {
+    load();
+  } catch (...) {
+    ::close(deltaFd);
+    throw;
+  }
+}
+
+OverlayDataSource::~OverlayDataSource()
+{
+  ::close(deltaFd);
+}
+
+auto OverlayDataSource::stat(struct stat *st) -> int
+{
+  return base->stat(st);
+}
+
+auto OverlayDataSource::read(void *buffer, size_t bytes, off_t offset) -> ssize_t
+{
+  auto out = static_cast<uint8_t *>(buffer);
+  auto end = offset + static_cast<off_t>(bytes);
+  auto at = offset;
+
+  while (at < end) {
+    auto sector = static_cast<int>(at / SECTOR_SIZE);
+    auto inSector = at % SECTOR_SIZE;
+    auto slot = slotOf(sector);
+    auto next = min(end, static_cast<off_t>(sector + 1) * SECTOR_SIZE);
+
+    if (slot == NO_SLOT) {
+      // read the whole run of unmodified sectors from the base at once
+      while (next < end && slotOf(next / SECTOR_SIZE) == NO_SLOT) {
+        next = min(end, next + SECTOR_SIZE);
+      }
+
+      auto err = base->read(out + (at - offset), next - at, at);
+      if (err < 0) {
+        return err;
+      }
+    } else {
+      auto err = preadAll(deltaFd, out + (at - offset), next - at, recordOffset(slot) + RECORD_HEADER_BYTES + inSector);
+      if (err < 0) {
+        return err;
+      }
+    }
+
+    at = next;
+  }
+
+  return bytes;
+}
+
+auto OverlayDataSource::write(void *buffer, size_t bytes, off_t offset) -> ssize_t
+{
+  auto in = static_cast<const uint8_t *>(buffer);
+  auto end = offset + static_cast<off_t>(bytes);
+  auto at = offset;
+
+  if (offset < 0 || end > static_cast<off_t>(sectors) * SECTOR_SIZE) {
+    return -EINVAL;
+  }
+
+  while (at < end) {
+    auto sector = static_cast<int>(at / SECTOR_SIZE);
+    auto inSector = static_cast<int>(at % SECTOR_SIZE);
+    auto next = min(end, static_cast<off_t>(sector + 1) * SECTOR_SIZE);
+
+    auto err = writeSector(in + (at - offset), sector, inSector, next - at);
+    if (err < 0) {
+      return err;
+    }
+
+    at = next;
+  }
+
+  return bytes;
+}
+
+auto OverlayDataSource::readv(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t
+{
+  auto total = ssize_t {0};
+  for (auto i = 0; i < iovcnt; i++) {
+    auto err = read(iov[i].iov_base, iov[i].iov_len, offset + total);
+    if (err < 0) {
+      return err;
+    }
+    total += iov[i].iov_len;
+  }
+
+  return total;
+}
+
+auto OverlayDataSource::writev(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t
+{
+  auto total = ssize_t {0};
+  for (auto i = 0; i < iovcnt; i++) {
+    auto err = write(iov[i].iov_base, iov[i].iov_len, offset + total);
+    if (err < 0) {
+      return err;
+    }
+    total += iov[i].iov_len;
+  }
+
+  return total;
+}
+
+/**
+ * Write all modified sectors into the base image and empty the delta file.
+ *
+ * The delta file is only emptied once every sector has been written, so a
+ * failed commit may be retried.
+ *
+ * @return 0 on success or a negated errno
+ */
+auto OverlayDataSource::commit() -> int
+{
+  lock_guard<mutex> lock {slotLock};
+
+  uint8_t data[SECTOR_SIZE];
+  for (auto sector = 0; sector < sectors; sector++) {
+    if (slots[sector] == NO_SLOT) {
+      continue;
+    }
+
+    auto err = preadAll(deltaFd, data, SECTOR_SIZE, recordOffset(slots[sector]) + RECORD_HEADER_BYTES);
+    if (err < 0) {
+      return err;
+    }
+
+    auto xfer = base->write(data, SECTOR_SIZE, static_cast<off_t>(sector) * SECTOR_SIZE);
+    if (xfer < 0) {
+      return static_cast<int>(xfer);
+    }
+  }
+
+  return reset();
+}
+
+/**
+ * Throw away all modified sectors, reverting to the contents of the base.
+ *
+ * Any cache above the overlay must be discarded as well.
+ *
+ * @return 0 on success or a negated errno
+ */
+auto OverlayDataSource::discard() -> int
+{
+  lock_guard<mutex> lock {slotLock};
+  return reset();
+}
+
+/**
+ * @return the number of sectors which differ from the base.
+ */
+auto OverlayDataSource::getModifiedSectors() -> int
+{
+  lock_guard<mutex> lock {slotLock};
+  return modified;
+}
+
+auto OverlayDataSource::recordOffset(int slot) -> off_t
+{
+  return sizeof(Header) + static_cast<off_t>(slot) * (RECORD_HEADER_BYTES + SECTOR_SIZE);
+}
+
+/**
+ * Initialize an empty delta file, or rebuild the slot table from an existing
+ * one. A partial record at the end, left by an interrupted append, is ignored
+ * and will be overwritten by the next one.
+ */
+auto OverlayDataSource::load() -> void
+{
+  struct stat st;
+  if (::fstat(deltaFd, &st) == -1) {
+    throw FilesystemException {-errno, "could not stat overlay delta file"};
+  }
+
+  auto header = Header {};
+  if (st.st_size == 0) {
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.sectorSize = SECTOR_SIZE;
+    header.sectors = sectors;
+
+    auto err = pwriteAll(deltaFd, &header, sizeof(header), 0);
+    if (err < 0) {
+      throw FilesystemException {err, "could not initialize overlay delta file"};
+    }
+    return;
+  }
+
+  auto err = st.st_size < static_cast<off_t>(sizeof(header))
+    ? -EINVAL
+    : preadAll(deltaFd, &header, sizeof(header), 0);
+  if (err < 0) {
+    throw FilesystemException {err, "could not read overlay delta file header"};
+  }
+
+  if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.sectorSize != SECTOR_SIZE ||
+      header.sectors != static_cast<uint32_t>(sectors)) {
+    throw FilesystemException {-EINVAL, "overlay delta file does not match the base image"};
+  }
+
+  auto records = static_cast<int>((st.st_size - sizeof(header)) / (RECORD_HEADER_BYTES + SECTOR_SIZE));
+  for (auto slot = 0; slot < records; slot++) {
+    auto sector = uint32_t {0};
+    auto err = preadAll(deltaFd, &sector, sizeof(sector), recordOffset(slot));
+    if (err < 0) {
+      throw FilesystemException {err, "could not read overlay delta file"};
+    }
+
+    if (sector >= static_cast<uint32_t>(sectors) || slots[sector] != NO_SLOT) {
+      throw FilesystemException {-EINVAL, "overlay delta file is corrupt"};
+    }
+
+    slots[sector] = slot;
+  }
+
+  nextSlot = records;
+  modified = records;
+}
+
+auto OverlayDataSource::slotOf(int sector) -> int
+{
+  lock_guard<mutex> lock {slotLock};
+  return sector < sectors ? slots[sector] : NO_SLOT;
+}
+
+/**
+ * Write part or all of one sector into the delta file.
+ *
+ * The first write of a sector appends a record for it, filling in from
+ * the base anything the write doesn't cover.
+ *
+ * @param data the data to write.
+ * @param sector the sector to write.
+ * @param inSector the offset into the sector to write at.
+ * @param bytes the number of bytes to write, which must not cross into the next sector.
+ * @return 0 on success or a negated errno
+ */
+auto OverlayDataSource::writeSector(const uint8_t *data, int sector, int inSector, size_t bytes) -> int
+{
+  lock_guard<mutex> lock {slotLock};
+
+  if (slots[sector] != NO_SLOT) {
+    return pwriteAll(deltaFd, data, bytes, recordOffset(slots[sector]) + RECORD_HEADER_BYTES + inSector);
+  }
+
+  uint8_t record[RECORD_HEADER_BYTES + SECTOR_SIZE];
+  auto number = static_cast<uint32_t>(sector);
+  memcpy(record, &number, sizeof(number));
+
+  auto contents = record + RECORD_HEADER_BYTES;
+  if (bytes < SECTOR_SIZE) {
+    auto xfer = base->read(contents, SECTOR_SIZE, static_cast<off_t>(sector) * SECTOR_SIZE);
+    if (xfer < 0) {
+      return static_cast<int>(xfer);
+    }
+  }
+  memcpy(contents + inSector, data, bytes);
+
+  auto err = pwriteAll(deltaFd, record, sizeof(record), recordOffset(nextSlot));
+  if (err < 0) {
+    return err;
+  }
+
+  slots[sector] = nextSlot++;
+  modified++;
+  return 0;
+}
+
+/**
+ * Empty the delta file. The caller must hold the slot lock.
+ */
+auto OverlayDataSource::reset() -> int
+{
+  if (::ftruncate(deltaFd, sizeof(Header)) == -1) {
+    return -errno;
+  }
+
+  slots.assign(sectors, NO_SLOT);
+  nextSlot = 0;
+  modified = 0;
+  return 0;
+}
+
+}
@@ -0,0 +1,74 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __OVERLAYDATASOURCE_H_
+#define __OVERLAYDATASOURCE_H_
+
+#include "DataSource.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace RT11FS {
+/**
+ * A copy on write view of a read only base image.
+ *
+ * Reads go through to the base except for sectors which have been written,
+ * which are kept in a delta file. Many overlays may share one base, so a
+ * pristine image can be mounted writable any number of times without
+ * copying it.
+ *
+ * The delta file is a header followed by records, each of which is the
+ * number of a sector and its contents. The first write of a sector appends
+ * a record; later writes update the record in place. The slot table, which
+ * maps each sector to its record, is rebuilt from the records when the
+ * overlay is opened, so a delta file may be reattached on a later mount.
+ *
+ * `commit' writes the modified sectors into the base and `discard' throws
+ * them away; either leaves the delta file empty.
+ */
+class OverlayDataSource : public DataSource {
+public:
+  OverlayDataSource(std::unique_ptr<DataSource> base, int deltaFd);
+  ~OverlayDataSource();
+
+  auto stat(struct stat *st) -> int override;
+  auto read(void *buffer, size_t bytes, off_t offset) -> ssize_t override;
+  auto write(void *buffer, size_t bytes, off_t offset) -> ssize_t override;
+  auto readv(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t override;
+  auto writev(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t override;
+
+  auto commit() -> int;
+  auto discard() -> int;
+  auto getModifiedSectors() -> int;
+
+  static const char MAGIC[8];
+
+private:
+  struct Header {
+    char magic[8];
+    uint32_t sectorSize;
+    uint32_t sectors;      /*!< the size of the base, which the delta may only be applied to */
+  };
+
+  static const int NO_SLOT = -1;
+  static const off_t RECORD_HEADER_BYTES = sizeof(uint32_t);
+
+  std::unique_ptr<DataSource> base;
+  int deltaFd;
+  int sectors;
+  std::vector<int> slots;     /*!< the record holding each sector, or NO_SLOT if it's unmodified */
+  int nextSlot;               /*!< the record the next modified sector will be appended as */
+  int modified;               /*!< the number of sectors with records */
+  std::mutex slotLock;        /*!< protects the slot table */
+
+  static auto recordOffset(int slot) -> off_t;
+  auto load() -> void;
+  auto slotOf(int sector) -> int;
+  auto writeSector(const uint8_t *data, int sector, int inSector, size_t bytes) -> int;
+  auto reset() -> int;
+};
+}
+
+#endif
@@ -3,47 +3,191 @@
 
 #include "Rad50.h"
 
-#include <sstream>
-#include <stdexcept>
-
-using std::ostringstream;
-using std::runtime_error;
 using std::string;
 
 namespace RT11FS {
 
+const int Rad50::CHARS_PER_WORD;
+const int Rad50::NAME_BUFFER_SIZE;
+
 namespace {
-const auto charset = string {" ABCDEFGHIJKLMNOPQRSTUVWXYZ$.%0123456789"};
 const auto BASE = 050;
+constexpr char charset[] = " ABCDEFGHIJKLMNOPQRSTUVWXYZ$.%0123456789";
+
+// A word is decoded as its first character and then the pair of characters
+// below it. Words above the largest valid value (0174777) decode with '?' 
+// as the first character.
+const auto FIRST_CHARS = 0177777 / (BASE * BASE) + 1;
+
+struct DecodeTable {
+  char first[FIRST_CHARS];
+  char pairs[BASE * BASE][2];
+};
+
+constexpr auto makeDecodeTable()
+{
+  auto table = DecodeTable {};
+
+  for (auto i = 0; i < FIRST_CHARS; i++) {
+    table.first[i] = i < BASE ? charset[i] : '?';
+  }
+
+  for (auto i = 0; i < BASE * BASE; i++) {
+    table.pairs[i][0] = charset[i / BASE];
+    table.pairs[i][1] = charset[i % BASE];
+  }
+
+  return table;
 }
 
-auto Rad50::fromRad50(uint16_t rad50) -> string
+// The index of each character in the character set, or -1 if it has none.
+struct EncodeTable {
+  int8_t index[256];
+};
+
+constexpr auto makeEncodeTable()
 {
-  auto c0 = charset.substr(rad50 / (BASE * BASE), 1);
-  auto c1 = charset.substr((rad50 / BASE) % BASE, 1);
-  auto c2 = charset.substr(rad50 % BASE, 1);
+  auto table = EncodeTable {};
+
+  for (auto i = 0; i < 256; i++) {
+    table.index[i] = -1;
+  }
+
+  for (auto i = 0; i < BASE; i++) {
+    table.index[static_cast<uint8_t>(charset[i])] = i;
+  }
+
+  return table;
+}
+
+constexpr auto decodeTable = makeDecodeTable();
+constexpr auto encodeTable = makeEncodeTable();
+
+/**
+ * Copy `count' characters to `out', dropping trailing spaces.
+ *
+ * @return the number of characters copied
+ */
+auto copyTrimmed(const char *chars, int count, char *out)
+{
+  while (count > 0 && chars[count - 1] == ' ') {
+    count--;
+  }
+
+  for (auto i = 0; i < count; i++) {
+    out[i] = chars[i];
+  }
 
-  return c0 + c1 + c2;
+  return count;
+}
 }
 
+/**
+ * Convert one Rad50 word to a string.
+ *
+ * @param rad50 the word to convert.
+ * @return the three characters it holds
+ */
+auto Rad50::fromRad50(uint16_t rad50) -> string
+{
+  char chars[CHARS_PER_WORD];
+  decodeWord(rad50, chars);
+  return string(chars, CHARS_PER_WORD);
+}
+
+/**
+ * Convert a three character string to one Rad50 word.
+ *
+ * @param str the characters to convert.
+ * @param out on success, the Rad50 word.
+ * @return false if `str' isn't three characters from the Rad50 set
+ */
 auto Rad50::toRad50(const string &str, uint16_t &out) -> bool
 {
-  if (str.size() != 3) {
+  if (str.size() != CHARS_PER_WORD) {
     return false;
   }
 
-  auto result = uint16_t {0};
-  
-  for (auto ch : str) {
-    auto index = charset.find(ch);
-    if (index == string::npos) {
+  return encodeWord(str.data(), out);
+}
+
+/**
+ * Convert one Rad50 word to characters.
+ *
+ * @param rad50 the word to convert.
+ * @param out receives CHARS_PER_WORD characters; no terminator is written.
+ */
+auto Rad50::decodeWord(uint16_t rad50, char *out) -> void
+{
+  const auto &pair = decodeTable.pairs[rad50 % (BASE * BASE)];
+
+  out[0] = decodeTable.first[rad50 / (BASE * BASE)];
+  out[1] = pair[0];
+  out[2] = pair[1];
+}
+
+/**
+ * Convert characters to one Rad50 word.
+ *
+ * @param chars CHARS_PER_WORD characters to convert.
+ * @param out on success, the Rad50 word.
+ * @return false if any of the characters aren't in the Rad50 set
+ */
+auto Rad50::encodeWord(const char *chars, uint16_t &out) -> bool
+{
+  auto result = 0;
+
+  for (auto i = 0; i < CHARS_PER_WORD; i++) {
+    auto index = encodeTable.index[static_cast<uint8_t>(chars[i])];
+    if (index < 0) {
       return false;
     }
     result = result * BASE + index;
   }
-  
+
   out = result;
   return true;
 }
 
+/**
+ * Convert a Rad50 file name to printable form.
+ *
+ * The name is written as the base name and extension, each with trailing
+ * spaces removed, separated by a dot, and terminated with a NUL.
+ *
+ * @param name the file name to convert.
+ * @param out receives the printable name.
+ * @return the length of the name, not counting the terminator
+ */
+auto Rad50::decodeName(const Dir::Rad50Name &name, NameBuffer &out) -> int
+{
+  char chars[Dir::FILENAME_LENGTH * CHARS_PER_WORD];
+
+  for (auto i = 0; i < Dir::FILENAME_LENGTH; i++) {
+    decodeWord(name[i], &chars[i * CHARS_PER_WORD]);
+  }
+
+  auto length = copyTrimmed(chars, 2 * CHARS_PER_WORD, &out[0]);
+  out[length++] = '.';
+  length += copyTrimmed(&chars[2 * CHARS_PER_WORD], CHARS_PER_WORD, &out[length]);
+  out[length] = '\0';
+
+  return length;
+}
+
+/**
+ * Convert many Rad50 file names to printable form, such as all of the names
+ * in a directory segment.
+ *
+ * @param names the file names to convert.
+ * @param count the number of names.
+ * @param out receives `count' printable names, as from `decodeName'.
+ */
+auto Rad50::decodeNames(const Dir::Rad50Name *names, size_t count, NameBuffer *out) -> void
+{
+  for (auto i = size_t {0}; i < count; i++) {
+    decodeName(names[i], out[i]);
+  }
+}
+
 }
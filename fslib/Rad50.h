@@ -4,16 +4,38 @@
 #ifndef __RAD50_H_
 #define __RAD50_H_
 
+#include "DirConst.h"
+
+#include <array>
+#include <cstddef>
 #include <cstdint>
 #include <string>
 
 namespace RT11FS {
 
+/**
+ * Conversion between text and Rad50, which packs three characters from a 40
+ * character set into each 16 bit word.
+ *
+ * Conversion is done with lookup tables computed at compile time, and the
+ * buffer based calls never allocate.
+ */
 class Rad50
 {
 public:
+  static const int CHARS_PER_WORD = 3;
+  static const int NAME_BUFFER_SIZE = 11;   /*!< room for "NNNNNN.EEE" and a terminating NUL */
+
+  using NameBuffer = std::array<char, NAME_BUFFER_SIZE>;
+
   static auto fromRad50(uint16_t rad50) -> std::string;
   static auto toRad50(const std::string &str, uint16_t &out) -> bool;
+
+  static auto decodeWord(uint16_t rad50, char *out) -> void;
+  static auto encodeWord(const char *chars, uint16_t &out) -> bool;
+
+  static auto decodeName(const Dir::Rad50Name &name, NameBuffer &out) -> int;
+  static auto decodeNames(const Dir::Rad50Name *names, size_t count, NameBuffer *out) -> void;
 };
 
 }
@@ -0,0 +1,283 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "Statistics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+using std::atomic;
+using std::lock_guard;
+using std::memory_order_relaxed;
+using std::mutex;
+using std::ostringstream;
+using std::string;
+using std::vector;
+
+namespace RT11FS {
+
+const int Statistics::OPERATIONS;
+const int Statistics::COUNTERS;
+const int Statistics::LATENCY_BUCKETS;
+
+namespace {
+/**
+ * Add to a counter which only the calling thread writes. Other threads may
+ * read it at any time, so it's atomic, but it needs no read-modify-write.
+ */
+auto bump(atomic<uint64_t> &counter, uint64_t n)
+{
+  counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+auto bucketOf(uint64_t micros)
+{
+  auto bucket = 0;
+  while (micros != 0 && bucket < Statistics::LATENCY_BUCKETS - 1) {
+    micros >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+}
+
+struct Statistics::ThreadCounters {
+  struct OperationCounters {
+    atomic<uint64_t> calls;
+    atomic<uint64_t> errors;
+    atomic<uint64_t> totalMicros;
+    std::array<atomic<uint64_t>, LATENCY_BUCKETS> latency;
+  };
+
+  std::array<atomic<uint64_t>, COUNTERS> counters;
+  std::array<OperationCounters, OPERATIONS> operations;
+
+  ThreadCounters();
+  ~ThreadCounters();
+
+  auto addTo(Snapshot &snap) const -> void;
+};
+
+/**
+ * Every live thread's counters, and the totals of threads which have exited.
+ */
+struct Statistics::Registry {
+  mutex lock;
+  vector<const ThreadCounters *> threads;
+  Snapshot retired;
+};
+
+/**
+ * @return the registry, which is created on first use so that it outlives
+ * every thread's counters.
+ */
+auto Statistics::registry() -> Registry &
+{
+  static Registry reg {};
+  return reg;
+}
+
+Statistics::ThreadCounters::ThreadCounters()
+{
+  for (auto &counter : counters) {
+    counter.store(0, memory_order_relaxed);
+  }
+
+  for (auto &op : operations) {
+    op.calls.store(0, memory_order_relaxed);
+    op.errors.store(0, memory_order_relaxed);
+    op.totalMicros.store(0, memory_order_relaxed);
+    for (auto &bucket : op.latency) {
+      bucket.store(0, memory_order_relaxed);
+    }
+  }
+
+  auto &reg = registry();
+  lock_guard<mutex> lock {reg.lock};
+  reg.threads.push_back(this);
+}
+
+Statistics::ThreadCounters::~ThreadCounters()
+{
+  auto &reg = registry();
+  lock_guard<mutex> lock {reg.lock};
+
+  addTo(reg.retired);
+  reg.threads.erase(std::find(begin(reg.threads), end(reg.threads), this));
+}
+
+/**
+ * Add this thread's counts to a snapshot.
+ *
+ * @param snap the snapshot to add to.
+ */
+auto Statistics::ThreadCounters::addTo(Snapshot &snap) const -> void
+{
+  for (auto i = 0; i < COUNTERS; i++) {
+    snap.counters[i] += counters[i].load(memory_order_relaxed);
+  }
+
+  for (auto i = 0; i < OPERATIONS; i++) {
+    const auto &from = operations[i];
+    auto &to = snap.operations[i];
+
+    to.calls += from.calls.load(memory_order_relaxed);
+    to.errors += from.errors.load(memory_order_relaxed);
+    to.totalMicros += from.totalMicros.load(memory_order_relaxed);
+    for (auto j = 0; j < LATENCY_BUCKETS; j++) {
+      to.latency[j] += from.latency[j].load(memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * @return the calling thread's counters, which are created on first use.
+ */
+auto Statistics::local() -> ThreadCounters &
+{
+  static thread_local ThreadCounters counters;
+  return counters;
+}
+
+/**
+ * Count an event.
+ *
+ * @param counter the event.
+ * @param n how many times it happened.
+ */
+auto Statistics::count(Counter counter, uint64_t n) -> void
+{
+  bump(local().counters[static_cast<int>(counter)], n);
+}
+
+/**
+ * Record a call to a file system operation.
+ *
+ * @param op the operation.
+ * @param elapsed how long the call took.
+ * @param failed true if the call returned an error.
+ */
+auto Statistics::record(Operation op, std::chrono::steady_clock::duration elapsed, bool failed) -> void
+{
+  auto &counters = local().operations[static_cast<int>(op)];
+  auto micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+
+  bump(counters.calls, 1);
+  if (failed) {
+    bump(counters.errors, 1);
+  }
+  bump(counters.totalMicros, micros);
+  bump(counters.latency[bucketOf(micros)], 1);
+}
+
+/**
+ * Sum the counts of every thread.
+ *
+ * Counting continues while the snapshot is taken, so it may include part
+ * of a concurrent operation's counts.
+ *
+ * @return the totals
+ */
+auto Statistics::snapshot() -> Snapshot
+{
+  auto &reg = registry();
+  lock_guard<mutex> lock {reg.lock};
+
+  auto snap = reg.retired;
+  for (auto thread : reg.threads) {
+    thread->addTo(snap);
+  }
+
+  return snap;
+}
+
+/**
+ * Format a snapshot as text, one value per line.
+ *
+ * Latency histograms list only their non-empty buckets, as the bucket's 
+ * upper bound in microseconds and its count.
+ *
+ * @param snap the snapshot to format.
+ * @param dirtyBytes the cache's current unwritten bytes, which is a level
+ * rather than a count and so isn't kept here.
+ * @return the report
+ */
+auto Statistics::report(const Snapshot &snap, size_t dirtyBytes) -> string
+{
+  auto out = ostringstream {};
+
+  for (auto i = 0; i < COUNTERS; i++) {
+    out << counterName(static_cast<Counter>(i)) << " " << snap.counters[i] << "\n";
+  }
+  out << "cache.dirty_bytes " << dirtyBytes << "\n";
+
+  for (auto i = 0; i < OPERATIONS; i++) {
+    const auto &op = snap.operations[i];
+    if (op.calls == 0) {
+      continue;
+    }
+
+    auto name = operationName(static_cast<Operation>(i));
+    out << "op." << name << ".calls " << op.calls << "\n";
+    out << "op." << name << ".errors " << op.errors << "\n";
+    out << "op." << name << ".total_us " << op.totalMicros << "\n";
+    out << "op." << name << ".latency_us";
+    for (auto j = 0; j < LATENCY_BUCKETS; j++) {
+      if (op.latency[j] != 0) {
+        out << " <" << (uint64_t {1} << j) << ":" << op.latency[j];
+      }
+    }
+    out << "\n";
+  }
+
+  return out.str();
+}
+
+/**
+ * @return the name of an operation, for reports.
+ */
+auto Statistics::operationName(Operation op) -> const char *
+{
+  switch (op) {
+    case Operation::Getattr:  return "getattr";
+    case Operation::Statfs:   return "statfs";
+    case Operation::Unlink:   return "unlink";
+    case Operation::Rename:   return "rename";
+    case Operation::Readdir:  return "readdir";
+    case Operation::Open:     return "open";
+    case Operation::Create:   return "create";
+    case Operation::Release:  return "release";
+    case Operation::Read:     return "read";
+    case Operation::Write:    return "write";
+    case Operation::Truncate: return "truncate";
+    case Operation::Fsync:    return "fsync";
+    case Operation::Flush:    return "flush";
+    case Operation::Squeeze:  return "squeeze";
+    case Operation::Count:    break;
+  }
+  return "?";
+}
+
+/**
+ * @return the name of a counter, for reports.
+ */
+auto Statistics::counterName(Counter counter) -> const char *
+{
+  switch (counter) {
+    case Counter::CacheHits:        return "cache.hits";
+    case Counter::CacheMisses:      return "cache.misses";
+    case Counter::CacheEvictions:   return "cache.evictions";
+    case Counter::BytesWritten:     return "cache.bytes_written";
+    case Counter::EntryMoves:       return "dir.entry_moves";
+    case Counter::SectorsRelocated: return "dir.sectors_relocated";
+    case Counter::AttrHits:         return "attr.hits";
+    case Counter::AttrMisses:       return "attr.misses";
+    case Counter::Count:            break;
+  }
+  return "?";
+}
+
+}
@@ -0,0 +1,98 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __STATISTICS_H_
+#define __STATISTICS_H_
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace RT11FS {
+
+/**
+ * Process wide counters of file system activity.
+ *
+ * Each thread counts into its own set of counters, which only it writes, so
+ * counting never contends on a lock or a shared cache line. The sets are 
+ * summed when a snapshot is taken. A thread's counts are kept when it exits.
+ */
+class Statistics
+{
+public:
+  /**
+   * The file system operations which are timed.
+   */
+  enum class Operation {
+    Getattr,
+    Statfs,
+    Unlink,
+    Rename,
+    Readdir,
+    Open,
+    Create,
+    Release,
+    Read,
+    Write,
+    Truncate,
+    Fsync,
+    Flush,        /*!< writing back the volume outside of any one operation */
+    Squeeze,
+    Count,
+  };
+
+  /**
+   * Events which are counted.
+   */
+  enum class Counter {
+    CacheHits,
+    CacheMisses,
+    CacheEvictions,
+    BytesWritten,       /*!< bytes written back from the cache */
+    EntryMoves,         /*!< file entries moved within the directory */
+    SectorsRelocated,   /*!< sectors of file data moved on the volume */
+    AttrHits,           /*!< getattr calls answered from the attribute cache */
+    AttrMisses,         /*!< getattr calls which had to look in the directory */
+    Count,
+  };
+
+  static const int OPERATIONS = static_cast<int>(Operation::Count);
+  static const int COUNTERS = static_cast<int>(Counter::Count);
+  static const int LATENCY_BUCKETS = 32;    /*!< bucket i holds calls which took under 2^i microseconds */
+
+  struct OperationStats {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t totalMicros;
+    std::array<uint64_t, LATENCY_BUCKETS> latency;
+  };
+
+  struct Snapshot {
+    std::array<uint64_t, COUNTERS> counters;
+    std::array<OperationStats, OPERATIONS> operations;
+
+    auto get(Counter counter) const { return counters[static_cast<int>(counter)]; }
+    auto get(Operation op) const -> const OperationStats & { return operations[static_cast<int>(op)]; }
+  };
+
+  static auto count(Counter counter, uint64_t n = 1) -> void;
+  static auto record(Operation op, std::chrono::steady_clock::duration elapsed, bool failed) -> void;
+  static auto snapshot() -> Snapshot;
+  static auto report(const Snapshot &snap, size_t dirtyBytes) -> std::string;
+
+  static auto operationName(Operation op) -> const char *;
+  static auto counterName(Counter counter) -> const char *;
+
+private:
+  struct ThreadCounters;
+  struct Registry;
+
+  static auto local() -> ThreadCounters &;
+  static auto registry() -> Registry &;
+};
+
+}
+
+#endif
@@ -0,0 +1,335 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#include "UringDataSource.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#ifdef RT11FS_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::unique_ptr;
+
+namespace RT11FS {
+
+const unsigned UringDataSource::RING_ENTRIES;
+
+namespace {
+#ifdef RT11FS_HAVE_IO_URING
+auto totalBytes(const struct iovec *iov, int iovcnt) -> size_t
+{
+  auto total = size_t {0};
+  for (auto i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+  return total;
+}
+
+// glibc has no wrappers for the io_uring calls
+auto ioUringSetup(unsigned entries, struct io_uring_params *params) -> int
+{
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+auto ioUringEnter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags) -> int
+{
+  return static_cast<int>(::syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+auto atOffset(void *base, unsigned offset) -> unsigned *
+{
+  return reinterpret_cast<unsigned *>(static_cast<uint8_t *>(base) + offset);
+}
+#endif
+}
+
+UringDataSource::UringDataSource(int fd)
+  : FileDataSource(fd)
+  , ringFd(-1)
+  , broken(false)
+  , sqRing(nullptr)
+  , sqRingBytes(0)
+  , cqRing(nullptr)
+  , cqRingBytes(0)
+  , sqes(nullptr)
+  , sqesBytes(0)
+  , sqTail(nullptr)
+  , sqMask(0)
+  , sqArray(nullptr)
+  , sqEntries(0)
+  , cqHead(nullptr)
+  , cqTail(nullptr)
+  , cqMask(0)
+  , cqes(nullptr)
+{
+}
+
+UringDataSource::~UringDataSource()
+{
+#ifdef RT11FS_HAVE_IO_URING
+  if (sqes != nullptr) {
+    ::munmap(sqes, sqesBytes);
+  }
+  if (cqRing != nullptr && cqRing != sqRing) {
+    ::munmap(cqRing, cqRingBytes);
+  }
+  if (sqRing != nullptr) {
+    ::munmap(sqRing, sqRingBytes);
+  }
+#endif
+  if (ringFd != -1) {
+    ::close(ringFd);
+  }
+}
+
+/**
+ * Make a data source for a file which uses io_uring if it can.
+ *
+ * @param fd the open file, which the data source takes ownership of.
+ * @return a data source using io_uring, or a FileDataSource if io_uring
+ * can't be set up.
+ */
+auto UringDataSource::create(int fd) -> unique_ptr<FileDataSource>
+{
+  auto source = unique_ptr<UringDataSource> {new UringDataSource {fd}};
+  if (source->setup() == 0) {
+    return source;
+  }
+
+  // hand the file over to the fallback
+  source->fd = -1;
+  return unique_ptr<FileDataSource> {new FileDataSource {fd}};
+}
+
+/**
+ * Create the ring and map its queues.
+ *
+ * @return 0 on success or a negated errno
+ */
+auto UringDataSource::setup() -> int
+{
+#ifdef RT11FS_HAVE_IO_URING
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ringFd = ioUringSetup(RING_ENTRIES, &params);
+  if (ringFd == -1) {
+    return -errno;
+  }
+
+  sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+  // newer kernels map both rings with one call
+  auto singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (singleMap) {
+    sqRingBytes = cqRingBytes = std::max(sqRingBytes, cqRingBytes);
+  }
+
+  auto mapRing = [this](size_t bytes, off_t offset) -> void * {
+    auto ring = ::mmap(nullptr, bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ringFd, offset);
+    return ring == MAP_FAILED ? nullptr : ring;
+  };
+
+  sqRing = mapRing(sqRingBytes, IORING_OFF_SQ_RING);
+  if (sqRing == nullptr) {
+    return -errno;
+  }
+
+  cqRing = singleMap ? sqRing : mapRing(cqRingBytes, IORING_OFF_CQ_RING);
+  if (cqRing == nullptr) {
+    return -errno;
+  }
+
+  sqesBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = static_cast<struct io_uring_sqe *>(mapRing(sqesBytes, IORING_OFF_SQES));
+  if (sqes == nullptr) {
+    return -errno;
+  }
+
+  sqTail = atOffset(sqRing, params.sq_off.tail);
+  sqMask = *atOffset(sqRing, params.sq_off.ring_mask);
+  sqArray = atOffset(sqRing, params.sq_off.array);
+  sqEntries = params.sq_entries;
+
+  cqHead = atOffset(cqRing, params.cq_off.head);
+  cqTail = atOffset(cqRing, params.cq_off.tail);
+  cqMask = *atOffset(cqRing, params.cq_off.ring_mask);
+  cqes = reinterpret_cast<struct io_uring_cqe *>(static_cast<uint8_t *>(cqRing) + params.cq_off.cqes);
+
+  return 0;
+#else
+  return -ENOSYS;
+#endif
+}
+
+/**
+ * Carry out a batch of requests through the ring, as many at a time as the
+ * ring holds.
+ *
+ * If the ring fails, the requests it didn't take are done synchronously. 
+ * If the kernel was only short of resources, the next batch tries the ring
+ * again; otherwise every later batch is done synchronously.
+ *
+ * @param requests the requests. Each one's `result' is filled in.
+ * @param count the number of requests.
+ * @return 0 if every request succeeded, or the first failing request's
+ * negated errno
+ */
+auto UringDataSource::submit(Request *requests, int count) -> int
+{
+  lock_guard<mutex> lock {ringLock};
+
+  auto done = 0;
+  while (!broken && done < count) {
+    auto chunk = min(count - done, static_cast<int>(sqEntries));
+    auto submitted = 0;
+    auto err = submitChunk(requests + done, chunk, submitted);
+    done += submitted;
+
+    if (err < 0) {
+      if (err != -EAGAIN && err != -EBUSY) {
+        broken = true;
+      }
+      break;
+    }
+  }
+
+  if (done < count) {
+    DataSource::submit(requests + done, count - done);
+  }
+
+  for (auto i = 0; i < count; i++) {
+    if (requests[i].result < 0) {
+      return static_cast<int>(requests[i].result);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Put a batch of requests which fits in the ring into it, and wait for all
+ * of them to complete.
+ *
+ * If the ring fails, the requests it didn't take are withdrawn, and the ones
+ * it did take are waited for, so that none of their buffers are still in use
+ * by the kernel on return. The kernel takes requests in order, so those it
+ * took are the first `submitted'.
+ *
+ * @param requests the requests. The `result' of each one the ring took is 
+ * filled in.
+ * @param count the number of requests, at most the ring's size.
+ * @param submitted on return, the number of requests the ring took.
+ * @return 0 if the ring carried out every request (whether or not the
+ * requests themselves succeeded), or a negated errno if the ring failed
+ */
+auto UringDataSource::submitChunk(Request *requests, int count, int &submitted) -> int
+{
+#ifdef RT11FS_HAVE_IO_URING
+  // this is the only thread touching the submission queue, so the tail can
+  // be read plainly; the kernel must see the entries before the new tail
+  auto tail = *sqTail;
+  for (auto i = 0; i < count; i++) {
+    const auto &request = requests[i];
+    auto index = tail & sqMask;
+    auto sqe = &sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(request.iov);
+    sqe->len = request.iovcnt;
+    sqe->off = request.offset;
+    sqe->user_data = i;
+
+    sqArray[index] = index;
+    tail++;
+
+    // marks the requests which haven't completed
+    requests[i].result = -EINPROGRESS;
+  }
+  __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+  auto toSubmit = static_cast<unsigned>(count);
+  auto completed = 0;
+  auto err = 0;
+
+  while (true) {
+    auto taken = count - static_cast<int>(toSubmit);
+    if (completed == taken && (err < 0 || toSubmit == 0)) {
+      break;
+    }
+
+    // once the ring has failed, only wait for what it already took
+    auto entered = err < 0
+      ? ioUringEnter(ringFd, 0, taken - completed, IORING_ENTER_GETEVENTS)
+      : ioUringEnter(ringFd, toSubmit, count - completed, IORING_ENTER_GETEVENTS);
+    if (entered == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (err < 0) {
+        // what's still in flight can't be accounted for, and may complete
+        // later, so the ring can't be used again
+        for (auto i = 0; i < taken; i++) {
+          if (requests[i].result == -EINPROGRESS) {
+            requests[i].result = -EIO;
+          }
+        }
+        err = -EIO;
+        break;
+      }
+
+      // withdraw what the kernel didn't take; it only reads the queue when
+      // entered, so the entries can be given back
+      err = -errno;
+      tail -= toSubmit;
+      __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    if (err == 0) {
+      toSubmit -= min(toSubmit, static_cast<unsigned>(entered));
+    }
+
+    auto head = *cqHead;
+    auto cqeTail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    while (head != cqeTail) {
+      const auto &cqe = cqes[head & cqMask];
+      auto &request = requests[cqe.user_data];
+
+      if (cqe.res < 0) {
+        request.result = cqe.res;
+      } else if (static_cast<size_t>(cqe.res) != totalBytes(request.iov, request.iovcnt)) {
+        // as in FileDataSource, a short transfer is an error
+        request.result = -EIO;
+      } else {
+        request.result = cqe.res;
+      }
+
+      head++;
+      completed++;
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+  }
+
+  submitted = count - static_cast<int>(toSubmit);
+  return err;
+#else
+  submitted = 0;
+  return -ENOSYS;
+#endif
+}
+
+}
@@ -0,0 +1,69 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __URINGDATASOURCE_H_
+#define __URINGDATASOURCE_H_
+
+#include "FileDataSource.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+struct io_uring_cqe;
+struct io_uring_sqe;
+
+namespace RT11FS {
+
+/**
+ * A data source over a file which carries out batches of requests through a
+ * Linux io_uring, so that the kernel has all of a batch outstanding at once
+ * rather than completing it one request at a time.
+ *
+ * Only `submit' goes through the ring; a single read or write gains nothing
+ * from it and is done synchronously, as in FileDataSource. One batch is in
+ * the ring at a time.
+ *
+ * Where io_uring isn't available (it isn't built in, the kernel is too old,
+ * or a sandbox forbids it), `create' falls back to a plain FileDataSource.
+ */
+class UringDataSource : public FileDataSource
+{
+public:
+  static const unsigned RING_ENTRIES = 64;
+
+  ~UringDataSource();
+
+  static auto create(int fd) -> std::unique_ptr<FileDataSource>;
+
+  auto submit(Request *requests, int count) -> int override;
+
+private:
+  int ringFd;
+  std::mutex ringLock;          /*!< serializes batches through the ring */
+  bool broken;                  /*!< the ring failed, so batches are done synchronously */
+
+  void *sqRing;                 /*!< the submission ring, as mapped */
+  size_t sqRingBytes;
+  void *cqRing;                 /*!< the completion ring, as mapped */
+  size_t cqRingBytes;
+  io_uring_sqe *sqes;
+  size_t sqesBytes;
+
+  unsigned *sqTail;
+  unsigned sqMask;
+  unsigned *sqArray;
+  unsigned sqEntries;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  io_uring_cqe *cqes;
+
+  UringDataSource(int fd);
+
+  auto setup() -> int;
+  auto submitChunk(Request *requests, int count, int &submitted) -> int;
+};
+}
+
+#endif
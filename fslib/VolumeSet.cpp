@@ -0,0 +1,547 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#include "VolumeSet.h"
+
+#include "FilesystemException.h"
+
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+namespace RT11FS {
+
+const int VolumeSet::DEFAULT_IDLE_SECONDS;
+
+namespace {
+// how often the sweeper looks for idle volumes to close
+const auto SWEEP_INTERVAL = std::chrono::seconds {1};
+}
+
+/**
+ * Construct a volume set. No images are opened until they're accessed.
+ *
+ * @param imageDir the directory holding the images. Every regular file in it
+ * whose name doesn't start with a dot is taken to be one.
+ * @param options the options to open each volume with. `cacheBytes' is the
+ * budget shared by all of them; overlays aren't supported.
+ * @param idleSeconds how long a volume with no open files may go unused
+ * before it's closed.
+ */
+VolumeSet::VolumeSet(const string &imageDir, const FileSystemOptions &options, int idleSeconds)
+  : options(options)
+  , budget(options.cacheBytes ? options.cacheBytes : BlockCache::DEFAULT_MAX_BYTES)
+  , idleTime(idleSeconds)
+  , initialized(false)
+  , sweeperStopping(false)
+{
+  if (options.overlay != nullptr) {
+    throw FilesystemException {-EINVAL, "overlays can't be used with a volume set"};
+  }
+
+  this->options.cacheBytes = budget.getMaxBytes();
+  this->options.cacheBudget = &budget;
+
+  auto dir = ::opendir(imageDir.c_str());
+  if (dir == nullptr) {
+    throw FilesystemException {-errno, "image directory could not be read"};
+  }
+
+  while (auto ent = ::readdir(dir)) {
+    if (ent->d_name[0] == '.') {
+      continue;
+    }
+
+    auto image = imageDir + "/" + ent->d_name;
+    struct stat st;
+    if (::stat(image.c_str(), &st) == -1 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    volumes[ent->d_name] = Volume {image, nullptr, false, 0, steady_clock::time_point {}};
+  }
+
+  ::closedir(dir);
+}
+
+VolumeSet::~VolumeSet()
+{
+  if (sweeper.joinable()) {
+    {
+      lock_guard<mutex> lock {volumeLock};
+      sweeperStopping = true;
+    }
+    sweeperWake.notify_one();
+    sweeper.join();
+  }
+}
+
+/**
+ * Start the background threads of any open volumes, and of volumes opened
+ * from now on, and the thread which closes idle volumes. As with 
+ * FileSystem::init, this should be called from FUSE's `init' callback.
+ */
+auto VolumeSet::init() -> void
+{
+  lock_guard<mutex> lock {volumeLock};
+  if (initialized) {
+    return;
+  }
+  initialized = true;
+
+  for (auto &volume : volumes) {
+    if (volume.second.fs) {
+      volume.second.fs->init();
+    }
+  }
+
+  sweeper = std::thread {[this]() { sweepLoop(); }};
+}
+
+auto VolumeSet::getattr(const char *path, struct stat *stbuf) -> int
+{
+  auto name = string {};
+  auto rest = string {};
+  auto err = split(path, name, rest);
+  if (err < 0) {
+    return err;
+  }
+
+  // the root and the volumes' subdirectories can be described without
+  // opening anything
+  if (name.empty() || rest == "/") {
+    if (!name.empty()) {
+      lock_guard<mutex> lock {volumeLock};
+      if (volumes.find(name) == volumes.end()) {
+        return -ENOENT;
+      }
+    }
+
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = S_IFDIR | 0755;
+    stbuf->st_nlink = 2;
+    return 0;
+  }
+
+  return forward(path, [stbuf](FileSystem &fs, const char *rest) {
+    return fs.getattr(rest, stbuf);
+  });
+}
+
+auto VolumeSet::fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) -> int
+{
+  return forward(path, [stbuf, fi](FileSystem &fs, const char *rest) {
+    return fs.fgetattr(rest, stbuf, fi);
+  });
+}
+
+auto VolumeSet::statfs(const char *path, struct statvfs *vfs) -> int
+{
+  if (string {path} == "/") {
+    memset(vfs, 0, sizeof(struct statvfs));
+    vfs->f_bsize = Block::SECTOR_SIZE;
+    vfs->f_frsize = Block::SECTOR_SIZE;
+    vfs->f_namemax = 10;
+    return 0;
+  }
+
+  // every path on a volume is on the same file system
+  return forward(path, [vfs](FileSystem &fs, const char *) {
+    return fs.statfs("/", vfs);
+  });
+}
+
+auto VolumeSet::chmod(const char *path, mode_t mode) -> int
+{
+  return forward(path, [mode](FileSystem &fs, const char *rest) {
+    return fs.chmod(rest, mode);
+  });
+}
+
+auto VolumeSet::unlink(const char *path) -> int
+{
+  return forward(path, [](FileSystem &fs, const char *rest) {
+    return fs.unlink(rest);
+  });
+}
+
+auto VolumeSet::rename(const char *oldName, const char *newName) -> int
+{
+  auto oldVolume = string {};
+  auto oldRest = string {};
+  auto newVolume = string {};
+  auto newRest = string {};
+
+  auto err = split(oldName, oldVolume, oldRest);
+  if (err == 0) {
+    err = split(newName, newVolume, newRest);
+  }
+  if (err < 0) {
+    return err;
+  }
+
+  // the volumes themselves can't be renamed
+  if (oldVolume.empty() || newVolume.empty() || oldRest == "/" || newRest == "/") {
+    return -EACCES;
+  }
+
+  if (oldVolume != newVolume) {
+    return -EXDEV;
+  }
+
+  auto target = newRest;
+  return forward(oldName, [&target](FileSystem &fs, const char *rest) {
+    return fs.rename(rest, target.c_str());
+  });
+}
+
+auto VolumeSet::readdir(
+  const char *path, void *buf, fuse_fill_dir_t filler,
+  off_t offset, struct fuse_file_info *fi) -> int
+{
+  if (string {path} != "/") {
+    return forward(path, [buf, filler, offset, fi](FileSystem &fs, const char *rest) {
+      return fs.readdir(rest, buf, filler, offset, fi);
+    });
+  }
+
+  // numbered as FileSystem::readdir numbers files, so listings can be resumed
+  if (offset < 1 && filler(buf, ".", NULL, 1)) {
+    return 0;
+  }
+
+  if (offset < 2 && filler(buf, "..", NULL, 2)) {
+    return 0;
+  }
+
+  auto next = off_t {3};
+  for (const auto &name : getVolumeNames()) {
+    auto entOffset = next++;
+    if (entOffset <= offset) {
+      continue;
+    }
+
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFDIR | 0755;
+    if (filler(buf, name.c_str(), &st, entOffset)) {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+auto VolumeSet::open(const char *path, struct fuse_file_info *fi) -> int
+{
+  return forward(path, [this, path, fi](FileSystem &fs, const char *rest) {
+    auto err = fs.open(rest, fi);
+    if (err == 0) {
+      addOpenFiles(path, 1);
+    }
+    return err;
+  });
+}
+
+auto VolumeSet::create(const char *path, mode_t mode, struct fuse_file_info *fi) -> int
+{
+  // files can only be created on the volumes, not among them
+  auto name = string {};
+  auto rest = string {};
+  auto err = split(path, name, rest);
+  if (err < 0 || rest == "/") {
+    return err < 0 ? err : -EACCES;
+  }
+
+  return forward(path, [this, path, mode, fi](FileSystem &fs, const char *rest) {
+    auto err = fs.create(rest, mode, fi);
+    if (err == 0) {
+      addOpenFiles(path, 1);
+    }
+    return err;
+  });
+}
+
+auto VolumeSet::release(const char *path, struct fuse_file_info *fi) -> int
+{
+  return forward(path, [this, path, fi](FileSystem &fs, const char *rest) {
+    auto err = fs.release(rest, fi);
+    addOpenFiles(path, -1);
+    return err;
+  });
+}
+
+auto VolumeSet::read(const char *path, char *buf, size_t count, off_t offset, struct fuse_file_info *fi) -> int
+{
+  return forward(path, [buf, count, offset, fi](FileSystem &fs, const char *rest) {
+    return fs.read(rest, buf, count, offset, fi);
+  });
+}
+
+auto VolumeSet::write(const char *path, const char *buf, size_t count, off_t offset, struct fuse_file_info *fi) -> int
+{
+  return forward(path, [buf, count, offset, fi](FileSystem &fs, const char *rest) {
+    return fs.write(rest, buf, count, offset, fi);
+  });
+}
+
+auto VolumeSet::readBuf(
+  const char *path, struct fuse_bufvec **bufp, size_t count, off_t offset,
+  struct fuse_file_info *fi) -> int
+{
+  return forward(path, [bufp, count, offset, fi](FileSystem &fs, const char *rest) {
+    return fs.readBuf(rest, bufp, count, offset, fi);
+  });
+}
+
+auto VolumeSet::writeBuf(
+  const char *path, struct fuse_bufvec *bufv, off_t offset,
+  struct fuse_file_info *fi) -> int
+{
+  return forward(path, [bufv, offset, fi](FileSystem &fs, const char *rest) {
+    return fs.writeBuf(rest, bufv, offset, fi);
+  });
+}
+
+auto VolumeSet::ftruncate(const char *path, off_t size, struct fuse_file_info *fi) -> int
+{
+  return forward(path, [size, fi](FileSystem &fs, const char *rest) {
+    return fs.ftruncate(rest, size, fi);
+  });
+}
+
+auto VolumeSet::fsync(const char *path, int isdatasync, struct fuse_file_info *fi) -> int
+{
+  return forward(path, [isdatasync, fi](FileSystem &fs, const char *rest) {
+    return fs.fsync(rest, isdatasync, fi);
+  });
+}
+
+/**
+ * @return the subdirectory names of all the volumes, in order.
+ */
+auto VolumeSet::getVolumeNames() -> vector<string>
+{
+  lock_guard<mutex> lock {volumeLock};
+
+  auto names = vector<string> {};
+  for (const auto &volume : volumes) {
+    names.push_back(volume.first);
+  }
+  return names;
+}
+
+/**
+ * @return the number of volumes which are currently open.
+ */
+auto VolumeSet::getOpenVolumes() -> int
+{
+  lock_guard<mutex> lock {volumeLock};
+
+  auto open = 0;
+  for (const auto &volume : volumes) {
+    if (volume.second.fs) {
+      open++;
+    }
+  }
+  return open;
+}
+
+/**
+ * Close every volume which has no open files and has been unused for the
+ * idle time. Once the set is initialized, this is done periodically by a
+ * background thread.
+ *
+ * @param now the time to measure idleness from.
+ */
+auto VolumeSet::closeIdle(steady_clock::time_point now) -> void
+{
+  sweep(now);
+}
+
+/**
+ * Split a path into the name of a volume and the path on the volume.
+ *
+ * @param path the path to split.
+ * @param name on return, the volume's name, or empty for the root of the set.
+ * @param rest on return, the path on the volume, which is "/" for its root.
+ * @return 0 on success or a negated errno
+ */
+auto VolumeSet::split(const char *path, string &name, string &rest) -> int
+{
+  auto p = string {path};
+  if (p.empty() || p[0] != '/') {
+    return -ENOENT;
+  }
+
+  auto slash = p.find('/', 1);
+  name = p.substr(1, slash == string::npos ? string::npos : slash - 1);
+  rest = slash == string::npos ? string {"/"} : p.substr(slash);
+  return 0;
+}
+
+/**
+ * Get the volume a path is on, opening it if need be.
+ *
+ * @param path the path.
+ * @param rest on return, the path on the volume.
+ * @param fs on return, the volume.
+ * @return 0 on success or a negated errno
+ */
+auto VolumeSet::acquire(const char *path, string &rest, shared_ptr<FileSystem> &fs) -> int
+{
+  auto name = string {};
+  auto err = split(path, name, rest);
+  if (err < 0) {
+    return err;
+  }
+
+  unique_lock<mutex> lock {volumeLock};
+
+  auto iter = volumes.find(name);
+  if (iter == volumes.end()) {
+    return name.empty() ? -EACCES : -ENOENT;
+  }
+
+  // wait out anyone else opening or closing the volume; it must never be
+  // open twice, even while its last incarnation is being written out
+  auto &volume = iter->second;
+  volumeReady.wait(lock, [&volume]() { return !volume.busy; });
+
+  if (!volume.fs) {
+    // reading the directory can be slow, so don't hold up the other volumes
+    volume.busy = true;
+    lock.unlock();
+
+    auto opened = shared_ptr<FileSystem> {};
+    auto err = 0;
+    try {
+      opened = make_shared<FileSystem>(volume.image, options);
+    } catch (const FilesystemException &ex) {
+      err = ex.getError();
+    }
+
+    lock.lock();
+    volume.busy = false;
+    volumeReady.notify_all();
+
+    if (err < 0) {
+      return err;
+    }
+
+    volume.fs = opened;
+    if (initialized) {
+      volume.fs->init();
+    }
+  }
+
+  volume.lastUse = steady_clock::now();
+  fs = volume.fs;
+
+  return 0;
+}
+
+/**
+ * Close idle volumes. A volume is in use if anyone apart from the set holds
+ * it, even if it has no open files. Closing writes out the volume, so it's
+ * done outside the volume lock.
+ *
+ * @param now the time to measure idleness from.
+ */
+auto VolumeSet::sweep(steady_clock::time_point now) -> void
+{
+  auto closing = vector<Volume *> {};
+  auto idle = vector<shared_ptr<FileSystem>> {};
+
+  {
+    lock_guard<mutex> lock {volumeLock};
+    for (auto &volume : volumes) {
+      auto &vol = volume.second;
+      if (!vol.busy && vol.fs && vol.fs.use_count() == 1 && vol.openFiles == 0 && now - vol.lastUse >= idleTime) {
+        vol.busy = true;
+        closing.push_back(&vol);
+        idle.push_back(std::move(vol.fs));
+      }
+    }
+  }
+
+  if (closing.empty()) {
+    return;
+  }
+
+  idle.clear();
+
+  lock_guard<mutex> lock {volumeLock};
+  for (auto vol : closing) {
+    vol->busy = false;
+  }
+  volumeReady.notify_all();
+}
+
+/**
+ * The body of the thread which closes idle volumes until the set is
+ * destroyed.
+ */
+auto VolumeSet::sweepLoop() -> void
+{
+  while (true) {
+    {
+      unique_lock<mutex> lock {volumeLock};
+      if (sweeperWake.wait_for(lock, SWEEP_INTERVAL, [this]() { return sweeperStopping; })) {
+        return;
+      }
+    }
+
+    sweep(steady_clock::now());
+  }
+}
+
+/**
+ * Run an operation on the volume a path is on.
+ *
+ * @param path the path.
+ * @param fn the operation, which is passed the volume and the path on it.
+ * @return the result of `fn', or a negated errno if the volume can't be opened
+ */
+auto VolumeSet::forward(const char *path, std::function<int(FileSystem &, const char *)> fn) -> int
+{
+  auto rest = string {};
+  auto fs = shared_ptr<FileSystem> {};
+  auto err = acquire(path, rest, fs);
+  if (err < 0) {
+    return err;
+  }
+
+  return fn(*fs, rest.c_str());
+}
+
+/**
+ * Count files being opened or closed on the volume a path is on. A volume
+ * with open files is never closed for being idle.
+ */
+auto VolumeSet::addOpenFiles(const char *path, int delta) -> void
+{
+  auto name = string {};
+  auto rest = string {};
+  if (split(path, name, rest) < 0) {
+    return;
+  }
+
+  lock_guard<mutex> lock {volumeLock};
+  auto iter = volumes.find(name);
+  if (iter != volumes.end()) {
+    iter->second.openFiles += delta;
+  }
+}
+
+}
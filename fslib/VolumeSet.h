@@ -0,0 +1,104 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __VOLUMESET_H_
+#define __VOLUMESET_H_
+
+#include "CacheBudget.h"
+#include "FileSystem.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <fuse.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace RT11FS {
+/**
+ * The FUSE operations on a directory of volume images, each of which appears
+ * as a subdirectory of the mount named after its image file.
+ *
+ * A volume's FileSystem is only opened when something under its subdirectory
+ * is first accessed, and is closed again once it has no open files and hasn't
+ * been used for the idle time. The block caches of all the volumes share one
+ * CacheBudget.
+ *
+ * Volumes are handed out as shared pointers, so closing an idle volume never
+ * pulls it out from under an operation in progress on another thread. Volumes
+ * are opened and closed outside the set's lock, so a slow image only holds up
+ * the operations on its own volume.
+ */
+class VolumeSet
+{
+public:
+  static const int DEFAULT_IDLE_SECONDS = 60;
+
+  VolumeSet(
+    const std::string &imageDir,
+    const FileSystemOptions &options = FileSystemOptions {},
+    int idleSeconds = DEFAULT_IDLE_SECONDS);
+  ~VolumeSet();
+
+  auto init() -> void;
+
+  auto getattr(const char *path, struct stat *stbuf) -> int;
+  auto fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) -> int;
+  auto statfs(const char *path, struct statvfs *fs) -> int;
+  auto chmod(const char *path, mode_t mode) -> int;
+  auto unlink(const char *path) -> int;
+  auto rename(const char *oldName, const char *newName) -> int;
+
+  auto readdir(
+    const char *path, void *buf, fuse_fill_dir_t filler,
+    off_t offset, struct fuse_file_info *fi) -> int;
+  auto open(const char *path, struct fuse_file_info *fi) -> int;
+  auto create(const char *path, mode_t mode, struct fuse_file_info *fi) -> int;
+  auto release(const char *path, struct fuse_file_info *fi) -> int;
+  auto read(const char *path, char *buf, size_t count, off_t offset, struct fuse_file_info *fi) -> int;
+  auto write(const char *path, const char *buf, size_t count, off_t offset, struct fuse_file_info *fi) -> int;
+  auto readBuf(const char *path, struct fuse_bufvec **bufp, size_t count, off_t offset, struct fuse_file_info *fi) -> int;
+  auto writeBuf(const char *path, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi) -> int;
+
+  auto ftruncate(const char *path, off_t size, struct fuse_file_info *fi) -> int;
+  auto fsync(const char *path, int isdatasync, struct fuse_file_info *fi) -> int;
+
+  auto getVolumeNames() -> std::vector<std::string>;
+  auto getOpenVolumes() -> int;
+  auto getCacheBudget() -> CacheBudget & { return budget; }
+  auto closeIdle(std::chrono::steady_clock::time_point now) -> void;
+
+private:
+  struct Volume {
+    std::string image;                              /*!< the path of the image file */
+    std::shared_ptr<FileSystem> fs;                 /*!< the open volume, or null if it's closed */
+    bool busy;                                      /*!< the volume is being opened or closed */
+    int openFiles;
+    std::chrono::steady_clock::time_point lastUse;
+  };
+
+  FileSystemOptions options;
+  CacheBudget budget;
+  std::chrono::seconds idleTime;
+  bool initialized;                                 /*!< FUSE has started, so new volumes must start their threads */
+  std::map<std::string, Volume> volumes;            /*!< every volume, by subdirectory name */
+  std::mutex volumeLock;                            /*!< protects the volumes */
+  std::condition_variable volumeReady;              /*!< signalled when a volume stops being busy */
+  std::thread sweeper;                              /*!< closes idle volumes */
+  std::condition_variable sweeperWake;              /*!< signalled to stop the sweeper */
+  bool sweeperStopping;                             /*!< the sweeper should exit */
+
+  static auto split(const char *path, std::string &name, std::string &rest) -> int;
+  auto acquire(const char *path, std::string &rest, std::shared_ptr<FileSystem> &fs) -> int;
+  auto sweep(std::chrono::steady_clock::time_point now) -> void;
+  auto sweepLoop() -> void;
+  auto forward(const char *path, std::function<int(FileSystem &, const char *)> fn) -> int;
+  auto addOpenFiles(const char *path, int delta) -> void;
+};
+}
+
+#endif
@@ -0,0 +1,105 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "WorkStealingPool.h"
+
+#include <algorithm>
+#include <thread>
+
+using std::lock_guard;
+using std::mutex;
+using std::vector;
+
+namespace RT11FS {
+
+/**
+ * @param threads the number of threads to run tasks on, at least 1.
+ */
+WorkStealingPool::WorkStealingPool(int threads)
+  : threads(std::max(threads, 1))
+{
+  for (auto i = 0; i < this->threads; i++) {
+    queues.emplace_back(new Queue {});
+  }
+}
+
+/**
+ * Run tasks numbered from 0 to `tasks' - 1, returning once all of them 
+ * have been run.
+ *
+ * Tasks must not throw.
+ *
+ * @param tasks the number of tasks.
+ * @param task called once for each task, with the task's number and the 
+ * number of the thread running it, from 0 to getThreads() - 1.
+ */
+auto WorkStealingPool::run(size_t tasks, const Task &task) -> void
+{
+  for (auto i = size_t {0}; i < tasks; i++) {
+    queues[i % threads]->tasks.push_back(i);
+  }
+
+  auto workers = vector<std::thread> {};
+  for (auto i = 1; i < threads; i++) {
+    workers.emplace_back([this, i, &task]() { work(i, task); });
+  }
+
+  // the calling thread is worker 0
+  work(0, task);
+
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+/**
+ * Run tasks on one thread until there are none left anywhere.
+ *
+ * @param worker the number of the thread.
+ * @param task the function to run each task with.
+ */
+auto WorkStealingPool::work(int worker, const Task &task) -> void
+{
+  auto next = size_t {0};
+  while (this->next(worker, next)) {
+    task(next, worker);
+  }
+}
+
+/**
+ * Take the next task for a thread, from its own queue if it can or else
+ * from another thread's.
+ *
+ * No tasks are added once the pool is running, so when every queue is 
+ * empty the thread is done.
+ *
+ * @param worker the number of the thread.
+ * @param task on success, the task to run.
+ * @return true if there was a task.
+ */
+auto WorkStealingPool::next(int worker, size_t &task) -> bool
+{
+  {
+    auto &own = *queues[worker];
+    lock_guard<mutex> lock {own.lock};
+    if (!own.tasks.empty()) {
+      task = own.tasks.back();
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+
+  for (auto i = 1; i < threads; i++) {
+    auto &victim = *queues[(worker + i) % threads];
+    lock_guard<mutex> lock {victim.lock};
+    if (!victim.tasks.empty()) {
+      task = victim.tasks.front();
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+}
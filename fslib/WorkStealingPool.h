@@ -0,0 +1,54 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __WORKSTEALINGPOOL_H_
+#define __WORKSTEALINGPOOL_H_
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace RT11FS {
+/**
+ * Runs a fixed set of tasks on a pool of threads.
+ *
+ * The tasks are dealt out to the threads up front. Each thread works 
+ * through its own queue from the back, and once that's empty, takes tasks 
+ * from the front of the other threads' queues, so a thread which was dealt
+ * quick tasks helps out with the slow ones rather than going idle.
+ */
+class WorkStealingPool
+{
+public:
+  using Task = std::function<void(size_t task, int worker)>;
+
+  WorkStealingPool(int threads);
+
+  auto run(size_t tasks, const Task &task) -> void;
+
+  /**
+   * @return the number of threads the pool runs tasks on.
+   */
+  auto getThreads() const { return threads; }
+
+private:
+  /**
+   * The tasks dealt to one thread.
+   */
+  struct Queue {
+    std::mutex lock;              /*!< protects `tasks' */
+    std::deque<size_t> tasks;
+  };
+
+  int threads;
+  std::vector<std::unique_ptr<Queue>> queues;
+
+  auto work(int worker, const Task &task) -> void;
+  auto next(int worker, size_t &task) -> bool;
+};
+}
+
+#endif
@@ -0,0 +1,22 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#ifndef __WRITEBACKPOLICY_H_
+#define __WRITEBACKPOLICY_H_
+
+namespace RT11FS {
+/**
+ * When data written to the volume is flushed from the block cache to disk.
+ *
+ * Whatever the policy, `fsync' writes the file and the directory, and 
+ * everything is written when the volume is unmounted. Under the policies
+ * other than `Immediate', anything else left dirty is written once it is 
+ * older than the volume's dirty age limit.
+ */
+enum class WriteBackPolicy {
+  PerFile,          /*!< closing a file writes its data; the directory waits */
+  Immediate,        /*!< closing a file writes everything that is dirty */
+  Deferred,         /*!< closing a file writes nothing */
+};
+}
+#endif
@@ -1,60 +1,120 @@
 // Copyright 2017 Jim Geist. This software is licensed under the 
 // MIT license as described in the file LICENSE.txt.
 
+#include "CompressedDataSource.h"
+#include "Directory.h"
+#include "FileDataSource.h"
 #include "FileSystem.h"
+#include "FilesystemException.h"
+#include "ImageScanner.h"
 #include "LogUnimpl.h"
+#include "VolumeSet.h"
 
+#include <algorithm>
+#include <fcntl.h>
 #include <fuse.h>
 #include <iostream>
 #include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
+#include <dirent.h>
+#include <memory>
+#include <set>
 #include <string>
-
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using RT11FS::CompressedDataSource;
+using RT11FS::DataSource;
+using RT11FS::FileDataSource;
 using RT11FS::FileSystem;
+using RT11FS::FileSystemOptions;
+using RT11FS::FilesystemException;
+using RT11FS::ImageScanner;
+using RT11FS::ScanOptions;
+using RT11FS::VolumeSet;
+using RT11FS::WriteBackPolicy;
 
 using std::cerr;
 using std::endl;
 using std::string;
+using std::vector;
 
 namespace {
 struct rt11_config
 {
   char *image;
   int listdir;
+  unsigned cachekb;
+  int mmap;
+  int ioUring;
+  int squeeze;
+  int squeezeSectors;
+  int verbose;
+  char *writeBack;
+  int maxDirtySeconds;
+  int backgroundFlush;
+  int zeroCopy;
+  char *overlay;
+  int commitOverlay;
+  int discardOverlay;
+  char *imageDir;
+  int idleSeconds;
 };
 
+// the callbacks are instantiated for either a FileSystem or a VolumeSet
+template <typename FS>
 static auto getFS()
 {
-  return reinterpret_cast<FileSystem*>(fuse_get_context()->private_data);
+  return reinterpret_cast<FS*>(fuse_get_context()->private_data);
+}
+
+template <typename FS>
+auto rt11_init(struct fuse_conn_info *) -> void *
+{
+  auto fs = getFS<FS>();
+  fs->init();
+  return fs;
 }
 
+template <typename FS>
 auto rt11_getattr(const char *path, struct stat *stbuf) -> int
 {
-  return getFS()->getattr(path, stbuf);
+  return getFS<FS>()->getattr(path, stbuf);
 }
 
+template <typename FS>
 auto rt11_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) -> int
 {
-  return getFS()->fgetattr(path, stbuf, fi);
+  return getFS<FS>()->fgetattr(path, stbuf, fi);
 }
 
+template <typename FS>
 auto rt11_statfs(const char *path, struct statvfs *vfs) -> int
 {
-  return getFS()->statfs(path, vfs);
+  return getFS<FS>()->statfs(path, vfs);
 }
 
+template <typename FS>
 auto rt11_chmod(const char *path, mode_t mode) -> int
 {
-  return getFS()->chmod(path, mode);
+  return getFS<FS>()->chmod(path, mode);
 }
 
+template <typename FS>
 auto rt11_unlink(const char *path) -> int
 {
-  return getFS()->unlink(path);
+  return getFS<FS>()->unlink(path);
 }
 
+template <typename FS>
 auto rt11_rename(const char *oldName, const char *newName) -> int
 { 
-  return getFS()->rename(oldName, newName);
+  return getFS<FS>()->rename(oldName, newName);
 }
 
 auto rt11_opendir(const char *, struct fuse_file_info *) -> int
@@ -67,79 +127,419 @@ auto rt11_releasedir(const char *, struct fuse_file_info *) -> int
   return 0;
 }
 
+template <typename FS>
 auto rt11_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   off_t offset, struct fuse_file_info *fi) -> int
 {
-  return getFS()->readdir(path, buf, filler, offset, fi);
+  return getFS<FS>()->readdir(path, buf, filler, offset, fi);
 }
 
+template <typename FS>
 auto rt11_open(const char *path, struct fuse_file_info *fi)
 {
-  return getFS()->open(path, fi);
+  return getFS<FS>()->open(path, fi);
 }
 
+template <typename FS>
 auto rt11_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-  return getFS()->create(path, mode, fi);
+  return getFS<FS>()->create(path, mode, fi);
 }
 
+template <typename FS>
 auto rt11_release(const char *path, struct fuse_file_info *fi)
 {
-  return getFS()->release(path, fi);
+  return getFS<FS>()->release(path, fi);
 }
 
+template <typename FS>
 auto rt11_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) -> int
 {
-  return getFS()->ftruncate(path, size, fi);
+  return getFS<FS>()->ftruncate(path, size, fi);
 }
 
+template <typename FS>
 auto rt11_read(const char *path, char *buf, size_t count, off_t offset, struct fuse_file_info *fi)
 {
-  return getFS()->read(path, buf, count, offset, fi);
+  return getFS<FS>()->read(path, buf, count, offset, fi);
 }
 
+template <typename FS>
 auto rt11_write(const char *path, const char *buf, size_t count, off_t offset, struct fuse_file_info *fi)
 {
-  return getFS()->write(path, buf, count, offset, fi); 
+  return getFS<FS>()->write(path, buf, count, offset, fi); 
+}
+
+template <typename FS>
+auto rt11_read_buf(const char *path, struct fuse_bufvec **bufp, size_t count, off_t offset, struct fuse_file_info *fi)
+{
+  return getFS<FS>()->readBuf(path, bufp, count, offset, fi);
 }
 
+template <typename FS>
+auto rt11_write_buf(const char *path, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi)
+{
+  return getFS<FS>()->writeBuf(path, bufv, offset, fi);
+}
+
+template <typename FS>
 auto rt11_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
 {
-  return getFS()->fsync(path, isdatasync, fi);
+  return getFS<FS>()->fsync(path, isdatasync, fi);
 }
 
-auto build_oper(struct fuse_operations *oper)
+template <typename FS>
+auto build_oper(struct fuse_operations *oper, bool zeroCopy)
 {
+  // anything not set here must be null for FUSE to fall back on its defaults
+  memset(oper, 0, sizeof(*oper));
   add_unimpl(oper);
 
-  oper->getattr = &rt11_getattr;
-  oper->fgetattr = &rt11_fgetattr;
-  oper->statfs = &rt11_statfs;
-  oper->chmod = &rt11_chmod;
-  oper->unlink = &rt11_unlink;
-  oper->rename = &rt11_rename;
+  oper->init = &rt11_init<FS>;
+  oper->getattr = &rt11_getattr<FS>;
+  oper->fgetattr = &rt11_fgetattr<FS>;
+  oper->statfs = &rt11_statfs<FS>;
+  oper->chmod = &rt11_chmod<FS>;
+  oper->unlink = &rt11_unlink<FS>;
+  oper->rename = &rt11_rename<FS>;
   oper->opendir = &rt11_opendir;
   oper->releasedir = &rt11_releasedir;
-  oper->readdir = &rt11_readdir;
-  oper->open = &rt11_open;
-  oper->create = &rt11_create;
-  oper->release = &rt11_release;
-  oper->ftruncate = &rt11_ftruncate;
-  oper->read = &rt11_read;
-  oper->write = &rt11_write;
-  oper->fsync = &rt11_fsync;
+  oper->readdir = &rt11_readdir<FS>;
+  oper->open = &rt11_open<FS>;
+  oper->create = &rt11_create<FS>;
+  oper->release = &rt11_release<FS>;
+  oper->ftruncate = &rt11_ftruncate<FS>;
+  oper->read = &rt11_read<FS>;
+  oper->write = &rt11_write<FS>;
+  oper->fsync = &rt11_fsync<FS>;
+
+  if (zeroCopy) {
+    oper->read_buf = &rt11_read_buf<FS>;
+    oper->write_buf = &rt11_write_buf<FS>;
+  }
 }
 
 auto usage(const string &program)
 {
-  cerr << "usage: " << program << " disk-image mountpoint" << endl;
+  cerr << "usage: " << program << " mountpoint -i disk-image [-c cache-kbytes] [-m] [-u] [-q sectors] [-w immediate|file|deferred] [-a seconds] [-b] [-z] [-O delta-file [-C|-X]] [-v] [-d] [-S]" << endl;
+  cerr << "       " << program << " mountpoint -I image-directory [-T idle-seconds] [-c cache-kbytes] [-m] [-u] [-q sectors] [-w immediate|file|deferred] [-a seconds] [-b] [-z] [-v]" << endl;
+  cerr << "       " << program << " compress raw-image compressed-image [chunk-kbytes]" << endl;
+  cerr << "       " << program << " decompress compressed-image raw-image" << endl;
+  cerr << "       " << program << " put disk-image host-file..." << endl;
+  cerr << "       " << program << " get disk-image [file...]" << endl;
+  cerr << "       " << program << " scan [-j threads] [-H] [-c cache-kbytes] image-or-directory..." << endl;
   exit(1);
 }
 
+/**
+ * Copy an image from one data source to a raw image file.
+ *
+ * @return 0 on success or a negated errno
+ */
+auto copyImage(DataSource *from, int toFd) -> int
+{
+  struct stat st;
+  auto err = from->stat(&st);
+  if (err < 0) {
+    return err;
+  }
+
+  FileDataSource to {toFd};
+  auto buffer = vector<char>(CompressedDataSource::DEFAULT_CHUNK_BYTES);
+  for (auto offset = off_t {0}; offset < st.st_size; offset += buffer.size()) {
+    auto bytes = std::min<off_t>(buffer.size(), st.st_size - offset);
+    auto xfer = from->read(buffer.data(), bytes, offset);
+    if (xfer >= 0) {
+      xfer = to.write(buffer.data(), bytes, offset);
+    }
+    if (xfer < 0) {
+      return static_cast<int>(xfer);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Run the `compress' or `decompress' command, which convert between raw 
+ * images and compressed image containers.
+ *
+ * @return the process exit code
+ */
+auto convert(const string &program, int argc, char *argv[]) -> int
+{
+  auto command = string {argv[1]};
+  auto compress = command == "compress";
+
+  if (argc != 4 && !(compress && argc == 5)) {
+    usage(program);
+  }
+
+  auto chunkBytes = CompressedDataSource::DEFAULT_CHUNK_BYTES;
+  if (argc == 5) {
+    chunkBytes = static_cast<size_t>(strtoul(argv[4], nullptr, 10)) * 1024;
+  }
+
+  auto inFd = ::open(argv[2], O_RDONLY);
+  if (inFd == -1) {
+    cerr << program << ": could not open " << argv[2] << ": " << strerror(errno) << endl;
+    return 1;
+  }
+
+  if (compress == CompressedDataSource::isContainer(inFd)) {
+    cerr << program << ": " << argv[2] << (compress ? " is already compressed" : " is not compressed") << endl;
+    ::close(inFd);
+    return 1;
+  }
+
+  auto outFd = ::open(argv[3], O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if (outFd == -1) {
+    cerr << program << ": could not create " << argv[3] << ": " << strerror(errno) << endl;
+    ::close(inFd);
+    return 1;
+  }
+
+  auto err = 0;
+  try {
+    if (compress) {
+      FileDataSource from {inFd};
+      err = CompressedDataSource::create(&from, outFd, chunkBytes);
+      ::close(outFd);
+    } else {
+      CompressedDataSource from {inFd};
+      err = copyImage(&from, outFd);
+    }
+  } catch (const FilesystemException &ex) {
+    cerr << program << ": " << ex.what() << endl;
+    return 1;
+  }
+
+  if (err < 0) {
+    cerr << program << ": " << command << " failed: " << strerror(-err) << endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Run the `put' or `get' command, which copy files between the host and an
+ * unmounted image in one batch.
+ *
+ * `put' names each file on the volume after the host file, in upper case.
+ * `get' writes each file into the current directory, and gets every file on
+ * the volume if none are named.
+ *
+ * @return the process exit code
+ */
+auto transfer(const string &program, int argc, char *argv[]) -> int
+{
+  auto put = string {argv[1]} == "put";
+  if (argc < 3 || (put && argc < 4)) {
+    usage(program);
+  }
+
+  FileSystemOptions options;
+  memset(&options, 0, sizeof(options));
+  options.writeBack = WriteBackPolicy::Deferred;
+
+  try {
+    FileSystem fs {argv[2], options};
+
+    auto names = vector<string> {};
+    for (auto i = 3; i < argc; i++) {
+      auto name = string {argv[i]};
+      if (put) {
+        auto slash = name.rfind('/');
+        name = slash == string::npos ? name : name.substr(slash + 1);
+        std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+      }
+      names.push_back(name);
+    }
+
+    if (!put && names.empty()) {
+      auto dir = fs.getDirectory();
+      const auto &entries = dir->getEntries();
+      auto ent = RT11FS::DirEnt {};
+      for (
+        auto row = entries.find(0, RT11FS::Dir::E_PERM); 
+        row < entries.size(); 
+        row = entries.find(row + 1, RT11FS::Dir::E_PERM)
+      ) {
+        dir->getEnt(entries, row, ent);
+        names.push_back(ent.name);
+      }
+    }
+
+    auto sources = vector<std::unique_ptr<FileDataSource>> {};
+    auto files = vector<RT11FS::BatchTransfer::File> {};
+    for (auto i = 0; i < names.size(); i++) {
+      auto path = put ? argv[i + 3] : names[i].c_str();
+      auto fd = put ? ::open(path, O_RDONLY) : ::open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+      if (fd == -1) {
+        cerr << program << ": could not open " << path << ": " << strerror(errno) << endl;
+        return 1;
+      }
+
+      sources.push_back(std::make_unique<FileDataSource>(fd));
+      files.push_back(RT11FS::BatchTransfer::File {names[i], sources.back().get()});
+    }
+
+    auto err = put ? fs.put(files) : fs.get(files);
+    if (err < 0) {
+      cerr << program << ": " << argv[1] << " failed: " << strerror(-err) << endl;
+      return 1;
+    }
+  } catch (const FilesystemException &ex) {
+    cerr << program << ": " << ex.what() << endl;
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Add an image to scan, or if it's a directory, every regular file beneath it.
+ *
+ * Symbolic links are followed, but each file or directory is only visited 
+ * once, however many ways it can be reached, so links which loop back up the
+ * tree end. A path which can't be read is noted and skipped, so that the rest
+ * of the tree is still scanned.
+ *
+ * @param path the image or directory.
+ * @param images the images found so far, to add to.
+ * @param unreadable the paths which couldn't be read so far, with why, to add
+ * to.
+ * @param seen the device and inode of every file and directory visited so far.
+ */
+auto addScanPath(
+  const string &path, vector<string> &images, vector<ImageScanner::Result> &unreadable, 
+  std::set<std::pair<dev_t, ino_t>> &seen) -> void
+{
+  auto fail = [&path, &unreadable](int err) {
+    auto result = ImageScanner::Result {};
+    result.image = path;
+    result.error = strerror(err);
+    unreadable.push_back(result);
+  };
+
+  struct stat st;
+  if (::stat(path.c_str(), &st) == -1) {
+    fail(errno);
+    return;
+  }
+
+  if (!seen.insert(std::make_pair(st.st_dev, st.st_ino)).second) {
+    return;
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    images.push_back(path);
+    return;
+  }
+
+  auto dir = ::opendir(path.c_str());
+  if (dir == nullptr) {
+    fail(errno);
+    return;
+  }
+
+  auto names = vector<string> {};
+  while (auto ent = ::readdir(dir)) {
+    if (ent->d_name[0] != '.') {
+      names.push_back(ent->d_name);
+    }
+  }
+  ::closedir(dir);
+
+  // so that the same tree is always scanned in the same order
+  std::sort(names.begin(), names.end());
+
+  for (const auto &name : names) {
+    auto child = path + "/" + name;
+    if (::stat(child.c_str(), &st) == 0 && (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+      addScanPath(child, images, unreadable, seen);
+    }
+  }
+}
+
+/**
+ * Run the `scan' command, which checks and inventories many images offline
+ * and writes one line of JSON per image to stdout.
+ *
+ * @return the process exit code: 0 if every image is sound, 2 if any has 
+ * problems or couldn't be read
+ */
+auto scan(const string &program, int argc, char *argv[]) -> int
+{
+  ScanOptions options;
+  memset(&options, 0, sizeof(options));
+
+  auto arg = 2;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    auto flag = string {argv[arg]};
+    if (flag == "-H") {
+      options.hash = true;
+    } else if ((flag == "-j" || flag == "-c") && arg + 1 < argc) {
+      auto value = strtoul(argv[++arg], nullptr, 10);
+      if (flag == "-j") {
+        options.threads = static_cast<int>(value);
+      } else {
+        options.cacheBytes = static_cast<size_t>(value) * 1024;
+      }
+    } else {
+      usage(program);
+    }
+  }
+
+  if (arg == argc) {
+    usage(program);
+  }
+
+  auto images = vector<string> {};
+  auto unreadable = vector<ImageScanner::Result> {};
+  auto seen = std::set<std::pair<dev_t, ino_t>> {};
+  for (; arg < argc; arg++) {
+    addScanPath(argv[arg], images, unreadable, seen);
+  }
+
+  auto emit = [](const string &line) {
+    fwrite(line.data(), 1, line.size(), stdout);
+    fputc('\n', stdout);
+  };
+
+  // paths which couldn't be searched are reported like images which 
+  // couldn't be read
+  for (const auto &result : unreadable) {
+    emit(ImageScanner::toJson(result, false));
+  }
+
+  auto scanner = ImageScanner {options};
+  auto failed = scanner.scan(images, emit) + static_cast<int>(unreadable.size());
+  fflush(stdout);
+
+  return failed == 0 ? 0 : 2;
+}
+
 struct fuse_opt rt11_opts[] = 
 {
   { "-i %s", offsetof(struct rt11_config, image), 0 },
   { "-d",    offsetof(struct rt11_config, listdir), 1},
+  { "-c %u", offsetof(struct rt11_config, cachekb), 0 },
+  { "-m",    offsetof(struct rt11_config, mmap), 1 },
+  { "-u",    offsetof(struct rt11_config, ioUring), 1 },
+  { "-q %d", offsetof(struct rt11_config, squeezeSectors), 0 },
+  { "-S",    offsetof(struct rt11_config, squeeze), 1 },
+  { "-v",    offsetof(struct rt11_config, verbose), 1 },
+  { "-w %s", offsetof(struct rt11_config, writeBack), 0 },
+  { "-a %d", offsetof(struct rt11_config, maxDirtySeconds), 0 },
+  { "-b",    offsetof(struct rt11_config, backgroundFlush), 1 },
+  { "-z",    offsetof(struct rt11_config, zeroCopy), 1 },
+  { "-O %s", offsetof(struct rt11_config, overlay), 0 },
+  { "-C",    offsetof(struct rt11_config, commitOverlay), 1 },
+  { "-X",    offsetof(struct rt11_config, discardOverlay), 1 },
+  { "-I %s", offsetof(struct rt11_config, imageDir), 0 },
+  { "-T %d", offsetof(struct rt11_config, idleSeconds), 0 },
   FUSE_OPT_END,
 };
 
@@ -155,30 +555,120 @@ auto main(int argc, char *argv[]) -> int
   
   memset(&config, 0, sizeof(config));
 
+  if (argc > 1 && (string {argv[1]} == "compress" || string {argv[1]} == "decompress")) {
+    return convert(argv[0], argc, argv);
+  }
+
+  if (argc > 1 && (string {argv[1]} == "put" || string {argv[1]} == "get")) {
+    return transfer(argv[0], argc, argv);
+  }
+
+  if (argc > 1 && string {argv[1]} == "scan") {
+    return scan(argv[0], argc, argv);
+  }
+
   if (fuse_opt_parse(&args, &config, rt11_opts, NULL) == -1) {
     usage(argv[0]);
   }
 
-  if (config.image == NULL) {
-    cerr << argv[0] << ": must specify an image to mount" << endl;
+  if ((config.image == NULL) == (config.imageDir == NULL)) {
+    cerr << argv[0] << ": must specify either an image or a directory of images to mount" << endl;
+    usage(argv[0]);
+  }
+
+  if (config.imageDir != NULL && (config.overlay || config.listdir || config.squeeze)) {
+    cerr << argv[0] << ": -O, -d and -S can't be used with -I" << endl;
     usage(argv[0]);
   }
 
   // make FUSE responsible for enforcing permission bits
   fuse_opt_add_arg(&args, "-odefault_permissions");
 
-  // the file system isn't thread safe; make FUSE serialize requests
-  // (it isn't likely that perf will be enough of an issues that this will ever matter)
-  fuse_opt_add_arg(&args, "-s");
+  // the image is locked while it's mounted, so nothing but this mount changes 
+  // it and the kernel may hold on to attributes and failed lookups for a while
+  auto timeout = std::to_string(FileSystem::ATTR_TIMEOUT_SECONDS);
+  auto timeouts = "-oattr_timeout=" + timeout + ",entry_timeout=" + timeout + ",negative_timeout=" + timeout;
+  fuse_opt_add_arg(&args, timeouts.c_str());
+
+  FileSystemOptions options;
+  memset(&options, 0, sizeof(options));
+  options.cacheBytes = static_cast<size_t>(config.cachekb) * 1024;
+  options.mmap = config.mmap != 0;
+  options.ioUring = config.ioUring != 0;
+  options.squeezeSectors = config.squeezeSectors;
+  options.verbose = config.verbose != 0;
+  options.maxDirtySeconds = config.maxDirtySeconds;
+  options.backgroundFlush = config.backgroundFlush != 0;
+  options.writeBack = WriteBackPolicy::PerFile;
+  options.overlay = config.overlay;
+  options.commitOverlay = config.commitOverlay != 0;
+
+  if ((config.commitOverlay || config.discardOverlay) && config.overlay == NULL) {
+    cerr << argv[0] << ": -C and -X require an overlay" << endl;
+    usage(argv[0]);
+  }
+
+  if (config.writeBack != NULL) {
+    auto policy = string {config.writeBack};
+    if (policy == "immediate") {
+      options.writeBack = WriteBackPolicy::Immediate;
+    } else if (policy == "file") {
+      options.writeBack = WriteBackPolicy::PerFile;
+    } else if (policy == "deferred") {
+      options.writeBack = WriteBackPolicy::Deferred;
+    } else {
+      cerr << argv[0] << ": unknown write back policy " << policy << endl;
+      usage(argv[0]);
+    }
+  }
+
+  if (config.imageDir != NULL) {
+    VolumeSet volumes {
+      config.imageDir, 
+      options, 
+      config.idleSeconds ? config.idleSeconds : VolumeSet::DEFAULT_IDLE_SECONDS
+    };
 
-  FileSystem fs {config.image};
+    build_oper<VolumeSet>(&rt11_oper, config.zeroCopy != 0);
+    exitcode = fuse_main(args.argc, args.argv, &rt11_oper, &volumes);
+
+    fuse_opt_free_args(&args);
+    return exitcode;
+  }
+
+  FileSystem fs {config.image, options};
+
+  if (config.commitOverlay || config.discardOverlay) {
+    auto err = config.commitOverlay ? fs.commitOverlay() : fs.discardOverlay();
+    if (err < 0) {
+      cerr << argv[0] << ": overlay " << (config.commitOverlay ? "commit" : "discard") << " failed: " << strerror(-err) << endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  if (config.squeeze) {
+    auto err = fs.squeeze();
+    if (err < 0) {
+      cerr << argv[0] << ": squeeze failed: " << strerror(-err) << endl;
+      return 1;
+    }
+  }
 
   if (config.listdir) {
     fs.lsdir();
     return 0;
   }
 
-  build_oper(&rt11_oper);
+  if (config.squeeze) {
+    return 0;
+  }
+
+  if (fs.isReadOnly()) {
+    fuse_opt_add_arg(&args, "-oro");
+  }
+
+  build_oper<FileSystem>(&rt11_oper, config.zeroCopy != 0);
   exitcode = fuse_main(args.argc, args.argv, &rt11_oper, &fs);
 
   fuse_opt_free_args(&args);
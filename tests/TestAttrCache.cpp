@@ -0,0 +1,58 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "AttrCache.h"
+#include "gtest/gtest.h"
+
+#include <cerrno>
+#include <string>
+
+using namespace RT11FS;
+
+using std::string;
+
+TEST(AttrCache, RemembersLookups)
+{
+  AttrCache cache;
+  auto attr = AttrCache::Attr {};
+
+  EXPECT_FALSE(cache.lookup("/HELLO.TXT", 1, attr));
+
+  attr.err = 0;
+  attr.st.st_size = 512;
+  attr.segment = 1;
+  attr.index = 2;
+  cache.insert("/HELLO.TXT", 1, attr);
+
+  attr.err = -ENOENT;
+  cache.insert("/.DS_Store", 1, attr);
+
+  auto found = AttrCache::Attr {};
+  EXPECT_TRUE(cache.lookup("/HELLO.TXT", 1, found));
+  EXPECT_EQ(found.err, 0);
+  EXPECT_EQ(found.st.st_size, 512);
+  EXPECT_EQ(found.index, 2);
+
+  // failed lookups are remembered too
+  EXPECT_TRUE(cache.lookup("/.DS_Store", 1, found));
+  EXPECT_EQ(found.err, -ENOENT);
+
+  // once the directory changes, nothing is remembered
+  EXPECT_FALSE(cache.lookup("/HELLO.TXT", 2, found));
+  EXPECT_FALSE(cache.lookup("/.DS_Store", 2, found));
+}
+
+TEST(AttrCache, StaysBounded)
+{
+  AttrCache cache;
+  auto attr = AttrCache::Attr {};
+  attr.err = -ENOENT;
+
+  for (auto i = size_t {0}; i <= AttrCache::MAX_ENTRIES; i++) {
+    cache.insert("/PROBE" + std::to_string(i), 1, attr);
+  }
+
+  auto found = AttrCache::Attr {};
+  EXPECT_FALSE(cache.lookup("/PROBE0", 1, found));
+  EXPECT_TRUE(cache.lookup("/PROBE" + std::to_string(AttrCache::MAX_ENTRIES), 1, found));
+}
@@ -0,0 +1,164 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#include "BatchTransfer.h"
+#include "Block.h"
+#include "BlockCache.h"
+#include "DirConst.h"
+#include "Directory.h"
+#include "DirectoryBuilder.h"
+#include "MemoryDataSource.h"
+#include "gtest/gtest.h"
+
+#include <cerrno>
+#include <memory>
+#include <vector>
+
+using namespace RT11FS;
+using namespace RT11FS::Dir;
+
+using std::make_unique;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+class BatchTransferTest : public ::testing::Test
+{
+protected:
+  static const int sectors = 1024;
+
+  BatchTransferTest()
+    : dataSource(make_unique<MemoryDataSource>(sectors * Block::SECTOR_SIZE))
+    , blockCache(make_unique<BlockCache>(dataSource.get()))
+    , builder(*dataSource.get())
+  {
+    // two holes in the free space: 5 sectors at 18, and the rest from 26
+    using Ent = DirectoryBuilder::DirEntry;
+    builder.formatWithEntries(1, {
+      {
+        Ent {E_PERM, 10, { 1, 2, 3 }},
+        Ent {E_MPTY, 5},
+        Ent {E_PERM, 3, { 4, 5, 6 }},
+        Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+        Ent {E_EOS},
+      },
+    });
+  }
+
+  /**
+   * Make host data of a given size, with a different pattern for each file.
+   */
+  static auto makeData(size_t bytes, int seed)
+  {
+    auto data = make_unique<MemoryDataSource>(bytes);
+    for (auto i = size_t {0}; i < bytes; i++) {
+      data->getData()[i] = (i * 13 + seed) & 0xff;
+    }
+    return data;
+  }
+
+  static auto sector0(Directory &dir, const char *name)
+  {
+    auto ent = DirEnt {};
+    return dir.getEnt(name, ent) == 0 ? ent.sector0 : -1;
+  }
+
+  unique_ptr<MemoryDataSource> dataSource;
+  unique_ptr<BlockCache> blockCache;
+  DirectoryBuilder builder;
+};
+
+const int BatchTransferTest::sectors;
+}
+
+TEST_F(BatchTransferTest, PutAllocatesBestFit)
+{
+  auto dir = Directory {blockCache.get()};
+  auto batch = BatchTransfer {&dir, blockCache.get()};
+
+  auto a = makeData(2000, 1);
+  auto b = makeData(300 * Block::SECTOR_SIZE, 2);
+  auto c = makeData(0, 3);
+  auto d = makeData(700, 4);
+
+  EXPECT_EQ(batch.put({
+    {"A.DAT", a.get()},
+    {"B.DAT", b.get()},
+    {"C.DAT", c.get()},
+    {"D.DAT", d.get()},
+  }), 0);
+
+  // largest first, each into the smallest hole that holds it
+  EXPECT_EQ(sector0(dir, "B.DAT"), 26);
+  EXPECT_EQ(sector0(dir, "A.DAT"), 18);
+  EXPECT_EQ(sector0(dir, "D.DAT"), 326);
+  EXPECT_EQ(sector0(dir, "C.DAT"), 22);
+  EXPECT_TRUE(dir.verifyUsage());
+
+  // nothing is left dirty, and the data is on disk
+  EXPECT_EQ(blockCache->getDirtyBytes(), 0);
+  auto &image = dataSource->getData();
+  EXPECT_TRUE(std::equal(
+    b->getData().begin(), b->getData().end(),
+    image.begin() + 26 * Block::SECTOR_SIZE));
+
+  // short files come back padded out to whole sectors
+  auto out = make_unique<MemoryDataSource>(2 * Block::SECTOR_SIZE);
+  EXPECT_EQ(batch.get({{"D.DAT", out.get()}}), 0);
+  auto expect = d->getData();
+  expect.resize(2 * Block::SECTOR_SIZE);
+  EXPECT_EQ(out->getData(), expect);
+
+  EXPECT_EQ(batch.get({{"E.DAT", out.get()}}), -ENOENT);
+}
+
+TEST_F(BatchTransferTest, PutReplacesAndRollsBack)
+{
+  auto dir = Directory {blockCache.get()};
+  auto batch = BatchTransfer {&dir, blockCache.get()};
+
+  auto small = makeData(Block::SECTOR_SIZE, 1);
+  auto large = makeData(6 * Block::SECTOR_SIZE, 1);
+  EXPECT_EQ(batch.put({{"A.DAT", large.get()}}), 0);
+  EXPECT_EQ(sector0(dir, "A.DAT"), 26);
+
+  // putting a file again replaces it; this time it fits in the hole
+  EXPECT_EQ(batch.put({{"A.DAT", small.get()}}), 0);
+  EXPECT_EQ(sector0(dir, "A.DAT"), 18);
+
+  // if anything doesn't fit, none of the batch is kept
+  auto huge = makeData(1000 * Block::SECTOR_SIZE, 2);
+  EXPECT_EQ(batch.put({{"B.DAT", small.get()}, {"C.DAT", huge.get()}}), -ENOSPC);
+  EXPECT_EQ(sector0(dir, "B.DAT"), -1);
+  EXPECT_EQ(sector0(dir, "C.DAT"), -1);
+  EXPECT_TRUE(dir.verifyUsage());
+
+  EXPECT_EQ(batch.put({{"B.DAT", small.get()}, {"B.DAT", small.get()}}), -EINVAL);
+  EXPECT_EQ(batch.put({{"TOOLONGNAME.DAT", small.get()}}), -EINVAL);
+}
+
+TEST_F(BatchTransferTest, PutOverExistingFile)
+{
+  auto dir = Directory {blockCache.get()};
+  auto batch = BatchTransfer {&dir, blockCache.get()};
+
+  // the first copy's sectors stay cached, in a block of a different size
+  // than the second copy is written in
+  auto first = makeData(6 * Block::SECTOR_SIZE, 1);
+  auto second = makeData(10 * Block::SECTOR_SIZE, 2);
+  EXPECT_EQ(batch.put({{"A.DAT", first.get()}}), 0);
+  EXPECT_EQ(sector0(dir, "A.DAT"), 26);
+  EXPECT_EQ(batch.put({{"A.DAT", second.get()}}), 0);
+  EXPECT_EQ(sector0(dir, "A.DAT"), 26);
+  EXPECT_TRUE(dir.verifyUsage());
+
+  auto out = make_unique<MemoryDataSource>(10 * Block::SECTOR_SIZE);
+  EXPECT_EQ(batch.get({{"A.DAT", out.get()}}), 0);
+  EXPECT_EQ(out->getData(), second->getData());
+
+  auto &image = dataSource->getData();
+  EXPECT_TRUE(std::equal(
+    second->getData().begin(), second->getData().end(),
+    image.begin() + 26 * Block::SECTOR_SIZE));
+}
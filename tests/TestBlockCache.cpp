@@ -7,20 +7,83 @@
 #include "FilesystemException.h"
 #include "gtest/gtest.h"
 
+#include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <cstring>
+#include <future>
 #include <memory>
 #include <stdexcept>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 
 using namespace RT11FS;
 
 using std::make_unique;
+using std::thread;
 using std::unique_ptr;
 using std::vector;
 
 namespace {
+class CountingDataSource : public MemoryDataSource
+{
+public:
+  CountingDataSource(size_t bytes) 
+    : MemoryDataSource(bytes)
+    , reads(0)
+    , writes(0) 
+  {
+  }
+
+  auto read(void *buffer, size_t bytes, off_t offset) -> ssize_t override
+  {
+    reads++;
+    return MemoryDataSource::read(buffer, bytes, offset);
+  }
+
+  auto write(void *buffer, size_t bytes, off_t offset) -> ssize_t override
+  {
+    writes++;
+    return MemoryDataSource::write(buffer, bytes, offset);
+  }
+
+  auto writev(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t override
+  {
+    writes++;
+    return MemoryDataSource::writev(iov, iovcnt, offset);
+  }
+
+  int reads;
+  int writes;
+};
+
+/**
+ * A data source whose writes can be made to fail.
+ */
+class FailingDataSource : public MemoryDataSource
+{
+public:
+  FailingDataSource(size_t bytes) 
+    : MemoryDataSource(bytes)
+    , failing(false)
+    , failures(0)
+  {
+  }
+
+  auto writev(const struct iovec *iov, int iovcnt, off_t offset) -> ssize_t override
+  {
+    if (failing) {
+      failures++;
+      return -EIO;
+    }
+    return MemoryDataSource::writev(iov, iovcnt, offset);
+  }
+
+  std::atomic<bool> failing;
+  std::atomic<int> failures;
+};
+
 class BlockCacheTest : public ::testing::Test
 {
 protected:
@@ -152,4 +215,509 @@ TEST_F(BlockCacheTest, ResizeErrors)
   }
 }
 
+TEST_F(BlockCacheTest, GetBlockHit)
+{
+  auto block = blockCache->getBlock(3, 1);
+  EXPECT_EQ(block->getRefCount(), 1);
+
+  // a second request for the same block must return the same object, even 
+  // if the underlying data has changed
+  data[3 * Block::SECTOR_SIZE] = 42;
+
+  auto again = blockCache->getBlock(3, 1);
+  EXPECT_EQ(again, block);
+  EXPECT_EQ(again->getRefCount(), 2);
+  EXPECT_NE(again->getByte(0), 42);
+
+  blockCache->putBlock(again);
+  blockCache->putBlock(block);
+  EXPECT_EQ(block->getRefCount(), 0);
+}
+
+TEST_F(BlockCacheTest, EvictLeastRecentlyUsed)
+{
+  BlockCache cache {dataSource.get(), 2 * Block::SECTOR_SIZE};
+
+  for (auto i = 0; i < 3; i++) {
+    data[i * Block::SECTOR_SIZE] = i;
+    cache.putBlock(cache.getBlock(i, 1));
+  }
+
+  // sector 0 was the least recently used, so it's the one that was dropped
+  EXPECT_EQ(cache.getCachedBytes(), 2 * Block::SECTOR_SIZE);
+
+  for (auto i = 0; i < 3; i++) {
+    data[i * Block::SECTOR_SIZE] = 10 + i;
+  }
+
+  auto block = cache.getBlock(0, 1);
+  EXPECT_EQ(block->getByte(0), 10);
+  cache.putBlock(block);
+
+  // bringing 0 back in pushed out 1, but 2 is still cached
+  block = cache.getBlock(2, 1);
+  EXPECT_EQ(block->getByte(0), 2);
+  cache.putBlock(block);
+
+  block = cache.getBlock(1, 1);
+  EXPECT_EQ(block->getByte(0), 11);
+  cache.putBlock(block);
+}
+
+TEST_F(BlockCacheTest, SharedBudget)
+{
+  CacheBudget budget {3 * Block::SECTOR_SIZE};
+  auto other = make_unique<MemoryDataSource>(sectors * Block::SECTOR_SIZE);
+
+  BlockCache first {dataSource.get(), BlockCache::DEFAULT_MAX_BYTES, &budget};
+
+  {
+    BlockCache second {other.get(), BlockCache::DEFAULT_MAX_BYTES, &budget};
+
+    for (auto i = 0; i < 2; i++) {
+      first.putBlock(first.getBlock(i, 1));
+      second.putBlock(second.getBlock(i, 1));
+    }
+
+    // each cache is well under its own cap, but together they're held to the
+    // budget; the one which went over paid for it
+    EXPECT_EQ(budget.getUsedBytes(), 3 * Block::SECTOR_SIZE);
+    EXPECT_EQ(first.getCachedBytes(), 2 * Block::SECTOR_SIZE);
+    EXPECT_EQ(second.getCachedBytes(), Block::SECTOR_SIZE);
+  }
+
+  // a destroyed cache gives its share back
+  EXPECT_EQ(budget.getUsedBytes(), 2 * Block::SECTOR_SIZE);
+  first.putBlock(first.getBlock(2, 1));
+  EXPECT_EQ(first.getCachedBytes(), 3 * Block::SECTOR_SIZE);
+}
+
+TEST_F(BlockCacheTest, NoEvictReferencedOrDirty)
+{
+  BlockCache cache {dataSource.get(), Block::SECTOR_SIZE};
+
+  auto held = cache.getBlock(0, 1);
+
+  auto dirty = cache.getBlock(1, 1);
+  dirty->setByte(0, 42);
+  cache.putBlock(dirty);
+
+  cache.putBlock(cache.getBlock(2, 1));
+
+  // only the clean, unreferenced block could be dropped
+  EXPECT_EQ(cache.getCachedBytes(), 2 * Block::SECTOR_SIZE);
+  EXPECT_EQ(data[Block::SECTOR_SIZE], 0);
+
+  // once it's written, the dirty block can go too
+  cache.sync();
+  EXPECT_EQ(data[Block::SECTOR_SIZE], 42);
+  EXPECT_EQ(cache.getCachedBytes(), Block::SECTOR_SIZE);
+
+  cache.putBlock(held);
+  EXPECT_EQ(cache.getCachedBytes(), Block::SECTOR_SIZE);
+
+  cache.setMaxBytes(0);
+  EXPECT_EQ(cache.getCachedBytes(), 0);
+}
+
+TEST_F(BlockCacheTest, ReadDirect)
+{
+  for (auto i = 0; i < sectors * Block::SECTOR_SIZE; i++) {
+    data[i] = i & 0xff;
+  }
+
+  // a dirty block in the middle of the range must win over the disk contents
+  auto block = blockCache->getBlock(3, 1);
+  block->setByte(0, 42);
+  block->setByte(Block::SECTOR_SIZE - 1, 43);
+  blockCache->putBlock(block);
+
+  auto offset = 2 * Block::SECTOR_SIZE + 100;
+  auto bytes = 2 * Block::SECTOR_SIZE;
+  auto buffer = vector<char>(bytes);
+
+  blockCache->readDirect(offset, bytes, &buffer[0]);
+
+  for (auto i = 0; i < bytes; i++) {
+    auto at = offset + i;
+    auto expect = static_cast<uint8_t>(at & 0xff);
+    if (at == 3 * Block::SECTOR_SIZE) {
+      expect = 42;
+    } else if (at == 4 * Block::SECTOR_SIZE - 1) {
+      expect = 43;
+    }
+    EXPECT_EQ(static_cast<uint8_t>(buffer[i]), expect) << "at offset " << at;
+  }
+
+  // the disk itself is untouched until sync
+  EXPECT_EQ(data[3 * Block::SECTOR_SIZE], 3 * Block::SECTOR_SIZE & 0xff);
+
+  try {
+    blockCache->readDirect((sectors - 1) * Block::SECTOR_SIZE, 2 * Block::SECTOR_SIZE, &buffer[0]);
+    FAIL() << "Reading past the end of the volume did not throw an exception";
+  } catch (FilesystemException &ex) {
+    EXPECT_EQ(ex.getError(), -EIO);
+  }
+}
+
+TEST_F(BlockCacheTest, SyncCoalescesAdjacentBlocks)
+{
+  auto counting = CountingDataSource {sectors * Block::SECTOR_SIZE};
+  BlockCache cache {&counting};
+
+  for (auto sector : { 2, 3, 4, 7 }) {
+    auto block = cache.getBlock(sector, 1);
+    block->setByte(0, sector);
+    cache.putBlock(block);
+  }
+
+  // a clean block in between breaks the run
+  cache.putBlock(cache.getBlock(5, 1));
+
+  cache.sync();
+  EXPECT_EQ(counting.writes, 2);
+
+  for (auto sector : { 2, 3, 4, 7 }) {
+    EXPECT_EQ(counting.getData()[sector * Block::SECTOR_SIZE], sector);
+  }
+
+  // nothing is dirty any more
+  cache.sync();
+  EXPECT_EQ(counting.writes, 2);
+}
+
+TEST_F(BlockCacheTest, SyncRange)
+{
+  auto counting = CountingDataSource {sectors * Block::SECTOR_SIZE};
+  BlockCache cache {&counting};
+
+  auto multi = cache.getBlock(2, 3);
+  multi->setByte(Block::SECTOR_SIZE, 1);
+  cache.putBlock(multi);
+
+  for (auto sector : { 8, 9 }) {
+    auto block = cache.getBlock(sector, 1);
+    block->setByte(0, sector);
+    cache.putBlock(block);
+  }
+
+  // a range that only overlaps the middle of a block still writes it
+  cache.syncRange(3, 1);
+  EXPECT_EQ(counting.writes, 1);
+  EXPECT_EQ(counting.getData()[3 * Block::SECTOR_SIZE], 1);
+  EXPECT_EQ(counting.getData()[8 * Block::SECTOR_SIZE], 0);
+
+  cache.syncRange(9, 4);
+  EXPECT_EQ(counting.writes, 2);
+  EXPECT_EQ(counting.getData()[8 * Block::SECTOR_SIZE], 0);
+  EXPECT_EQ(counting.getData()[9 * Block::SECTOR_SIZE], 9);
+
+  cache.sync();
+  EXPECT_EQ(counting.writes, 3);
+  EXPECT_EQ(counting.getData()[8 * Block::SECTOR_SIZE], 8);
+}
+
+TEST_F(BlockCacheTest, CopySectors)
+{
+  for (auto i = 0; i < sectors; i++) {
+    data[i * Block::SECTOR_SIZE] = i;
+  }
+
+  // a dirty source block must be written before it's copied
+  auto source = blockCache->getBlock(1, 1);
+  source->setByte(0, 100);
+  blockCache->putBlock(source);
+
+  // cached destination blocks, one still referenced
+  blockCache->putBlock(blockCache->getBlock(8, 1));
+  auto held = blockCache->getBlock(9, 1);
+  auto cachedBefore = blockCache->getCachedBytes();
+
+  blockCache->copySectors(0, 8, 4);
+
+  EXPECT_FALSE(source->isDirty());
+  EXPECT_EQ(data[8 * Block::SECTOR_SIZE], 0);
+  EXPECT_EQ(data[9 * Block::SECTOR_SIZE], 100);
+  EXPECT_EQ(data[11 * Block::SECTOR_SIZE], 3);
+
+  // the held block was refreshed and the other one dropped
+  EXPECT_EQ(held->getByte(0), 100);
+  EXPECT_EQ(blockCache->getCachedBytes(), cachedBefore - Block::SECTOR_SIZE);
+  blockCache->putBlock(held);
+
+  auto block = blockCache->getBlock(8, 1);
+  EXPECT_EQ(block->getByte(0), 0);
+  blockCache->putBlock(block);
+}
+
+TEST_F(BlockCacheTest, ConcurrentReaders)
+{
+  // a cap smaller than the working set keeps the threads racing misses 
+  // against evictions
+  BlockCache cache {dataSource.get(), 4 * Block::SECTOR_SIZE};
+
+  for (auto i = 0; i < sectors; i++) {
+    data[i * Block::SECTOR_SIZE] = i;
+    data[i * Block::SECTOR_SIZE + 1] = 0xa5;
+  }
+
+  auto failures = vector<int>(4);
+  auto threads = vector<thread> {};
+
+  for (auto t = 0; t < 4; t++) {
+    threads.emplace_back([&cache, &failures, t]() {
+      for (auto i = 0; i < 2000; i++) {
+        auto sector = (i * 7 + t) % sectors;
+        auto block = cache.getBlock(sector, 1);
+        if (block->extractWord(0) != (0xa500 | sector)) {
+          failures[t]++;
+        }
+        cache.putBlock(block);
+      }
+    });
+  }
+
+  for (auto &th : threads) {
+    th.join();
+  }
+
+  EXPECT_EQ(failures, vector<int>(4));
+  EXPECT_LE(cache.getCachedBytes(), 4 * Block::SECTOR_SIZE);
+}
+
+
+TEST_F(BlockCacheTest, FlusherWritesAgedBlocks)
+{
+  auto limits = BlockCache::FlushLimits {};
+  limits.highWaterBytes = sectors * Block::SECTOR_SIZE;
+  limits.hardLimitBytes = sectors * Block::SECTOR_SIZE;
+  limits.maxAge = std::chrono::milliseconds {20};
+  blockCache->startFlusher(limits);
+
+  auto block = blockCache->getBlock(3, 1);
+  block->setByte(0, 0x5a);
+  blockCache->putBlock(block);
+
+  // give the flusher up to a few seconds to get to it
+  for (auto i = 0; i < 500 && blockCache->getDirtyBytes() != 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds {10});
+  }
+
+  EXPECT_EQ(blockCache->getDirtyBytes(), 0);
+  EXPECT_EQ(data[3 * Block::SECTOR_SIZE], 0x5a);
+
+  blockCache->stopFlusher();
+}
+
+TEST_F(BlockCacheTest, FlusherAppliesBackpressure)
+{
+  auto limits = BlockCache::FlushLimits {};
+  limits.highWaterBytes = 2 * Block::SECTOR_SIZE;
+  limits.hardLimitBytes = 4 * Block::SECTOR_SIZE;
+  limits.maxAge = std::chrono::hours {1};
+  blockCache->startFlusher(limits);
+
+  // blocks are never old enough to be written, so only the watermarks 
+  // get them to disk
+  for (auto i = 0; i < sectors; i++) {
+    auto block = blockCache->getBlock(i, 1);
+    block->setByte(0, i + 1);
+    blockCache->putBlock(block);
+
+    EXPECT_LE(blockCache->getDirtyBytes(), limits.hardLimitBytes);
+  }
+
+  blockCache->stopFlusher();
+  blockCache->sync();
+
+  for (auto i = 0; i < sectors; i++) {
+    EXPECT_EQ(data[i * Block::SECTOR_SIZE], i + 1);
+  }
+}
+
+TEST_F(BlockCacheTest, FlusherCapsHighWater)
+{
+  // a high watermark above the hard limit would leave writers waiting on the
+  // hard limit for blocks to age out
+  auto limits = BlockCache::FlushLimits {};
+  limits.highWaterBytes = 8 * Block::SECTOR_SIZE;
+  limits.hardLimitBytes = 4 * Block::SECTOR_SIZE;
+  limits.maxAge = std::chrono::hours {1};
+  blockCache->startFlusher(limits);
+
+  auto writer = std::async(std::launch::async, [this]() {
+    for (auto i = 0; i < sectors; i++) {
+      auto block = blockCache->getBlock(i, 1);
+      block->setByte(0, i + 1);
+      blockCache->putBlock(block);
+    }
+  });
+
+  EXPECT_EQ(writer.wait_for(std::chrono::seconds {5}), std::future_status::ready);
+
+  // stopping the flusher releases the writer if it's stuck
+  blockCache->stopFlusher();
+  writer.wait();
+}
+
+TEST_F(BlockCacheTest, FlusherIgnoresHeldBlocks)
+{
+  auto limits = BlockCache::FlushLimits {};
+  limits.highWaterBytes = 2 * Block::SECTOR_SIZE;
+  limits.hardLimitBytes = 4 * Block::SECTOR_SIZE;
+  limits.maxAge = std::chrono::hours {1};
+
+  // dirty blocks which are taken again aren't counted, since the flusher 
+  // can't write them
+  auto held = vector<Block *> {};
+  for (auto i = 0; i < 4; i++) {
+    auto block = blockCache->getBlock(i, 1);
+    block->setByte(0, i + 1);
+    blockCache->putBlock(block);
+    held.push_back(blockCache->getBlock(i, 1));
+  }
+  EXPECT_EQ(blockCache->getDirtyBytes(), 0);
+
+  blockCache->startFlusher(limits);
+
+  // so writers aren't held up by them, and the cache can still be used
+  auto writer = std::async(std::launch::async, [this]() {
+    for (auto i = 4; i < sectors; i++) {
+      auto block = blockCache->getBlock(i, 1);
+      block->setByte(0, i + 1);
+      blockCache->putBlock(block);
+    }
+  });
+  EXPECT_EQ(writer.wait_for(std::chrono::seconds {5}), std::future_status::ready);
+
+  blockCache->stopFlusher();
+  writer.wait();
+
+  // releasing them counts them again
+  for (auto block : held) {
+    blockCache->putBlock(block);
+  }
+  EXPECT_GE(blockCache->getDirtyBytes(), 4 * Block::SECTOR_SIZE);
+  blockCache->sync();
+
+  for (auto i = 0; i < sectors; i++) {
+    EXPECT_EQ(data[i * Block::SECTOR_SIZE], i + 1);
+  }
+}
+
+TEST(BlockCache, FlusherKeepsFailedWrites)
+{
+  FailingDataSource source {4 * Block::SECTOR_SIZE};
+  BlockCache cache {&source};
+
+  auto limits = BlockCache::FlushLimits {};
+  limits.highWaterBytes = 4 * Block::SECTOR_SIZE;
+  limits.hardLimitBytes = 4 * Block::SECTOR_SIZE;
+  limits.maxAge = std::chrono::milliseconds {10};
+  cache.startFlusher(limits);
+
+  source.failing = true;
+  auto block = cache.getBlock(1, 1);
+  block->setByte(0, 0x5a);
+  cache.putBlock(block);
+
+  for (auto i = 0; i < 500 && source.failures == 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds {10});
+  }
+  cache.stopFlusher();
+
+  // the block is still dirty, and the failure is reported once, even though
+  // the sync itself succeeds
+  EXPECT_GT(source.failures, 0);
+  EXPECT_EQ(cache.getDirtyBytes(), Block::SECTOR_SIZE);
+  source.failing = false;
+  EXPECT_THROW(cache.sync(), FilesystemException);
+  EXPECT_EQ(source.getData()[Block::SECTOR_SIZE], 0x5a);
+  EXPECT_NO_THROW(cache.sync());
+}
+
+TEST_F(BlockCacheTest, Prefetch)
+{
+  for (auto i = 0; i < sectors; i++) {
+    data[i * Block::SECTOR_SIZE] = i;
+  }
+
+  // one sector of the range is already cached
+  auto held = blockCache->getBlock(6, 1);
+
+  blockCache->prefetch(4, 4);
+  EXPECT_EQ(blockCache->getCachedBytes(), 4 * Block::SECTOR_SIZE);
+
+  // change the disk under the cache; prefetched sectors shouldn't be read again
+  for (auto i = 0; i < sectors; i++) {
+    data[i * Block::SECTOR_SIZE] = 0xff;
+  }
+
+  auto block = blockCache->getBlock(5, 1);
+  EXPECT_EQ(block->getByte(0), 5);
+  blockCache->putBlock(block);
+
+  auto buffer = vector<char>(4 * Block::SECTOR_SIZE);
+  blockCache->readDirect(4 * Block::SECTOR_SIZE, buffer.size(), &buffer[0]);
+  for (auto i = 0; i < 4; i++) {
+    EXPECT_EQ(buffer[i * Block::SECTOR_SIZE], 4 + i);
+  }
+
+  // a range that isn't completely cached comes from the disk
+  blockCache->readDirect(7 * Block::SECTOR_SIZE, 2 * Block::SECTOR_SIZE, &buffer[0]);
+  EXPECT_EQ(buffer[0], '\xff');
+
+  blockCache->putBlock(held);
+}
+}
+
+TEST_F(BlockCacheTest, GetBlockForOverwrite)
+{
+  auto counting = CountingDataSource {sectors * Block::SECTOR_SIZE};
+  BlockCache cache {&counting};
+
+  // an uncached block is created without reading it
+  auto buffer = vector<char>(Block::SECTOR_SIZE, 'x');
+  auto bp = cache.getBlockForOverwrite(3, 1);
+  EXPECT_EQ(counting.reads, 0);
+  bp->copyIn(0, Block::SECTOR_SIZE, buffer.data());
+  cache.putBlock(bp);
+
+  // a cached block is returned as is
+  bp = cache.getBlockForOverwrite(3, 1);
+  EXPECT_EQ(bp->getByte(0), 'x');
+  cache.putBlock(bp);
+
+  cache.sync();
+  EXPECT_EQ(counting.reads, 0);
+  EXPECT_EQ(counting.getData()[3 * Block::SECTOR_SIZE], 'x');
+}
+
+TEST_F(BlockCacheTest, DiscardAndIsClean)
+{
+  auto bp = blockCache->getBlock(4, 1);
+  blockCache->putBlock(blockCache->getBlock(5, 1));
+
+  // a referenced block can't be dropped
+  EXPECT_TRUE(blockCache->isClean(4, 2));
+  EXPECT_FALSE(blockCache->discard(4, 2));
+
+  bp->setByte(0, 1);
+  blockCache->putBlock(bp);
+
+  // nor can a dirty one
+  EXPECT_FALSE(blockCache->isClean(4, 2));
+  EXPECT_TRUE(blockCache->isClean(5, 4));
+  EXPECT_FALSE(blockCache->discard(3, 2));
+
+  blockCache->sync();
+  EXPECT_TRUE(blockCache->isClean(4, 2));
+  EXPECT_TRUE(blockCache->discard(4, 2));
+  EXPECT_EQ(blockCache->getCachedBytes(), 0);
+
+  // the volume is read again after a discard
+  data[4 * Block::SECTOR_SIZE] = 7;
+  bp = blockCache->getBlock(4, 1);
+  EXPECT_EQ(bp->getByte(0), 7);
+  blockCache->putBlock(bp);
 }
@@ -0,0 +1,77 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "Block.h"
+#include "BufferPool.h"
+#include "gtest/gtest.h"
+
+#include <cstdint>
+#include <list>
+#include <vector>
+
+using namespace RT11FS;
+
+using std::list;
+using std::vector;
+
+namespace {
+TEST(BufferPool, BuffersAreAlignedAndReused)
+{
+  BufferPool pool {Block::SECTOR_SIZE, 4};
+
+  auto buffers = vector<uint8_t *> {};
+  for (auto i = 0; i < 6; i++) {
+    auto buffer = pool.allocate();
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(buffer) % Block::SECTOR_SIZE);
+    buffers.push_back(buffer);
+  }
+
+  // the first slab's buffers are handed out in order
+  EXPECT_EQ(buffers[0] + Block::SECTOR_SIZE, buffers[1]);
+  EXPECT_EQ(0, reinterpret_cast<uintptr_t>(buffers[0]) % BufferPool::ALIGNMENT);
+
+  pool.release(buffers[2]);
+  EXPECT_EQ(buffers[2], pool.allocate());
+}
+
+TEST(BufferPool, BlocksUsePoolForMatchingSize)
+{
+  BufferPool pool {Block::SECTOR_SIZE, 4};
+  auto first = pool.allocate();
+  pool.release(first);
+
+  {
+    auto block = Block {7, 1, &pool};
+    EXPECT_EQ(first, block.getData());
+
+    auto moved = Block {std::move(block)};
+    EXPECT_EQ(first, moved.getData());
+  }
+
+  // only one buffer was taken, and the move didn't release it twice
+  EXPECT_EQ(first, pool.allocate());
+  EXPECT_NE(first, pool.allocate());
+
+  // other sizes come from the heap, still aligned
+  auto big = Block {7, 3, &pool};
+  EXPECT_EQ(0, reinterpret_cast<uintptr_t>(big.getData()) % BufferPool::ALIGNMENT);
+}
+
+TEST(BufferPool, NodeArenaRecyclesNodes)
+{
+  NodeArena arena {8};
+  auto nodes = list<int, ArenaAllocator<int>> {ArenaAllocator<int> {&arena}};
+
+  for (auto i = 0; i < 20; i++) {
+    nodes.push_back(i);
+  }
+
+  auto firstNode = &nodes.front();
+  nodes.pop_front();
+  nodes.push_back(20);
+
+  EXPECT_EQ(firstNode, &nodes.back());
+  EXPECT_EQ(20, nodes.size());
+  EXPECT_EQ(1, nodes.front());
+}
+}
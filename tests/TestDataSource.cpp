@@ -0,0 +1,415 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "Block.h"
+#include "BlockCache.h"
+#include "CompressedDataSource.h"
+#include "FileDataSource.h"
+#include "FilesystemException.h"
+#include "MemoryDataSource.h"
+#include "MmapDataSource.h"
+#include "OverlayDataSource.h"
+#include "UringDataSource.h"
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace RT11FS;
+
+using std::make_unique;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+const auto imageSize = 8 * Block::SECTOR_SIZE;
+
+/**
+ * Make an empty temporary file, which is deleted when closed.
+ */
+auto makeTempFile() -> int
+{
+  char name[] = "/tmp/rt11fs-test-XXXXXX";
+  auto fd = mkstemp(name);
+  EXPECT_NE(fd, -1);
+  unlink(name);
+
+  return fd;
+}
+
+/**
+ * Make a temporary image file, which is deleted when closed.
+ */
+auto makeImageFile() -> int
+{
+  auto fd = makeTempFile();
+  EXPECT_EQ(ftruncate(fd, imageSize), 0);
+
+  return fd;
+}
+
+/**
+ * Exercise batches of requests on a data source, writing one batch of 
+ * `sectors' single sector requests and reading it back with another.
+ */
+auto checkBatches(DataSource *dataSource, int sectors)
+{
+  auto data = vector<char>(sectors * Block::SECTOR_SIZE);
+  auto iov = vector<struct iovec>(sectors);
+  auto requests = vector<DataSource::Request>(sectors);
+
+  auto prepare = [&](bool write) {
+    for (auto i = 0; i < sectors; i++) {
+      iov[i] = iovec { &data[i * Block::SECTOR_SIZE], Block::SECTOR_SIZE };
+      requests[i] = DataSource::Request { write, &iov[i], 1, off_t(i) * Block::SECTOR_SIZE, 0 };
+    }
+  };
+
+  for (auto i = 0; i < data.size(); i++) {
+    data[i] = (i / Block::SECTOR_SIZE + i) & 0xff;
+  }
+  auto expect = data;
+
+  prepare(true);
+  EXPECT_EQ(dataSource->submit(&requests[0], sectors), 0);
+
+  std::fill(begin(data), end(data), 0);
+  prepare(false);
+  EXPECT_EQ(dataSource->submit(&requests[0], sectors), 0);
+  for (const auto &request : requests) {
+    EXPECT_EQ(request.result, Block::SECTOR_SIZE);
+  }
+  EXPECT_EQ(data, expect);
+
+  // one failure doesn't stop the rest of the batch
+  requests[0].offset = off_t(sectors) * Block::SECTOR_SIZE;
+  EXPECT_EQ(dataSource->submit(&requests[0], 2), -EIO);
+  EXPECT_EQ(requests[0].result, -EIO);
+  EXPECT_EQ(requests[1].result, Block::SECTOR_SIZE);
+}
+
+/**
+ * Exercise the positional and vectored calls of a data source.
+ */
+auto checkDataSource(DataSource *dataSource)
+{
+  struct stat st;
+  EXPECT_EQ(dataSource->stat(&st), 0);
+  EXPECT_EQ(st.st_size, imageSize);
+
+  auto pattern = vector<char>(imageSize);
+  for (auto i = 0; i < imageSize; i++) {
+    pattern[i] = i & 0xff;
+  }
+
+  EXPECT_EQ(dataSource->write(&pattern[0], imageSize, 0), imageSize);
+
+  auto out = vector<char>(Block::SECTOR_SIZE);
+  EXPECT_EQ(dataSource->read(&out[0], out.size(), 3 * Block::SECTOR_SIZE), out.size());
+  EXPECT_EQ(memcmp(&out[0], &pattern[3 * Block::SECTOR_SIZE], out.size()), 0);
+
+  // gather two buffers into consecutive sectors
+  auto first = vector<char>(Block::SECTOR_SIZE, 1);
+  auto second = vector<char>(2 * Block::SECTOR_SIZE, 2);
+  struct iovec iov[2] = {
+    { &first[0], first.size() },
+    { &second[0], second.size() },
+  };
+
+  EXPECT_EQ(dataSource->writev(iov, 2, 2 * Block::SECTOR_SIZE), 3 * Block::SECTOR_SIZE);
+
+  // and scatter them back out, shifted by one sector
+  auto a = vector<char>(2 * Block::SECTOR_SIZE);
+  auto b = vector<char>(Block::SECTOR_SIZE);
+  struct iovec back[2] = {
+    { &a[0], a.size() },
+    { &b[0], b.size() },
+  };
+
+  EXPECT_EQ(dataSource->readv(back, 2, Block::SECTOR_SIZE), 3 * Block::SECTOR_SIZE);
+  EXPECT_EQ(memcmp(&a[0], &pattern[Block::SECTOR_SIZE], Block::SECTOR_SIZE), 0);
+  EXPECT_EQ(memcmp(&a[Block::SECTOR_SIZE], &first[0], Block::SECTOR_SIZE), 0);
+  EXPECT_EQ(memcmp(&b[0], &second[0], Block::SECTOR_SIZE), 0);
+
+  // overlapping copies behave like memmove in both directions
+  EXPECT_EQ(dataSource->write(&pattern[0], imageSize, 0), imageSize);
+  auto expect = pattern;
+  memmove(&expect[100], &expect[0], 3 * Block::SECTOR_SIZE);
+  EXPECT_EQ(dataSource->copy(0, 100, 3 * Block::SECTOR_SIZE), 0);
+  memmove(&expect[Block::SECTOR_SIZE], &expect[Block::SECTOR_SIZE + 7], 4 * Block::SECTOR_SIZE);
+  EXPECT_EQ(dataSource->copy(Block::SECTOR_SIZE + 7, Block::SECTOR_SIZE, 4 * Block::SECTOR_SIZE), 0);
+
+  auto all = vector<char>(imageSize);
+  EXPECT_EQ(dataSource->read(&all[0], all.size(), 0), imageSize);
+  EXPECT_EQ(all, expect);
+
+  // requests that can't be entirely satisfied are errors
+  EXPECT_EQ(dataSource->read(&out[0], out.size(), imageSize - 1), -EIO);
+  EXPECT_EQ(dataSource->readv(back, 2, imageSize - Block::SECTOR_SIZE), -EIO);
+
+  checkBatches(dataSource, imageSize / Block::SECTOR_SIZE);
+}
+
+TEST(DataSource, Memory)
+{
+  auto dataSource = MemoryDataSource {imageSize};
+  checkDataSource(&dataSource);
+
+  struct iovec past = { nullptr, 1 };
+  EXPECT_EQ(dataSource.writev(&past, 1, imageSize), -EIO);
+}
+
+TEST(DataSource, File)
+{
+  auto dataSource = FileDataSource {makeImageFile()};
+  checkDataSource(&dataSource);
+}
+
+TEST(DataSource, Uring)
+{
+  // where io_uring isn't available this is a plain FileDataSource, which
+  // must behave the same
+  auto dataSource = UringDataSource::create(makeImageFile());
+  checkDataSource(dataSource.get());
+
+  // a batch larger than the ring goes through in pieces
+  auto sectors = 3 * UringDataSource::RING_ENTRIES + 1;
+  auto fd = makeTempFile();
+  EXPECT_EQ(ftruncate(fd, sectors * Block::SECTOR_SIZE), 0);
+  auto large = UringDataSource::create(fd);
+  checkBatches(large.get(), sectors);
+}
+
+TEST(DataSource, Mmap)
+{
+  auto fd = makeImageFile();
+  auto dataSource = MmapDataSource {dup(fd), false};
+  checkDataSource(&dataSource);
+
+  // copy mode never exposes the mapping
+  EXPECT_EQ(dataSource.map(0, Block::SECTOR_SIZE), nullptr);
+
+  // writes must land in the file
+  auto sector = vector<char>(Block::SECTOR_SIZE, 7);
+  EXPECT_EQ(dataSource.write(&sector[0], sector.size(), Block::SECTOR_SIZE), sector.size());
+
+  auto out = vector<char>(Block::SECTOR_SIZE);
+  EXPECT_EQ(pread(fd, &out[0], out.size(), Block::SECTOR_SIZE), out.size());
+  EXPECT_EQ(out, sector);
+  close(fd);
+}
+
+TEST(DataSource, MmapZeroCopy)
+{
+  auto fd = makeImageFile();
+  auto dataSource = MmapDataSource {dup(fd)};
+  checkDataSource(&dataSource);
+
+  EXPECT_EQ(dataSource.map(imageSize - 1, 2), nullptr);
+
+  auto base = dataSource.map(0, imageSize);
+  EXPECT_NE(base, nullptr);
+  EXPECT_EQ(dataSource.map(Block::SECTOR_SIZE, Block::SECTOR_SIZE), base + Block::SECTOR_SIZE);
+
+  // cached blocks alias the mapping rather than copying it
+  BlockCache cache {&dataSource};
+  auto block = cache.getBlock(2, 2);
+  EXPECT_TRUE(block->isMapped());
+  EXPECT_EQ(block->getData(), base + 2 * Block::SECTOR_SIZE);
+
+  block->setWord(0, 0123456);
+  EXPECT_EQ(base[2 * Block::SECTOR_SIZE], 0123456 & 0377);
+  EXPECT_TRUE(block->isDirty());
+
+  cache.putBlock(block);
+  cache.sync();
+  EXPECT_FALSE(block->isDirty());
+
+  auto word = uint16_t {0};
+  EXPECT_EQ(pread(fd, &word, sizeof(word), 2 * Block::SECTOR_SIZE), sizeof(word));
+  EXPECT_EQ(word, 0123456);
+
+  // growing a mapped block just extends the alias
+  block = cache.getBlock(4, 1);
+  cache.resizeBlock(block, 3);
+  EXPECT_EQ(block->getCount(), 3);
+  EXPECT_EQ(block->extractWord(2 * Block::SECTOR_SIZE), *reinterpret_cast<uint16_t *>(base + 6 * Block::SECTOR_SIZE));
+  cache.putBlock(block);
+  close(fd);
+}
+
+TEST(DataSource, Overlay)
+{
+  auto base = make_unique<MemoryDataSource>(imageSize);
+  auto baseData = &base->getData();
+
+  OverlayDataSource dataSource {std::move(base), makeTempFile()};
+  checkDataSource(&dataSource);
+
+  // every sector was written, none of them to the base
+  EXPECT_EQ(dataSource.getModifiedSectors(), imageSize / Block::SECTOR_SIZE);
+  EXPECT_EQ(*baseData, vector<uint8_t>(imageSize));
+
+  // the image can't grow underneath the overlay
+  auto sector = vector<char>(Block::SECTOR_SIZE);
+  EXPECT_EQ(dataSource.write(&sector[0], sector.size(), imageSize), -EINVAL);
+}
+
+TEST(DataSource, OverlayCommitAndDiscard)
+{
+  auto pattern = vector<uint8_t>(imageSize);
+  for (auto i = 0; i < imageSize; i++) {
+    pattern[i] = (i * 7) & 0xff;
+  }
+
+  auto makeBase = [&pattern]() {
+    auto base = make_unique<MemoryDataSource>(imageSize);
+    base->getData() = pattern;
+    return base;
+  };
+
+  auto deltaFd = makeTempFile();
+  auto base = makeBase();
+  auto baseData = &base->getData();
+  auto dataSource = make_unique<OverlayDataSource>(std::move(base), dup(deltaFd));
+
+  // a partial write fills in the rest of the sector from the base
+  const char patch[] = "PATCH";
+  EXPECT_EQ(dataSource->write(const_cast<char *>(patch), sizeof(patch), 3 * Block::SECTOR_SIZE + 100), sizeof(patch));
+  EXPECT_EQ(dataSource->getModifiedSectors(), 1);
+
+  auto expect = pattern;
+  memcpy(&expect[3 * Block::SECTOR_SIZE + 100], patch, sizeof(patch));
+
+  auto all = vector<uint8_t>(imageSize);
+  EXPECT_EQ(dataSource->read(&all[0], all.size(), 0), imageSize);
+  EXPECT_EQ(all, expect);
+  EXPECT_EQ(*baseData, pattern);
+
+  // the delta file can be reattached to the same base later
+  dataSource = make_unique<OverlayDataSource>(makeBase(), dup(deltaFd));
+  EXPECT_EQ(dataSource->getModifiedSectors(), 1);
+  EXPECT_EQ(dataSource->read(&all[0], all.size(), 0), imageSize);
+  EXPECT_EQ(all, expect);
+
+  // but not to a different one
+  EXPECT_THROW(
+    OverlayDataSource(make_unique<MemoryDataSource>(2 * imageSize), dup(deltaFd)), 
+    FilesystemException);
+
+  // discarding reverts to the base
+  EXPECT_EQ(dataSource->discard(), 0);
+  EXPECT_EQ(dataSource->getModifiedSectors(), 0);
+  EXPECT_EQ(dataSource->read(&all[0], all.size(), 0), imageSize);
+  EXPECT_EQ(all, pattern);
+
+  // committing writes the changes into the base and empties the delta file
+  base = makeBase();
+  baseData = &base->getData();
+  dataSource = make_unique<OverlayDataSource>(std::move(base), dup(deltaFd));
+  EXPECT_EQ(dataSource->getModifiedSectors(), 0);
+  EXPECT_EQ(dataSource->write(const_cast<char *>(patch), sizeof(patch), 3 * Block::SECTOR_SIZE + 100), sizeof(patch));
+  EXPECT_EQ(dataSource->commit(), 0);
+  EXPECT_EQ(dataSource->getModifiedSectors(), 0);
+  EXPECT_EQ(*baseData, expect);
+
+  dataSource = make_unique<OverlayDataSource>(makeBase(), dup(deltaFd));
+  EXPECT_EQ(dataSource->getModifiedSectors(), 0);
+  close(deltaFd);
+}
+
+TEST(DataSource, Compressed)
+{
+  const auto chunkBytes = 2 * Block::SECTOR_SIZE;
+
+  // one chunk of zeroes, which isn't stored; one which compresses; one which
+  // doesn't; and a short chunk at the end
+  auto image = MemoryDataSource {7 * Block::SECTOR_SIZE};
+  auto &raw = image.getData();
+  for (auto i = 2 * Block::SECTOR_SIZE; i < 4 * Block::SECTOR_SIZE; i++) {
+    raw[i] = (i / 100) & 0xff;
+  }
+  auto seed = 12345u;
+  for (auto i = 4 * Block::SECTOR_SIZE; i < 7 * Block::SECTOR_SIZE; i++) {
+    seed = seed * 1103515245 + 12345;
+    raw[i] = (seed >> 16) & 0xff;
+  }
+
+  auto fd = makeTempFile();
+  EXPECT_FALSE(CompressedDataSource::isContainer(fd));
+  EXPECT_EQ(CompressedDataSource::create(&image, fd, chunkBytes), 0);
+  EXPECT_TRUE(CompressedDataSource::isContainer(fd));
+
+  struct stat st;
+  EXPECT_EQ(fstat(fd, &st), 0);
+  EXPECT_LT(st.st_size, raw.size());
+
+  CompressedDataSource dataSource {dup(fd), 1};
+  EXPECT_EQ(dataSource.stat(&st), 0);
+  EXPECT_EQ(st.st_size, raw.size());
+
+  auto all = vector<uint8_t>(raw.size());
+  EXPECT_EQ(dataSource.read(&all[0], all.size(), 0), all.size());
+  EXPECT_EQ(all, raw);
+
+  // the zero chunk is never decompressed, and reading a chunk a sector at a
+  // time decompresses it once
+  EXPECT_EQ(dataSource.getDecompressions(), 3);
+  auto sector = vector<uint8_t>(Block::SECTOR_SIZE);
+  EXPECT_EQ(dataSource.read(&sector[0], sector.size(), 2 * Block::SECTOR_SIZE), sector.size());
+  EXPECT_EQ(dataSource.read(&sector[0], sector.size(), 3 * Block::SECTOR_SIZE), sector.size());
+  EXPECT_EQ(dataSource.getDecompressions(), 4);
+  EXPECT_EQ(memcmp(&sector[0], &raw[3 * Block::SECTOR_SIZE], sector.size()), 0);
+
+  // reads may straddle chunks
+  auto a = vector<uint8_t>(Block::SECTOR_SIZE + 10);
+  auto b = vector<uint8_t>(2 * Block::SECTOR_SIZE);
+  struct iovec iov[2] = {
+    { &a[0], a.size() },
+    { &b[0], b.size() },
+  };
+  EXPECT_EQ(dataSource.readv(iov, 2, Block::SECTOR_SIZE + 5), a.size() + b.size());
+  EXPECT_EQ(memcmp(&a[0], &raw[Block::SECTOR_SIZE + 5], a.size()), 0);
+  EXPECT_EQ(memcmp(&b[0], &raw[2 * Block::SECTOR_SIZE + 15], b.size()), 0);
+
+  EXPECT_EQ(dataSource.read(&sector[0], sector.size(), raw.size() - 1), -EIO);
+  EXPECT_EQ(dataSource.write(&sector[0], sector.size(), 0), -EROFS);
+
+  // an overlay makes it writable
+  auto base = make_unique<CompressedDataSource>(dup(fd));
+  OverlayDataSource overlay {std::move(base), makeTempFile()};
+  sector.assign(Block::SECTOR_SIZE, 9);
+  EXPECT_EQ(overlay.write(&sector[0], sector.size(), Block::SECTOR_SIZE), sector.size());
+  EXPECT_EQ(overlay.read(&all[0], all.size(), 0), all.size());
+  memcpy(&raw[Block::SECTOR_SIZE], &sector[0], sector.size());
+  EXPECT_EQ(all, raw);
+  close(fd);
+}
+
+TEST(DataSource, CompressedHeaderIsChecked)
+{
+  auto image = MemoryDataSource {imageSize};
+  auto fd = makeTempFile();
+  EXPECT_EQ(CompressedDataSource::create(&image, fd, Block::SECTOR_SIZE), 0);
+  EXPECT_NO_THROW(CompressedDataSource(dup(fd)));
+
+  // a chunk count which agrees with the image size but not with the size of
+  // the container, laid out as the magic, chunk size, chunk count and image
+  // size
+  const auto chunkBytes = uint32_t {1};
+  const auto chunks = uint32_t {0xffffffff};
+  const auto imageBytes = uint64_t {chunks};
+  EXPECT_EQ(pwrite(fd, &chunkBytes, sizeof(chunkBytes), 8), sizeof(chunkBytes));
+  EXPECT_EQ(pwrite(fd, &chunks, sizeof(chunks), 12), sizeof(chunks));
+  EXPECT_EQ(pwrite(fd, &imageBytes, sizeof(imageBytes), 16), sizeof(imageBytes));
+  EXPECT_THROW(CompressedDataSource(dup(fd)), FilesystemException);
+  close(fd);
+}
+
+}
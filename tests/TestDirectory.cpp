@@ -12,6 +12,7 @@
 #include "Rad50.h"
 #include "gtest/gtest.h"
 
+#include <algorithm>
 #include <array>
 #include <cerrno>
 #include <cstdlib>
@@ -37,6 +38,30 @@ using std::vector;
 
 namespace {
 
+/**
+ * A memory data source which fails the test if it's asked to copy a range
+ * over itself.
+ */
+class NoOverlapDataSource : public MemoryDataSource
+{
+public:
+  NoOverlapDataSource(size_t bytes)
+    : MemoryDataSource(bytes)
+    , copies(0)
+  {
+  }
+
+  auto copy(off_t from, off_t to, size_t bytes) -> int override
+  {
+    EXPECT_TRUE(from + static_cast<off_t>(bytes) <= to || to + static_cast<off_t>(bytes) <= from)
+      << "copied " << bytes << " bytes from " << from << " to " << to;
+    copies++;
+    return MemoryDataSource::copy(from, to, bytes);
+  }
+
+  int copies;
+};
+
 class DirectoryTest : public ::testing::Test
 {
 protected:
@@ -80,6 +105,31 @@ protected:
     }
   }
 
+  /**
+   * Check that looking up every file by name finds the same entry as 
+   * scanning the directory does.
+   */
+  static auto expectLookupsMatchScan(Directory &dir)
+  {
+    auto scan = dir.startScan();
+    while (++scan) {
+      if (scan.hasStatus(E_MPTY) || scan.hasStatus(E_EOS)) {
+        continue;
+      }
+
+      auto name = Rad50Name {
+        scan.getWord(FILENAME_WORDS), 
+        scan.getWord(FILENAME_WORDS + 2), 
+        scan.getWord(FILENAME_WORDS + 4)
+      };
+
+      auto dirp = dir.getDirPointer(name);
+      EXPECT_EQ(dirp.getSegment(), scan.getSegment());
+      EXPECT_EQ(dirp.getIndex(), scan.getIndex());
+      EXPECT_EQ(dirp.getDataSector(), scan.getDataSector());
+    }
+  }
+
   static auto dumpMoves(const vector<DirChangeTracker::Entry> &moves) 
   {
     for (const auto &move : moves) {
@@ -308,6 +358,115 @@ TEST_F(DirectoryTest, MoveNextFiltered)
   EXPECT_FALSE(found);
 }
 
+TEST_F(DirectoryTest, EntryTableMatchesScan)
+{
+  auto segments = 8;
+
+  using Ent = DirectoryBuilder::DirEntry;
+  vector<vector<Ent>> dirdata = {
+    {
+      Ent {E_MPTY, 2 },
+      Ent {E_PERM, 3, { 075131, 062000, 075273 }},      // SWAP.SYS
+      Ent {E_EOS},
+    },
+    {
+      Ent {E_PERM, 4, { 1, 2, 3 }},
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  };
+
+  builder.formatWithEntries(segments, dirdata);
+
+  auto dir = Directory {blockCache.get()};
+
+  auto expectTableMatchesScan = [&dir]() {
+    const auto &table = dir.getEntries();
+    auto row = 0;
+    auto dirp = dir.startScan();
+    while (++dirp) {
+      ASSERT_LT(row, table.size());
+      EXPECT_EQ(table.getStatus(row), dirp.getWord(STATUS_WORD));
+      EXPECT_EQ(table.getLength(row), dirp.getWord(TOTAL_LENGTH_WORD));
+      EXPECT_EQ(table.getSector0(row), dirp.getDataSector());
+      EXPECT_EQ(table.getSegment(row), dirp.getSegment());
+      EXPECT_EQ(table.getIndex(row), dirp.getIndex());
+      row++;
+    }
+    EXPECT_EQ(row, table.size());
+  };
+
+  expectTableMatchesScan();
+
+  const auto &table = dir.getEntries();
+  auto row = table.find(0, E_PERM);
+  EXPECT_EQ(row, 1);
+
+  auto ent = DirEnt {};
+  dir.getEnt(table, row, ent);
+  EXPECT_EQ(ent.name, "SWAP.SYS");
+  EXPECT_EQ(ent.length, 3 * Block::SECTOR_SIZE);
+
+  row = table.find(row + 1, E_PERM);
+  EXPECT_EQ(table.getSegment(row), 2);
+  EXPECT_EQ(table.find(row + 1, E_PERM), table.size());
+
+  // the table is rebuilt once the directory changes
+  auto moves = vector<DirChangeTracker::Entry> {};
+  EXPECT_EQ(dir.removeEntry("SWAP.SYS", moves), 0);
+  EXPECT_EQ(dir.getEntries().find(0, E_PERM), dir.getEntries().find(0, E_PERM | E_EOS) + 1);
+  expectTableMatchesScan();
+}
+
+TEST_F(DirectoryTest, CreationDates)
+{
+  auto segments = 1;
+  auto date = [](int year, int mon, int day) {
+    year -= 1972;
+    return static_cast<uint16_t>(((year / 32) << 14) | (mon << 10) | (day << 5) | (year % 32));
+  };
+
+  using Ent = DirectoryBuilder::DirEntry;
+  vector<vector<Ent>> dirdata = {
+    {
+      Ent {E_PERM, 1, { 1, 1, 1 }, 0, 0, date(1972, 1, 1)},
+      Ent {E_PERM, 1, { 2, 2, 2 }, 0, 0, date(2000, 2, 29)},
+      Ent {E_PERM, 1, { 3, 3, 3 }, 0, 0, date(2026, 10, 14)},
+      Ent {E_PERM, 1, { 4, 4, 4 }, 0, 0, date(2001, 2, 29)},
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  };
+
+  builder.formatWithEntries(segments, dirdata);
+
+  auto dir = Directory {blockCache.get()};
+
+  // dates come back as noon UTC
+  auto expect = [](int year, int mon, int day) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = mon - 1;
+    tm.tm_mday = day;
+    tm.tm_hour = 12;
+    return timegm(&tm);
+  };
+
+  const auto &table = dir.getEntries();
+  auto ent = DirEnt {};
+  dir.getEnt(table, 0, ent);
+  EXPECT_EQ(ent.create_time, expect(1972, 1, 1));
+  dir.getEnt(table, 1, ent);
+  EXPECT_EQ(ent.create_time, expect(2000, 2, 29));
+  dir.getEnt(table, 2, ent);
+  EXPECT_EQ(ent.create_time, expect(2026, 10, 14));
+
+  // an invalid date is the epoch
+  dir.getEnt(table, 3, ent);
+  EXPECT_EQ(ent.create_time, 0);
+}
+
 TEST_F(DirectoryTest, StatFS)
 {
   auto segments = 8;
@@ -667,6 +826,45 @@ TEST_F(DirectoryTest, TruncateGrowWithMove)
   EXPECT_EQ(dirp.getWord(STATUS_WORD), E_EOS);
 }
 
+TEST_F(DirectoryTest, TruncateGrowWithMoveToBestFit)
+{
+  auto swapFilename = Rad50Name { 075131, 062000, 075273 };   // SWAP.SYS
+
+  using Ent = DirectoryBuilder::DirEntry;
+  vector<vector<Ent>> dirdata = {
+    {
+      Ent {E_PERM, 3, swapFilename },               // 1:0  swap file
+      Ent {E_PERM, 2, Rad50Name {1, 2, 3}},         // 1:1
+      Ent {E_MPTY, 5 },                             // 1:2  swap file will move here
+      Ent {E_PERM, 2, Rad50Name {4, 5, 6}},         // 1:3
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA}, // 1:4  rest of data
+      Ent {E_EOS}                                   // 1:5  eos
+    },
+  };
+
+  builder.formatWithEntries(1, dirdata);
+
+  auto dir = Directory {blockCache.get()};
+  auto dirp = dir.getDirPointer(swapFilename);
+  auto target = dirp.next().next().getDataSector();
+
+  // the first free block will do, so the large one at the end is left whole
+  auto moves = vector<DirChangeTracker::Entry> {};
+  EXPECT_EQ(dir.truncate(dirp, 4 * Block::SECTOR_SIZE, moves), 0);
+  EXPECT_EQ(dirp.getDataSector(), target);
+  EXPECT_EQ(dirp.getWord(TOTAL_LENGTH_WORD), 4);
+
+  auto nextp = dirp.next();
+  EXPECT_EQ(nextp.getWord(STATUS_WORD), E_MPTY);
+  EXPECT_EQ(nextp.getWord(TOTAL_LENGTH_WORD), 1);
+
+  struct statvfs vfs;
+  dir.statfs(&vfs);
+  auto tailp = nextp.next().next();
+  EXPECT_EQ(tailp.getWord(STATUS_WORD), E_MPTY);
+  EXPECT_EQ(tailp.getWord(TOTAL_LENGTH_WORD), vfs.f_bfree - 3 - 1);
+}
+
 TEST_F(DirectoryTest, TruncateShrinkWithSpill)
 {
   auto segments = 8;
@@ -1553,4 +1751,303 @@ TEST_F(DirectoryTest, CreateWithCarve)
   EXPECT_EQ(dirp.getWord(STATUS_WORD), E_EOS);
 }
 
+TEST_F(DirectoryTest, NameIndexFollowsMoves)
+{
+  auto segments = 8;
+  auto swapFilename = Rad50Name { 075131, 062000, 075273 };   // SWAP.SYS
+
+  using Ent = DirectoryBuilder::DirEntry;
+  vector<vector<Ent>> dirdata = {
+    {
+      Ent {E_PERM, 3, swapFilename },
+    },
+    {
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS}
+    },
+  };
+
+  // fill the first segment so that changes to it spill into the second
+  auto entries = segmentsPerEntry();
+  auto &firstSeg = dirdata[0];
+  auto index = uint16_t {1};
+
+  while (firstSeg.size() < entries - 1) {
+    firstSeg.push_back(Ent {E_PERM, 1, Rad50Name {index, index, index}});
+    index++;
+  }
+  firstSeg.push_back(Ent{E_EOS});
+
+  builder.formatWithEntries(segments, dirdata);
+
+  auto dir = Directory {blockCache.get()};
+  expectLookupsMatchScan(dir);
+
+  // spill the last file in segment 1 into segment 2
+  auto moves = vector<DirChangeTracker::Entry> {};
+  auto dirp = dir.getDirPointer(swapFilename);
+  EXPECT_EQ(dir.truncate(dirp, 0, moves), 0);
+  expectLookupsMatchScan(dir);
+
+  // move a file into the free space at the end of the volume
+  dirp = dir.getDirPointer(Rad50Name {1, 1, 1});
+  EXPECT_EQ(dir.truncate(dirp, 5 * Block::SECTOR_SIZE, moves), 0);
+  expectLookupsMatchScan(dir);
+  EXPECT_EQ(dir.getDirPointer(Rad50Name {1, 1, 1}).getSegment(), 2);
+
+  auto ent = DirEnt {};
+  EXPECT_EQ(dir.getEnt("SWAP.SYS", ent), 0);
+  EXPECT_TRUE(dir.getDirPointer(Rad50Name {2, 2, 2}));
+
+  EXPECT_EQ(dir.rename("SWAP.SYS", "SWAP.TXT"), 0);
+  EXPECT_EQ(dir.getEnt("SWAP.SYS", ent), -ENOENT);
+  EXPECT_EQ(dir.getEnt("SWAP.TXT", ent), 0);
+  expectLookupsMatchScan(dir);
+
+  EXPECT_EQ(dir.removeEntry("SWAP.TXT", moves), 0);
+  EXPECT_EQ(dir.getEnt("SWAP.TXT", ent), -ENOENT);
+  expectLookupsMatchScan(dir);
+
+  auto dirpp = unique_ptr<DirPtr> {};
+  EXPECT_EQ(dir.createEntry("NEW.DAT", dirpp, moves), 0);
+  EXPECT_EQ(dir.getEnt("NEW.DAT", ent), 0);
+  expectLookupsMatchScan(dir);
+}
+
+TEST_F(DirectoryTest, StatFSCountersFollowChanges)
+{
+  auto segments = 8;
+
+  using Ent = DirectoryBuilder::DirEntry;
+  vector<vector<Ent>> dirdata = {
+    {
+      Ent {E_PERM, 2, { 1, 2, 3 }},
+      Ent {E_PERM, 3, { 075131, 062000, 075273 }},      // SWAP.SYS
+      Ent {E_MPTY, 4},
+      Ent {E_PERM, 5, { 4, 5, 6 }},
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  };
+
+  builder.formatWithEntries(segments, dirdata);
+
+  auto dir = Directory {blockCache.get()};
+  EXPECT_TRUE(dir.verifyUsage());
+
+  struct statvfs before;
+  dir.statfs(&before);
+
+  auto files = before.f_files - before.f_ffree;
+  EXPECT_EQ(files, 3);
+
+  // grow in place, into the following free block
+  auto moves = vector<DirChangeTracker::Entry> {};
+  auto dirp = dir.getDirPointer(Rad50Name {075131, 062000, 075273});
+  EXPECT_EQ(dir.truncate(dirp, 5 * Block::SECTOR_SIZE, moves), 0);
+  EXPECT_TRUE(dir.verifyUsage());
+
+  // grow by moving to the end of the volume
+  dirp = dir.getDirPointer(Rad50Name {1, 2, 3});
+  EXPECT_EQ(dir.truncate(dirp, 10 * Block::SECTOR_SIZE, moves), 0);
+  EXPECT_TRUE(dir.verifyUsage());
+
+  dirp = dir.getDirPointer(Rad50Name {4, 5, 6});
+  EXPECT_EQ(dir.truncate(dirp, Block::SECTOR_SIZE, moves), 0);
+  EXPECT_TRUE(dir.verifyUsage());
+
+  auto dirpp = unique_ptr<DirPtr> {};
+  EXPECT_EQ(dir.createEntry("NEW.DAT", dirpp, moves), 0);
+  EXPECT_TRUE(dir.verifyUsage());
+
+  EXPECT_EQ(dir.removeEntry("SWAP.SYS", moves), 0);
+  EXPECT_TRUE(dir.verifyUsage());
+
+  // net effect: SWAP.SYS (3) removed, 123 grew by 8, 456 shrank by 4
+  struct statvfs after;
+  dir.statfs(&after);
+  EXPECT_EQ(after.f_bfree, before.f_bfree + 3 - 8 + 4);
+  EXPECT_EQ(after.f_files - after.f_ffree, files);
+}
+
+}
+
+TEST_F(DirectoryTest, Squeeze)
+{
+  auto segments = 4;
+
+  using Ent = DirectoryBuilder::DirEntry;
+  vector<vector<Ent>> dirdata = {
+    {
+      Ent {E_PERM, 2, { 1, 1, 1 }},
+      Ent {E_MPTY, 3},
+      Ent {E_PERM, 4, { 2, 2, 2 }},
+      Ent {E_MPTY, 1},
+      Ent {E_EOS},
+    },
+    {
+      Ent {E_PERM, 3, { 3, 3, 3 }},
+      Ent {E_MPTY, 2},
+      Ent {E_PERM, 2, { 4, 4, 4 }},
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  };
+
+  builder.formatWithEntries(segments, dirdata);
+
+  // stamp every sector of each file with the file's name
+  auto dir = Directory {blockCache.get()};
+  auto scan = dir.startScan();
+  while (dir.moveNextFiltered(scan, E_PERM)) {
+    auto start = scan.getDataSector() * Block::SECTOR_SIZE;
+    auto bytes = scan.getWord(TOTAL_LENGTH_WORD) * Block::SECTOR_SIZE;
+    memset(&data[start], scan.getWord(FILENAME_WORDS), bytes);
+  }
+
+  struct statvfs before;
+  dir.statfs(&before);
+
+  // a small budget should take several passes
+  auto passes = 0;
+  auto moves = vector<DirChangeTracker::Entry> {};
+  auto err = 0;
+  do {
+    err = dir.squeeze(1, moves);
+    passes++;
+    EXPECT_TRUE(dir.verifyUsage());
+    expectLookupsMatchScan(dir);
+  } while (err == 1);
+
+  EXPECT_EQ(err, 0);
+  EXPECT_GT(passes, 1);
+
+  // files are packed in their original order, followed by one free block
+  auto firstData = FIRST_SEGMENT_SECTOR + segments * SECTORS_PER_SEGMENT;
+  auto expectStart = firstData;
+  auto freeEntries = 0;
+
+  scan = dir.startScan();
+  while (++scan) {
+    if (scan.hasStatus(E_EOS)) {
+      continue;
+    }
+
+    if (scan.hasStatus(E_MPTY)) {
+      freeEntries++;
+      EXPECT_EQ(scan.getDataSector(), firstData + 11);
+      EXPECT_EQ(scan.getWord(TOTAL_LENGTH_WORD), sectors - firstData - 11);
+      continue;
+    }
+
+    EXPECT_EQ(freeEntries, 0);
+    EXPECT_EQ(scan.getDataSector(), expectStart);
+
+    auto start = scan.getDataSector() * Block::SECTOR_SIZE;
+    auto bytes = scan.getWord(TOTAL_LENGTH_WORD) * Block::SECTOR_SIZE;
+    for (auto i = 0; i < bytes; i++) {
+      if (data[start + i] != scan.getWord(FILENAME_WORDS)) {
+        ADD_FAILURE() << "file data was not moved intact";
+        break;
+      }
+    }
+
+    expectStart += scan.getWord(TOTAL_LENGTH_WORD);
+  }
+
+  EXPECT_EQ(freeEntries, 1);
+  EXPECT_EQ(expectStart, firstData + 11);
+
+  struct statvfs after;
+  dir.statfs(&after);
+  EXPECT_EQ(after.f_bfree, before.f_bfree);
+
+  // nothing more to do
+  EXPECT_EQ(dir.squeeze(0, moves), 0);
+  EXPECT_TRUE(moves.empty());
+}
+
+TEST_F(DirectoryTest, SqueezeCopiesThroughScratch)
+{
+  auto segments = 4;
+  NoOverlapDataSource source {sectors * Block::SECTOR_SIZE};
+  BlockCache cache {&source};
+  auto &image = source.getData();
+
+  // each file is longer than the free space before it, and the first is at
+  // the start of a segment
+  using Ent = DirectoryBuilder::DirEntry;
+  auto build = DirectoryBuilder {source};
+  build.formatWithEntries(segments, {
+    {
+      Ent {E_PERM, 2, { 1, 1, 1 }},
+      Ent {E_MPTY, 3},
+      Ent {E_EOS},
+    },
+    {
+      Ent {E_PERM, 6, { 2, 2, 2 }},
+      Ent {E_MPTY, 1},
+      Ent {E_PERM, 5, { 3, 3, 3 }},
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  });
+
+  auto dir = Directory {&cache};
+  auto scan = dir.startScan();
+  while (dir.moveNextFiltered(scan, E_PERM)) {
+    auto start = scan.getDataSector() * Block::SECTOR_SIZE;
+    auto bytes = scan.getWord(TOTAL_LENGTH_WORD) * Block::SECTOR_SIZE;
+    memset(&image[start], scan.getWord(FILENAME_WORDS), bytes);
+  }
+
+  auto moves = vector<DirChangeTracker::Entry> {};
+  EXPECT_EQ(dir.squeeze(0, moves), 0);
+  EXPECT_TRUE(dir.verifyUsage());
+  expectLookupsMatchScan(dir);
+  EXPECT_EQ(source.copies, 4);
+
+  // the files are still packed in their original order
+  auto firstData = FIRST_SEGMENT_SECTOR + segments * SECTORS_PER_SEGMENT;
+  auto expectStart = firstData;
+  scan = dir.startScan();
+  while (dir.moveNextFiltered(scan, E_PERM)) {
+    EXPECT_EQ(scan.getDataSector(), expectStart);
+
+    auto start = scan.getDataSector() * Block::SECTOR_SIZE;
+    auto bytes = scan.getWord(TOTAL_LENGTH_WORD) * Block::SECTOR_SIZE;
+    EXPECT_TRUE(std::all_of(&image[start], &image[start + bytes], [&scan](uint8_t byte) {
+      return byte == static_cast<uint8_t>(scan.getWord(FILENAME_WORDS));
+    }));
+
+    expectStart += scan.getWord(TOTAL_LENGTH_WORD);
+  }
+  EXPECT_EQ(expectStart, firstData + 13);
+}
+
+TEST_F(DirectoryTest, SqueezeLeavesFilesWithNoScratch)
+{
+  using Ent = DirectoryBuilder::DirEntry;
+  builder.formatWithEntries(1, {
+    {
+      Ent {E_PERM, 2, { 1, 1, 1 }},
+      Ent {E_MPTY, 3},
+      Ent {E_PERM, 6, { 2, 2, 2 }},
+      Ent {E_MPTY, 2},
+      Ent {E_PERM, DirectoryBuilder::REST_OF_DATA, { 3, 3, 3 }},
+      Ent {E_EOS},
+    },
+  });
+
+  // no free space is large enough to move either of the files after it
+  // through, so nothing can be moved safely
+  auto dir = Directory {blockCache.get()};
+  auto before = vector<uint8_t> {data};
+  auto moves = vector<DirChangeTracker::Entry> {};
+  EXPECT_EQ(dir.squeeze(0, moves), 0);
+  EXPECT_TRUE(moves.empty());
+  EXPECT_TRUE(dir.verifyUsage());
+
+  blockCache->sync();
+  EXPECT_EQ(data, before);
 }
@@ -0,0 +1,307 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#include "Block.h"
+#include "DirConst.h"
+#include "DirectoryBuilder.h"
+#include "FilesystemException.h"
+#include "ImageScanner.h"
+#include "MemoryDataSource.h"
+#include "WorkStealingPool.h"
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+using namespace RT11FS;
+using namespace RT11FS::Dir;
+
+using std::string;
+using std::vector;
+
+namespace {
+const auto volumeSectors = 256;
+const auto firstDataSector = FIRST_SEGMENT_SECTOR + SECTORS_PER_SEGMENT;
+
+using Ent = DirectoryBuilder::DirEntry;
+
+auto buildImage(MemoryDataSource &dataSource, const vector<Ent> &entries) -> void
+{
+  auto builder = DirectoryBuilder {dataSource};
+  builder.formatWithEntries(1, {entries});
+}
+
+auto hashOptions() -> ScanOptions
+{
+  auto options = ScanOptions {};
+  options.threads = 1;
+  options.hash = true;
+  return options;
+}
+}
+
+TEST(ImageScanner, CleanImageIsOk)
+{
+  auto dataSource = MemoryDataSource {volumeSectors * Block::SECTOR_SIZE};
+  buildImage(dataSource, {
+    Ent {E_PERM, 4, { 1, 2, 3 }},
+    Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+    Ent {E_EOS},
+  });
+
+  auto &data = dataSource.getData();
+  auto fileData = data.data() + firstDataSector * Block::SECTOR_SIZE;
+  for (auto i = 0; i < 4 * Block::SECTOR_SIZE; i++) {
+    fileData[i] = static_cast<uint8_t>(i * 7);
+  }
+  auto crc = crc32(0, fileData, 4 * Block::SECTOR_SIZE);
+
+  auto scanner = ImageScanner {hashOptions()};
+  auto result = ImageScanner::Result {};
+  scanner.scanDataSource(&dataSource, result);
+
+  EXPECT_TRUE(result.isOk());
+  EXPECT_EQ(result.volumeSectors, volumeSectors);
+  EXPECT_EQ(result.segments, 1);
+  EXPECT_EQ(result.freeSectors, volumeSectors - firstDataSector - 4);
+  ASSERT_EQ(result.files.size(), 1);
+  EXPECT_EQ(result.files[0].sector0, firstDataSector);
+  EXPECT_EQ(result.files[0].sectors, 4);
+  EXPECT_EQ(result.files[0].crc32, crc);
+
+  char hex[9];
+  snprintf(hex, sizeof(hex), "%08lx", crc);
+  auto json = ImageScanner::toJson(result, true);
+  EXPECT_EQ(json.find("{\"image\":\"\",\"ok\":true,"), 0);
+  EXPECT_NE(json.find(string {"\"crc32\":\""} + hex + "\""), string::npos);
+}
+
+TEST(ImageScanner, DamagedImageReportsProblems)
+{
+  auto dataSource = MemoryDataSource {volumeSectors * Block::SECTOR_SIZE};
+  buildImage(dataSource, {
+    Ent {E_PERM, 4, { 1, 2, 3 }},
+    Ent {E_PERM, 4, { 1, 2, 3 }},
+    Ent {E_TENT, 4, { 4, 5, 6 }},
+    Ent {E_PROT, 4, { 7, 8, 9 }},
+    Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+    Ent {E_EOS},
+  });
+
+  auto scanner = ImageScanner {hashOptions()};
+  auto result = ImageScanner::Result {};
+  scanner.scanDataSource(&dataSource, result);
+
+  EXPECT_FALSE(result.isOk());
+  ASSERT_EQ(result.problems.size(), 3);
+  EXPECT_NE(result.problems[0].find("appears more than once"), string::npos);
+  EXPECT_NE(result.problems[1].find("was left open"), string::npos);
+  EXPECT_NE(result.problems[2].find("invalid status"), string::npos);
+  EXPECT_EQ(result.files.size(), 2);
+
+  auto json = ImageScanner::toJson(result, false);
+  EXPECT_NE(json.find("\"ok\":false"), string::npos);
+  EXPECT_EQ(json.find("crc32"), string::npos);
+}
+
+TEST(ImageScanner, MisplacedDataIsReported)
+{
+  auto dataSource = MemoryDataSource {volumeSectors * Block::SECTOR_SIZE};
+  auto builder = DirectoryBuilder {dataSource};
+  builder.formatWithEntries(2, {
+    {
+      Ent {E_PERM, 4, { 1, 2, 3 }},
+      Ent {E_PERM, 4, { 4, 5, 6 }},
+      Ent {E_EOS},
+    },
+    {
+      Ent {E_PERM, 4, { 7, 8, 9 }},
+      Ent {E_PERM, volumeSectors, { 10, 11, 12 }},
+      Ent {E_EOS},
+    },
+  });
+
+  // start segment 2's data two sectors early, over the end of the segment 1's
+  // last file
+  auto &data = dataSource.getData();
+  auto start = (FIRST_SEGMENT_SECTOR + SECTORS_PER_SEGMENT) * Block::SECTOR_SIZE + SEGMENT_DATA_BLOCK;
+  auto sector0 = (data[start] | (data[start + 1] << 8)) - 2;
+  data[start] = sector0 & 0xff;
+  data[start + 1] = sector0 >> 8;
+
+  auto scanner = ImageScanner {};
+  auto result = ImageScanner::Result {};
+  scanner.scanDataSource(&dataSource, result);
+
+  EXPECT_FALSE(result.isOk());
+  ASSERT_EQ(result.problems.size(), 3);
+  EXPECT_NE(result.problems[0].find("segment 2 starts at sector"), string::npos);
+  EXPECT_NE(result.problems[1].find("entry 2:1 runs past the end of the volume"), string::npos);
+  EXPECT_NE(result.problems[2].find("entry 1:1 overlaps entry 2:0"), string::npos);
+}
+
+TEST(ImageScanner, OverlapsBeyondTheNextFileAreReported)
+{
+  auto dataSource = MemoryDataSource {volumeSectors * Block::SECTOR_SIZE};
+  auto builder = DirectoryBuilder {dataSource};
+  builder.formatWithEntries(2, {
+    {
+      Ent {E_PERM, 30, { 1, 2, 3 }},
+      Ent {E_EOS},
+    },
+    {
+      Ent {E_PERM, 4, { 4, 5, 6 }},
+      Ent {E_PERM, 4, { 7, 8, 9 }},
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  });
+
+  // start segment 2's data inside the first file, which then covers both of 
+  // the files in segment 2 and the start of the free space
+  auto &data = dataSource.getData();
+  auto start = (FIRST_SEGMENT_SECTOR + SECTORS_PER_SEGMENT) * Block::SECTOR_SIZE + SEGMENT_DATA_BLOCK;
+  auto sector0 = (data[start] | (data[start + 1] << 8)) - 28;
+  data[start] = sector0 & 0xff;
+  data[start + 1] = sector0 >> 8;
+
+  auto scanner = ImageScanner {};
+  auto result = ImageScanner::Result {};
+  scanner.scanDataSource(&dataSource, result);
+
+  ASSERT_EQ(result.problems.size(), 4);
+  EXPECT_NE(result.problems[0].find("segment 2 starts at sector"), string::npos);
+  EXPECT_NE(result.problems[1].find("entry 1:0 overlaps entry 2:0"), string::npos);
+  EXPECT_NE(result.problems[2].find("entry 1:0 overlaps entry 2:1"), string::npos);
+  EXPECT_NE(result.problems[3].find("entry 1:0 overlaps entry 2:2"), string::npos);
+}
+
+TEST(ImageScanner, BadNamesAndDatesAreReported)
+{
+  // month 15 doesn't exist
+  const auto badDate = static_cast<uint16_t>((15 << 10) | (1 << 5));
+
+  auto dataSource = MemoryDataSource {volumeSectors * Block::SECTOR_SIZE};
+  buildImage(dataSource, {
+    Ent {E_PERM, 4, { 0xffff, 2, 3 }},
+    Ent {E_PERM, 4, { 4, 5, 6 }, 0, 0, badDate},
+    Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+    Ent {E_EOS},
+  });
+
+  auto scanner = ImageScanner {};
+  auto result = ImageScanner::Result {};
+  scanner.scanDataSource(&dataSource, result);
+
+  EXPECT_FALSE(result.isOk());
+  ASSERT_EQ(result.problems.size(), 2);
+  EXPECT_NE(result.problems[0].find("entry 1:0 has an invalid name"), string::npos);
+  EXPECT_NE(result.problems[1].find("has an invalid date"), string::npos);
+
+  // the file with the bad date is still listed; the one with the bad name
+  // can't be
+  ASSERT_EQ(result.files.size(), 1);
+  EXPECT_EQ(result.files[0].sector0, firstDataSector + 4);
+}
+
+TEST(ImageScanner, SegmentCycleIsRejected)
+{
+  auto dataSource = MemoryDataSource {volumeSectors * Block::SECTOR_SIZE};
+  auto builder = DirectoryBuilder {dataSource};
+  builder.formatWithEntries(2, {
+    {
+      Ent {E_PERM, 4, { 1, 2, 3 }},
+      Ent {E_EOS},
+    },
+    {
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  });
+
+  // point segment 2 back at segment 1
+  auto &data = dataSource.getData();
+  auto link = (FIRST_SEGMENT_SECTOR + SECTORS_PER_SEGMENT) * Block::SECTOR_SIZE + NEXT_SEGMENT;
+  data[link] = 1;
+  data[link + 1] = 0;
+
+  auto scanner = ImageScanner {};
+  auto result = ImageScanner::Result {};
+  EXPECT_THROW(scanner.scanDataSource(&dataSource, result), FilesystemException);
+}
+
+TEST(ImageScanner, ScansEveryImage)
+{
+  char name[] = "/tmp/rt11fs-scan-XXXXXX";
+  ASSERT_NE(mkdtemp(name), nullptr);
+  auto dir = string {name};
+
+  auto images = vector<string> {};
+  for (auto i = 0; i < 5; i++) {
+    auto dataSource = MemoryDataSource {volumeSectors * Block::SECTOR_SIZE};
+    buildImage(dataSource, {
+      Ent {E_PERM, 4, { 1, 2, 3 }},
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    });
+
+    images.push_back(dir + "/" + std::to_string(i) + ".dsk");
+    auto fd = ::open(images.back().c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+    ASSERT_NE(fd, -1);
+    auto &data = dataSource.getData();
+    // the last image is cut off in the middle of its directory
+    auto bytes = i == 4 ? firstDataSector * Block::SECTOR_SIZE / 2 : data.size();
+    EXPECT_EQ(::write(fd, data.data(), bytes), bytes);
+    ::close(fd);
+  }
+  images.push_back(dir + "/missing.dsk");
+
+  auto options = ScanOptions {};
+  options.threads = 3;
+
+  auto lines = vector<string> {};
+  auto scanner = ImageScanner {options};
+  auto failed = scanner.scan(images, [&lines](const string &line) { lines.push_back(line); });
+
+  EXPECT_EQ(failed, 2);
+  ASSERT_EQ(lines.size(), images.size());
+  auto errors = 0;
+  for (const auto &line : lines) {
+    if (line.find("\"error\":") != string::npos) {
+      errors++;
+    }
+  }
+  EXPECT_EQ(errors, 2);
+
+  for (auto i = 0; i < 5; i++) {
+    ::unlink(images[i].c_str());
+  }
+  ::rmdir(dir.c_str());
+}
+
+TEST(WorkStealingPool, RunsEveryTaskOnce)
+{
+  const auto tasks = 1000;
+  auto runs = vector<std::atomic<int>>(tasks);
+
+  WorkStealingPool pool {4};
+  pool.run(tasks, [&runs](size_t task, int worker) {
+    EXPECT_GE(worker, 0);
+    EXPECT_LT(worker, 4);
+    // uneven work, so that idle workers have something to steal
+    if (task % 10 == 0) {
+      usleep(100);
+    }
+    runs[task]++;
+  });
+
+  for (const auto &count : runs) {
+    EXPECT_EQ(count, 1);
+  }
+}
@@ -0,0 +1,375 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "Block.h"
+#include "BlockCache.h"
+#include "DirConst.h"
+#include "Directory.h"
+#include "DirectoryBuilder.h"
+#include "MemoryDataSource.h"
+#include "OpenFileTable.h"
+#include "gtest/gtest.h"
+
+#include <cerrno>
+#include <memory>
+#include <vector>
+
+using namespace RT11FS;
+using namespace RT11FS::Dir;
+
+using std::make_unique;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+class OpenFileTableTest : public ::testing::Test
+{
+protected:
+  static const int sectors = 256;
+
+  OpenFileTableTest()
+    : dataSource(make_unique<MemoryDataSource>(sectors * Block::SECTOR_SIZE))
+    , blockCache(make_unique<BlockCache>(dataSource.get()))
+    , builder(*dataSource.get())
+  { 
+  }
+
+  auto allocatedSectors(Directory &dir, const char *name) 
+  {
+    auto dirpp = unique_ptr<DirPtr> {};
+    EXPECT_EQ(dir.getDirPointer(name, dirpp), 0);
+    return dirpp ? dirpp->getWord(TOTAL_LENGTH_WORD) : -1;
+  }
+
+  unique_ptr<MemoryDataSource> dataSource;
+  unique_ptr<BlockCache> blockCache;
+  DirectoryBuilder builder;
+};
+}
+
+TEST_F(OpenFileTableTest, AppendsPreallocateAndTrimOnClose)
+{
+  using Ent = DirectoryBuilder::DirEntry;
+  vector<vector<Ent>> dirdata = {
+    {
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  };
+
+  builder.formatWithEntries(4, dirdata);
+
+  auto dir = Directory {blockCache.get()};
+  OpenFileTable oft {&dir, blockCache.get()};
+
+  auto fd = oft.createFile("LOG.TXT");
+  ASSERT_GE(fd, 0);
+
+  auto buffer = vector<char>(Block::SECTOR_SIZE, 'x');
+
+  // each append past the reserved space should at least double it
+  for (auto i = 0; i < 5; i++) {
+    auto offset = static_cast<off_t>(i) * Block::SECTOR_SIZE;
+    EXPECT_EQ(oft.writeFile(fd, buffer.data(), buffer.size(), offset), Block::SECTOR_SIZE);
+  }
+
+  auto dirpp = unique_ptr<DirPtr> {};
+  ASSERT_EQ(dir.getDirPointer("LOG.TXT", dirpp), 0);
+  EXPECT_EQ(oft.getOpenLength(*dirpp), 5);
+  EXPECT_EQ(allocatedSectors(dir, "LOG.TXT"), 8);  
+
+  // reads stop at the logical end
+  auto readBack = vector<char>(8 * Block::SECTOR_SIZE);
+  EXPECT_EQ(oft.readFile(fd, readBack.data(), readBack.size(), 0), 5 * Block::SECTOR_SIZE);
+
+  EXPECT_EQ(oft.closeFile(fd), 0);
+  EXPECT_EQ(allocatedSectors(dir, "LOG.TXT"), 5);
+  EXPECT_EQ(oft.getOpenLength(*dirpp), -1);
+  EXPECT_TRUE(dir.verifyUsage());
+}
+
+TEST_F(OpenFileTableTest, PermanentFilesGrowExactly)
+{
+  using Ent = DirectoryBuilder::DirEntry;
+  vector<vector<Ent>> dirdata = {
+    {
+      Ent {E_PERM, 2, { 1, 2, 3 }},
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  };
+
+  builder.formatWithEntries(4, dirdata);
+
+  auto dir = Directory {blockCache.get()};
+  OpenFileTable oft {&dir, blockCache.get()};
+
+  auto ent = DirEnt {};
+  ASSERT_TRUE(dir.getEnt(dir.getDirPointer(Rad50Name {1, 2, 3}), ent));
+
+  auto fd = oft.openFile(ent.name);
+  ASSERT_GE(fd, 0);
+
+  auto buffer = vector<char>(Block::SECTOR_SIZE, 'x');
+  EXPECT_EQ(oft.writeFile(fd, buffer.data(), buffer.size(), 2 * Block::SECTOR_SIZE), Block::SECTOR_SIZE);
+  EXPECT_EQ(allocatedSectors(dir, ent.name.c_str()), 3);
+
+  EXPECT_EQ(oft.closeFile(fd), 0);
+  EXPECT_EQ(allocatedSectors(dir, ent.name.c_str()), 3);
+}
+
+TEST_F(OpenFileTableTest, SqueezeKeepsOpenFilesValid)
+{
+  using Ent = DirectoryBuilder::DirEntry;
+  vector<vector<Ent>> dirdata = {
+    {
+      Ent {E_MPTY, 4},
+      Ent {E_PERM, 2, { 1, 2, 3 }},
+      Ent {E_MPTY, 1},
+      Ent {E_PERM, 1, { 4, 5, 6 }},
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  };
+
+  builder.formatWithEntries(4, dirdata);
+
+  auto dir = Directory {blockCache.get()};
+  OpenFileTable oft {&dir, blockCache.get()};
+
+  auto ent = DirEnt {};
+  ASSERT_TRUE(dir.getEnt(dir.getDirPointer(Rad50Name {4, 5, 6}), ent));
+
+  auto fd = oft.openFile(ent.name);
+  ASSERT_GE(fd, 0);
+
+  auto buffer = vector<char>(Block::SECTOR_SIZE, 'q');
+  EXPECT_EQ(oft.writeFile(fd, buffer.data(), buffer.size(), 0), Block::SECTOR_SIZE);
+
+  EXPECT_EQ(oft.squeeze(0), 0);
+
+  auto dirp = dir.getDirPointer(Rad50Name {4, 5, 6});
+  EXPECT_EQ(dirp.getIndex(), 1);
+  EXPECT_EQ(oft.getOpenLength(dirp), 1);
+
+  auto readBack = vector<char>(Block::SECTOR_SIZE);
+  EXPECT_EQ(oft.readFile(fd, readBack.data(), readBack.size(), 0), Block::SECTOR_SIZE);
+  EXPECT_EQ(readBack, buffer);
+
+  EXPECT_EQ(oft.closeFile(fd), 0);
+}
+
+TEST_F(OpenFileTableTest, DescriptorsAreSharedAndReused)
+{
+  using Ent = DirectoryBuilder::DirEntry;
+  vector<vector<Ent>> dirdata = {
+    {
+      Ent {E_PERM, 2, { 1, 2, 3 }},
+      Ent {E_PERM, 2, { 4, 5, 6 }},
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  };
+
+  builder.formatWithEntries(4, dirdata);
+
+  auto dir = Directory {blockCache.get()};
+  OpenFileTable oft {&dir, blockCache.get()};
+
+  auto first = DirEnt {};
+  auto second = DirEnt {};
+  ASSERT_TRUE(dir.getEnt(dir.getDirPointer(Rad50Name {1, 2, 3}), first));
+  ASSERT_TRUE(dir.getEnt(dir.getDirPointer(Rad50Name {4, 5, 6}), second));
+
+  auto fd = oft.openFile(first.name);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(oft.openFile(first.name), fd);
+
+  EXPECT_EQ(oft.closeFile(fd), 0);
+  EXPECT_EQ(oft.getOpenLength(dir.getDirPointer(first.rad50_name)), 2);
+  EXPECT_EQ(oft.closeFile(fd), 0);
+  EXPECT_EQ(oft.getOpenLength(dir.getDirPointer(first.rad50_name)), -1);
+  EXPECT_EQ(oft.closeFile(fd), -EINVAL);
+
+  // the closed slot is reused, and no longer refers to the first file
+  EXPECT_EQ(oft.openFile(second.name), fd);
+  EXPECT_EQ(oft.getOpenLength(dir.getDirPointer(first.rad50_name)), -1);
+  EXPECT_EQ(oft.closeFile(fd), 0);
+}
+
+TEST_F(OpenFileTableTest, PerFileWriteBackLeavesDirectoryDirty)
+{
+  using Ent = DirectoryBuilder::DirEntry;
+  vector<vector<Ent>> dirdata = {
+    {
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  };
+
+  builder.formatWithEntries(4, dirdata);
+
+  auto dir = Directory {blockCache.get()};
+  OpenFileTable oft {&dir, blockCache.get(), WriteBackPolicy::PerFile};
+
+  auto fd = oft.createFile("NEW.DAT");
+  ASSERT_GE(fd, 0);
+
+  auto buffer = vector<char>(Block::SECTOR_SIZE, 'z');
+  EXPECT_EQ(oft.writeFile(fd, buffer.data(), buffer.size(), 0), Block::SECTOR_SIZE);
+  EXPECT_EQ(oft.closeFile(fd), 0);
+
+  // the file's data is on disk...
+  auto dirpp = unique_ptr<DirPtr> {};
+  ASSERT_EQ(dir.getDirPointer("NEW.DAT", dirpp), 0);
+  auto &data = dataSource->getData();
+  EXPECT_EQ(data[dirpp->getDataSector() * Block::SECTOR_SIZE], 'z');
+
+  // ...but the directory isn't until it's synced
+  {
+    BlockCache onDiskCache {dataSource.get()};
+    auto onDisk = Directory {&onDiskCache};
+    EXPECT_EQ(onDisk.getDirPointer("NEW.DAT", dirpp), -ENOENT);
+  }
+
+  dir.sync();
+
+  BlockCache onDiskCache {dataSource.get()};
+  auto onDisk = Directory {&onDiskCache};
+  EXPECT_EQ(onDisk.getDirPointer("NEW.DAT", dirpp), 0);
+}
+
+TEST_F(OpenFileTableTest, SequentialReadsReadAhead)
+{
+  using Ent = DirectoryBuilder::DirEntry;
+  vector<vector<Ent>> dirdata = {
+    {
+      Ent {E_PERM, 64, { 1, 2, 3 }},
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  };
+
+  builder.formatWithEntries(4, dirdata);
+
+  auto dir = Directory {blockCache.get()};
+  OpenFileTable oft {&dir, blockCache.get()};
+
+  auto ent = DirEnt {};
+  ASSERT_TRUE(dir.getEnt(dir.getDirPointer(Rad50Name {1, 2, 3}), ent));
+
+  auto fd = oft.openFile(ent.name);
+  ASSERT_GE(fd, 0);
+
+  auto before = blockCache->getCachedBytes();
+  auto buffer = vector<char>(100);
+
+  // small sequential reads pull in more than they ask for
+  for (auto offset = 0; offset < 1000; offset += buffer.size()) {
+    EXPECT_EQ(oft.readFile(fd, buffer.data(), buffer.size(), offset), buffer.size());
+  }
+
+  auto afterSequential = blockCache->getCachedBytes();
+  EXPECT_GT(afterSequential, before + 2 * Block::SECTOR_SIZE);
+
+  // the read ahead stops at the end of the file 
+  for (auto offset = 0; offset < 64 * Block::SECTOR_SIZE; offset += buffer.size()) {
+    oft.readFile(fd, buffer.data(), buffer.size(), offset);
+  }
+  EXPECT_EQ(blockCache->getCachedBytes(), before + 64 * Block::SECTOR_SIZE);
+
+  EXPECT_EQ(oft.closeFile(fd), 0);
+}
+
+TEST_F(OpenFileTableTest, CloseWithFullDirectoryReleasesFile)
+{
+  using Ent = DirectoryBuilder::DirEntry;
+
+  // one entry short of a full segment: fillers, a small free block, a file,
+  // the largest free block, which LOG.TXT will take all of, and a file
+  // which keeps LOG.TXT from being followed by free space
+  auto entries = (SECTORS_PER_SEGMENT * Block::SECTOR_SIZE - FIRST_ENTRY_OFFSET) / ENTRY_LENGTH;
+  auto fillers = entries - 6;
+  auto dataSectors = sectors - FIRST_SEGMENT_SECTOR - SECTORS_PER_SEGMENT;
+
+  auto segment = vector<Ent> {};
+  for (auto i = 0; i < fillers; i++) {
+    auto word = static_cast<uint16_t>(i + 1);
+    segment.push_back(Ent {E_PERM, 1, Rad50Name {word, word, word}});
+  }
+  segment.push_back(Ent {E_MPTY, 2});
+  segment.push_back(Ent {E_PERM, 1, Rad50Name {1000, 1000, 1000}});
+  segment.push_back(Ent {E_MPTY, 4});
+  segment.push_back(Ent {E_PERM, static_cast<uint16_t>(dataSectors - fillers - 7), Rad50Name {1001, 1001, 1001}});
+  segment.push_back(Ent {E_EOS});
+
+  builder.formatWithEntries(1, {segment});
+
+  auto dir = Directory {blockCache.get()};
+  OpenFileTable oft {&dir, blockCache.get()};
+
+  // three sectors of appends reserve four
+  auto log = oft.createFile("LOG.TXT");
+  ASSERT_GE(log, 0);
+  auto buffer = vector<char>(Block::SECTOR_SIZE, 'x');
+  for (auto i = 0; i < 3; i++) {
+    auto offset = static_cast<off_t>(i) * Block::SECTOR_SIZE;
+    EXPECT_EQ(oft.writeFile(log, buffer.data(), buffer.size(), offset), Block::SECTOR_SIZE);
+  }
+
+  // and another file fills the directory, so there's no room to give back
+  // the extra sector
+  auto other = oft.createFile("OTHER.TXT");
+  ASSERT_GE(other, 0);
+
+  EXPECT_EQ(oft.closeFile(log), -ENOSPC);
+  EXPECT_EQ(oft.closeFile(other), 0);
+
+  // the file was closed anyway, keeping its reserved space
+  EXPECT_FALSE(oft.hasOpenFiles());
+  EXPECT_EQ(allocatedSectors(dir, "LOG.TXT"), 4);
+}
+
+TEST_F(OpenFileTableTest, MapReadAndWrite)
+{
+  using Ent = DirectoryBuilder::DirEntry;
+  vector<vector<Ent>> dirdata = {
+    {
+      Ent {E_MPTY, DirectoryBuilder::REST_OF_DATA},
+      Ent {E_EOS},
+    },
+  };
+
+  builder.formatWithEntries(4, dirdata);
+
+  auto dir = Directory {blockCache.get()};
+  OpenFileTable oft {&dir, blockCache.get()};
+
+  auto fd = oft.createFile("RAW.DAT");
+  ASSERT_GE(fd, 0);
+
+  auto volumeOffset = off_t {0};
+  EXPECT_EQ(oft.mapWrite(fd, 100, 0, volumeOffset), -EINVAL);
+  ASSERT_EQ(oft.mapWrite(fd, 3 * Block::SECTOR_SIZE, Block::SECTOR_SIZE, volumeOffset), 0);
+
+  auto dirpp = unique_ptr<DirPtr> {};
+  ASSERT_EQ(dir.getDirPointer("RAW.DAT", dirpp), 0);
+  EXPECT_EQ(volumeOffset, static_cast<off_t>(dirpp->getDataSector() + 1) * Block::SECTOR_SIZE);
+
+  // the file only grows by what the caller says it wrote
+  EXPECT_EQ(oft.getOpenLength(*dirpp), 0);
+  EXPECT_EQ(oft.commitWrite(fd, 2 * Block::SECTOR_SIZE + 10), 0);
+  EXPECT_EQ(oft.getOpenLength(*dirpp), 3);
+  EXPECT_EQ(oft.commitWrite(fd, 4 * Block::SECTOR_SIZE), 0);
+  EXPECT_EQ(oft.getOpenLength(*dirpp), 4);
+
+  // reads of the file's data on the volume stop at its end
+  auto readOffset = off_t {0};
+  EXPECT_EQ(oft.mapRead(fd, 8 * Block::SECTOR_SIZE, 10, readOffset), 4 * Block::SECTOR_SIZE - 10);
+  EXPECT_EQ(readOffset, static_cast<off_t>(dirpp->getDataSector()) * Block::SECTOR_SIZE + 10);
+  EXPECT_EQ(oft.mapRead(fd, 100, 4 * Block::SECTOR_SIZE, readOffset), 0);
+
+  EXPECT_EQ(oft.closeFile(fd), 0);
+  EXPECT_EQ(allocatedSectors(dir, "RAW.DAT"), 4);
+}
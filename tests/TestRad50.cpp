@@ -0,0 +1,55 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "DirConst.h"
+#include "Rad50.h"
+#include "gtest/gtest.h"
+
+#include <string>
+
+using namespace RT11FS;
+using namespace RT11FS::Dir;
+
+using std::string;
+
+namespace {
+TEST(Rad50, WordsRoundTrip)
+{
+  EXPECT_EQ(Rad50::fromRad50(075131), "SWA");
+  EXPECT_EQ(Rad50::fromRad50(0), "   ");
+  EXPECT_EQ(Rad50::fromRad50(0174777), "999");
+
+  auto word = uint16_t {0};
+  EXPECT_TRUE(Rad50::toRad50("SYS", word));
+  EXPECT_EQ(word, 075273);
+
+  EXPECT_FALSE(Rad50::toRad50("sys", word));
+  EXPECT_FALSE(Rad50::toRad50("SY", word));
+
+  for (auto i = 0; i <= 0174777; i++) {
+    ASSERT_TRUE(Rad50::toRad50(Rad50::fromRad50(i), word));
+    ASSERT_EQ(word, i);
+  }
+}
+
+TEST(Rad50, DecodesNames)
+{
+  auto name = Rad50::NameBuffer {};
+
+  EXPECT_EQ(Rad50::decodeName(Rad50Name {075131, 062000, 075273}, name), 8);
+  EXPECT_EQ(string {&name[0]}, "SWAP.SYS");
+
+  EXPECT_EQ(Rad50::decodeName(Rad50Name {0, 0, 0}, name), 1);
+  EXPECT_EQ(string {&name[0]}, ".");
+
+  Rad50Name names[] = {
+    {075131, 062000, 075273},
+    {075131, 062000, 0100324},
+  };
+  Rad50::NameBuffer decoded[2];
+  Rad50::decodeNames(names, 2, decoded);
+
+  EXPECT_EQ(string {&decoded[0][0]}, "SWAP.SYS");
+  EXPECT_EQ(string {&decoded[1][0]}, "SWAP.TXT");
+}
+}
@@ -0,0 +1,80 @@
+// Copyright 2017 Jim Geist. This software is licensed under the 
+// MIT license as described in the file LICENSE.txt.
+
+#include "Block.h"
+#include "BlockCache.h"
+#include "MemoryDataSource.h"
+#include "Statistics.h"
+#include "gtest/gtest.h"
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+using namespace RT11FS;
+
+using std::string;
+using std::thread;
+
+using Counter = Statistics::Counter;
+using Operation = Statistics::Operation;
+
+namespace {
+TEST(Statistics, CountsSurviveThreads)
+{
+  // statistics are process wide, so only look at what this test adds
+  auto before = Statistics::snapshot();
+
+  Statistics::count(Counter::EntryMoves);
+  thread {[]() { Statistics::count(Counter::EntryMoves, 2); }}.join();
+
+  auto after = Statistics::snapshot();
+  EXPECT_EQ(after.get(Counter::EntryMoves) - before.get(Counter::EntryMoves), 3);
+}
+
+TEST(Statistics, RecordsLatencyHistogram)
+{
+  auto before = Statistics::snapshot();
+
+  Statistics::record(Operation::Rename, std::chrono::microseconds {0}, false);
+  Statistics::record(Operation::Rename, std::chrono::microseconds {5}, true);
+  Statistics::record(Operation::Rename, std::chrono::microseconds {7}, false);
+
+  auto after = Statistics::snapshot();
+  const auto &was = before.get(Operation::Rename);
+  const auto &now = after.get(Operation::Rename);
+
+  EXPECT_EQ(now.calls - was.calls, 3);
+  EXPECT_EQ(now.errors - was.errors, 1);
+  EXPECT_EQ(now.totalMicros - was.totalMicros, 12);
+  EXPECT_EQ(now.latency[0] - was.latency[0], 1);
+  EXPECT_EQ(now.latency[3] - was.latency[3], 2);   // both under 8us
+
+  auto report = Statistics::report(after, 1234);
+  EXPECT_NE(report.find("cache.dirty_bytes 1234\n"), string::npos);
+  EXPECT_NE(report.find("op.rename.calls "), string::npos);
+  EXPECT_NE(report.find("op.rename.latency_us <1:"), string::npos);
+}
+
+TEST(Statistics, CacheCounters)
+{
+  auto dataSource = MemoryDataSource {16 * Block::SECTOR_SIZE};
+  BlockCache cache {&dataSource, Block::SECTOR_SIZE};
+
+  auto before = Statistics::snapshot();
+
+  cache.putBlock(cache.getBlock(1, 1));
+  cache.putBlock(cache.getBlock(1, 1));
+
+  auto bp = cache.getBlock(2, 1);
+  bp->setByte(0, 1);
+  cache.putBlock(bp);
+  cache.sync();
+
+  auto after = Statistics::snapshot();
+  EXPECT_EQ(after.get(Counter::CacheMisses) - before.get(Counter::CacheMisses), 2);
+  EXPECT_EQ(after.get(Counter::CacheHits) - before.get(Counter::CacheHits), 1);
+  EXPECT_EQ(after.get(Counter::CacheEvictions) - before.get(Counter::CacheEvictions), 1);
+  EXPECT_EQ(after.get(Counter::BytesWritten) - before.get(Counter::BytesWritten), Block::SECTOR_SIZE);
+}
+}
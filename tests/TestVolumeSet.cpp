@@ -0,0 +1,243 @@
+// Copyright 2017 Jim Geist. This software is licensed under the
+// MIT license as described in the file LICENSE.txt.
+
+#include "Block.h"
+#include "DirConst.h"
+#include "DirectoryBuilder.h"
+#include "FileSystem.h"
+#include "MemoryDataSource.h"
+#include "VolumeSet.h"
+#include "gtest/gtest.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace RT11FS;
+
+using std::string;
+using std::vector;
+
+namespace {
+const auto volumeSectors = 256;
+
+/**
+ * A directory of empty volume images, which is removed afterwards.
+ */
+class VolumeSetTest : public ::testing::Test
+{
+protected:
+  VolumeSetTest()
+  {
+    char name[] = "/tmp/rt11fs-volumes-XXXXXX";
+    EXPECT_NE(mkdtemp(name), nullptr);
+    dir = name;
+
+    for (auto image : {"one.dsk", "two.dsk"}) {
+      auto dataSource = MemoryDataSource {volumeSectors * Block::SECTOR_SIZE};
+      auto builder = DirectoryBuilder {dataSource};
+      builder.formatWithEntries(1, {
+        {
+          DirectoryBuilder::DirEntry {Dir::E_MPTY, DirectoryBuilder::REST_OF_DATA},
+          DirectoryBuilder::DirEntry {Dir::E_EOS},
+        },
+      });
+
+      auto path = dir + "/" + image;
+      auto fd = ::open(path.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+      EXPECT_NE(fd, -1);
+      auto &data = dataSource.getData();
+      EXPECT_EQ(::write(fd, data.data(), data.size()), data.size());
+      ::close(fd);
+      images.push_back(path);
+    }
+  }
+
+  ~VolumeSetTest()
+  {
+    for (const auto &image : images) {
+      ::unlink(image.c_str());
+    }
+    ::rmdir(dir.c_str());
+  }
+
+  static auto collect(void *buf, const char *name, const struct stat *, off_t) -> int
+  {
+    static_cast<vector<string> *>(buf)->push_back(name);
+    return 0;
+  }
+
+  string dir;
+  vector<string> images;
+};
+}
+
+TEST_F(VolumeSetTest, RoutesPathsToVolumes)
+{
+  VolumeSet volumes {dir};
+
+  EXPECT_EQ(volumes.getVolumeNames(), (vector<string> {"one.dsk", "two.dsk"}));
+
+  // the root and the volumes' directories are described without opening anything
+  struct stat st;
+  EXPECT_EQ(volumes.getattr("/", &st), 0);
+  EXPECT_TRUE(S_ISDIR(st.st_mode));
+  EXPECT_EQ(volumes.getattr("/one.dsk", &st), 0);
+  EXPECT_TRUE(S_ISDIR(st.st_mode));
+  EXPECT_EQ(volumes.getattr("/three.dsk", &st), -ENOENT);
+
+  auto names = vector<string> {};
+  EXPECT_EQ(volumes.readdir("/", &names, &collect, 0, nullptr), 0);
+  EXPECT_EQ(names, (vector<string> {".", "..", "one.dsk", "two.dsk"}));
+  EXPECT_EQ(volumes.getOpenVolumes(), 0);
+
+  // a failed lookup is forgotten once the file is created
+  EXPECT_EQ(volumes.getattr("/one.dsk/HELLO.TXT", &st), -ENOENT);
+  EXPECT_EQ(volumes.getattr("/one.dsk/HELLO.TXT", &st), -ENOENT);
+
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  EXPECT_EQ(volumes.create("/one.dsk/HELLO.TXT", S_IFREG | 0644, &fi), 0);
+  EXPECT_EQ(volumes.getOpenVolumes(), 1);
+  EXPECT_EQ(volumes.write("/one.dsk/HELLO.TXT", "hello", 5, 0, &fi), 5);
+  EXPECT_EQ(volumes.getattr("/one.dsk/HELLO.TXT", &st), 0);
+  EXPECT_EQ(volumes.release("/one.dsk/HELLO.TXT", &fi), 0);
+
+  names.clear();
+  EXPECT_EQ(volumes.readdir("/one.dsk", &names, &collect, 0, nullptr), 0);
+  EXPECT_EQ(names, (vector<string> {".", "..", "HELLO.TXT"}));
+
+  names.clear();
+  EXPECT_EQ(volumes.readdir("/two.dsk", &names, &collect, 0, nullptr), 0);
+  EXPECT_EQ(names, (vector<string> {".", ".."}));
+  EXPECT_EQ(volumes.getOpenVolumes(), 2);
+
+  // files stay on their own volumes, and the root holds only volumes
+  EXPECT_EQ(volumes.rename("/one.dsk/HELLO.TXT", "/two.dsk/HELLO.TXT"), -EXDEV);
+  EXPECT_EQ(volumes.rename("/one.dsk", "/three.dsk"), -EACCES);
+  EXPECT_EQ(volumes.create("/HELLO.TXT", S_IFREG | 0644, &fi), -EACCES);
+}
+
+TEST_F(VolumeSetTest, ClosesIdleVolumes)
+{
+  VolumeSet volumes {dir, FileSystemOptions {}, 60};
+  auto later = std::chrono::steady_clock::now() + std::chrono::hours {1};
+
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  EXPECT_EQ(volumes.create("/one.dsk/HELLO.TXT", S_IFREG | 0644, &fi), 0);
+  EXPECT_EQ(volumes.write("/one.dsk/HELLO.TXT", "hello", 5, 0, &fi), 5);
+
+  // a volume with an open file is never idle
+  volumes.closeIdle(later);
+  EXPECT_EQ(volumes.getOpenVolumes(), 1);
+
+  EXPECT_EQ(volumes.release("/one.dsk/HELLO.TXT", &fi), 0);
+  volumes.closeIdle(std::chrono::steady_clock::now());
+  EXPECT_EQ(volumes.getOpenVolumes(), 1);
+  volumes.closeIdle(later);
+  EXPECT_EQ(volumes.getOpenVolumes(), 0);
+  EXPECT_EQ(volumes.getCacheBudget().getUsedBytes(), 0);
+
+  // closing wrote the volume, which is reopened on the next access
+  memset(&fi, 0, sizeof(fi));
+  fi.flags = O_RDONLY;
+  EXPECT_EQ(volumes.open("/one.dsk/HELLO.TXT", &fi), 0);
+  EXPECT_EQ(volumes.getOpenVolumes(), 1);
+
+  char buffer[5];
+  EXPECT_EQ(volumes.read("/one.dsk/HELLO.TXT", buffer, sizeof(buffer), 0, &fi), 5);
+  EXPECT_EQ(memcmp(buffer, "hello", 5), 0);
+  EXPECT_EQ(volumes.release("/one.dsk/HELLO.TXT", &fi), 0);
+}
+
+TEST_F(VolumeSetTest, SweeperClosesIdleVolumes)
+{
+  VolumeSet volumes {dir, FileSystemOptions {}, 0};
+  volumes.init();
+
+  struct stat st;
+  EXPECT_EQ(volumes.getattr("/one.dsk/HELLO.TXT", &st), -ENOENT);
+
+  // the volume is closed without the set being used again
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds {5};
+  while (volumes.getOpenVolumes() != 0 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds {50});
+  }
+  EXPECT_EQ(volumes.getOpenVolumes(), 0);
+
+  // and opened again when it's next needed
+  EXPECT_EQ(volumes.getattr("/one.dsk/HELLO.TXT", &st), -ENOENT);
+}
+
+TEST_F(VolumeSetTest, IdleVolumeIsWrittenAtAgeLimit)
+{
+  auto readDirectory = [this]() {
+    auto bytes = vector<char>(Dir::SECTORS_PER_SEGMENT * Block::SECTOR_SIZE);
+    auto fd = ::open(images[0].c_str(), O_RDONLY);
+    EXPECT_EQ(::pread(fd, bytes.data(), bytes.size(), Dir::FIRST_SEGMENT_SECTOR * Block::SECTOR_SIZE), bytes.size());
+    ::close(fd);
+    return bytes;
+  };
+
+  auto options = FileSystemOptions {};
+  options.writeBack = WriteBackPolicy::Deferred;
+  options.maxDirtySeconds = 1;
+
+  FileSystem fs {images[0], options};
+  fs.init();
+
+  auto before = readDirectory();
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  EXPECT_EQ(fs.create("/HELLO.TXT", S_IFREG | 0644, &fi), 0);
+  EXPECT_EQ(fs.write("/HELLO.TXT", "hello", 5, 0, &fi), 5);
+  EXPECT_EQ(fs.release("/HELLO.TXT", &fi), 0);
+  EXPECT_EQ(readDirectory(), before);
+
+  // nothing else happens on the volume, so only the timer can write it
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds {5};
+  while (readDirectory() == before && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds {50});
+  }
+  EXPECT_NE(readDirectory(), before);
+}
+
+TEST_F(VolumeSetTest, ReadBufRepliesFromMemory)
+{
+  FileSystem fs {images[0]};
+
+  auto data = vector<char>(2 * Block::SECTOR_SIZE);
+  for (auto i = 0u; i < data.size(); i++) {
+    data[i] = static_cast<char>(i * 13);
+  }
+
+  struct fuse_file_info fi;
+  memset(&fi, 0, sizeof(fi));
+  EXPECT_EQ(fs.create("/DATA.BIN", S_IFREG | 0644, &fi), 0);
+  EXPECT_EQ(fs.write("/DATA.BIN", data.data(), data.size(), 0, &fi), data.size());
+  EXPECT_EQ(fs.release("/DATA.BIN", &fi), 0);
+
+  // even with the data clean on the image, the reply is a copy made under
+  // the lock, never a range of the image for FUSE to read later
+  memset(&fi, 0, sizeof(fi));
+  fi.flags = O_RDONLY;
+  EXPECT_EQ(fs.open("/DATA.BIN", &fi), 0);
+
+  struct fuse_bufvec *bufv = nullptr;
+  ASSERT_EQ(fs.readBuf("/DATA.BIN", &bufv, data.size(), 0, &fi), 0);
+  ASSERT_NE(bufv, nullptr);
+  EXPECT_EQ(bufv->buf[0].flags & FUSE_BUF_IS_FD, 0);
+  ASSERT_EQ(bufv->buf[0].size, data.size());
+  EXPECT_EQ(memcmp(bufv->buf[0].mem, data.data(), data.size()), 0);
+  free(bufv->buf[0].mem);
+  free(bufv);
+
+  EXPECT_EQ(fs.release("/DATA.BIN", &fi), 0);
+}